@@ -178,7 +178,7 @@ void   pgcodec__superblock__free_unpacked
   PROTOBUF_C_ASSERT (message->base.descriptor == &pgcodec__superblock__descriptor);
   protobuf_c_message_free_unpacked ((ProtobufCMessage*)message, allocator);
 }
-static const ProtobufCFieldDescriptor pgcodec__root_ent__field_descriptors[3] =
+static const ProtobufCFieldDescriptor pgcodec__root_ent__field_descriptors[4] =
 {
   {
     "key",
@@ -216,16 +216,29 @@ static const ProtobufCFieldDescriptor pgcodec__root_ent__field_descriptors[3] =
     0,            /* packed */
     0,NULL,NULL    /* reserved1,reserved2, etc */
   },
+  {
+    "run_id",
+    4,
+    PROTOBUF_C_LABEL_OPTIONAL,
+    PROTOBUF_C_TYPE_UINT64,
+    PROTOBUF_C_OFFSETOF(PGcodec__RootEnt, has_run_id),
+    PROTOBUF_C_OFFSETOF(PGcodec__RootEnt, run_id),
+    NULL,
+    NULL,
+    0,            /* packed */
+    0,NULL,NULL    /* reserved1,reserved2, etc */
+  },
 };
 static const unsigned pgcodec__root_ent__field_indices_by_name[] = {
   2,   /* field[2] = file_id */
   0,   /* field[0] = key */
   1,   /* field[1] = n_records */
+  3,   /* field[3] = run_id */
 };
 static const ProtobufCIntRange pgcodec__root_ent__number_ranges[1 + 1] =
 {
   { 1, 0 },
-  { 0, 3 }
+  { 0, 4 }
 };
 const ProtobufCMessageDescriptor pgcodec__root_ent__descriptor =
 {
@@ -235,7 +248,7 @@ const ProtobufCMessageDescriptor pgcodec__root_ent__descriptor =
   "PGcodec__RootEnt",
   "PGcodec",
   sizeof(PGcodec__RootEnt),
-  3,
+  4,
   pgcodec__root_ent__field_descriptors,
   pgcodec__root_ent__field_indices_by_name,
   1,  pgcodec__root_ent__number_ranges,
@@ -280,7 +293,7 @@ const ProtobufCMessageDescriptor pgcodec__root_idx__descriptor =
   (ProtobufCMessageInit) pgcodec__root_idx__init,
   NULL,NULL,NULL    /* reserved[123] */
 };
-static const ProtobufCFieldDescriptor pgcodec__table_meta__field_descriptors[3] =
+static const ProtobufCFieldDescriptor pgcodec__table_meta__field_descriptors[8] =
 {
   {
     "name",
@@ -318,16 +331,81 @@ static const ProtobufCFieldDescriptor pgcodec__table_meta__field_descriptors[3]
     0,            /* packed */
     0,NULL,NULL    /* reserved1,reserved2, etc */
   },
+  {
+    "table_id",
+    4,
+    PROTOBUF_C_LABEL_OPTIONAL,
+    PROTOBUF_C_TYPE_UINT32,
+    PROTOBUF_C_OFFSETOF(PGcodec__TableMeta, has_table_id),
+    PROTOBUF_C_OFFSETOF(PGcodec__TableMeta, table_id),
+    NULL,
+    NULL,
+    0,            /* packed */
+    0,NULL,NULL    /* reserved1,reserved2, etc */
+  },
+  {
+    "write_buffer_size",
+    5,
+    PROTOBUF_C_LABEL_OPTIONAL,
+    PROTOBUF_C_TYPE_UINT64,
+    PROTOBUF_C_OFFSETOF(PGcodec__TableMeta, has_write_buffer_size),
+    PROTOBUF_C_OFFSETOF(PGcodec__TableMeta, write_buffer_size),
+    NULL,
+    NULL,
+    0,            /* packed */
+    0,NULL,NULL    /* reserved1,reserved2, etc */
+  },
+  {
+    "max_file_size",
+    6,
+    PROTOBUF_C_LABEL_OPTIONAL,
+    PROTOBUF_C_TYPE_UINT64,
+    PROTOBUF_C_OFFSETOF(PGcodec__TableMeta, has_max_file_size),
+    PROTOBUF_C_OFFSETOF(PGcodec__TableMeta, max_file_size),
+    NULL,
+    NULL,
+    0,            /* packed */
+    0,NULL,NULL    /* reserved1,reserved2, etc */
+  },
+  {
+    "max_open_files",
+    7,
+    PROTOBUF_C_LABEL_OPTIONAL,
+    PROTOBUF_C_TYPE_UINT32,
+    PROTOBUF_C_OFFSETOF(PGcodec__TableMeta, has_max_open_files),
+    PROTOBUF_C_OFFSETOF(PGcodec__TableMeta, max_open_files),
+    NULL,
+    NULL,
+    0,            /* packed */
+    0,NULL,NULL    /* reserved1,reserved2, etc */
+  },
+  {
+    "compact_trigger",
+    8,
+    PROTOBUF_C_LABEL_OPTIONAL,
+    PROTOBUF_C_TYPE_UINT32,
+    PROTOBUF_C_OFFSETOF(PGcodec__TableMeta, has_compact_trigger),
+    PROTOBUF_C_OFFSETOF(PGcodec__TableMeta, compact_trigger),
+    NULL,
+    NULL,
+    0,            /* packed */
+    0,NULL,NULL    /* reserved1,reserved2, etc */
+  },
 };
 static const unsigned pgcodec__table_meta__field_indices_by_name[] = {
+  7,   /* field[7] = compact_trigger */
+  5,   /* field[5] = max_file_size */
+  6,   /* field[6] = max_open_files */
   0,   /* field[0] = name */
   2,   /* field[2] = root_id */
+  3,   /* field[3] = table_id */
   1,   /* field[1] = uuid */
+  4,   /* field[4] = write_buffer_size */
 };
 static const ProtobufCIntRange pgcodec__table_meta__number_ranges[1 + 1] =
 {
   { 1, 0 },
-  { 0, 3 }
+  { 0, 8 }
 };
 const ProtobufCMessageDescriptor pgcodec__table_meta__descriptor =
 {
@@ -337,14 +415,14 @@ const ProtobufCMessageDescriptor pgcodec__table_meta__descriptor =
   "PGcodec__TableMeta",
   "PGcodec",
   sizeof(PGcodec__TableMeta),
-  3,
+  8,
   pgcodec__table_meta__field_descriptors,
   pgcodec__table_meta__field_indices_by_name,
   1,  pgcodec__table_meta__number_ranges,
   (ProtobufCMessageInit) pgcodec__table_meta__init,
   NULL,NULL,NULL    /* reserved[123] */
 };
-static const ProtobufCFieldDescriptor pgcodec__superblock__field_descriptors[2] =
+static const ProtobufCFieldDescriptor pgcodec__superblock__field_descriptors[3] =
 {
   {
     "uuid",
@@ -370,15 +448,28 @@ static const ProtobufCFieldDescriptor pgcodec__superblock__field_descriptors[2]
     0,            /* packed */
     0,NULL,NULL    /* reserved1,reserved2, etc */
   },
+  {
+    "next_table_id",
+    3,
+    PROTOBUF_C_LABEL_OPTIONAL,
+    PROTOBUF_C_TYPE_UINT32,
+    PROTOBUF_C_OFFSETOF(PGcodec__Superblock, has_next_table_id),
+    PROTOBUF_C_OFFSETOF(PGcodec__Superblock, next_table_id),
+    NULL,
+    NULL,
+    0,            /* packed */
+    0,NULL,NULL    /* reserved1,reserved2, etc */
+  },
 };
 static const unsigned pgcodec__superblock__field_indices_by_name[] = {
+  2,   /* field[2] = next_table_id */
   1,   /* field[1] = tables */
   0,   /* field[0] = uuid */
 };
 static const ProtobufCIntRange pgcodec__superblock__number_ranges[1 + 1] =
 {
   { 1, 0 },
-  { 0, 2 }
+  { 0, 3 }
 };
 const ProtobufCMessageDescriptor pgcodec__superblock__descriptor =
 {
@@ -388,7 +479,7 @@ const ProtobufCMessageDescriptor pgcodec__superblock__descriptor =
   "PGcodec__Superblock",
   "PGcodec",
   sizeof(PGcodec__Superblock),
-  2,
+  3,
   pgcodec__superblock__field_descriptors,
   pgcodec__superblock__field_indices_by_name,
   1,  pgcodec__superblock__number_ranges,
@@ -25,10 +25,12 @@ struct  _PGcodec__RootEnt
   ProtobufCBinaryData key;
   uint32_t n_records;
   uint64_t file_id;
+  protobuf_c_boolean has_run_id;
+  uint64_t run_id;
 };
 #define PGCODEC__ROOT_ENT__INIT \
  { PROTOBUF_C_MESSAGE_INIT (&pgcodec__root_ent__descriptor) \
-    , {0,NULL}, 0, 0 }
+    , {0,NULL}, 0, 0, 0,0 }
 
 
 struct  _PGcodec__RootIdx
@@ -48,10 +50,20 @@ struct  _PGcodec__TableMeta
   char *name;
   char *uuid;
   uint64_t root_id;
+  protobuf_c_boolean has_table_id;
+  uint32_t table_id;
+  protobuf_c_boolean has_write_buffer_size;
+  uint64_t write_buffer_size;
+  protobuf_c_boolean has_max_file_size;
+  uint64_t max_file_size;
+  protobuf_c_boolean has_max_open_files;
+  uint32_t max_open_files;
+  protobuf_c_boolean has_compact_trigger;
+  uint32_t compact_trigger;
 };
 #define PGCODEC__TABLE_META__INIT \
  { PROTOBUF_C_MESSAGE_INIT (&pgcodec__table_meta__descriptor) \
-    , NULL, NULL, 0 }
+    , NULL, NULL, 0, 0,0, 0,0, 0,0, 0,0, 0,0 }
 
 
 struct  _PGcodec__Superblock
@@ -60,10 +72,12 @@ struct  _PGcodec__Superblock
   char *uuid;
   size_t n_tables;
   PGcodec__TableMeta **tables;
+  protobuf_c_boolean has_next_table_id;
+  uint32_t next_table_id;
 };
 #define PGCODEC__SUPERBLOCK__INIT \
  { PROTOBUF_C_MESSAGE_INIT (&pgcodec__superblock__descriptor) \
-    , NULL, 0,NULL }
+    , NULL, 0,NULL, 0,0 }
 
 
 /* PGcodec__RootEnt methods */
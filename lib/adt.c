@@ -43,30 +43,24 @@ struct dstring *dstr_new(const void *init_str, size_t init_len,
 		return NULL;
 	}
 
-	if (init_str) {
+	if (init_str)
 		memcpy(dstr->s, init_str, is_len);
-		dstr->len = is_len;
-	}
 
+	dstr->len = is_len;
 	dstr->alloc_len = alloc_len;
 
 	return dstr;
 }
 
-static bool dstr_grow(struct dstring *dstr, unsigned int target)
+static bool dstr_grow(struct dstring *dstr, size_t target)
 {
-	unsigned int new_alloc_len = 32;
-	do {
+	size_t new_alloc_len = dstr->alloc_len ? dstr->alloc_len : 32;
+	while (new_alloc_len < target)
 		new_alloc_len <<= 1;
-	} while (new_alloc_len < target);
 
-	void *new_mem = calloc(1, new_alloc_len);
+	void *new_mem = realloc(dstr->s, new_alloc_len);
 	if (unlikely(!new_mem))
 		return false;
-	
-	memcpy(new_mem, dstr->s, dstr->len);
-
-	free(dstr->s);
 
 	dstr->s = new_mem;
 	dstr->alloc_len = new_alloc_len;
@@ -79,17 +73,34 @@ bool dstr_append(struct dstring *dstr, void *s, size_t s_len)
 	if (!s_len)
 		s_len = strlen(s);
 
-	unsigned int wanted = dstr->len + s_len + 1;
-	if ((wanted < dstr->alloc_len) &&
-	    !dstr_grow(dstr, wanted))
+	void *p = dstr_extend(dstr, s_len);
+	if (unlikely(!p))
 		return false;
-		
-	memcpy(&dstr->s[dstr->len], s, s_len);
-	dstr->s[dstr->len + s_len] = 0;
-	dstr->len += s_len;
+
+	memcpy(p, s, s_len);
 	return true;
 }
 
+// append len bytes for the caller to fill in; returns where they start
+void *dstr_extend(struct dstring *dstr, size_t len)
+{
+	size_t wanted = dstr->len + len + 1;
+	if ((wanted > dstr->alloc_len) &&
+	    !dstr_grow(dstr, wanted))
+		return NULL;
+
+	char *p = &dstr->s[dstr->len];
+	dstr->len += len;
+	dstr->s[dstr->len] = 0;
+	return p;
+}
+
+void dstr_clear(struct dstring *dstr)
+{
+	dstr->len = 0;
+	dstr->s[0] = 0;
+}
+
 void dlist_free(struct dlist *dl)
 {
 	if (!dl)
@@ -26,6 +26,8 @@ extern void dstr_free(struct dstring *dstr);
 extern struct dstring *dstr_new(const void *init_str, size_t init_len,
 			 size_t alloc_len_);
 extern bool dstr_append(struct dstring *dstr, void *s, size_t s_len);
+extern void *dstr_extend(struct dstring *dstr, size_t len);
+extern void dstr_clear(struct dstring *dstr);
 
 extern void dlist_free(struct dlist *dl);
 extern struct dlist *dlist_new(size_t alloc_len, void (*elem_destructor)(void *));
@@ -0,0 +1,834 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "pgdb-internal.h"
+
+/*
+ * Asynchronous gets.
+ *
+ * A get of a key whose pagefile is cold stalls its thread on page
+ * faults: one for the restart window's index entries, one for their
+ * keys, one for the value or its block.  A get queue issues those reads
+ * through an io_uring instead, so one thread keeps many lookups in
+ * flight, each waiting on at most one read at a time.  The memtables,
+ * fences, filters and restart points -- what any read of a table
+ * keeps warm -- are still searched in place, at submission.
+ *
+ * Each lookup walks the sorted runs as pgdb_get() does.  For a pagefile
+ * which may hold its key, it reads the index entries of the key's
+ * restart window, then the span of file holding their keys, then the
+ * value: straight into the buffer returned, or, for compressed
+ * pagefiles, the value's block unless the block cache has it.  Pagefiles
+ * without restart points, or whose window's keys lie too far apart, are
+ * searched in place, as are those read whole into memory (see
+ * pgmap_read()).  So is everything, should io_uring be unavailable:
+ * the queue then only defers the callbacks.
+ *
+ * A lookup holds a view of its table from submission until its callback
+ * is made, from pgdb_getq_reap(); a lookup completed without a read
+ * posts a no-op, so the ring's fd still wakes a poller.
+ */
+
+enum aget_stage {
+	AGET_INDEX,		// reading the restart window's index entries
+	AGET_KEYS,		// reading the span of their keys
+	AGET_VALUE,		// reading the value
+	AGET_BLOCK,		// reading the value's block
+	AGET_DONE,		// completed; waiting to be reaped
+};
+
+struct aget {
+	pgdb_getq_t		*q;
+	struct pgdb_view	view;
+	bool			verify;
+	bool			fill_cache;
+	void			(*done)(void *arg, char *val, size_t vallen,
+					char *err);
+	void			*arg;
+
+	enum aget_stage		stage;
+	enum pgdb_mt_result	res;
+	unsigned int		run;		// being searched
+	struct pgdb_pagefile	*pf;
+	unsigned int		lo;		// first slot read
+	unsigned int		n_pi;		// index entries in pi
+	unsigned int		n_window;	// of which, the restart window
+	struct pgdb_page_index	*pi;
+	uint64_t		buf_offset;	// in the pagefile
+	char			*buf;		// keys, or a compressed block
+	int			slot;
+	struct pgdb_page_index	ent;		// of slot
+
+	struct iovec		iov;		// read in flight
+	char			*val;
+	size_t			vlen;
+	char			*err;
+	struct aget		*next;		// on the done list
+
+	size_t			klen;
+	char			key[];
+};
+
+struct pgdb_getq_t {
+	pgdb_t			*db;
+	unsigned int		depth;
+	unsigned int		n_pending;	// submitted, not yet reaped
+	struct aget		*done;		// without a ring
+	struct aget		**done_tail;
+
+	// the ring, if any
+	int			fd;
+	unsigned int		to_submit;
+	void			*sq_ring;
+	size_t			sq_ring_len;
+	void			*cq_ring;
+	size_t			cq_ring_len;
+	struct io_uring_sqe	*sqes;
+	size_t			sqes_len;
+	unsigned int		*sq_tail;
+	unsigned int		*sq_mask;
+	unsigned int		*sq_array;
+	unsigned int		*cq_head;
+	unsigned int		*cq_tail;
+	unsigned int		*cq_mask;
+	struct io_uring_cqe	*cqes;
+};
+
+static int uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned int to_submit,
+		       unsigned int min_complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+static void ring_free(pgdb_getq_t *q)
+{
+	if (q->sqes)
+		munmap(q->sqes, q->sqes_len);
+	if (q->cq_ring && q->cq_ring != q->sq_ring)
+		munmap(q->cq_ring, q->cq_ring_len);
+	if (q->sq_ring)
+		munmap(q->sq_ring, q->sq_ring_len);
+	if (q->fd >= 0)
+		close(q->fd);
+
+	q->fd = -1;
+}
+
+// set up a ring of depth entries; false, leaving none, if we cannot
+static bool ring_init(pgdb_getq_t *q, unsigned int depth)
+{
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+
+	q->fd = uring_setup(depth, &p);
+	if (q->fd < 0)
+		return false;
+
+	q->sq_ring_len = p.sq_off.array + (p.sq_entries * sizeof(unsigned int));
+	q->cq_ring_len = p.cq_off.cqes +
+			 (p.cq_entries * sizeof(struct io_uring_cqe));
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (q->cq_ring_len > q->sq_ring_len)
+			q->sq_ring_len = q->cq_ring_len;
+		q->cq_ring_len = q->sq_ring_len;
+	}
+
+	q->sq_ring = mmap(NULL, q->sq_ring_len, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, q->fd, IORING_OFF_SQ_RING);
+	if (q->sq_ring == MAP_FAILED) {
+		q->sq_ring = NULL;
+		goto err_out;
+	}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		q->cq_ring = q->sq_ring;
+	} else {
+		q->cq_ring = mmap(NULL, q->cq_ring_len, PROT_READ | PROT_WRITE,
+				  MAP_SHARED | MAP_POPULATE, q->fd,
+				  IORING_OFF_CQ_RING);
+		if (q->cq_ring == MAP_FAILED) {
+			q->cq_ring = NULL;
+			goto err_out;
+		}
+	}
+
+	q->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	q->sqes = mmap(NULL, q->sqes_len, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, q->fd, IORING_OFF_SQES);
+	if (q->sqes == MAP_FAILED) {
+		q->sqes = NULL;
+		goto err_out;
+	}
+
+	q->sq_tail = q->sq_ring + p.sq_off.tail;
+	q->sq_mask = q->sq_ring + p.sq_off.ring_mask;
+	q->sq_array = q->sq_ring + p.sq_off.array;
+	q->cq_head = q->cq_ring + p.cq_off.head;
+	q->cq_tail = q->cq_ring + p.cq_off.tail;
+	q->cq_mask = q->cq_ring + p.cq_off.ring_mask;
+	q->cqes = q->cq_ring + p.cq_off.cqes;
+
+	return true;
+
+err_out:
+	ring_free(q);
+	return false;
+}
+
+/*
+ * Queue an operation for req.  Each lookup has at most one queued or in
+ * flight, and there are never more lookups than the ring has entries,
+ * so there is always room.
+ */
+static struct io_uring_sqe *ring_sqe(pgdb_getq_t *q, struct aget *req,
+				     unsigned int opcode)
+{
+	unsigned int tail = *q->sq_tail;
+	unsigned int idx = tail & *q->sq_mask;
+	struct io_uring_sqe *sqe = &q->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->user_data = (uintptr_t) req;
+
+	q->sq_array[idx] = idx;
+	__atomic_store_n(q->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	q->to_submit++;
+
+	return sqe;
+}
+
+// submit what is queued, then wait for min_complete completions
+static bool ring_enter(pgdb_getq_t *q, unsigned int min_complete)
+{
+	unsigned int flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+
+	while (q->to_submit || min_complete) {
+		int rc = uring_enter(q->fd, q->to_submit, min_complete, flags);
+		if (rc < 0) {
+			if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+				continue;
+			return false;
+		}
+
+		q->to_submit -= (rc < q->to_submit) ? rc : q->to_submit;
+		if (min_complete && !q->to_submit)
+			break;
+	}
+
+	return true;
+}
+
+// read len bytes at offset of req's pagefile into buf
+static void aget_read(struct aget *req, void *buf, size_t len,
+		      uint64_t offset)
+{
+	struct io_uring_sqe *sqe = ring_sqe(req->q, req, IORING_OP_READV);
+
+	req->iov.iov_base = buf;
+	req->iov.iov_len = len;
+
+	sqe->fd = req->pf->map->fd;
+	sqe->addr = (uintptr_t) &req->iov;
+	sqe->len = 1;
+	sqe->off = offset;
+}
+
+static void aget_error(struct aget *req, const char *msg)
+{
+	if (!req->err)
+		req->err = strdup(msg);
+}
+
+static void *aget_alloc(struct aget *req, size_t len)
+{
+	void *p = malloc(len ? len : 1);
+	if (!p)
+		aget_error(req, "OOM");		// irony, but recoverable
+	return p;
+}
+
+// done with the current pagefile
+static void aget_drop(struct aget *req)
+{
+	free(req->pi);
+	free(req->buf);
+	req->pi = NULL;
+	req->buf = NULL;
+
+	pg_pagefile_put(req->pf);
+	req->pf = NULL;
+}
+
+static void aget_complete(struct aget *req)
+{
+	pgdb_getq_t *q = req->q;
+
+	aget_drop(req);
+	if (req->res != PGDB_MT_FOUND || req->err) {
+		free(req->val);
+		req->val = NULL;
+		req->vlen = 0;
+	}
+	req->stage = AGET_DONE;
+
+	if (q->fd >= 0) {
+		ring_sqe(q, req, IORING_OP_NOP);
+		return;
+	}
+
+	req->next = NULL;
+	*q->done_tail = req;
+	q->done_tail = &req->next;
+}
+
+// search pf in place, as pgdb_get() does; takes over the reference
+static void aget_lookup_sync(struct aget *req, struct pgdb_pagefile *pf)
+{
+	const void *v;
+	size_t v_len;
+	pgdb_pinned_t *pin;
+
+	req->res = pg_pagefile_lookup(pf, req->key, req->klen, &v, &v_len,
+				      &pin, req->verify, req->fill_cache,
+				      &req->err);
+	if (req->res != PGDB_MT_FOUND)
+		return;
+
+	req->val = aget_alloc(req, v_len);
+	if (req->val) {
+		memcpy(req->val, v, v_len);
+		req->vlen = v_len;
+	}
+	pgdb_pinned_release(pin);
+}
+
+// start reading the index entries of key's restart window in pf
+static void aget_index(struct aget *req, struct pgdb_pagefile *pf)
+{
+	unsigned int lo, hi;
+
+	pg_pagefile_window(pf, req->key, req->klen, &lo, &hi);
+
+	// the key's slot may be hi, the restart point itself
+	unsigned int end = (hi < pf->n_entries) ? hi + 1 : pf->n_entries;
+	if (lo >= end) {
+		pg_pagefile_put(pf);
+		return;
+	}
+
+	req->pf = pf;
+	req->lo = lo;
+	req->n_pi = end - lo;
+	req->n_window = hi - lo;
+	req->pi = aget_alloc(req, req->n_pi * sizeof(struct pgdb_page_index));
+	if (!req->pi)
+		return;
+
+	req->stage = AGET_INDEX;
+	aget_read(req, req->pi, req->n_pi * sizeof(struct pgdb_page_index),
+		  sizeof(struct pgdb_page_hdr) +
+		  ((uint64_t) lo * sizeof(struct pgdb_page_index)));
+}
+
+/*
+ * Search the runs from req->run on, until a read is started or the
+ * lookup is resolved; then complete it.
+ */
+static void aget_runs(struct aget *req)
+{
+	struct pgdb_rootgen *rg = req->view.rg;
+	bool ring = req->q->fd >= 0;
+
+	for (; req->res == PGDB_MT_MISS && !req->err &&
+	       req->run < rg->n_runs; req->run++) {
+		struct pgdb_run *run = &rg->runs[req->run];
+
+		const struct pgdb_fence_ent *fe = pg_fence_find(run->fence,
+							req->key, req->klen);
+		if (!fe)
+			continue;
+		if (!pg_filter_may_match(rg->table->db, run, fe, req->key,
+					 req->klen))
+			continue;
+
+		struct pgdb_pagefile *pf = pg_pagefile_get(rg->table,
+							   fe->file_id,
+							   &req->err);
+		if (!pf)
+			break;
+
+		if (!ring || !pf->n_restarts || pf->map->fd < 0) {
+			aget_lookup_sync(req, pf);
+			continue;
+		}
+
+		aget_index(req, pf);
+		if (req->pf && !req->err)
+			return;
+	}
+
+	aget_complete(req);
+}
+
+// the pagefile could not resolve the lookup; on to the next run
+static void aget_miss(struct aget *req)
+{
+	aget_drop(req);
+	req->run++;
+	aget_runs(req);
+}
+
+static inline const char *aget_key(struct aget *req,
+				   const struct pgdb_page_index *pi)
+{
+	return req->buf + (le32toh(pi->k_offset) - req->buf_offset);
+}
+
+// the index entries are in: read the span of file holding their keys
+static void aget_index_done(struct aget *req)
+{
+	uint64_t file_len = req->pf->map->st.st_size;
+	uint64_t start = UINT64_MAX, end = 0;
+	unsigned int i;
+
+	for (i = 0; i < req->n_pi; i++) {
+		uint64_t k_offset = le32toh(req->pi[i].k_offset);
+		uint64_t k_end = k_offset + le32toh(req->pi[i].k_len);
+
+		if (k_end > file_len) {
+			aget_error(req, "pagefile key out of range");
+			aget_complete(req);
+			return;
+		}
+		if (k_offset < start)
+			start = k_offset;
+		if (k_end > end)
+			end = k_end;
+	}
+
+	// keys interleaved with large values: cheaper searched in place
+	if ((end - start) > PGDB_AGET_SPAN_MAX) {
+		struct pgdb_pagefile *pf = req->pf;
+
+		req->pf = NULL;
+		aget_drop(req);
+		aget_lookup_sync(req, pf);
+		req->run++;
+		aget_runs(req);
+		return;
+	}
+
+	req->buf_offset = start;
+	req->buf = aget_alloc(req, end - start);
+	if (!req->buf) {
+		aget_complete(req);
+		return;
+	}
+
+	req->stage = AGET_KEYS;
+	aget_read(req, req->buf, end - start, start);
+}
+
+// the value is in req->val; check it, and complete
+static void aget_value_done(struct aget *req)
+{
+	if (req->verify &&
+	    !pg_pagefile_verify(req->pf, req->slot, req->val, req->vlen,
+				&req->err)) {
+		aget_complete(req);
+		return;
+	}
+
+	// tombstones have no value, but hide what older runs hold
+	req->res = (le32toh(req->ent.flags) & PGDB_PI_DELETED) ?
+		   PGDB_MT_DELETED : PGDB_MT_FOUND;
+	aget_complete(req);
+}
+
+// the value's block is in req->buf: uncompress it, and copy the value
+static void aget_block_done(struct aget *req)
+{
+	struct pgdb_pagefile *pf = req->pf;
+	uint32_t block = le32toh(req->ent.v_block);
+
+	struct pgdb_vblock *blk = pg_vblock_load(pf, block, req->buf,
+						 &req->err);
+	if (!blk) {
+		aget_complete(req);
+		return;
+	}
+
+	memcpy(req->val, blk->data + le32toh(req->ent.v_offset), req->vlen);
+	if (req->fill_cache)
+		pg_cache_insert(pf->cache, blk);
+	pg_vblock_unref(blk);
+
+	aget_value_done(req);
+}
+
+// found the key's slot: fetch its value
+static void aget_value(struct aget *req)
+{
+	struct pgdb_pagefile *pf = req->pf;
+	uint64_t file_len = pf->map->st.st_size;
+	uint32_t v_offset = le32toh(req->ent.v_offset);
+	uint32_t v_len = le32toh(req->ent.v_len);
+
+	req->vlen = v_len;
+	req->val = aget_alloc(req, v_len);
+	if (!req->val) {
+		aget_complete(req);
+		return;
+	}
+
+	if (!v_len) {
+		aget_value_done(req);
+		return;
+	}
+
+	if (pf->compression == PGDB_COMP_NONE) {
+		if (((uint64_t) v_offset + v_len) > file_len)
+			goto range_err;
+
+		req->stage = AGET_VALUE;
+		aget_read(req, req->val, v_len, v_offset);
+		return;
+	}
+
+	uint32_t block = le32toh(req->ent.v_block);
+	if (block >= pf->n_vblocks)
+		goto range_err;
+
+	const struct pgdb_page_vblock *vb = &pf->vb[block];
+	uint32_t vb_offset = le32toh(vb->offset);
+	uint32_t c_len = le32toh(vb->c_len);
+	uint32_t raw_len = le32toh(vb->raw_len);
+
+	if (((uint64_t) vb_offset + c_len) > file_len ||
+	    ((uint64_t) v_offset + v_len) > raw_len)
+		goto range_err;
+
+	if (le32toh(vb->flags) & PGDB_VB_RAW) {
+		if (c_len != raw_len)
+			goto range_err;
+
+		req->stage = AGET_VALUE;
+		aget_read(req, req->val, v_len, (uint64_t) vb_offset + v_offset);
+		return;
+	}
+
+	struct pgdb_vblock *blk = pg_cache_lookup(pf->cache, pf->cache_id,
+						  pf->file_id, block);
+	if (blk) {
+		memcpy(req->val, blk->data + v_offset, v_len);
+		pg_vblock_unref(blk);
+		aget_value_done(req);
+		return;
+	}
+
+	req->buf = aget_alloc(req, c_len);
+	if (!req->buf) {
+		aget_complete(req);
+		return;
+	}
+
+	req->stage = AGET_BLOCK;
+	aget_read(req, req->buf, c_len, vb_offset);
+	return;
+
+range_err:
+	aget_error(req, "pagefile value out of range");
+	aget_complete(req);
+}
+
+// the keys are in: find the key's slot, as pg_pagefile_find() does
+static void aget_keys_done(struct aget *req)
+{
+	unsigned int lo = 0, hi = req->n_window;
+
+	while (lo < hi) {
+		unsigned int mid = lo + ((hi - lo) / 2);
+		const struct pgdb_page_index *pi = &req->pi[mid];
+
+		if (pg_key_cmp(aget_key(req, pi), le32toh(pi->k_len),
+			       req->key, req->klen) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo >= req->n_pi ||
+	    pg_key_cmp(aget_key(req, &req->pi[lo]), le32toh(req->pi[lo].k_len),
+		       req->key, req->klen)) {
+		aget_miss(req);
+		return;
+	}
+
+	req->slot = req->lo + lo;
+	req->ent = req->pi[lo];
+	free(req->pi);
+	free(req->buf);
+	req->pi = NULL;
+	req->buf = NULL;
+
+	aget_value(req);
+}
+
+// a read of req's completed, with result res
+static void aget_io_done(struct aget *req, int res)
+{
+	if (res < 0) {
+		req->err = strdup(strerror(-res));
+		aget_complete(req);
+		return;
+	}
+	if ((size_t) res != req->iov.iov_len) {
+		aget_error(req, "pagefile short read");
+		aget_complete(req);
+		return;
+	}
+
+	switch (req->stage) {
+	case AGET_INDEX:
+		aget_index_done(req);
+		break;
+	case AGET_KEYS:
+		aget_keys_done(req);
+		break;
+	case AGET_VALUE:
+		aget_value_done(req);
+		break;
+	case AGET_BLOCK:
+		aget_block_done(req);
+		break;
+	case AGET_DONE:
+		break;
+	}
+}
+
+static void aget_deliver(struct aget *req)
+{
+	pgdb_getq_t *q = req->q;
+
+	pg_view_put(&req->view);
+	q->n_pending--;
+
+	void (*done)(void *, char *, size_t, char *) = req->done;
+	void *arg = req->arg;
+	char *val = req->val, *err = req->err;
+	size_t vlen = req->vlen;
+
+	memset(req, 0xff, sizeof(*req));
+	free(req);
+
+	done(arg, val, vlen, err);
+}
+
+unsigned int pgdb_getq_reap(pgdb_getq_t* q, unsigned int min_done)
+{
+	unsigned int n_done = 0;
+
+	for (;;) {
+		while (q->done) {
+			struct aget *req = q->done;
+
+			q->done = req->next;
+			if (!q->done)
+				q->done_tail = &q->done;
+			aget_deliver(req);
+			n_done++;
+		}
+
+		if (q->fd >= 0) {
+			unsigned int head = *q->cq_head;
+
+			while (head != __atomic_load_n(q->cq_tail,
+						       __ATOMIC_ACQUIRE)) {
+				struct io_uring_cqe *cqe =
+					&q->cqes[head & *q->cq_mask];
+				struct aget *req =
+					(void *) (uintptr_t) cqe->user_data;
+				int res = cqe->res;
+
+				__atomic_store_n(q->cq_head, ++head,
+						 __ATOMIC_RELEASE);
+
+				if (req->stage == AGET_DONE) {
+					aget_deliver(req);
+					n_done++;
+				} else {
+					aget_io_done(req, res);
+				}
+				head = *q->cq_head;
+			}
+		}
+
+		if (n_done >= min_done || !q->n_pending)
+			break;
+		if (q->done)
+			continue;
+
+		if (!ring_enter(q, 1))
+			break;
+	}
+
+	// reads started by completions
+	if (q->fd >= 0)
+		ring_enter(q, 0);
+
+	return n_done;
+}
+
+static bool __pgdb_get_async(
+    pgdb_getq_t* q, unsigned int table_slot,
+    const pgdb_readoptions_t* options,
+    const char* key, size_t keylen,
+    void (*done)(void* arg, char* val, size_t vallen, char* err),
+    void* arg,
+    char** errptr)
+{
+	*errptr = NULL;
+
+	while (q->n_pending >= q->depth)
+		pgdb_getq_reap(q, 1);
+
+	struct aget *req = calloc(1, sizeof(*req) + keylen);
+	if (!req) {
+		*errptr = strdup("OOM");	// irony, but recoverable
+		return false;
+	}
+
+	req->q = q;
+	req->done = done;
+	req->arg = arg;
+	req->verify = options && options->verify_checksums;
+	req->fill_cache = !options || options->fill_cache;
+	req->res = PGDB_MT_MISS;
+	req->klen = keylen;
+	memcpy(req->key, key, keylen);
+
+	if (!pg_view_get(q->db, table_slot, options, &req->view, errptr)) {
+		pg_view_put(&req->view);
+		free(req);
+		return false;
+	}
+
+	q->n_pending++;
+
+	struct pgdb_memset *ms = req->view.ms;
+	unsigned int i;
+	for (i = 0; i < ms->n_mt && req->res == PGDB_MT_MISS; i++) {
+		const void *v;
+		size_t v_len;
+
+		req->res = pg_memtable_get(ms->mt[i], key, keylen,
+					   req->view.seq, &v, &v_len);
+		if (req->res != PGDB_MT_FOUND)
+			continue;
+
+		req->val = aget_alloc(req, v_len);
+		if (req->val) {
+			memcpy(req->val, v, v_len);
+			req->vlen = v_len;
+		}
+	}
+
+	aget_runs(req);
+
+	if (q->fd >= 0)
+		ring_enter(q, 0);
+
+	return true;
+}
+
+bool pgdb_get_async(
+    pgdb_getq_t* q,
+    const pgdb_readoptions_t* options,
+    const char* key, size_t keylen,
+    void (*done)(void* arg, char* val, size_t vallen, char* err),
+    void* arg,
+    char** errptr)
+{
+	return __pgdb_get_async(q, 0, options, key, keylen, done, arg,
+				errptr);
+}
+
+bool pgdb_get_async_cf(
+    pgdb_getq_t* q,
+    const pgdb_readoptions_t* options,
+    pgdb_table_t* table,
+    const char* key, size_t keylen,
+    void (*done)(void* arg, char* val, size_t vallen, char* err),
+    void* arg,
+    char** errptr)
+{
+	return __pgdb_get_async(q, table->slot, options, key, keylen, done,
+				arg, errptr);
+}
+
+unsigned int pgdb_getq_pending(pgdb_getq_t* q)
+{
+	return q->n_pending;
+}
+
+int pgdb_getq_fd(pgdb_getq_t* q)
+{
+	return q->fd;
+}
+
+pgdb_getq_t* pgdb_getq_create(
+    pgdb_t* db,
+    unsigned int depth,
+    char** errptr)
+{
+	*errptr = NULL;
+
+	if (!depth)
+		depth = PGDB_GETQ_DEF_DEPTH;
+	if (depth > PGDB_GETQ_MAX_DEPTH) {
+		*errptr = strdup("get queue depth too large");
+		return NULL;
+	}
+
+	pgdb_getq_t *q = calloc(1, sizeof(*q));
+	if (!q) {
+		*errptr = strdup("OOM");	// irony, but recoverable
+		return NULL;
+	}
+
+	q->db = db;
+	q->depth = depth;
+	q->done_tail = &q->done;
+
+	// without io_uring, lookups complete at submission
+	ring_init(q, depth);
+
+	return q;
+}
+
+void pgdb_getq_destroy(pgdb_getq_t* q)
+{
+	if (!q)
+		return;
+
+	while (q->n_pending && pgdb_getq_reap(q, q->n_pending))
+		;
+
+	ring_free(q);
+
+	memset(q, 0xff, sizeof(*q));
+	free(q);
+}
@@ -0,0 +1,317 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "pgdb-internal.h"
+
+/*
+ * Block cache.
+ *
+ * Uncompressed value blocks are kept across reads, up to a capacity in
+ * bytes, in a fixed number of shards keyed by (database, file, block)
+ * so that concurrent readers rarely share a lock.  One cache may serve
+ * several databases in a process: each open database draws a cache id
+ * of its own, so equal file ids never collide.
+ *
+ * Each shard keeps two LRU lists.  Blocks enter the cold list, and move
+ * to the hot one when hit again; the hot list holds at most
+ * PGDB_CACHE_HOT_PCT of the shard, its overflow falling back to the
+ * head of the cold list, and eviction takes cold blocks first.  A scan
+ * reading each block once thus only cycles the cold list, leaving the
+ * blocks point reads keep returning to.  Reads may also ask not to fill
+ * the cache at all.
+ *
+ * Each cached block holds one reference owned by the cache, plus one
+ * per reader using it; blocks are freed after the shard lock is
+ * released.
+ */
+
+static uint64_t next_cache_id;
+
+// a cache id for a newly opened database
+uint64_t pg_cache_new_id(void)
+{
+	return __atomic_add_fetch(&next_cache_id, 1, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t block_hash(uint64_t cache_id, uint64_t file_id,
+				  uint32_t block)
+{
+	uint64_t h = (cache_id * 0x9e3779b97f4a7c15ULL) ^ file_id;
+
+	h = (h * 0xbf58476d1ce4e5b9ULL) ^ block;
+	return h * 0x94d049bb133111ebULL;
+}
+
+static inline struct pgdb_cache_shard *shard_of(pgdb_cache_t *cache,
+						uint64_t hash)
+{
+	return &cache->shard[(hash >> 60) & (PGDB_CACHE_SHARDS - 1)];
+}
+
+static inline struct pgdb_vblock **bucket_of(struct pgdb_cache_shard *sh,
+					     uint64_t hash)
+{
+	return &sh->hash[hash & sh->hash_mask];
+}
+
+static void lru_unlink(struct pgdb_cache_lru *lru, struct pgdb_vblock *blk)
+{
+	if (blk->lru_prev)
+		blk->lru_prev->lru_next = blk->lru_next;
+	else
+		lru->head = blk->lru_next;
+	if (blk->lru_next)
+		blk->lru_next->lru_prev = blk->lru_prev;
+	else
+		lru->tail = blk->lru_prev;
+
+	blk->lru_prev = blk->lru_next = NULL;
+	lru->usage -= blk->charge;
+}
+
+static void lru_push(struct pgdb_cache_lru *lru, struct pgdb_vblock *blk)
+{
+	blk->lru_prev = NULL;
+	blk->lru_next = lru->head;
+	if (lru->head)
+		lru->head->lru_prev = blk;
+	else
+		lru->tail = blk;
+	lru->head = blk;
+	lru->usage += blk->charge;
+}
+
+static inline struct pgdb_cache_lru *lru_of(struct pgdb_cache_shard *sh,
+					    struct pgdb_vblock *blk)
+{
+	return blk->hot ? &sh->hot : &sh->cold;
+}
+
+static void hash_unlink(struct pgdb_cache_shard *sh, struct pgdb_vblock *blk)
+{
+	uint64_t hash = block_hash(blk->cache_id, blk->file_id, blk->block);
+	struct pgdb_vblock **pp = bucket_of(sh, hash);
+
+	while (*pp != blk)
+		pp = &(*pp)->hnext;
+	*pp = blk->hnext;
+	blk->hnext = NULL;
+}
+
+static struct pgdb_vblock *shard_lookup(struct pgdb_cache_shard *sh,
+					uint64_t hash, uint64_t cache_id,
+					uint64_t file_id, uint32_t block)
+{
+	struct pgdb_vblock *blk = *bucket_of(sh, hash);
+
+	while (blk && (blk->block != block || blk->file_id != file_id ||
+		       blk->cache_id != cache_id))
+		blk = blk->hnext;
+
+	return blk;
+}
+
+// double the buckets once they average more than one block; best effort
+static void shard_grow(struct pgdb_cache_shard *sh)
+{
+	unsigned int n_buckets = sh->hash_mask + 1;
+	if (sh->n_ents <= n_buckets)
+		return;
+
+	struct pgdb_vblock **hash = calloc(n_buckets * 2, sizeof(*hash));
+	if (!hash)
+		return;
+
+	struct pgdb_vblock **old = sh->hash;
+	unsigned int i;
+
+	sh->hash = hash;
+	sh->hash_mask = (n_buckets * 2) - 1;
+
+	for (i = 0; i < n_buckets; i++) {
+		struct pgdb_vblock *blk = old[i];
+		while (blk) {
+			struct pgdb_vblock *next = blk->hnext;
+			struct pgdb_vblock **bucket = bucket_of(sh,
+				block_hash(blk->cache_id, blk->file_id,
+					   blk->block));
+			blk->hnext = *bucket;
+			*bucket = blk;
+			blk = next;
+		}
+	}
+
+	free(old);
+}
+
+// demote the hot list's oldest blocks while it holds more than its share
+static void shard_cool(struct pgdb_cache_shard *sh)
+{
+	size_t hot_max = (sh->capacity / 100) * PGDB_CACHE_HOT_PCT;
+
+	while (sh->hot.usage > hot_max && sh->hot.tail) {
+		struct pgdb_vblock *blk = sh->hot.tail;
+		lru_unlink(&sh->hot, blk);
+		blk->hot = false;
+		lru_push(&sh->cold, blk);
+	}
+}
+
+/*
+ * Remove LRU blocks, cold ones first, until the shard fits its
+ * capacity.  Returns the list of blocks, chained through hnext, whose
+ * last reference was the cache's own; the caller frees them once the
+ * lock is dropped.
+ */
+static struct pgdb_vblock *shard_evict(struct pgdb_cache_shard *sh)
+{
+	struct pgdb_vblock *dead = NULL;
+
+	while (sh->usage > sh->capacity) {
+		struct pgdb_vblock *victim = sh->cold.tail ? sh->cold.tail :
+					     sh->hot.tail;
+		if (!victim)
+			break;
+
+		lru_unlink(lru_of(sh, victim), victim);
+		hash_unlink(sh, victim);
+		sh->usage -= victim->charge;
+		sh->n_ents--;
+
+		if (__atomic_sub_fetch(&victim->refcnt, 1,
+				       __ATOMIC_ACQ_REL) == 0) {
+			victim->hnext = dead;
+			dead = victim;
+		}
+	}
+
+	return dead;
+}
+
+static void free_list(struct pgdb_vblock *dead)
+{
+	while (dead) {
+		struct pgdb_vblock *next = dead->hnext;
+
+		memset(dead, 0xff, sizeof(*dead));
+		free(dead);
+		dead = next;
+	}
+}
+
+/*
+ * Return the cached block of file_id, with a reference the caller drops
+ * with pg_vblock_unref(); NULL if not cached.
+ */
+struct pgdb_vblock *pg_cache_lookup(pgdb_cache_t *cache, uint64_t cache_id,
+				    uint64_t file_id, uint32_t block)
+{
+	uint64_t hash = block_hash(cache_id, file_id, block);
+	struct pgdb_cache_shard *sh = shard_of(cache, hash);
+
+	pthread_mutex_lock(&sh->lock);
+
+	struct pgdb_vblock *blk = shard_lookup(sh, hash, cache_id, file_id,
+					       block);
+	if (blk) {
+		pg_vblock_ref(blk);
+
+		// a second hit makes a block hot
+		if (!blk->hot || sh->hot.head != blk) {
+			lru_unlink(lru_of(sh, blk), blk);
+			blk->hot = true;
+			lru_push(&sh->hot, blk);
+			shard_cool(sh);
+		}
+	}
+
+	pthread_mutex_unlock(&sh->lock);
+
+	return blk;
+}
+
+/*
+ * Cache blk, cold, unless another reader cached the same block first.
+ * The cache takes a reference of its own; the caller keeps theirs.
+ */
+void pg_cache_insert(pgdb_cache_t *cache, struct pgdb_vblock *blk)
+{
+	uint64_t hash = block_hash(blk->cache_id, blk->file_id, blk->block);
+	struct pgdb_cache_shard *sh = shard_of(cache, hash);
+
+	pthread_mutex_lock(&sh->lock);
+
+	if (shard_lookup(sh, hash, blk->cache_id, blk->file_id, blk->block)) {
+		pthread_mutex_unlock(&sh->lock);
+		return;
+	}
+
+	pg_vblock_ref(blk);
+	blk->charge = sizeof(*blk) + blk->len;
+	blk->hot = false;
+
+	struct pgdb_vblock **bucket = bucket_of(sh, hash);
+	blk->hnext = *bucket;
+	*bucket = blk;
+	lru_push(&sh->cold, blk);
+	sh->usage += blk->charge;
+	sh->n_ents++;
+
+	shard_grow(sh);
+	struct pgdb_vblock *dead = shard_evict(sh);
+
+	pthread_mutex_unlock(&sh->lock);
+
+	free_list(dead);
+}
+
+pgdb_cache_t* pgdb_cache_create_lru(size_t capacity)
+{
+	pgdb_cache_t *cache = NULL;
+	if (posix_memalign((void **) &cache, 64, sizeof(*cache)))
+		return NULL;
+	memset(cache, 0, sizeof(*cache));
+
+	size_t per_shard = capacity / PGDB_CACHE_SHARDS;
+
+	unsigned int n_buckets = 16;
+	while (n_buckets < (per_shard / PGDB_DEF_BLOCK_SIZE))
+		n_buckets <<= 1;
+
+	unsigned int i;
+	for (i = 0; i < PGDB_CACHE_SHARDS; i++) {
+		struct pgdb_cache_shard *sh = &cache->shard[i];
+
+		pthread_mutex_init(&sh->lock, NULL);
+		sh->capacity = per_shard;
+		sh->hash_mask = n_buckets - 1;
+		sh->hash = calloc(n_buckets, sizeof(struct pgdb_vblock *));
+		if (!sh->hash) {
+			pgdb_cache_destroy(cache);
+			return NULL;
+		}
+	}
+
+	return cache;
+}
+
+// every database using cache must be closed first
+void pgdb_cache_destroy(pgdb_cache_t* cache)
+{
+	if (!cache)
+		return;
+
+	unsigned int i;
+	for (i = 0; i < PGDB_CACHE_SHARDS; i++) {
+		struct pgdb_cache_shard *sh = &cache->shard[i];
+
+		sh->capacity = 0;
+		free_list(shard_evict(sh));
+
+		free(sh->hash);
+		pthread_mutex_destroy(&sh->lock);
+	}
+
+	memset(cache, 0xff, sizeof(*cache));
+	free(cache);
+}
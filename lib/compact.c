@@ -0,0 +1,610 @@
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "pgdb-internal.h"
+
+/*
+ * Compaction.
+ *
+ * Every flush adds a sorted run, and every run is one more place a
+ * lookup may have to search.  The compaction thread merges runs back
+ * together, size-tiered: once a table has its compact_trigger runs,
+ * it takes the newest run, then each next older run no larger than
+ * PGDB_COMPACT_SIZE_RATIO times those taken so far.  Since the inputs
+ * are a newest prefix of the runs, the output keeps the newest input's
+ * run id and still sorts ahead of every run it overlaps.  Tombstones
+ * can only be dropped when every run is an input.
+ *
+ * pgdb_compact_range() instead takes, from every run, the pagefiles
+ * overlapping a key range, widening the range until no pagefile left
+ * out overlaps it.  Every version of every key in the range is then an
+ * input, so tombstones go, and the output can join the oldest input
+ * run without overlapping anything that remains there.
+ *
+ * Either way the merge keeps the newest version of each key.  Flushes
+ * continue meanwhile; they only add newer runs.  Input files are
+ * deleted once no root generation refers to them.
+ */
+
+enum {
+	COMPACT_PROGRESS_STEP	= 4096,		// records between callbacks
+};
+
+struct compact_src {
+	uint64_t		run_id;
+	PGcodec__RootEnt	**ents;		// input files of one run
+	unsigned int		n_ents;
+	unsigned int		cur_ent;
+	struct pgdb_pagefile	*pf;		// NULL once exhausted
+	uint32_t		slot;
+	struct pgdb_vblock	*blk;		// holding val, if uncompressed
+
+	const void		*key;		// current record
+	size_t			klen;
+	const void		*val;
+	size_t			vlen;
+	bool			deleted;
+};
+
+struct compaction {
+	pgdb_t			*db;
+	struct pgdb_table_t	*table;
+	struct pgdb_rootgen	*rg;		// inputs are listed here
+
+	unsigned int		n_src;
+	struct compact_src	src[];		// newest run first
+};
+
+struct compact_opts {
+	uint64_t		out_run_id;
+	bool			drop_tombstones;
+	bool			cancellable;	// stop at shutdown
+	void			(*progress)(void *arg, uint64_t done,
+					    uint64_t total);
+	void			*progress_arg;
+};
+
+static uint64_t run_records(const struct pgdb_run *run)
+{
+	uint64_t n = 0;
+	unsigned int i;
+
+	for (i = 0; i < run->n_ents; i++)
+		n += run->ents[i]->n_records;
+
+	return n;
+}
+
+bool pg_compact_needed(const struct pgdb_rootgen *rg)
+{
+	return rg->n_runs >= rg->table->opt.compact_trigger;
+}
+
+static struct compaction *compaction_new(pgdb_t *db, struct pgdb_table_t *table,
+					 struct pgdb_rootgen *rg,
+					 unsigned int max_src)
+{
+	struct compaction *c = calloc(1, sizeof(*c) +
+				      (max_src * sizeof(struct compact_src)));
+	if (!c)
+		return NULL;
+
+	c->db = db;
+	c->table = table;
+	c->rg = rg;
+
+	return c;
+}
+
+static void compaction_free(struct compaction *c)
+{
+	unsigned int i;
+	for (i = 0; i < c->n_src; i++) {
+		pg_pagefile_put(c->src[i].pf);
+		pg_vblock_unref(c->src[i].blk);
+	}
+
+	pg_rootgen_unref(c->rg);
+
+	memset(c, 0xff, sizeof(*c));
+	free(c);
+}
+
+static void add_src(struct compaction *c, const struct pgdb_run *run,
+		    unsigned int first, unsigned int end)
+{
+	struct compact_src *src = &c->src[c->n_src++];
+
+	src->run_id = run->run_id;
+	src->ents = &run->ents[first];
+	src->n_ents = end - first;
+}
+
+// position src on its current record, moving on to its next file as needed
+static bool src_load(struct pgdb_table_t *table, struct compact_src *src,
+		     char **errptr)
+{
+	while (1) {
+		struct pgdb_pagefile *pf = src->pf;
+
+		if (pf && src->slot < pf->n_entries) {
+			struct pgdb_page_index *pi = &pf->pi[src->slot];
+			uint64_t k_offset = le32toh(pi->k_offset);
+			uint64_t k_len = le32toh(pi->k_len);
+
+			if ((k_offset + k_len) > pf->map->st.st_size) {
+				*errptr = strdup("pagefile record out of range");
+				return false;
+			}
+
+			// each block is read once: keep it out of the cache
+			src->val = pg_pagefile_value(pf, src->slot, &src->blk,
+						     &src->vlen, false, errptr);
+			if (!src->val)
+				return false;
+
+			src->key = pf->map->mem + k_offset;
+			src->klen = k_len;
+			src->deleted = le32toh(pi->flags) & PGDB_PI_DELETED;
+			return true;
+		}
+
+		if (pf) {
+			pg_pagefile_put(pf);
+			src->pf = NULL;
+			src->cur_ent++;
+		}
+
+		if (src->cur_ent >= src->n_ents)
+			return true;		// exhausted
+
+		src->pf = pg_pagefile_get(table,
+					  src->ents[src->cur_ent]->file_id,
+					  errptr);
+		if (!src->pf)
+			return false;
+		src->slot = 0;
+	}
+}
+
+static inline bool src_advance(struct pgdb_table_t *table,
+			       struct compact_src *src, char **errptr)
+{
+	src->slot++;
+	return src_load(table, src, errptr);
+}
+
+// merge the sources into a new run, and install it in their place
+static bool compaction_run(struct compaction *c, const struct compact_opts *co,
+			   char **errptr)
+{
+	pgdb_t *db = c->db;
+	uint64_t total = 0, done = 0, next_report = COMPACT_PROGRESS_STEP;
+	unsigned int i, j, n_del = 0;
+
+	for (i = 0; i < c->n_src; i++)
+		for (j = 0; j < c->src[i].n_ents; j++) {
+			total += c->src[i].ents[j]->n_records;
+			n_del++;
+		}
+
+	uint64_t *del = malloc((n_del + 1) * sizeof(uint64_t));
+	struct pgdb_pagebuild *pb = pg_pagebuild_new(db, co->out_run_id,
+					c->table->opt.max_file_size);
+	if (!del || !pb) {
+		free(del);
+		pg_pagebuild_free(pb, false);
+		*errptr = strdup("OOM");	// irony, but recoverable
+		return false;
+	}
+
+	n_del = 0;
+	for (i = 0; i < c->n_src; i++)
+		for (j = 0; j < c->src[i].n_ents; j++)
+			del[n_del++] = c->src[i].ents[j]->file_id;
+
+	for (i = 0; i < c->n_src; i++)
+		if (!src_load(c->table, &c->src[i], errptr))
+			goto err_out;
+
+	while (1) {
+		// sources are newest first, so ties go to the newest version
+		struct compact_src *min = NULL;
+		for (i = 0; i < c->n_src; i++) {
+			struct compact_src *src = &c->src[i];
+			if (src->pf && (!min ||
+			    pg_key_cmp(src->key, src->klen,
+				       min->key, min->klen) < 0))
+				min = src;
+		}
+		if (!min)
+			break;
+
+		if (!(min->deleted && co->drop_tombstones) &&
+		    !pg_pagebuild_add(pb, min->deleted ? PGDB_REC_DEL :
+						PGDB_REC_PUT,
+				      min->key, min->klen,
+				      min->val, min->vlen, errptr))
+			goto err_out;
+
+		// skip the shadowed versions; min's key stays valid till last
+		for (i = 0; i < c->n_src; i++) {
+			struct compact_src *src = &c->src[i];
+			if (src == min || !src->pf ||
+			    pg_key_cmp(src->key, src->klen,
+				       min->key, min->klen))
+				continue;
+			if (!src_advance(c->table, src, errptr))
+				goto err_out;
+			done++;
+		}
+		if (!src_advance(c->table, min, errptr))
+			goto err_out;
+		done++;
+
+		// shadowed versions may carry done past a multiple of the step
+		if (done >= next_report) {
+			next_report = done + COMPACT_PROGRESS_STEP;
+			if (co->progress)
+				co->progress(co->progress_arg, done, total);
+			if (co->cancellable &&
+			    __atomic_load_n(&db->bg_shutdown, __ATOMIC_RELAXED)) {
+				*errptr = strdup("compaction cancelled");
+				goto err_out;
+			}
+		}
+	}
+
+	if (!pg_pagebuild_finish(pb, errptr))
+		goto err_out;
+
+	pthread_mutex_lock(&db->root_lock);
+
+	struct pgdb_rootgen *rg = pg_rootgen_write(db, c->table,
+						   pb->ents, pb->n_ents,
+						   del, n_del, errptr);
+	if (!rg) {
+		pthread_mutex_unlock(&db->root_lock);
+		goto err_out;
+	}
+
+	pthread_mutex_lock(&db->lock);
+	struct pgdb_rootgen *old = pg_rootgen_swap(c->table, rg);
+	pthread_mutex_unlock(&db->lock);
+
+	pthread_mutex_unlock(&db->root_lock);
+
+	pg_rootgen_retire(old);
+	pg_epoch_collect(db->epoch);
+
+	if (co->progress)
+		co->progress(co->progress_arg, total, total);
+
+	pg_pagebuild_free(pb, false);
+	free(del);
+	return true;
+
+err_out:
+	pg_pagebuild_free(pb, true);
+	free(del);
+	return false;
+}
+
+// size-tiered merge of a newest prefix of the table's runs
+static bool compact_auto(pgdb_t *db, struct pgdb_table_t *table, char **errptr)
+{
+	pthread_mutex_lock(&db->compact_lock);
+
+	// a drop waits for compact_lock, so rg stays the table's
+	pthread_mutex_lock(&db->lock);
+	struct pgdb_rootgen *rg = table->rootgen;
+	if (rg)
+		pg_rootgen_ref(rg);
+	pthread_mutex_unlock(&db->lock);
+
+	if (!rg || !pg_compact_needed(rg)) {
+		pg_rootgen_unref(rg);
+		pthread_mutex_unlock(&db->compact_lock);
+		return true;
+	}
+
+	uint64_t acc = run_records(&rg->runs[0]);
+	unsigned int n = 1;
+	while (n < rg->n_runs) {
+		uint64_t sz = run_records(&rg->runs[n]);
+		if (sz > (acc * PGDB_COMPACT_SIZE_RATIO))
+			break;
+		acc += sz;
+		n++;
+	}
+
+	// one run dwarfs the newer ones; merge a few anyway
+	if (n < 2)
+		n = table->opt.compact_trigger;
+
+	struct compaction *c = compaction_new(db, table, rg, n);
+	if (!c) {
+		pg_rootgen_unref(rg);
+		pthread_mutex_unlock(&db->compact_lock);
+		*errptr = strdup("OOM");	// irony, but recoverable
+		return false;
+	}
+
+	unsigned int i;
+	for (i = 0; i < n; i++)
+		add_src(c, &rg->runs[i], 0, rg->runs[i].n_ents);
+
+	struct compact_opts co = {
+		.out_run_id		= rg->runs[0].run_id,
+		.drop_tombstones	= (n == rg->n_runs),
+		.cancellable		= true,
+	};
+
+	bool rc = compaction_run(c, &co, errptr);
+
+	compaction_free(c);
+	pthread_mutex_unlock(&db->compact_lock);
+	return rc;
+}
+
+/*
+ * The table furthest past its compaction trigger, or NULL; so a busy
+ * table cannot starve the rest.  db->lock held.
+ */
+struct pgdb_table_t *pg_compact_pick(pgdb_t *db)
+{
+	struct pgdb_table_t *pick = NULL;
+	unsigned int i, excess = 0;
+
+	for (i = 0; i < db->n_tables; i++) {
+		struct pgdb_table_t *table = db->tables[i];
+		if (table->dropped || !pg_compact_needed(table->rootgen))
+			continue;
+
+		unsigned int n = table->rootgen->n_runs -
+				 table->opt.compact_trigger;
+		if (!pick || n > excess) {
+			pick = table;
+			excess = n;
+		}
+	}
+
+	return pick;
+}
+
+void *pg_compact_thread(void *arg)
+{
+	pgdb_t *db = arg;
+
+	pthread_mutex_lock(&db->lock);
+
+	while (!db->bg_shutdown) {
+		struct pgdb_table_t *table = NULL;
+		if (!db->bg_error)
+			table = pg_compact_pick(db);
+
+		if (!table) {
+			pthread_cond_wait(&db->compact_cv, &db->lock);
+			continue;
+		}
+
+		db->compacting = true;
+		pthread_mutex_unlock(&db->lock);
+
+		char *err = NULL;
+		bool ok = compact_auto(db, table, &err);
+
+		pthread_mutex_lock(&db->lock);
+
+		// stop for good, unless merely cut short by shutdown
+		if (!ok && !db->bg_shutdown && !db->bg_error)
+			db->bg_error = err ? err : strdup("compaction failed");
+		else
+			free(err);
+
+		db->compacting = false;
+		pthread_cond_broadcast(&db->idle_cv);
+	}
+
+	pthread_mutex_unlock(&db->lock);
+	return NULL;
+}
+
+struct key_bound {
+	const void		*key;		// NULL: unbounded
+	size_t			len;
+	bool			inclusive;
+};
+
+// index of the first entry of run lying above bound lo
+static unsigned int run_first_above(const struct pgdb_run *run,
+				    const struct key_bound *lo)
+{
+	unsigned int first = 0, end = run->n_ents;
+
+	if (!lo->key)
+		return 0;
+
+	while (first < end) {
+		unsigned int mid = first + ((end - first) / 2);
+		PGcodec__RootEnt *ent = run->ents[mid];
+		int cmp = pg_key_cmp(ent->key.data, ent->key.len,
+				     lo->key, lo->len);
+		if (cmp < 0 || (cmp == 0 && !lo->inclusive))
+			first = mid + 1;
+		else
+			end = mid;
+	}
+
+	return first;
+}
+
+// one past the last entry of run that may hold keys <= hi
+static unsigned int run_end_below(const struct pgdb_run *run,
+				  const struct key_bound *hi)
+{
+	if (!hi->key)
+		return run->n_ents;
+
+	struct key_bound b = { hi->key, hi->len, true };
+	unsigned int i = run_first_above(run, &b);
+
+	return (i < run->n_ents) ? i + 1 : i;
+}
+
+/*
+ * Pick, from every run, the files overlapping [lo, hi], widening the
+ * range to cover each file taken until no other file overlaps it.
+ * first[] and end[] receive each run's range of files.
+ */
+static void pick_range(const struct pgdb_rootgen *rg,
+		       struct key_bound lo, struct key_bound hi,
+		       unsigned int *first, unsigned int *end)
+{
+	bool changed = true;
+	unsigned int r;
+
+	while (changed) {
+		changed = false;
+
+		for (r = 0; r < rg->n_runs; r++) {
+			const struct pgdb_run *run = &rg->runs[r];
+
+			first[r] = run_first_above(run, &lo);
+			end[r] = run_end_below(run, &hi);
+			if (first[r] >= end[r])
+				continue;
+
+			// keys of file i lie above the key of file i - 1
+			if (lo.key && first[r] == 0) {
+				lo.key = NULL;
+				changed = true;
+			} else if (lo.key) {
+				PGcodec__RootEnt *ent = run->ents[first[r] - 1];
+				if (pg_key_cmp(ent->key.data, ent->key.len,
+					       lo.key, lo.len) < 0) {
+					lo.key = ent->key.data;
+					lo.len = ent->key.len;
+					lo.inclusive = false;
+					changed = true;
+				}
+			}
+
+			PGcodec__RootEnt *last = run->ents[end[r] - 1];
+			if (hi.key && pg_key_cmp(last->key.data, last->key.len,
+						 hi.key, hi.len) > 0) {
+				hi.key = last->key.data;
+				hi.len = last->key.len;
+				changed = true;
+			}
+		}
+	}
+}
+
+static void __pgdb_compact_range(
+    pgdb_t* db, struct pgdb_table_t* table,
+    const char* start_key, size_t start_key_len,
+    const char* limit_key, size_t limit_key_len,
+    void (*progress)(void* arg, uint64_t done, uint64_t total),
+    void* arg,
+    char** errptr)
+{
+	*errptr = NULL;
+
+	if (db->opt->readonly) {
+		*errptr = strdup("database is read-only");
+		return;
+	}
+
+	pthread_mutex_lock(&db->compact_lock);
+
+	pthread_mutex_lock(&db->lock);
+	struct pgdb_rootgen *rg = table->rootgen;
+	if (rg)
+		pg_rootgen_ref(rg);
+	pthread_mutex_unlock(&db->lock);
+
+	struct compaction *c = NULL;
+	unsigned int *first = NULL, *end = NULL;
+	if (!rg) {
+		*errptr = strdup("table dropped");
+		goto out;
+	}
+
+	first = calloc(rg->n_runs + 1, sizeof(unsigned int));
+	end = calloc(rg->n_runs + 1, sizeof(unsigned int));
+	if (!first || !end)
+		goto oom;
+
+	struct key_bound lo = { start_key, start_key_len, true };
+	struct key_bound hi = { limit_key, limit_key_len, true };
+	pick_range(rg, lo, hi, first, end);
+
+	c = compaction_new(db, table, rg, rg->n_runs);
+	if (!c)
+		goto oom;
+
+	unsigned int r;
+	for (r = 0; r < rg->n_runs; r++)
+		if (first[r] < end[r])
+			add_src(c, &rg->runs[r], first[r], end[r]);
+
+	if (c->n_src) {
+		struct compact_opts co = {
+			.out_run_id		= c->src[c->n_src - 1].run_id,
+			.drop_tombstones	= true,
+			.progress		= progress,
+			.progress_arg		= arg,
+		};
+
+		compaction_run(c, &co, errptr);
+	}
+
+	compaction_free(c);
+	rg = NULL;
+	goto out;
+
+oom:
+	*errptr = strdup("OOM");	// irony, but recoverable
+out:
+	pg_rootgen_unref(rg);
+	free(end);
+	free(first);
+	pthread_mutex_unlock(&db->compact_lock);
+}
+
+void pgdb_compact_range_progress(
+    pgdb_t* db,
+    const char* start_key, size_t start_key_len,
+    const char* limit_key, size_t limit_key_len,
+    void (*progress)(void* arg, uint64_t done, uint64_t total),
+    void* arg,
+    char** errptr)
+{
+	__pgdb_compact_range(db, db->tables[0], start_key, start_key_len,
+			     limit_key, limit_key_len, progress, arg, errptr);
+}
+
+void pgdb_compact_range(
+    pgdb_t* db,
+    const char* start_key, size_t start_key_len,
+    const char* limit_key, size_t limit_key_len)
+{
+	char *err = NULL;
+
+	pgdb_compact_range_progress(db, start_key, start_key_len,
+				    limit_key, limit_key_len, NULL, NULL, &err);
+	free(err);
+}
+
+void pgdb_compact_range_cf(
+    pgdb_t* db,
+    pgdb_table_t* table,
+    const char* start_key, size_t start_key_len,
+    const char* limit_key, size_t limit_key_len,
+    char** errptr)
+{
+	__pgdb_compact_range(db, table, start_key, start_key_len,
+			     limit_key, limit_key_len, NULL, NULL, errptr);
+}
@@ -0,0 +1,158 @@
+
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "pgdb-internal.h"
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+/*
+ * CRC32C (Castagnoli), as used by iSCSI, ext4 and LevelDB.
+ *
+ * x86-64 CPUs with SSE4.2 compute it with the crc32 instruction, eight
+ * bytes at a time; the choice is made at run time, the first time a
+ * checksum is taken.  ARMv8 builds targeting the CRC extension use its
+ * crc32c instructions.  Anything else uses a slicing-by-8 table.
+ */
+
+#define CRC32C_POLY	0x82f63b78	// reflected
+
+static uint32_t crc32c_table[8][256];
+
+static uint32_t (*crc32c_fn)(uint32_t crc, const unsigned char *p,
+			     size_t len);
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len)
+{
+	const uint32_t (*t)[256] = crc32c_table;
+
+	while (len && ((uintptr_t) p & 7)) {
+		crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
+		len--;
+	}
+
+	while (len >= 8) {
+		uint64_t w;
+		memcpy(&w, p, sizeof(w));
+		w = le64toh(w);
+
+		uint32_t lo = (uint32_t) w ^ crc;
+		uint32_t hi = w >> 32;
+		crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^
+		      t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24] ^
+		      t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^
+		      t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+
+		p += 8;
+		len -= 8;
+	}
+
+	while (len--)
+		crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
+
+	return crc;
+}
+
+#if defined(__x86_64__)
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *p,
+			     size_t len)
+{
+	while (len && ((uintptr_t) p & 7)) {
+		crc = __builtin_ia32_crc32qi(crc, *p++);
+		len--;
+	}
+
+	uint64_t crc64 = crc;
+	while (len >= 8) {
+		uint64_t w;
+		memcpy(&w, p, sizeof(w));
+		crc64 = __builtin_ia32_crc32di(crc64, w);
+		p += 8;
+		len -= 8;
+	}
+	crc = crc64;
+
+	while (len--)
+		crc = __builtin_ia32_crc32qi(crc, *p++);
+
+	return crc;
+}
+
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+
+static uint32_t crc32c_armv8(uint32_t crc, const unsigned char *p,
+			     size_t len)
+{
+	while (len && ((uintptr_t) p & 7)) {
+		crc = __crc32cb(crc, *p++);
+		len--;
+	}
+
+	while (len >= 8) {
+		uint64_t w;
+		memcpy(&w, p, sizeof(w));
+		crc = __crc32cd(crc, w);
+		p += 8;
+		len -= 8;
+	}
+
+	while (len--)
+		crc = __crc32cb(crc, *p++);
+
+	return crc;
+}
+
+#endif
+
+static void crc32c_init(void)
+{
+	uint32_t i, j;
+
+	for (i = 0; i < 256; i++) {
+		uint32_t crc = i;
+		for (j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (CRC32C_POLY & -(crc & 1));
+		crc32c_table[0][i] = crc;
+	}
+
+	// table j: the crc of a byte followed by j zero bytes
+	for (i = 0; i < 256; i++)
+		for (j = 1; j < 8; j++) {
+			uint32_t crc = crc32c_table[j - 1][i];
+			crc32c_table[j][i] = (crc >> 8) ^
+					     crc32c_table[0][crc & 0xff];
+		}
+
+	crc32c_fn = crc32c_sw;
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("sse4.2"))
+		crc32c_fn = crc32c_sse42;
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+	crc32c_fn = crc32c_armv8;
+#endif
+}
+
+/*
+ * Extend crc, the CRC32C of some preceding bytes (0 for none), over
+ * data[0..len).
+ */
+uint32_t pg_crc32c(uint32_t crc, const void *data, size_t len)
+{
+	pthread_once(&crc32c_once, crc32c_init);
+
+	return ~crc32c_fn(~crc, data, len);
+}
+
+// the same, always by table; so tests can check it against the above
+uint32_t pg_crc32c_sw(uint32_t crc, const void *data, size_t len)
+{
+	pthread_once(&crc32c_once, crc32c_init);
+
+	return ~crc32c_sw(~crc, data, len);
+}
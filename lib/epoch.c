@@ -0,0 +1,204 @@
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "pgdb-internal.h"
+
+/*
+ * Epoch-based reclamation.
+ *
+ * Reads take no lock.  A table's current memset and root generation
+ * are published through atomic pointers (see pg_view_enter()), and the
+ * open-pagefile cache is searched without its shard lock; what a reader
+ * finds there may be unpublished at any moment.  So nothing unpublished
+ * is freed at once: it is retired, stamped with the global epoch, and
+ * freed once every reader that could have seen it has left.
+ *
+ * A reader enters the epoch current when it starts, counting itself in
+ * a slot shared by a few threads, by the epoch's parity.  Pointers to
+ * reclaimable objects are stored and loaded sequentially consistent,
+ * as are the epoch and the counts, so an object is retired in an epoch
+ * no earlier than that of any reader which found it.  The epoch
+ * moves from e to e+1 only once no reader remains in e-1, so two moves
+ * after an object was retired in e, no reader that could reach it is
+ * left.  Entering and leaving are an atomic add each, on a cache line
+ * that readers on other cores rarely touch; retiring and collecting take
+ * the epoch's own lock, never a reader's.
+ *
+ * Collection is never waited for: a flush, compaction or table drop, or
+ * a reader leaving once enough has been retired, tries to move the
+ * epoch along, and frees what is old enough.  A reader stalled inside
+ * its epoch delays reclamation, never another read or write.
+ */
+
+static unsigned int next_slot;
+static __thread unsigned int thread_slot = UINT_MAX;
+
+static inline struct pgdb_epoch_slot *slot_of(struct pgdb_epoch *ep)
+{
+	if (thread_slot == UINT_MAX)
+		thread_slot = __atomic_fetch_add(&next_slot, 1,
+						 __ATOMIC_RELAXED);
+
+	return &ep->slot[thread_slot & (PGDB_EPOCH_SLOTS - 1)];
+}
+
+void pg_epoch_enter(struct pgdb_epoch *ep, struct pgdb_guard *g)
+{
+	struct pgdb_epoch_slot *slot = slot_of(ep);
+
+	g->ep = ep;
+	for (;;) {
+		uint64_t e = __atomic_load_n(&ep->global, __ATOMIC_SEQ_CST);
+		unsigned int *readers = &slot->readers[e & 1];
+
+		__atomic_add_fetch(readers, 1, __ATOMIC_SEQ_CST);
+
+		// counted in e only if e is still current
+		if (__atomic_load_n(&ep->global, __ATOMIC_SEQ_CST) == e) {
+			g->readers = readers;
+			return;
+		}
+
+		__atomic_sub_fetch(readers, 1, __ATOMIC_SEQ_CST);
+	}
+}
+
+void pg_epoch_leave(struct pgdb_guard *g)
+{
+	struct pgdb_epoch *ep = g->ep;
+
+	__atomic_sub_fetch(g->readers, 1, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&ep->n_retired, __ATOMIC_RELAXED) >=
+	    PGDB_EPOCH_BATCH)
+		pg_epoch_collect(ep);
+}
+
+// move to the next epoch, if no reader is left in the one before; ep->lock
+static bool epoch_advance(struct pgdb_epoch *ep)
+{
+	uint64_t e = __atomic_load_n(&ep->global, __ATOMIC_SEQ_CST);
+	unsigned int i;
+
+	for (i = 0; i < PGDB_EPOCH_SLOTS; i++)
+		if (__atomic_load_n(&ep->slot[i].readers[(e + 1) & 1],
+				    __ATOMIC_SEQ_CST))
+			return false;
+
+	__atomic_store_n(&ep->global, e + 1, __ATOMIC_SEQ_CST);
+	return true;
+}
+
+/*
+ * Call free_fn(node) once no reader can still be using the object it is
+ * embedded in, which the caller has just unpublished.
+ */
+void pg_epoch_retire(struct pgdb_epoch *ep, struct pgdb_retired *node,
+		     void (*free_fn)(struct pgdb_retired *))
+{
+	node->free = free_fn;
+
+	pthread_mutex_lock(&ep->lock);
+
+	node->epoch = __atomic_load_n(&ep->global, __ATOMIC_SEQ_CST);
+	node->next = ep->retired;
+	ep->retired = node;
+	__atomic_store_n(&ep->n_retired, ep->n_retired + 1, __ATOMIC_RELAXED);
+
+	pthread_mutex_unlock(&ep->lock);
+}
+
+static void free_list(struct pgdb_retired *dead)
+{
+	while (dead) {
+		struct pgdb_retired *next = dead->next;
+		dead->free(dead);
+		dead = next;
+	}
+}
+
+// detach what was retired two epochs ago or more; ep->lock held
+static struct pgdb_retired *epoch_reap(struct pgdb_epoch *ep)
+{
+	uint64_t e = __atomic_load_n(&ep->global, __ATOMIC_SEQ_CST);
+	struct pgdb_retired **pp = &ep->retired, *dead;
+	unsigned int n = 0;
+
+	// newest first: everything past the first old enough node is too
+	while (*pp && ((*pp)->epoch + 2) > e)
+		pp = &(*pp)->next;
+
+	dead = *pp;
+	*pp = NULL;
+
+	struct pgdb_retired *node;
+	for (node = dead; node; node = node->next)
+		n++;
+	__atomic_store_n(&ep->n_retired, ep->n_retired - n, __ATOMIC_RELAXED);
+
+	return dead;
+}
+
+// free what no reader can reach any more; never waits for readers
+void pg_epoch_collect(struct pgdb_epoch *ep)
+{
+	if (!ep || pthread_mutex_trylock(&ep->lock))
+		return;
+
+	if (epoch_advance(ep))
+		epoch_advance(ep);
+
+	struct pgdb_retired *dead = epoch_reap(ep);
+
+	pthread_mutex_unlock(&ep->lock);
+
+	free_list(dead);
+}
+
+// free everything retired; no reader may remain
+void pg_epoch_drain(struct pgdb_epoch *ep)
+{
+	if (!ep)
+		return;
+
+	for (;;) {
+		pthread_mutex_lock(&ep->lock);
+
+		epoch_advance(ep);
+		epoch_advance(ep);
+		struct pgdb_retired *dead = epoch_reap(ep);
+		bool empty = !ep->retired;
+
+		pthread_mutex_unlock(&ep->lock);
+
+		// freeing may retire more
+		free_list(dead);
+		if (empty && !dead)
+			break;
+	}
+}
+
+struct pgdb_epoch *pg_epoch_new(void)
+{
+	struct pgdb_epoch *ep = NULL;
+	if (posix_memalign((void **) &ep, 64, sizeof(*ep)))
+		return NULL;
+	memset(ep, 0, sizeof(*ep));
+
+	pthread_mutex_init(&ep->lock, NULL);
+
+	return ep;
+}
+
+void pg_epoch_free(struct pgdb_epoch *ep)
+{
+	if (!ep)
+		return;
+
+	pg_epoch_drain(ep);
+	pthread_mutex_destroy(&ep->lock);
+
+	memset(ep, 0xff, sizeof(*ep));
+	free(ep);
+}
@@ -0,0 +1,110 @@
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "pgdb-internal.h"
+
+/*
+ * In-memory fence index over the root entries of one sorted run.
+ *
+ * Each RootEnt key is the upper bound (last key) of its pagefile.  When
+ * a root generation is built the entries are copied into one contiguous
+ * array laid out in Eytzinger (BFS) order, each node carrying an inline
+ * 8-byte key prefix.  A lookup walks the implicit tree top-down; nearly all
+ * comparisons resolve on the prefix without touching the full key, and
+ * the top levels of the tree stay cache-resident across lookups.
+ */
+
+static unsigned int fence_fill(struct pgdb_fence *fence,
+			       PGcodec__RootEnt **ents,
+			       unsigned int i, unsigned int k)
+{
+	if (k > fence->n_entries)
+		return i;
+
+	i = fence_fill(fence, ents, i, 2 * k);
+
+	struct pgdb_fence_ent *fe = &fence->ent[k];
+	PGcodec__RootEnt *ent = ents[i];
+	fe->prefix = pg_key_prefix(ent->key.data, ent->key.len);
+	fe->key = ent->key.data;
+	fe->file_id = ent->file_id;
+	fe->k_len = ent->key.len;
+	fe->rank = i;
+
+	return fence_fill(fence, ents, i + 1, 2 * k + 1);
+}
+
+void pg_fence_free(struct pgdb_fence *fence)
+{
+	if (!fence)
+		return;
+
+	free(fence->ent);
+
+	memset(fence, 0xff, sizeof(*fence));
+	free(fence);
+}
+
+struct pgdb_fence *pg_fence_build(PGcodec__RootEnt **ents, size_t n_ents,
+				  char **errptr)
+{
+	struct pgdb_fence *fence = calloc(1, sizeof(*fence));
+	if (!fence)
+		goto oom;
+
+	// slot 0 is unused; siblings 2k,2k+1 share one cache line
+	void *mem = NULL;
+	if (posix_memalign(&mem, 64,
+			   (n_ents + 1) * sizeof(struct pgdb_fence_ent)))
+		goto oom_fence;
+	memset(mem, 0, (n_ents + 1) * sizeof(struct pgdb_fence_ent));
+
+	fence->ent = mem;
+	fence->n_entries = n_ents;
+
+	fence_fill(fence, ents, 0, 1);
+
+	return fence;
+
+oom_fence:
+	free(fence);
+oom:
+	*errptr = strdup("OOM");	// irony, but recoverable
+	return NULL;
+}
+
+static inline int fence_cmp(const struct pgdb_fence_ent *fe,
+			    uint64_t prefix, const void *key, size_t klen)
+{
+	if (fe->prefix != prefix)
+		return (fe->prefix < prefix) ? -1 : 1;
+
+	return pg_key_cmp(fe->key, fe->k_len, key, klen);
+}
+
+/*
+ * Return the fence entry of the first pagefile whose upper bound is
+ * >= key, or NULL if key sorts after every pagefile.
+ */
+const struct pgdb_fence_ent *pg_fence_find(const struct pgdb_fence *fence,
+					   const void *key, size_t klen)
+{
+	const struct pgdb_fence_ent *ent = fence->ent;
+	unsigned int n = fence->n_entries;
+	uint64_t prefix = pg_key_prefix(key, klen);
+	unsigned int k = 1;
+
+	while (k <= n) {
+		// grandchildren 4k..4k+3 span two cache lines
+		__builtin_prefetch(&ent[4 * k]);
+		__builtin_prefetch(&ent[4 * k + 2]);
+
+		k = 2 * k + (fence_cmp(&ent[k], prefix, key, klen) < 0);
+	}
+
+	// strip the trailing right-turns to recover the lower bound
+	k >>= __builtin_ffs(~k);
+
+	return k ? &ent[k] : NULL;
+}
@@ -0,0 +1,335 @@
+#define _GNU_SOURCE		// fallocate(2), sync_file_range(2)
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <openssl/sha.h>
+
+#include "pgdb-internal.h"
+
+/*
+ * File writer.
+ *
+ * New files are written front to back through a buffer of at most
+ * PGDB_FW_BUF_SIZE, so the memory a file takes to write does not grow
+ * with the file.  Disk space is reserved with fallocate(2) ahead of the
+ * data, all of a known size at once, else PGDB_FW_RESERVE_STEP at a
+ * time; and with bytes_per_sync set, writeback of what is written is
+ * started every so many bytes, so the final sync has little left to
+ * wait for.  The writer can digest what it appends in chunks (see
+ * merkle.c) as it goes.
+ *
+ * Wrapped files -- root indexes and the superblock -- are laid out as
+ *
+ *	pgdb_file_header
+ *	data
+ *	sha256 of each chunk of data
+ *	sha256(header + chunk digests)
+ *
+ * The header goes in last, once the data length is known.  Files
+ * written before chunking have a zero chunk_shift, and just
+ * sha256(header + data) for trailer; see pg_verify_file().
+ *
+ * Errors are sticky: the first one is kept, and reported by
+ * pg_fw_finish().
+ */
+
+static void fw_error(struct pgdb_filewriter *fw, char *err)
+{
+	if (!fw->err)
+		fw->err = err;
+	else
+		free(err);
+}
+
+// reserve space through end; failure only costs fragmentation
+static void fw_reserve(struct pgdb_filewriter *fw, uint64_t end)
+{
+	if (fw->no_reserve || end <= fw->reserved)
+		return;
+
+	if (fallocate(fw->fd, FALLOC_FL_KEEP_SIZE, fw->reserved,
+		      end - fw->reserved) < 0) {
+		fw->no_reserve = true;
+		return;
+	}
+
+	fw->reserved = end;
+}
+
+static bool fw_flush(struct pgdb_filewriter *fw)
+{
+	if (fw->err)
+		return false;
+	if (!fw->buf_len)
+		return true;
+
+	uint64_t end = fw->flushed + fw->buf_len;
+	if (end > fw->reserved)
+		fw_reserve(fw, end + PGDB_FW_RESERVE_STEP);
+
+	const char *p = fw->buf;
+	size_t len = fw->buf_len;
+
+	while (len) {
+		ssize_t bwrite = write(fw->fd, p, len);
+		if (bwrite < 0) {
+			if (errno == EINTR)
+				continue;
+			fw_error(fw, strdup(strerror(errno)));
+			return false;
+		}
+		p += bwrite;
+		len -= bwrite;
+	}
+
+	fw->flushed = end;
+	fw->buf_len = 0;
+
+	// start writeback now, rather than all of it at the final sync
+	if (fw->bytes_per_sync &&
+	    (fw->flushed - fw->synced) >= fw->bytes_per_sync) {
+		sync_file_range(fw->fd, fw->synced, fw->flushed - fw->synced,
+				SYNC_FILE_RANGE_WRITE);
+		fw->synced = fw->flushed;
+	}
+
+	return true;
+}
+
+// append data, undigested
+static bool fw_write(struct pgdb_filewriter *fw, const void *data,
+		     size_t len)
+{
+	const char *p = data;
+
+	while (len && !fw->err) {
+		size_t n = fw->buf_size - fw->buf_len;
+		if (n > len)
+			n = len;
+
+		memcpy(fw->buf + fw->buf_len, p, n);
+		fw->buf_len += n;
+		fw->offset += n;
+		p += n;
+		len -= n;
+
+		if (fw->buf_len == fw->buf_size)
+			fw_flush(fw);
+	}
+
+	return !fw->err;
+}
+
+static void fw_pb_append(ProtobufCBuffer *pbuf, size_t len,
+			 const uint8_t *data)
+{
+	struct pgdb_filewriter *fw =
+		container_of(pbuf, struct pgdb_filewriter, pbuf);
+
+	pg_fw_append(fw, data, len);
+}
+
+/*
+ * Create pathname, to be written by the writer returned.  size_hint, if
+ * not 0, is the expected file size.  With hash set, everything appended
+ * is digested in chunks.
+ */
+struct pgdb_filewriter *pg_fw_create(pgdb_t *db, const char *pathname,
+				     uint64_t size_hint, bool hash,
+				     char **errptr)
+{
+	struct pgdb_filewriter *fw = calloc(1, sizeof(*fw));
+	if (!fw) {
+		*errptr = strdup("OOM");	// irony, but recoverable
+		return NULL;
+	}
+
+	fw->fd = -1;
+	fw->pbuf.append = fw_pb_append;
+	fw->bytes_per_sync = db->opt->bytes_per_sync;
+
+	fw->buf_size = PGDB_FW_BUF_SIZE;
+	if (size_hint && size_hint < fw->buf_size)
+		fw->buf_size = (size_hint < PGDB_FW_BUF_MIN) ?
+			       PGDB_FW_BUF_MIN : size_hint;
+
+	fw->pathname = strdup(pathname);
+	fw->buf = malloc(fw->buf_size);
+	if (!fw->pathname || !fw->buf)
+		goto oom;
+
+	if (hash) {
+		fw->merkle = pg_merkle_new(PGDB_CHUNK_SHIFT);
+		if (!fw->merkle)
+			goto oom;
+	}
+
+	fw->fd = open(pathname, O_WRONLY | O_CREAT | O_EXCL, 0666);
+	if (fw->fd < 0) {
+		*errptr = strdup(strerror(errno));
+		goto err_out;
+	}
+
+	if (size_hint)
+		fw_reserve(fw, size_hint);
+
+	return fw;
+
+oom:
+	*errptr = strdup("OOM");	// irony, but recoverable
+err_out:
+	pg_fw_free(fw, false);
+	return NULL;
+}
+
+// append data, digesting it if hashing
+bool pg_fw_append(struct pgdb_filewriter *fw, const void *data, size_t len)
+{
+	if (fw->merkle && !fw->err && !pg_merkle_update(fw->merkle, data, len))
+		fw_error(fw, strdup("OOM"));	// irony, but recoverable
+
+	return fw_write(fw, data, len);
+}
+
+// append the chunk digests of everything appended so far, and stop hashing
+bool pg_fw_append_digests(struct pgdb_filewriter *fw)
+{
+	if (!fw->err && !pg_merkle_final(fw->merkle))
+		fw_error(fw, strdup("OOM"));	// irony, but recoverable
+	if (fw->err)
+		return false;
+
+	size_t len;
+	const unsigned char *digests = pg_merkle_digests(fw->merkle, &len);
+	bool rc = fw_write(fw, digests, len);
+
+	pg_merkle_free(fw->merkle);
+	fw->merkle = NULL;
+
+	return rc;
+}
+
+// size of a wrapped file holding data_len bytes
+uint64_t pg_fw_wrap_size(size_t data_len)
+{
+	return sizeof(struct pgdb_file_header) + data_len +
+	       (pg_merkle_n_chunks(data_len, PGDB_CHUNK_SHIFT) *
+		SHA256_DIGEST_LENGTH) + PGDB_TRAIL_SZ;
+}
+
+// start a wrapped file: room for its header, then hash what follows
+bool pg_fw_wrap_begin(struct pgdb_filewriter *fw, const char *magic)
+{
+	struct pgdb_file_header hdr;
+	memset(&hdr, 0, sizeof(hdr));
+
+	memcpy(fw->magic, magic, sizeof(fw->magic));
+
+	fw->merkle = pg_merkle_new(PGDB_CHUNK_SHIFT);
+	if (!fw->merkle) {
+		fw_error(fw, strdup("OOM"));	// irony, but recoverable
+		return false;
+	}
+
+	return fw_write(fw, &hdr, sizeof(hdr));
+}
+
+// end a wrapped file: its trailer, then its header
+bool pg_fw_wrap_end(struct pgdb_filewriter *fw)
+{
+	if (!fw->err && !pg_merkle_final(fw->merkle))
+		fw_error(fw, strdup("OOM"));	// irony, but recoverable
+	if (fw->err)
+		return false;
+
+	uint64_t data_len = fw->offset - sizeof(struct pgdb_file_header);
+	if (data_len > UINT32_MAX) {
+		fw_error(fw, strdup("file too large"));
+		return false;
+	}
+
+	struct pgdb_file_header hdr;
+	memcpy(&hdr.magic, fw->magic, sizeof(hdr.magic));
+	hdr.len = htole32(data_len);
+	hdr.chunk_shift = htole32(PGDB_CHUNK_SHIFT);
+
+	size_t digests_len;
+	const unsigned char *digests = pg_merkle_digests(fw->merkle,
+							 &digests_len);
+
+	unsigned char md[SHA256_DIGEST_LENGTH];
+	if (!pg_merkle_top(md, &hdr, sizeof(hdr), digests, digests_len)) {
+		fw_error(fw, strdup("OOM"));	// irony, but recoverable
+		return false;
+	}
+
+	fw_write(fw, digests, digests_len);
+	fw_write(fw, md, sizeof(md));
+
+	pg_merkle_free(fw->merkle);
+	fw->merkle = NULL;
+
+	if (!fw_flush(fw))
+		return false;
+
+	if (pwrite(fw->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+		fw_error(fw, strdup(strerror(errno)));
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Write out what is buffered, release space reserved past the end, and
+ * make the file durable.  On failure, *errptr has the first error met
+ * since the writer was created.
+ */
+bool pg_fw_finish(struct pgdb_filewriter *fw, char **errptr)
+{
+	fw_flush(fw);
+
+	// truncating to the same size frees blocks kept past it
+	if (!fw->err && fw->reserved > fw->offset &&
+	    ftruncate(fw->fd, fw->offset) < 0)
+		fw_error(fw, strdup(strerror(errno)));
+
+	if (!fw->err && fdatasync(fw->fd) < 0)
+		fw_error(fw, strdup(strerror(errno)));
+
+	if (!fw->err && close(fw->fd) < 0)
+		fw_error(fw, strdup(strerror(errno)));
+	else if (fw->err)
+		close(fw->fd);
+	fw->fd = -1;
+
+	if (fw->err) {
+		*errptr = fw->err;
+		fw->err = NULL;
+		return false;
+	}
+
+	return true;
+}
+
+void pg_fw_free(struct pgdb_filewriter *fw, bool remove_file)
+{
+	if (!fw)
+		return;
+
+	if (fw->fd >= 0)
+		close(fw->fd);
+	if (remove_file && fw->pathname)
+		unlink(fw->pathname);
+
+	pg_merkle_free(fw->merkle);
+	free(fw->pathname);
+	free(fw->buf);
+	free(fw->err);
+
+	memset(fw, 0xff, sizeof(*fw));
+	free(fw);
+}
@@ -0,0 +1,337 @@
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <alloca.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "pgdb-internal.h"
+
+/*
+ * Per-pagefile filters.
+ *
+ * A pagefile may carry a filter block (typically a Bloom filter) over
+ * all of its keys, located through its meta block.  The first lookup
+ * routed to a pagefile preads just that block -- the pagefile itself is
+ * not mapped -- and the root generation keeps it in memory from then
+ * on, so a key absent from the database costs a few hash probes and no
+ * I/O.  Blocks are refcounted so that later generations listing the
+ * same pagefile share them instead of reading them again.
+ */
+
+struct bloom_state {
+	unsigned int		bits_per_key;
+	unsigned int		k;
+};
+
+// the "no usable filter in this file" marker
+static struct pgdb_filter_blk no_filter;
+
+uint32_t pg_hash32(const void *data, size_t n, uint32_t seed)
+{
+	// murmur-like, as used for LevelDB bloom filters
+	const uint32_t m = 0xc6a4a793;
+	const uint32_t r = 24;
+	const unsigned char *p = data;
+	const unsigned char *limit = p + n;
+	uint32_t h = seed ^ (n * m);
+
+	while (p + 4 <= limit) {
+		uint32_t w = p[0] | (p[1] << 8) | (p[2] << 16) |
+			     ((uint32_t) p[3] << 24);
+		p += 4;
+		h += w;
+		h *= m;
+		h ^= (h >> 16);
+	}
+
+	switch (limit - p) {
+	case 3:
+		h += p[2] << 16;
+		// fall through
+	case 2:
+		h += p[1] << 8;
+		// fall through
+	case 1:
+		h += p[0];
+		h *= m;
+		h ^= (h >> r);
+		break;
+	}
+
+	return h;
+}
+
+static inline uint32_t bloom_hash(const void *key, size_t klen)
+{
+	return pg_hash32(key, klen, 0xbc9f1d34);
+}
+
+static char *bloom_create(void *priv, const char * const *keys,
+			  const size_t *key_lens, int n_keys,
+			  size_t *filter_len)
+{
+	struct bloom_state *bs = priv;
+
+	size_t bits = (size_t) n_keys * bs->bits_per_key;
+	if (bits < 64)			// avoid high FP rate for tiny sets
+		bits = 64;
+	size_t bytes = (bits + 7) / 8;
+	bits = bytes * 8;
+
+	unsigned char *filter = calloc(1, bytes + 1);
+	if (!filter)
+		return NULL;
+	filter[bytes] = bs->k;		// remember # of probes
+
+	int i;
+	for (i = 0; i < n_keys; i++) {
+		// double hashing: h, h+delta, h+2*delta, ...
+		uint32_t h = bloom_hash(keys[i], key_lens[i]);
+		uint32_t delta = (h >> 17) | (h << 15);
+		unsigned int j;
+		for (j = 0; j < bs->k; j++) {
+			uint32_t bitpos = h % bits;
+			filter[bitpos / 8] |= (1 << (bitpos % 8));
+			h += delta;
+		}
+	}
+
+	*filter_len = bytes + 1;
+	return (char *) filter;
+}
+
+static unsigned char bloom_may_match(void *priv, const char *key, size_t klen,
+				     const char *filter_, size_t filter_len)
+{
+	const unsigned char *filter = (const unsigned char *) filter_;
+
+	if (filter_len < 2)
+		return 0;
+
+	size_t bits = (filter_len - 1) * 8;
+	unsigned int k = filter[filter_len - 1];
+	if (k > 30)			// reserved for future encodings
+		return 1;
+
+	uint32_t h = bloom_hash(key, klen);
+	uint32_t delta = (h >> 17) | (h << 15);
+	unsigned int j;
+	for (j = 0; j < k; j++) {
+		uint32_t bitpos = h % bits;
+		if (!(filter[bitpos / 8] & (1 << (bitpos % 8))))
+			return 0;
+		h += delta;
+	}
+
+	return 1;
+}
+
+static const char *bloom_name(void *priv)
+{
+	return "pgdb.BuiltinBloomFilter";
+}
+
+pgdb_filterpolicy_t* pgdb_filterpolicy_create(
+    void* state,
+    void (*destructor)(void*),
+    char* (*create_filter)(
+        void*,
+        const char* const* key_array, const size_t* key_length_array,
+        int num_keys,
+        size_t* filter_length),
+    unsigned char (*key_may_match)(
+        void*,
+        const char* key, size_t length,
+        const char* filter, size_t filter_length),
+    const char* (*name)(void*))
+{
+	pgdb_filterpolicy_t *fp = calloc(1, sizeof(*fp));
+	if (!fp)
+		return NULL;
+
+	fp->state = state;
+	fp->destructor = destructor;
+	fp->create_filter = create_filter;
+	fp->key_may_match = key_may_match;
+	fp->name = name;
+
+	return fp;
+}
+
+void pgdb_filterpolicy_destroy(pgdb_filterpolicy_t* fp)
+{
+	if (!fp)
+		return;
+
+	if (fp->destructor)
+		fp->destructor(fp->state);
+
+	memset(fp, 0xff, sizeof(*fp));
+	free(fp);
+}
+
+pgdb_filterpolicy_t* pgdb_filterpolicy_create_bloom(
+    int bits_per_key)
+{
+	struct bloom_state *bs = calloc(1, sizeof(*bs));
+	if (!bs)
+		return NULL;
+
+	if (bits_per_key < 1)
+		bits_per_key = 1;
+	bs->bits_per_key = bits_per_key;
+
+	// 0.69 =~ ln(2), which minimizes the false positive rate
+	bs->k = bits_per_key * 69 / 100;
+	if (bs->k < 1)
+		bs->k = 1;
+	if (bs->k > 30)
+		bs->k = 30;
+
+	pgdb_filterpolicy_t *fp = pgdb_filterpolicy_create(bs, free,
+				bloom_create, bloom_may_match, bloom_name);
+	if (!fp)
+		free(bs);
+
+	return fp;
+}
+
+// identifies the policy that built a filter block
+uint32_t pg_filter_id(const pgdb_filterpolicy_t *fp)
+{
+	const char *name = fp->name(fp->state);
+
+	return pg_hash32(name, strlen(name), 0);
+}
+
+static struct pgdb_filter_blk *filter_read(pgdb_t *db, uint64_t file_id,
+					   const pgdb_filterpolicy_t *fp)
+{
+	size_t fn_len = strlen(db->pathname) + 64 + 2;
+	char *fn = alloca(fn_len);
+	snprintf(fn, fn_len, "%s/%llu", db->pathname,
+		 (unsigned long long) file_id);
+
+	int fd = open(fn, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	struct pgdb_filter_blk *blk = &no_filter;
+
+	struct pgdb_page_hdr phdr;
+	if (pread(fd, &phdr, sizeof(phdr), 0) != sizeof(phdr) ||
+	    memcmp(phdr.magic, PGDB_PAGE_MAGIC, sizeof(phdr.magic)) ||
+	    le32toh(phdr.version) < PGDB_PAGE_V1)
+		goto out;
+
+	struct pgdb_page_meta meta;
+	if (pread(fd, &meta, sizeof(meta), le32toh(phdr.meta_offset)) !=
+	    sizeof(meta))
+		goto out;
+
+	uint32_t f_len = le32toh(meta.filter_len);
+	if (!f_len || le32toh(meta.filter_id) != pg_filter_id(fp))
+		goto out;
+
+	struct pgdb_filter_blk *tmp = malloc(sizeof(*tmp) + f_len);
+	if (!tmp) {
+		blk = NULL;
+		goto out;
+	}
+	tmp->refcnt = 1;
+	tmp->len = f_len;
+
+	if (pread(fd, tmp->data, f_len, le32toh(meta.filter_offset)) != f_len) {
+		free(tmp);
+		goto out;
+	}
+
+	blk = tmp;
+
+out:
+	close(fd);
+	return blk;
+}
+
+void pg_filter_ref(struct pgdb_filter_blk *blk)
+{
+	if (blk != &no_filter)
+		__atomic_add_fetch(&blk->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+static void filter_unref(struct pgdb_filter_blk *blk)
+{
+	if (!blk || blk == &no_filter)
+		return;
+
+	if (__atomic_sub_fetch(&blk->refcnt, 1, __ATOMIC_ACQ_REL) == 0)
+		free(blk);
+}
+
+void pg_filters_free(struct pgdb_filter_blk **filters, unsigned int n)
+{
+	if (!filters)
+		return;
+
+	unsigned int i;
+	for (i = 0; i < n; i++)
+		filter_unref(filters[i]);
+
+	free(filters);
+}
+
+/*
+ * Return false only if the pagefile's filter proves key is absent.
+ * Without a configured policy, or a filter block in the file, every
+ * key may match and the caller must search the pagefile.
+ */
+bool pg_filter_may_match(pgdb_t *db, struct pgdb_run *run,
+			 const struct pgdb_fence_ent *fe,
+			 const void *key, size_t klen)
+{
+	const pgdb_filterpolicy_t *fp = db->opt->filter_policy;
+	if (!fp)
+		return true;
+
+	struct pgdb_filter_blk **slot = &run->filters[fe->rank];
+	struct pgdb_filter_blk *blk = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+	if (!blk) {
+		blk = filter_read(db, fe->file_id, fp);
+		if (!blk)
+			return true;	// retry on a later lookup
+
+		struct pgdb_filter_blk *expected = NULL;
+		if (!__atomic_compare_exchange_n(slot, &expected, blk, false,
+						 __ATOMIC_ACQ_REL,
+						 __ATOMIC_ACQUIRE)) {
+			filter_unref(blk);
+			blk = expected;
+		}
+	}
+
+	if (blk == &no_filter)
+		return true;
+
+	return fp->key_may_match(fp->state, key, klen, blk->data, blk->len);
+}
+
+/*
+ * Build a filter block over keys with the configured policy, for the
+ * pagefile writer.  Returns NULL, with *filter_len zero, if no policy
+ * is configured.
+ */
+char *pg_filter_create(const pgdb_options_t *opt, const char * const *keys,
+		       const size_t *key_lens, unsigned int n_keys,
+		       size_t *filter_len)
+{
+	const pgdb_filterpolicy_t *fp = opt->filter_policy;
+
+	*filter_len = 0;
+	if (!fp)
+		return NULL;
+
+	return fp->create_filter(fp->state, keys, key_lens, n_keys,
+				 filter_len);
+}
@@ -0,0 +1,237 @@
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+
+#include "pgdb-internal.h"
+
+/*
+ * Background flushing.
+ *
+ * When a write buffer fills, the writer rotates it out (see write.c) and
+ * wakes the background thread, which writes the oldest full memtable of
+ * a table out as a new sorted run of pagefiles.  Only the newest
+ * version of each key is kept; tombstones are kept too, since older
+ * runs may still hold the key.  The run is installed with a new root
+ * index and superblock, then the new root generation and a memset
+ * without the flushed memtable are published together, so readers see
+ * every record exactly once.  Logs older than every remaining memtable
+ * of every table are removed last.  Writers never wait on any of this.
+ * A table dropped meanwhile just loses the flush.
+ *
+ * A second thread compacts runs (see compact.c), concurrently with
+ * flushes; the two serialize only around root installs.
+ */
+
+static bool flush_memtable(pgdb_t *db, struct pgdb_table_t *table,
+			   struct pgdb_memtable *mt, uint64_t run_id,
+			   char **errptr)
+{
+	struct pgdb_pagebuild *pb = pg_pagebuild_new(db, run_id,
+						     table->opt.max_file_size);
+	if (!pb) {
+		*errptr = strdup("OOM");	// irony, but recoverable
+		return false;
+	}
+
+	struct pgdb_mt_node *n, *prev = NULL;
+	for (n = pg_memtable_first(mt); n; n = pg_memtable_next(n)) {
+		// older versions of the same key follow the newest
+		if (prev && !pg_key_cmp(pg_mt_key(prev), prev->k_len,
+					pg_mt_key(n), n->k_len))
+			continue;
+		prev = n;
+
+		if (!pg_pagebuild_add(pb, n->type, pg_mt_key(n), n->k_len,
+				      pg_mt_val(n), n->v_len, errptr))
+			goto err_out;
+	}
+
+	if (!pg_pagebuild_finish(pb, errptr))
+		goto err_out;
+
+	pthread_mutex_lock(&db->root_lock);
+
+	// dropped meanwhile: nothing refers to the new files
+	if (table->dropped) {
+		pthread_mutex_unlock(&db->root_lock);
+		pg_pagebuild_free(pb, true);
+		return true;
+	}
+
+	struct pgdb_rootgen *rg = NULL;
+	if (pb->n_ents) {
+		rg = pg_rootgen_write(db, table, pb->ents, pb->n_ents,
+				      NULL, 0, errptr);
+		if (!rg) {
+			pthread_mutex_unlock(&db->root_lock);
+			goto err_out;
+		}
+	}
+
+	pthread_mutex_lock(&db->lock);
+
+	struct pgdb_memset *old_ms = table->memset;
+	assert(old_ms->n_mt > 1 && old_ms->mt[old_ms->n_mt - 1] == mt);
+
+	struct pgdb_memset *ms = pg_memset_new(NULL, old_ms, old_ms->n_mt - 1);
+	if (!ms) {
+		// the new root is installed; keep the data readable
+		struct pgdb_rootgen *old = rg ? pg_rootgen_swap(table, rg) : NULL;
+		pthread_mutex_unlock(&db->lock);
+		pthread_mutex_unlock(&db->root_lock);
+		pg_rootgen_retire(old);
+		pg_pagebuild_free(pb, false);
+		*errptr = strdup("OOM");	// irony, but recoverable
+		return false;
+	}
+
+	// the new root first: a reader without the memtable must have it
+	struct pgdb_rootgen *old = rg ? pg_rootgen_swap(table, rg) : NULL;
+	__atomic_store_n(&table->memset, ms, __ATOMIC_SEQ_CST);
+	uint64_t min_log_id = pg_min_log_id(db);
+
+	if (rg)
+		pthread_cond_signal(&db->compact_cv);
+
+	pthread_mutex_unlock(&db->lock);
+	pthread_mutex_unlock(&db->root_lock);
+
+	pg_memset_retire(db, old_ms);
+	pg_rootgen_retire(old);
+	pg_epoch_collect(db->epoch);
+
+	pg_wal_remove_obsolete(db, min_log_id);
+
+	pg_pagebuild_free(pb, false);
+	return true;
+
+err_out:
+	pg_pagebuild_free(pb, true);
+	return false;
+}
+
+/*
+ * The table with the most full memtables awaiting flush, or NULL; so a
+ * busy table cannot starve the rest.  db->lock held.
+ */
+static struct pgdb_table_t *flush_pick(pgdb_t *db)
+{
+	struct pgdb_table_t *pick = NULL;
+	unsigned int i;
+
+	for (i = 0; i < db->n_tables; i++) {
+		struct pgdb_table_t *table = db->tables[i];
+		if (table->dropped || table->memset->n_mt < 2)
+			continue;
+		if (!pick || table->memset->n_mt > pick->memset->n_mt)
+			pick = table;
+	}
+
+	return pick;
+}
+
+static void *bg_thread(void *arg)
+{
+	pgdb_t *db = arg;
+
+	pthread_mutex_lock(&db->lock);
+
+	while (!db->bg_shutdown) {
+		struct pgdb_table_t *table = NULL;
+		if (!db->bg_error)
+			table = flush_pick(db);
+		if (!table) {
+			pthread_cond_wait(&db->bg_cv, &db->lock);
+			continue;
+		}
+
+		// a drop may retire the memtable while we write it out
+		struct pgdb_memset *ms = table->memset;
+		struct pgdb_memtable *mt = ms->mt[ms->n_mt - 1];
+		pg_memtable_ref(mt);
+
+		// only flushes start new runs; compaction reuses run ids
+		uint64_t run_id = table->rootgen->max_run_id + 1;
+
+		db->flushing = true;
+		pthread_mutex_unlock(&db->lock);
+
+		char *err = NULL;
+		bool ok = flush_memtable(db, table, mt, run_id, &err);
+		pg_memtable_unref(mt);
+
+		pthread_mutex_lock(&db->lock);
+
+		// stop for good; the error is reported to writers
+		if (!ok && !db->bg_error)
+			db->bg_error = err ? err : strdup("flush failed");
+		else
+			free(err);
+
+		db->flushing = false;
+		pthread_cond_broadcast(&db->idle_cv);
+	}
+
+	pthread_mutex_unlock(&db->lock);
+	return NULL;
+}
+
+bool pg_bg_start(pgdb_t *db, char **errptr)
+{
+	int rc = pthread_create(&db->bg_thread, NULL, bg_thread, db);
+	if (rc) {
+		*errptr = strdup(strerror(rc));
+		return false;
+	}
+
+	rc = pthread_create(&db->compact_thread, NULL, pg_compact_thread, db);
+	if (rc) {
+		*errptr = strdup(strerror(rc));
+
+		pthread_mutex_lock(&db->lock);
+		db->bg_shutdown = true;
+		pthread_cond_broadcast(&db->bg_cv);
+		pthread_mutex_unlock(&db->lock);
+		pthread_join(db->bg_thread, NULL);
+		return false;
+	}
+
+	db->bg_started = true;
+	return true;
+}
+
+// wait out any flush or compaction in progress, then stop both threads
+void pg_bg_stop(pgdb_t *db)
+{
+	if (!db->bg_started)
+		return;
+
+	pthread_mutex_lock(&db->lock);
+	__atomic_store_n(&db->bg_shutdown, true, __ATOMIC_RELAXED);
+	pthread_cond_broadcast(&db->bg_cv);
+	pthread_cond_broadcast(&db->compact_cv);
+	pthread_mutex_unlock(&db->lock);
+
+	pthread_join(db->bg_thread, NULL);
+	pthread_join(db->compact_thread, NULL);
+	db->bg_started = false;
+}
+
+void pgdb_wait_background(pgdb_t* db, char** errptr)
+{
+	*errptr = NULL;
+
+	pthread_mutex_lock(&db->lock);
+
+	while (db->bg_started && !db->bg_shutdown && !db->bg_error &&
+	       (db->flushing || db->compacting || flush_pick(db) ||
+		pg_compact_pick(db)))
+		pthread_cond_wait(&db->idle_cv, &db->lock);
+
+	if (db->bg_error)
+		*errptr = strdup(db->bg_error);
+
+	pthread_mutex_unlock(&db->lock);
+}
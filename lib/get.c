@@ -1,50 +1,175 @@
 
 #include <string.h>
+#include <stdlib.h>
 
 #include "pgdb-internal.h"
 
-static char* __pgdb_get(
+/*
+ * Search the memtables, newest first.  Returns PGDB_MT_MISS if the
+ * pagefiles must be searched next.
+ */
+static enum pgdb_mt_result memset_get(struct pgdb_memset *ms, uint64_t seq,
+				      const char *key, size_t keylen,
+				      const void **val, size_t *vallen,
+				      pgdb_pinned_t **pin)
+{
+	enum pgdb_mt_result res = PGDB_MT_MISS;
+	unsigned int i;
+	for (i = 0; i < ms->n_mt && res == PGDB_MT_MISS; i++) {
+		struct pgdb_memtable *mt = ms->mt[i];
+
+		res = pg_memtable_get(mt, key, keylen, seq, val, vallen);
+		if (res == PGDB_MT_FOUND) {
+			pg_memtable_ref(mt);
+			*pin = &mt->pin;
+		}
+	}
+
+	return res;
+}
+
+/*
+ * Search pagefile pf, passing on the caller's reference to it: on a hit
+ * *pin holds what the value needs, else pf is dropped.  Returns
+ * PGDB_MT_MISS, with *errptr set, on error.
+ */
+enum pgdb_mt_result pg_pagefile_lookup(struct pgdb_pagefile *pf,
+				       const char *key, size_t keylen,
+				       const void **val, size_t *vallen,
+				       pgdb_pinned_t **pin, bool verify,
+				       bool fill_cache, char **errptr)
+{
+	enum pgdb_mt_result res = PGDB_MT_MISS;
+	int slot = pg_pagefile_find(pf, key, keylen, true);
+	if (slot < 0)
+		goto out;
+
+	struct pgdb_vblock *blk = NULL;
+	size_t v_len;
+	const void *v = pg_pagefile_value(pf, slot, &blk, &v_len, fill_cache,
+					  errptr);
+	if (!v)
+		goto out;
+
+	if (verify && !pg_pagefile_verify(pf, slot, v, v_len, errptr)) {
+		pg_vblock_unref(blk);
+		goto out;
+	}
+
+	// tombstones have no value, hence no block
+	if (le32toh(pf->pi[slot].flags) & PGDB_PI_DELETED) {
+		res = PGDB_MT_DELETED;
+		goto out;
+	}
+
+	*val = v;
+	*vallen = v_len;
+
+	// a value uncompressed holds its block, not the pagefile
+	if (blk) {
+		*pin = &blk->pin;
+		pg_pagefile_put(pf);
+	} else {
+		*pin = &pf->pin;
+	}
+	return PGDB_MT_FOUND;
+
+out:
+	pg_pagefile_put(pf);
+	return res;
+}
+
+/*
+ * Search one sorted run: at most one of its pagefiles can hold key.
+ * Returns PGDB_MT_MISS, with *errptr set, on error.
+ */
+static enum pgdb_mt_result run_get(struct pgdb_table_t *table,
+				   struct pgdb_run *run,
+				   const char *key, size_t keylen,
+				   const void **val, size_t *vallen,
+				   pgdb_pinned_t **pin, bool verify,
+				   bool fill_cache, char **errptr)
+{
+	const struct pgdb_fence_ent *fe = pg_fence_find(run->fence,
+							key, keylen);
+	if (!fe)
+		return PGDB_MT_MISS;
+
+	if (!pg_filter_may_match(table->db, run, fe, key, keylen))
+		return PGDB_MT_MISS;
+
+	struct pgdb_pagefile *pf = pg_pagefile_get(table, fe->file_id, errptr);
+	if (!pf)
+		return PGDB_MT_MISS;
+
+	return pg_pagefile_lookup(pf, key, keylen, val, vallen, pin, verify,
+				  fill_cache, errptr);
+}
+
+/*
+ * Locate key and return a pointer to its value in place.  On a hit the
+ * caller owns *pin and must drop it with pgdb_pinned_release() once
+ * done with the value.  Allocates no memory unless an error occurs.
+ */
+static bool __pgdb_get(
     pgdb_t* db, unsigned int table_slot,
     const pgdb_readoptions_t* options,
     const char* key, size_t keylen,
-    size_t* vallen,
+    const void** val, size_t* vallen,
+    pgdb_pinned_t** pin,
     char** errptr)
 {
 	*errptr = NULL;
 
-	struct pgdb_table *table = &db->tables[table_slot];
+	struct pgdb_view view;
+	if (!pg_view_enter(db, table_slot, options, &view, errptr)) {
+		pg_view_leave(&view);
+		return false;
+	}
 
-	int root_idx = pg_find_rootent(table->root, key, keylen);
-	if (root_idx < 0)
-		return NULL;
+	enum pgdb_mt_result res = memset_get(view.ms, view.seq, key, keylen,
+					     val, vallen, pin);
 
-	struct pgdb_pagefile *pf = pg_pagefile_open(db, root_idx, errptr);
-	if (!pf)
-		return NULL;
+	struct pgdb_rootgen *rg = view.rg;
+	bool verify = options && options->verify_checksums;
+	bool fill_cache = !options || options->fill_cache;
+	unsigned int i;
+	for (i = 0; res == PGDB_MT_MISS && !*errptr && i < rg->n_runs; i++)
+		res = run_get(rg->table, &rg->runs[i], key, keylen, val, vallen,
+			      pin, verify, fill_cache, errptr);
 
-	int slot = pg_pagefile_find(pf, key, keylen, true);
-	if (slot < 0)
-		goto out;
+	pg_view_leave(&view);
+
+	return res == PGDB_MT_FOUND;
+}
 
-	struct pgdb_page_index *pi = &pf->pi[slot];
-	uint32_t v_offset = le32toh(pi->v_offset);
-	uint32_t v_len = le32toh(pi->v_len);
+static char* __pgdb_get_copy(
+    pgdb_t* db, unsigned int table_slot,
+    const pgdb_readoptions_t* options,
+    const char* key, size_t keylen,
+    size_t* vallen,
+    char** errptr)
+{
+	const void *val;
+	size_t len;
+	pgdb_pinned_t *pin;
+
+	if (!__pgdb_get(db, table_slot, options, key, keylen, &val, &len,
+			&pin, errptr))
+		return NULL;
 
-	void *v_mem = malloc(v_len);
+	void *v_mem = malloc(len ? len : 1);
 	if (!v_mem) {
 		*errptr = strdup("OOM");	// irony, but recoverable
 		goto out;
 	}
 
-	memcpy(v_mem, pf->map->mem + v_offset, v_len);
-
-	pg_pagefile_close(pf);
-	*vallen = v_len;
-	return v_mem;
+	memcpy(v_mem, val, len);
+	*vallen = len;
 
 out:
-	pg_pagefile_close(pf);
-	return NULL;
+	pgdb_pinned_release(pin);
+	return v_mem;
 }
 
 char* pgdb_get(
@@ -54,6 +179,348 @@ char* pgdb_get(
     size_t* vallen,
     char** errptr)
 {
-	return __pgdb_get(db, 0, options, key, keylen, vallen, errptr);
+	return __pgdb_get_copy(db, 0, options, key, keylen, vallen, errptr);
+}
+
+char* pgdb_get_cf(
+    pgdb_t* db,
+    const pgdb_readoptions_t* options,
+    pgdb_table_t* table,
+    const char* key, size_t keylen,
+    size_t* vallen,
+    char** errptr)
+{
+	return __pgdb_get_copy(db, table->slot, options, key, keylen, vallen,
+			       errptr);
 }
 
+const char* pgdb_get_pinned(
+    pgdb_t* db,
+    const pgdb_readoptions_t* options,
+    const char* key, size_t keylen,
+    size_t* vallen,
+    pgdb_pinned_t** pin,
+    char** errptr)
+{
+	const void *val;
+
+	*pin = NULL;
+	if (!__pgdb_get(db, 0, options, key, keylen, &val, vallen, pin, errptr))
+		return NULL;
+
+	return val;
+}
+
+void pgdb_pinned_release(pgdb_pinned_t* pin)
+{
+	if (pin)
+		pin->release(pin);
+}
+
+bool pgdb_get_into(
+    pgdb_t* db,
+    const pgdb_readoptions_t* options,
+    const char* key, size_t keylen,
+    char* buf, size_t buflen,
+    size_t* vallen,
+    char** errptr)
+{
+	const void *val;
+	pgdb_pinned_t *pin;
+
+	if (!__pgdb_get(db, 0, options, key, keylen, &val, vallen, &pin, errptr))
+		return false;
+
+	memcpy(buf, val, (*vallen < buflen) ? *vallen : buflen);
+
+	pgdb_pinned_release(pin);
+	return true;
+}
+
+/*
+ * Multi-get.
+ *
+ * The keys are sorted once.  Then each sorted run is matched against
+ * the keys still unresolved in one forward pass over its entries, so
+ * each pagefile needed is opened once, for all the keys it may hold.
+ * Within a pagefile every key's slot is found first, prefetching its
+ * index entry and value, and only then are the records read.  Found
+ * values are copied out last, into one buffer.
+ */
+
+struct mget_key {
+	const char		*key;
+	size_t			klen;
+	size_t			idx;		// in the caller's arrays
+	enum pgdb_mt_result	res;
+	int			slot;
+	const void		*val;		// in place, until copied out
+	size_t			vlen;
+	struct pgdb_vblock	*blk;		// holding val, if uncompressed
+};
+
+static int mget_key_cmp(const void *a_, const void *b_)
+{
+	const struct mget_key *a = a_, *b = b_;
+
+	return pg_key_cmp(a->key, a->klen, b->key, b->klen);
+}
+
+// first entry at or after lo whose last key is >= key
+static unsigned int run_lower_bound(const struct pgdb_run *run,
+				    unsigned int lo,
+				    const void *key, size_t klen)
+{
+	unsigned int hi = run->n_ents;
+
+	while (lo < hi) {
+		unsigned int mid = lo + ((hi - lo) / 2);
+		const PGcodec__RootEnt *ent = run->ents[mid];
+
+		if (pg_key_cmp(ent->key.data, ent->key.len, key, klen) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+// look up batch[0..n), sorted keys which can only be in pf; returns hits
+static unsigned int mget_pagefile(struct pgdb_pagefile *pf,
+				  struct mget_key **batch, unsigned int n,
+				  bool verify, bool fill_cache, char **errptr)
+{
+	unsigned int i, found = 0;
+
+	for (i = 0; i < n; i++) {
+		struct mget_key *k = batch[i];
+
+		k->slot = pg_pagefile_find(pf, k->key, k->klen, true);
+		if (k->slot < 0)
+			continue;
+
+		struct pgdb_page_index *pi = &pf->pi[k->slot];
+		__builtin_prefetch(pi);
+		if (pf->compression == PGDB_COMP_NONE)
+			__builtin_prefetch(pf->map->mem +
+					   le32toh(pi->v_offset));
+	}
+
+	// sorted keys share blocks: each is uncompressed once
+	struct pgdb_vblock *blk = NULL;
+
+	for (i = 0; i < n; i++) {
+		struct mget_key *k = batch[i];
+		if (k->slot < 0)
+			continue;
+
+		size_t v_len;
+		const void *v = pg_pagefile_value(pf, k->slot, &blk, &v_len,
+						  fill_cache, errptr);
+		if (!v)
+			break;
+
+		if (verify && !pg_pagefile_verify(pf, k->slot, v, v_len,
+						  errptr))
+			break;
+
+		if (le32toh(pf->pi[k->slot].flags) & PGDB_PI_DELETED) {
+			k->res = PGDB_MT_DELETED;
+			continue;
+		}
+
+		k->res = PGDB_MT_FOUND;
+		k->val = v;
+		k->vlen = v_len;
+		if (blk) {
+			pg_vblock_ref(blk);
+			k->blk = blk;
+		}
+		found++;
+	}
+
+	pg_vblock_unref(blk);
+	return found;
+}
+
+/*
+ * Resolve the keys of mk[0..n) still missed against one run.  Pagefiles
+ * holding a hit are added to pfs[], and stay open while values point
+ * into them; there are never more than there are keys.
+ */
+static void mget_run(struct pgdb_table_t *table, struct pgdb_run *run,
+		     struct mget_key *mk, size_t n,
+		     struct mget_key **batch,
+		     struct pgdb_pagefile **pfs, size_t *n_pfs,
+		     bool verify, bool fill_cache, char **errptr)
+{
+	unsigned int rank = 0;
+	size_t i = 0;
+
+	while (i < n && !*errptr) {
+		if (mk[i].res != PGDB_MT_MISS) {
+			i++;
+			continue;
+		}
+
+		rank = run_lower_bound(run, rank, mk[i].key, mk[i].klen);
+		if (rank >= run->n_ents)
+			break;
+
+		// gather the missed keys up to this pagefile's last key
+		const PGcodec__RootEnt *ent = run->ents[rank];
+		struct pgdb_fence_ent fe = {
+			.file_id = ent->file_id,
+			.rank = rank,
+		};
+		unsigned int n_batch = 0;
+
+		for (; i < n; i++) {
+			if (mk[i].res != PGDB_MT_MISS)
+				continue;
+			if (pg_key_cmp(mk[i].key, mk[i].klen,
+				       ent->key.data, ent->key.len) > 0)
+				break;
+			if (pg_filter_may_match(table->db, run, &fe, mk[i].key,
+						mk[i].klen))
+				batch[n_batch++] = &mk[i];
+		}
+
+		if (!n_batch)
+			continue;
+
+		struct pgdb_pagefile *pf = pg_pagefile_get(table, ent->file_id,
+							   errptr);
+		if (!pf)
+			break;
+
+		if (mget_pagefile(pf, batch, n_batch, verify, fill_cache,
+				  errptr))
+			pfs[(*n_pfs)++] = pf;
+		else
+			pg_pagefile_put(pf);
+	}
+}
+
+static char* __pgdb_multi_get(
+    pgdb_t* db, unsigned int table_slot,
+    const pgdb_readoptions_t* options,
+    size_t num_keys,
+    const char* const* keys, const size_t* keylens,
+    const char** vals, size_t* vallens,
+    char** errptr)
+{
+	*errptr = NULL;
+
+	size_t i;
+	for (i = 0; i < num_keys; i++) {
+		vals[i] = NULL;
+		vallens[i] = 0;
+	}
+	if (!num_keys)
+		return NULL;
+
+	// one allocation: sorted keys, a scratch batch, open pagefiles
+	struct mget_key *mk = malloc(num_keys * (sizeof(struct mget_key) +
+					sizeof(struct mget_key *) +
+					sizeof(struct pgdb_pagefile *)));
+	if (!mk) {
+		*errptr = strdup("OOM");	// irony, but recoverable
+		return NULL;
+	}
+	struct mget_key **batch = (struct mget_key **) &mk[num_keys];
+	struct pgdb_pagefile **pfs = (struct pgdb_pagefile **) &batch[num_keys];
+	size_t n_pfs = 0;
+
+	for (i = 0; i < num_keys; i++) {
+		mk[i].key = keys[i];
+		mk[i].klen = keylens[i];
+		mk[i].idx = i;
+		mk[i].res = PGDB_MT_MISS;
+		mk[i].blk = NULL;
+	}
+	qsort(mk, num_keys, sizeof(struct mget_key), mget_key_cmp);
+
+	struct pgdb_view view;
+	if (!pg_view_enter(db, table_slot, options, &view, errptr)) {
+		pg_view_leave(&view);
+		free(mk);
+		return NULL;
+	}
+
+	// memtable values stay put until the view is left
+	unsigned int m;
+	for (m = 0; m < view.ms->n_mt; m++)
+		for (i = 0; i < num_keys; i++)
+			if (mk[i].res == PGDB_MT_MISS)
+				mk[i].res = pg_memtable_get(view.ms->mt[m],
+						mk[i].key, mk[i].klen, view.seq,
+						&mk[i].val, &mk[i].vlen);
+
+	bool verify = options && options->verify_checksums;
+	bool fill_cache = !options || options->fill_cache;
+	unsigned int r;
+	for (r = 0; r < view.rg->n_runs && !*errptr; r++)
+		mget_run(view.rg->table, &view.rg->runs[r], mk, num_keys,
+			 batch, pfs, &n_pfs, verify, fill_cache, errptr);
+
+	size_t total = 0, n_found = 0;
+	for (i = 0; i < num_keys; i++)
+		if (mk[i].res == PGDB_MT_FOUND) {
+			total += mk[i].vlen;
+			n_found++;
+		}
+
+	char *buf = NULL;
+	if (!*errptr && n_found) {
+		buf = malloc(total ? total : 1);
+		if (!buf)
+			*errptr = strdup("OOM");	// irony, but recoverable
+	}
+
+	char *p = buf;
+	for (i = 0; buf && i < num_keys; i++) {
+		if (mk[i].res != PGDB_MT_FOUND)
+			continue;
+
+		memcpy(p, mk[i].val, mk[i].vlen);
+		vals[mk[i].idx] = p;
+		vallens[mk[i].idx] = mk[i].vlen;
+		p += mk[i].vlen;
+	}
+
+	for (i = 0; i < num_keys; i++)
+		pg_vblock_unref(mk[i].blk);
+	for (i = 0; i < n_pfs; i++)
+		pg_pagefile_put(pfs[i]);
+	pg_view_leave(&view);
+	free(mk);
+
+	return buf;
+}
+
+char* pgdb_multi_get(
+    pgdb_t* db,
+    const pgdb_readoptions_t* options,
+    size_t num_keys,
+    const char* const* keys, const size_t* keylens,
+    const char** vals, size_t* vallens,
+    char** errptr)
+{
+	return __pgdb_multi_get(db, 0, options, num_keys, keys, keylens,
+				vals, vallens, errptr);
+}
+
+char* pgdb_multi_get_cf(
+    pgdb_t* db,
+    const pgdb_readoptions_t* options,
+    pgdb_table_t* table,
+    size_t num_keys,
+    const char* const* keys, const size_t* keylens,
+    const char** vals, size_t* vallens,
+    char** errptr)
+{
+	return __pgdb_multi_get(db, table->slot, options, num_keys, keys,
+				keylens, vals, vallens, errptr);
+}
@@ -0,0 +1,638 @@
+
+#include <sys/mman.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "pgdb-internal.h"
+
+/*
+ * Iterators.
+ *
+ * An iterator pins a view of the table (see snapshot.c): the one of the
+ * snapshot given in its read options, or else the table as it stands.
+ * Each memtable and each sorted run is walked by a child cursor, and the
+ * iterator merges them by key, the newest source winning a tie; a
+ * winning tombstone hides the key.  Keys and values are returned in
+ * place, from memtable arenas or pagefile mappings, valid until the
+ * iterator next moves.
+ *
+ * Scanning a run maps its pagefiles in key order: the one being read is
+ * advised MADV_SEQUENTIAL, and the next one in the scan direction is
+ * opened early and advised MADV_WILLNEED, so the kernel reads it in
+ * while the current one is consumed.
+ */
+
+enum iter_child_type {
+	ITER_MEMTABLE,
+	ITER_RUN,
+};
+
+struct iter_child {
+	enum iter_child_type	type;
+	bool			valid;
+	const char		*key;
+	size_t			k_len;
+	const char		*val;
+	size_t			v_len;
+	bool			deleted;
+
+	// ITER_MEMTABLE
+	struct pgdb_memtable	*mt;
+	struct pgdb_mt_node	*node;
+
+	// ITER_RUN
+	struct pgdb_run		*run;
+	unsigned int		file;		// rank of pf within run
+	struct pgdb_pagefile	*pf;
+	bool			pf_seq;		// pf advised MADV_SEQUENTIAL
+	uint32_t		slot;
+	struct pgdb_vblock	*blk;		// holding val, if uncompressed
+	unsigned int		ahead_file;
+	struct pgdb_pagefile	*ahead;		// prefetched neighbour
+};
+
+struct pgdb_iterator_t {
+	pgdb_t			*db;
+	struct pgdb_view	view;
+
+	unsigned int		n_child;
+	struct iter_child	*child;		// newest first
+	int			cur;		// winning child, -1 if none
+	bool			forward;
+	bool			verify;		// pagefile record checksums
+	bool			fill_cache;
+	char			*err;
+};
+
+static void iter_error(pgdb_iterator_t *it, char *err)
+{
+	if (!it->err)
+		it->err = err;
+	else
+		free(err);
+}
+
+/*
+ * Memtable cursors.  A key may have several versions, newest first; the
+ * cursor rests on the newest one visible at the iterator's sequence.
+ */
+
+static inline bool mt_same_key(const struct pgdb_mt_node *a,
+			       const struct pgdb_mt_node *b)
+{
+	return !pg_key_cmp(pg_mt_key(a), a->k_len, pg_mt_key(b), b->k_len);
+}
+
+static void mt_set(struct iter_child *c, struct pgdb_mt_node *n)
+{
+	c->node = n;
+	c->valid = (n != NULL);
+	if (!n)
+		return;
+
+	c->key = pg_mt_key(n);
+	c->k_len = n->k_len;
+	c->val = pg_mt_val(n);
+	c->v_len = n->v_len;
+	c->deleted = (n->type != PGDB_REC_PUT);
+}
+
+// first visible version at or after n
+static void mt_settle_fwd(pgdb_iterator_t *it, struct iter_child *c,
+			  struct pgdb_mt_node *n)
+{
+	while (n && n->seq > it->view.seq)
+		n = pg_memtable_next(n);
+
+	mt_set(c, n);
+}
+
+// n is the newest version of its key; back up past invisible keys
+static void mt_settle_back(pgdb_iterator_t *it, struct iter_child *c,
+			   struct pgdb_mt_node *n)
+{
+	while (n) {
+		struct pgdb_mt_node *v;
+		for (v = n; v && mt_same_key(v, n); v = pg_memtable_next(v))
+			if (v->seq <= it->view.seq) {
+				mt_set(c, v);
+				return;
+			}
+
+		n = pg_memtable_seek_lt(c->mt, pg_mt_key(n), n->k_len);
+	}
+
+	mt_set(c, NULL);
+}
+
+static void mt_seek(pgdb_iterator_t *it, struct iter_child *c,
+		    const void *key, size_t klen)
+{
+	mt_settle_fwd(it, c, pg_memtable_seek(c->mt, key, klen));
+}
+
+static void mt_first(pgdb_iterator_t *it, struct iter_child *c)
+{
+	mt_settle_fwd(it, c, pg_memtable_first(c->mt));
+}
+
+static void mt_last(pgdb_iterator_t *it, struct iter_child *c)
+{
+	mt_settle_back(it, c, pg_memtable_last(c->mt));
+}
+
+static void mt_next(pgdb_iterator_t *it, struct iter_child *c)
+{
+	struct pgdb_mt_node *n = pg_memtable_next(c->node);
+	while (n && mt_same_key(n, c->node))
+		n = pg_memtable_next(n);
+
+	mt_settle_fwd(it, c, n);
+}
+
+static void mt_prev(pgdb_iterator_t *it, struct iter_child *c)
+{
+	mt_settle_back(it, c, pg_memtable_seek_lt(c->mt, c->key, c->k_len));
+}
+
+/*
+ * Run cursors.  The run's pagefiles are disjoint and ordered, so the
+ * cursor is a (file, slot) pair.
+ */
+
+static void pf_release(struct pgdb_pagefile *pf, bool seq)
+{
+	if (!pf)
+		return;
+	if (seq)
+		pgmap_advise(pf->map, MADV_NORMAL);
+	pg_pagefile_put(pf);
+}
+
+// start reading in the file after (or before) the current one
+static void run_prefetch(pgdb_iterator_t *it, struct iter_child *c, int dir)
+{
+	if ((dir < 0 && c->file == 0) ||
+	    (dir > 0 && c->file + 1 >= c->run->n_ents))
+		return;
+
+	unsigned int file = c->file + dir;
+	if (c->ahead && c->ahead_file == file)
+		return;
+
+	pg_pagefile_put(c->ahead);
+	c->ahead = NULL;
+
+	// only a hint; an error surfaces when the file is reached
+	char *err = NULL;
+	struct pgdb_pagefile *pf = pg_pagefile_get(it->view.rg->table,
+					c->run->ents[file]->file_id, &err);
+	if (!pf) {
+		free(err);
+		return;
+	}
+
+	pgmap_advise(pf->map, MADV_WILLNEED);
+	c->ahead = pf;
+	c->ahead_file = file;
+}
+
+/*
+ * Make file the cursor's current pagefile.  A scan (dir != 0) reads it
+ * sequentially and prefetches the next file in direction dir; a seek
+ * (dir == 0) reads where it lands.
+ */
+static bool run_load(pgdb_iterator_t *it, struct iter_child *c,
+		     unsigned int file, int dir)
+{
+	if (!c->pf || c->file != file) {
+		struct pgdb_pagefile *pf;
+
+		if (c->ahead && c->ahead_file == file) {
+			pf = c->ahead;
+			c->ahead = NULL;
+		} else {
+			char *err = NULL;
+			pf = pg_pagefile_get(it->view.rg->table,
+					     c->run->ents[file]->file_id, &err);
+			if (!pf) {
+				iter_error(it, err);
+				return false;
+			}
+		}
+
+		pf_release(c->pf, c->pf_seq);
+		c->pf = pf;
+		c->pf_seq = false;
+		c->file = file;
+	}
+
+	if (dir && !c->pf_seq) {
+		pgmap_advise(c->pf->map, MADV_SEQUENTIAL);
+		c->pf_seq = true;
+	}
+	if (dir)
+		run_prefetch(it, c, dir);
+
+	return true;
+}
+
+static void run_set(pgdb_iterator_t *it, struct iter_child *c, uint32_t slot)
+{
+	struct pgdb_pagefile *pf = c->pf;
+	struct pgdb_page_index *pi = &pf->pi[slot];
+	uint64_t file_len = pf->map->st.st_size;
+
+	uint32_t k_offset = le32toh(pi->k_offset);
+	uint32_t k_len = le32toh(pi->k_len);
+
+	if (((uint64_t) k_offset + k_len) > file_len) {
+		iter_error(it, strdup("pagefile record out of range"));
+		c->valid = false;
+		return;
+	}
+
+	char *err = NULL;
+	size_t v_len;
+	const void *v = pg_pagefile_value(pf, slot, &c->blk, &v_len,
+					  it->fill_cache, &err);
+	if (!v || (it->verify && !pg_pagefile_verify(pf, slot, v, v_len,
+						     &err))) {
+		iter_error(it, err);
+		c->valid = false;
+		return;
+	}
+
+	c->slot = slot;
+	c->valid = true;
+	c->key = pf->map->mem + k_offset;
+	c->k_len = k_len;
+	c->val = v;
+	c->v_len = v_len;
+	c->deleted = (le32toh(pi->flags) & PGDB_PI_DELETED);
+}
+
+// first record at or after (file, slot)
+static void run_fwd_from(pgdb_iterator_t *it, struct iter_child *c,
+			 unsigned int file, uint32_t slot, int dir)
+{
+	c->valid = false;
+
+	for (; file < c->run->n_ents; file++, slot = 0) {
+		if (!run_load(it, c, file, dir))
+			return;
+		if (slot < c->pf->n_entries) {
+			run_set(it, c, slot);
+			return;
+		}
+		dir = 1;
+	}
+}
+
+// last record at or before (file, slot)
+static void run_back_from(pgdb_iterator_t *it, struct iter_child *c,
+			  unsigned int file, long slot)
+{
+	c->valid = false;
+
+	if (!c->run->n_ents)
+		return;
+
+	for (;; file--, slot = LONG_MAX) {
+		if (!run_load(it, c, file, -1))
+			return;
+		if (slot >= (long) c->pf->n_entries)
+			slot = (long) c->pf->n_entries - 1;
+		if (slot >= 0) {
+			run_set(it, c, slot);
+			return;
+		}
+		if (file == 0)
+			return;
+	}
+}
+
+static void run_seek(pgdb_iterator_t *it, struct iter_child *c,
+		     const void *key, size_t klen)
+{
+	const struct pgdb_fence_ent *fe = pg_fence_find(c->run->fence,
+							key, klen);
+	if (!fe) {
+		c->valid = false;
+		return;
+	}
+
+	if (!run_load(it, c, fe->rank, 0)) {
+		c->valid = false;
+		return;
+	}
+
+	int slot = pg_pagefile_find(c->pf, key, klen, false);
+	if (slot < 0)
+		run_fwd_from(it, c, fe->rank + 1, 0, 1);
+	else
+		run_set(it, c, slot);
+}
+
+static void child_seek(pgdb_iterator_t *it, struct iter_child *c,
+		       const void *key, size_t klen)
+{
+	if (c->type == ITER_MEMTABLE)
+		mt_seek(it, c, key, klen);
+	else
+		run_seek(it, c, key, klen);
+}
+
+static void child_first(pgdb_iterator_t *it, struct iter_child *c)
+{
+	if (c->type == ITER_MEMTABLE)
+		mt_first(it, c);
+	else
+		run_fwd_from(it, c, 0, 0, 1);
+}
+
+static void child_last(pgdb_iterator_t *it, struct iter_child *c)
+{
+	if (c->type == ITER_MEMTABLE)
+		mt_last(it, c);
+	else
+		run_back_from(it, c, c->run->n_ents - 1, LONG_MAX);
+}
+
+static void child_next(pgdb_iterator_t *it, struct iter_child *c)
+{
+	if (c->type == ITER_MEMTABLE)
+		mt_next(it, c);
+	else
+		run_fwd_from(it, c, c->file, c->slot + 1, 1);
+}
+
+static void child_prev(pgdb_iterator_t *it, struct iter_child *c)
+{
+	if (c->type == ITER_MEMTABLE)
+		mt_prev(it, c);
+	else
+		run_back_from(it, c, c->file, (long) c->slot - 1);
+}
+
+static inline int child_cmp(const struct iter_child *a,
+			    const struct iter_child *b)
+{
+	return pg_key_cmp(a->key, a->k_len, b->key, b->k_len);
+}
+
+/*
+ * The merge.  Moving forward, every child rests on its first key at or
+ * after the current one; moving backward, on its last key at or before
+ * it.  The newest child holding the smallest (largest) key wins.
+ */
+
+static void iter_pick(pgdb_iterator_t *it)
+{
+	int best = -1;
+	unsigned int i;
+
+	if (!it->err)
+		for (i = 0; i < it->n_child; i++) {
+			struct iter_child *c = &it->child[i];
+			if (!c->valid)
+				continue;
+
+			if (best < 0) {
+				best = i;
+				continue;
+			}
+
+			int cmp = child_cmp(c, &it->child[best]);
+			if (it->forward ? (cmp < 0) : (cmp > 0))
+				best = i;
+		}
+
+	it->cur = best;
+}
+
+// move every child off the current key, in the current direction
+static void iter_step(pgdb_iterator_t *it)
+{
+	struct iter_child *cur = &it->child[it->cur];
+	unsigned int i;
+
+	// cur moves last: the others compare against its key
+	for (i = 0; i < it->n_child; i++) {
+		struct iter_child *c = &it->child[i];
+		if (c == cur || !c->valid || child_cmp(c, cur))
+			continue;
+
+		if (it->forward)
+			child_next(it, c);
+		else
+			child_prev(it, c);
+	}
+
+	if (it->forward)
+		child_next(it, cur);
+	else
+		child_prev(it, cur);
+
+	iter_pick(it);
+}
+
+static void iter_skip_deleted(pgdb_iterator_t *it)
+{
+	while (it->cur >= 0 && it->child[it->cur].deleted)
+		iter_step(it);
+}
+
+// reposition the other children for a change of direction
+static void iter_turn(pgdb_iterator_t *it)
+{
+	struct iter_child *cur = &it->child[it->cur];
+	unsigned int i;
+
+	for (i = 0; i < it->n_child; i++) {
+		struct iter_child *c = &it->child[i];
+		if (c == cur)
+			continue;
+
+		child_seek(it, c, cur->key, cur->k_len);
+		if (it->forward)
+			continue;
+
+		// backward: the last key at or before cur's
+		if (!c->valid)
+			child_last(it, c);
+		else if (child_cmp(c, cur) > 0)
+			child_prev(it, c);
+	}
+}
+
+static pgdb_iterator_t* __pgdb_create_iterator(
+    pgdb_t* db, unsigned int table_slot,
+    const pgdb_readoptions_t* options)
+{
+	pgdb_iterator_t *it = calloc(1, sizeof(*it));
+	if (!it)
+		return NULL;
+
+	it->db = db;
+	it->cur = -1;
+	it->forward = true;
+	it->verify = options && options->verify_checksums;
+	it->fill_cache = !options || options->fill_cache;
+
+	// on failure, an iterator that is never valid, with the error
+	if (!pg_view_get(db, table_slot, options, &it->view, &it->err))
+		return it;
+
+	struct pgdb_memset *ms = it->view.ms;
+	struct pgdb_rootgen *rg = it->view.rg;
+
+	it->n_child = ms->n_mt + rg->n_runs;
+	it->child = calloc(it->n_child, sizeof(struct iter_child));
+	if (!it->child) {
+		pgdb_iter_destroy(it);
+		return NULL;
+	}
+
+	unsigned int i, n = 0;
+	for (i = 0; i < ms->n_mt; i++) {
+		it->child[n].type = ITER_MEMTABLE;
+		it->child[n++].mt = ms->mt[i];
+	}
+	for (i = 0; i < rg->n_runs; i++) {
+		it->child[n].type = ITER_RUN;
+		it->child[n++].run = &rg->runs[i];
+	}
+
+	return it;
+}
+
+pgdb_iterator_t* pgdb_create_iterator(
+    pgdb_t* db,
+    const pgdb_readoptions_t* options)
+{
+	return __pgdb_create_iterator(db, 0, options);
+}
+
+pgdb_iterator_t* pgdb_create_iterator_cf(
+    pgdb_t* db,
+    const pgdb_readoptions_t* options,
+    pgdb_table_t* table)
+{
+	return __pgdb_create_iterator(db, table->slot, options);
+}
+
+void pgdb_iter_destroy(pgdb_iterator_t* it)
+{
+	if (!it)
+		return;
+
+	unsigned int i;
+	for (i = 0; it->child && i < it->n_child; i++) {
+		struct iter_child *c = &it->child[i];
+
+		pf_release(c->pf, c->pf_seq);
+		pg_pagefile_put(c->ahead);
+		pg_vblock_unref(c->blk);
+	}
+	free(it->child);
+
+	pg_view_put(&it->view);
+	free(it->err);
+
+	memset(it, 0xff, sizeof(*it));
+	free(it);
+}
+
+unsigned char pgdb_iter_valid(const pgdb_iterator_t* it)
+{
+	return it->cur >= 0;
+}
+
+void pgdb_iter_seek_to_first(pgdb_iterator_t* it)
+{
+	unsigned int i;
+	for (i = 0; i < it->n_child; i++)
+		child_first(it, &it->child[i]);
+
+	it->forward = true;
+	iter_pick(it);
+	iter_skip_deleted(it);
+}
+
+void pgdb_iter_seek_to_last(pgdb_iterator_t* it)
+{
+	unsigned int i;
+	for (i = 0; i < it->n_child; i++)
+		child_last(it, &it->child[i]);
+
+	it->forward = false;
+	iter_pick(it);
+	iter_skip_deleted(it);
+}
+
+void pgdb_iter_seek(pgdb_iterator_t* it, const char* k, size_t klen)
+{
+	unsigned int i;
+	for (i = 0; i < it->n_child; i++)
+		child_seek(it, &it->child[i], k, klen);
+
+	it->forward = true;
+	iter_pick(it);
+	iter_skip_deleted(it);
+}
+
+void pgdb_iter_next(pgdb_iterator_t* it)
+{
+	if (it->cur < 0)
+		return;
+
+	if (!it->forward) {
+		it->forward = true;
+		iter_turn(it);
+	}
+
+	iter_step(it);
+	iter_skip_deleted(it);
+}
+
+void pgdb_iter_prev(pgdb_iterator_t* it)
+{
+	if (it->cur < 0)
+		return;
+
+	if (it->forward) {
+		it->forward = false;
+		iter_turn(it);
+	}
+
+	iter_step(it);
+	iter_skip_deleted(it);
+}
+
+const char* pgdb_iter_key(const pgdb_iterator_t* it, size_t* klen)
+{
+	if (it->cur < 0)
+		return NULL;
+
+	const struct iter_child *c = &it->child[it->cur];
+	*klen = c->k_len;
+	return c->key;
+}
+
+const char* pgdb_iter_value(const pgdb_iterator_t* it, size_t* vlen)
+{
+	if (it->cur < 0)
+		return NULL;
+
+	const struct iter_child *c = &it->child[it->cur];
+	*vlen = c->v_len;
+	return c->val;
+}
+
+void pgdb_iter_get_error(const pgdb_iterator_t* it, char** errptr)
+{
+	if (it->err)
+		*errptr = strdup(it->err);
+}
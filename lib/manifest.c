@@ -0,0 +1,437 @@
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <alloca.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "pgdb-internal.h"
+
+/*
+ * Manifests.
+ *
+ * Rewriting a table's whole root index, and the superblock naming it,
+ * for each flush or compaction costs I/O in proportion to the table,
+ * not to the change.  So a change is instead appended to the manifest
+ * of the table's root, "<root id>.manifest": one record of the
+ * pagefiles it removed and the entries it added (see struct
+ * pgdb_manifest_hdr), made durable with one fdatasync(2).  The
+ * directory is fsync(2)ed before each record is written, as the
+ * superblock's rename once did: pagefiles are written with their data
+ * synced but not their names, and a record must never name a file a
+ * crash can lose.  Opening the table reads its root, then applies
+ * every edit of the manifest.
+ *
+ * Once the manifest outgrows both PGDB_MANIFEST_MIN and the root
+ * itself, the next change is a checkpoint instead: a whole new root,
+ * which the superblock is then pointed at, leaving the old root and its
+ * manifest to be removed.  A new manifest is started by the change
+ * after.
+ *
+ * As in the write-ahead log, a torn record can only be the tail of an
+ * append cut short by a crash; replay stops there, and the tail is cut
+ * off before anything more is appended.  Each record header carries a
+ * checksum of its own, so a damaged length cannot pass for a record
+ * running past the end: a damaged record followed by others is not a
+ * torn tail, and fails the open.  A failed append is taken back as far
+ * as possible, and the next change is a checkpoint.
+ */
+
+static void manifest_name(pgdb_t *db, uint64_t root_id, char *fn,
+			  size_t fn_len)
+{
+	snprintf(fn, fn_len, "%s/%llu" PGDB_MANIFEST_SUFFIX, db->pathname,
+		 (unsigned long long) root_id);
+}
+
+static int cmp_u64(const void *a_, const void *b_)
+{
+	const uint64_t *a = a_, *b = b_;
+
+	if (*a == *b)
+		return 0;
+	return (*a < *b) ? -1 : 1;
+}
+
+static bool manifest_hdr_ok(const struct pgdb_manifest_hdr *hdr)
+{
+	return pg_crc32c(0, hdr, offsetof(struct pgdb_manifest_hdr, hdr_crc)) ==
+	       le32toh(hdr->hdr_crc);
+}
+
+// is there a sound record header anywhere in [p, end)?
+static bool manifest_hdr_follows(const void *p, const void *end)
+{
+	for (; (end - p) >= sizeof(struct pgdb_manifest_hdr); p += 8)
+		if (manifest_hdr_ok(p))
+			return true;
+
+	return false;
+}
+
+/*
+ * The length of the sound record at p, or 0 if there is none; then
+ * *torn tells whether it can only be the tail of an append cut short.
+ * A record is taken for one if its header is cut short; or if its
+ * header is sound but its payload runs to the end of the file or past
+ * it; or if its header is damaged and no sound one follows it.
+ */
+static size_t manifest_rec(const void *p, const void *end, bool *torn)
+{
+	const struct pgdb_manifest_hdr *hdr = p;
+	const void *payload = hdr + 1;
+
+	*torn = true;
+	if ((end - p) < sizeof(*hdr))
+		return 0;
+
+	if (!manifest_hdr_ok(hdr)) {
+		*torn = !manifest_hdr_follows(p + 8, end);
+		return 0;
+	}
+
+	uint32_t len = le32toh(hdr->len);
+	if (len > (end - payload))
+		return 0;
+
+	*torn = (payload + len == end);
+	if (pg_crc32c(0, payload, len) != le32toh(hdr->crc))
+		return 0;
+
+	// checksummed, yet unsound: not torn, whatever follows
+	*torn = false;
+	if (len % 8)
+		return 0;
+
+	uint64_t n_del = le32toh(hdr->n_del);
+	uint64_t n_add = le32toh(hdr->n_add);
+	uint64_t key_offset = (n_del * sizeof(uint64_t)) +
+			      (n_add * sizeof(struct pgdb_root_ent));
+	if (key_offset > len)
+		return 0;
+
+	const struct pgdb_root_ent *re = payload + (n_del * sizeof(uint64_t));
+	uint64_t i;
+	for (i = 0; i < n_add; i++) {
+		uint64_t k_offset = le32toh(re[i].k_offset);
+		uint64_t k_len = le32toh(re[i].k_len);
+		if (k_offset < key_offset || (k_offset + k_len) > len)
+			return 0;
+	}
+
+	return sizeof(*hdr) + len;
+}
+
+/*
+ * Apply the edits of records [start, end) to *root, replacing it and
+ * *root_map with a root built in memory.
+ */
+static bool manifest_apply(const void *start, const void *end,
+			   size_t n_add, size_t n_del,
+			   PGcodec__RootIdx **root, struct pgdb_map **root_map,
+			   char **errptr)
+{
+	size_t n_base = (*root)->n_entries;
+	PGcodec__RootEnt **ents = malloc((n_base + n_add + 1) *
+					 sizeof(PGcodec__RootEnt *));
+	PGcodec__RootEnt *added = malloc((n_add + 1) *
+					 sizeof(PGcodec__RootEnt));
+	uint64_t *del = malloc((n_del + 1) * sizeof(uint64_t));
+	bool rc = false;
+
+	if (!ents || !added || !del) {
+		*errptr = strdup("OOM");	// irony, but recoverable
+		goto out;
+	}
+
+	const void *p;
+	size_t i;
+	n_add = n_del = 0;
+
+	for (p = start; p < end; ) {
+		const struct pgdb_manifest_hdr *hdr = p;
+		const void *payload = hdr + 1;
+		const uint64_t *ids = payload;
+		uint32_t rec_del = le32toh(hdr->n_del);
+		uint32_t rec_add = le32toh(hdr->n_add);
+		const struct pgdb_root_ent *re = (const void *) &ids[rec_del];
+
+		for (i = 0; i < rec_del; i++)
+			del[n_del++] = le64toh(ids[i]);
+		for (i = 0; i < rec_add; i++)
+			pg_root_ent_decode(&added[n_add++], &re[i], payload);
+
+		p = payload + le32toh(hdr->len);
+	}
+
+	// file ids are never reused: an edit cannot add back what another
+	// removed, so the order edits are applied in does not matter
+	qsort(del, n_del, sizeof(uint64_t), cmp_u64);
+
+	size_t n = 0;
+	for (i = 0; i < n_base; i++) {
+		PGcodec__RootEnt *ent = (*root)->entries[i];
+		if (!bsearch(&ent->file_id, del, n_del, sizeof(uint64_t),
+			     cmp_u64))
+			ents[n++] = ent;
+	}
+	for (i = 0; i < n_add; i++)
+		if (!bsearch(&added[i].file_id, del, n_del, sizeof(uint64_t),
+			     cmp_u64))
+			ents[n++] = &added[i];
+
+	struct pgdb_map *map;
+	PGcodec__RootIdx *new_root = pg_root_build(ents, n, &map, errptr);
+	if (!new_root)
+		goto out;
+
+	pg_root_free(*root, *root_map);
+	*root = new_root;
+	*root_map = map;
+	rc = true;
+
+out:
+	free(ents);
+	free(added);
+	free(del);
+	return rc;
+}
+
+/*
+ * Apply the manifest of root root_id, if it has one, to *root: on
+ * success *root and *root_map are replaced, the caller still owning
+ * them on failure.  Called while table is opened.
+ */
+bool pg_manifest_replay(struct pgdb_table_t *table, uint64_t root_id,
+			PGcodec__RootIdx **root, struct pgdb_map **root_map,
+			char **errptr)
+{
+	pgdb_t *db = table->db;
+	size_t fn_len = strlen(db->pathname) + 64 + 2;
+	char *fn = alloca(fn_len);
+	manifest_name(db, root_id, fn, fn_len);
+
+	table->manifest_len = 0;
+
+	struct stat st;
+	if (stat(fn, &st) < 0) {
+		if (errno == ENOENT)
+			return true;	// no change since the checkpoint
+		*errptr = strdup(strerror(errno));
+		return false;
+	}
+
+	// crashed between create and header write: nothing was recorded
+	if (st.st_size < sizeof(struct pgdb_file_header)) {
+		if (!db->opt->readonly)
+			unlink(fn);
+		return true;
+	}
+
+	struct pgdb_map *map = pgmap_open(fn, errptr);
+	if (!map)
+		return false;
+
+	bool rc = false;
+	struct pgdb_file_header *fhdr = map->mem;
+	if (memcmp(fhdr->magic, PGDB_MANIFEST_MAGIC, sizeof(fhdr->magic))) {
+		*errptr = strdup("manifest magic mismatch");
+		goto out;
+	}
+
+	const void *start = map->mem + sizeof(*fhdr);
+	const void *end = map->mem + map->st.st_size;
+	const void *p;
+	size_t n_add = 0, n_del = 0;
+	bool torn = false;
+
+	for (p = start; p < end; ) {
+		size_t rec_len = manifest_rec(p, end, &torn);
+		if (!rec_len)
+			break;
+
+		const struct pgdb_manifest_hdr *hdr = p;
+		n_add += le32toh(hdr->n_add);
+		n_del += le32toh(hdr->n_del);
+		p += rec_len;
+	}
+
+	if (p < end && !torn) {
+		*errptr = strdup("manifest corrupt");
+		goto out;
+	}
+
+	if ((n_add || n_del) &&
+	    !manifest_apply(start, p, n_add, n_del, root, root_map, errptr))
+		goto out;
+
+	table->manifest_len = p - map->mem;
+
+	// cut off a torn tail, or append no more to this manifest
+	if (p < end && !db->opt->readonly &&
+	    truncate(fn, table->manifest_len) < 0)
+		table->manifest_broken = true;
+
+	rc = true;
+
+out:
+	pgmap_free(map);
+	return rc;
+}
+
+// should the next change be a checkpoint, of a root root_len long?
+bool pg_manifest_due(const struct pgdb_table_t *table, size_t root_len)
+{
+	if (table->manifest_broken)
+		return true;
+
+	size_t limit = (root_len > PGDB_MANIFEST_MIN) ?
+		       root_len : PGDB_MANIFEST_MIN;
+	return table->manifest_len >= limit;
+}
+
+/*
+ * Durably record, in the manifest of root root_id, a change to the
+ * table's root: the removal of files del[], and the addition of add[].
+ * Caller holds db->root_lock.
+ */
+bool pg_manifest_append(struct pgdb_table_t *table, uint64_t root_id,
+			PGcodec__RootEnt **add, unsigned int n_add,
+			const uint64_t *del, unsigned int n_del,
+			char **errptr)
+{
+	pgdb_t *db = table->db;
+	size_t key_offset = (n_del * sizeof(uint64_t)) +
+			    (n_add * sizeof(struct pgdb_root_ent));
+	size_t len = key_offset;
+	unsigned int i;
+
+	for (i = 0; i < n_add; i++)
+		len += add[i]->key.len;
+	len = (len + 7) & ~7UL;		// keeps the next record aligned
+
+	if (len > UINT32_MAX) {
+		*errptr = strdup("manifest record too large");
+		return false;
+	}
+
+	// a new manifest starts with its file header
+	bool create = !table->manifest_len;
+	size_t buf_len = sizeof(struct pgdb_manifest_hdr) + len;
+	if (create)
+		buf_len += sizeof(struct pgdb_file_header);
+
+	unsigned char *buf = calloc(1, buf_len);
+	if (!buf) {
+		*errptr = strdup("OOM");	// irony, but recoverable
+		return false;
+	}
+
+	unsigned char *p = buf;
+	if (create) {
+		struct pgdb_file_header *fhdr = (void *) p;
+		memcpy(fhdr->magic, PGDB_MANIFEST_MAGIC, sizeof(fhdr->magic));
+		p += sizeof(*fhdr);
+	}
+
+	struct pgdb_manifest_hdr *hdr = (void *) p;
+	unsigned char *payload = (unsigned char *) (hdr + 1);
+	uint64_t *ids = (uint64_t *) payload;
+	struct pgdb_root_ent *re = (struct pgdb_root_ent *) &ids[n_del];
+	unsigned char *key = payload + key_offset;
+
+	for (i = 0; i < n_del; i++)
+		ids[i] = htole64(del[i]);
+	for (i = 0; i < n_add; i++) {
+		pg_root_ent_encode(&re[i], add[i], key - payload);
+		memcpy(key, add[i]->key.data, add[i]->key.len);
+		key += add[i]->key.len;
+	}
+
+	hdr->len = htole32(len);
+	hdr->n_del = htole32(n_del);
+	hdr->n_add = htole32(n_add);
+	hdr->crc = htole32(pg_crc32c(0, payload, len));
+	hdr->hdr_crc = htole32(pg_crc32c(0, hdr,
+				offsetof(struct pgdb_manifest_hdr, hdr_crc)));
+
+	bool rc = false;
+
+	if (table->manifest_fd < 0) {
+		size_t fn_len = strlen(db->pathname) + 64 + 2;
+		char *fn = alloca(fn_len);
+		manifest_name(db, root_id, fn, fn_len);
+
+		int flags = O_WRONLY | O_CREAT | O_APPEND;
+		if (create)
+			flags |= O_TRUNC;
+
+		table->manifest_fd = open(fn, flags, 0666);
+		if (table->manifest_fd < 0) {
+			*errptr = strdup(strerror(errno));
+			goto out;
+		}
+	}
+
+	// the pagefiles added, and a new manifest, must be found once it is
+	if (!pg_sync_dir(db, errptr))
+		goto out;
+
+	ssize_t bwrite = write(table->manifest_fd, buf, buf_len);
+	if (bwrite != buf_len) {
+		*errptr = strdup((bwrite < 0) ? strerror(errno) :
+				 "short manifest write");
+		goto out;
+	}
+
+	if (fdatasync(table->manifest_fd) < 0) {
+		*errptr = strdup(strerror(errno));
+		goto out;
+	}
+
+	table->manifest_len += buf_len;
+	rc = true;
+
+out:
+	// take back what may have been written; no more appends, either way
+	if (!rc) {
+		if (table->manifest_fd >= 0)
+			ftruncate(table->manifest_fd, table->manifest_len);
+		table->manifest_broken = true;
+	}
+	free(buf);
+	return rc;
+}
+
+void pg_manifest_close(struct pgdb_table_t *table)
+{
+	if (table->manifest_fd >= 0)
+		close(table->manifest_fd);
+	table->manifest_fd = -1;
+}
+
+/*
+ * A checkpoint replaced root old_root_id, and the superblock now names
+ * the new one: drop the old root's manifest, and start afresh.
+ */
+void pg_manifest_reset(struct pgdb_table_t *table, uint64_t old_root_id)
+{
+	pg_manifest_close(table);
+	pg_manifest_remove(table->db, old_root_id);
+
+	table->manifest_len = 0;
+	table->manifest_broken = false;
+}
+
+bool pg_manifest_remove(pgdb_t *db, uint64_t root_id)
+{
+	size_t fn_len = strlen(db->pathname) + 64 + 2;
+	char *fn = alloca(fn_len);
+	manifest_name(db, root_id, fn, fn_len);
+
+	return unlink(fn) == 0;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE		// O_DIRECT
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -15,8 +16,16 @@ void pgmap_free(struct pgdb_map *map)
 	if (!map)
 		return;
 
-	if (map->mem)
+	if (map->pool) {
+		// freed memory stays locked, unlike unmapped
+		if (map->locked)
+			munlock(map->mem, map->st.st_size);
+		free(map->mem);
+		__atomic_sub_fetch(&map->pool->used, map->st.st_size,
+				   __ATOMIC_RELAXED);
+	} else if (map->mem) {
 		munmap(map->mem, map->st.st_size);
+	}
 
 	if (map->fd >= 0)
 		close(map->fd);
@@ -70,3 +79,214 @@ err_out_errno:
 	
 }
 
+// take len bytes of pool, if it has room for them
+static bool pool_reserve(struct pgdb_pool *pool, size_t len)
+{
+	size_t used = __atomic_load_n(&pool->used, __ATOMIC_RELAXED);
+
+	do {
+		if (pool->capacity && (used + len) > pool->capacity)
+			return false;
+	} while (!__atomic_compare_exchange_n(&pool->used, &used, used + len,
+					      true, __ATOMIC_RELAXED,
+					      __ATOMIC_RELAXED));
+
+	return true;
+}
+
+/*
+ * Read a file whole into memory of our own, taken from pool, rather
+ * than map it: nothing faults later, and what it costs is ours to
+ * count and to give back.  The memory is held of the pool from the
+ * read until pgmap_free(), whoever still holds the file, so the pool
+ * never holds more than its capacity; a file it has no room for is
+ * mapped instead, as pgmap_open() does.  With direct set the page
+ * cache is bypassed, where the filesystem allows; where it does not,
+ * the file is read as usual.  The result is used as a mapping is, but
+ * keeps no file descriptor.
+ */
+struct pgdb_map *pgmap_read(const char *pathname, bool direct,
+			    struct pgdb_pool *pool, char **errptr)
+{
+	struct pgdb_map *map = calloc(1, sizeof(struct pgdb_map));
+	if (!map) {
+		*errptr = strdup("OOM");
+		return NULL;
+	}
+
+	map->fd = -1;
+	map->pathname = strdup(pathname);
+	if (!map->pathname) {
+		*errptr = strdup("OOM");
+		goto err_out;
+	}
+
+	int fd = open(pathname, O_RDONLY | (direct ? O_DIRECT : 0));
+	if (fd < 0 && direct && errno == EINVAL) {
+		direct = false;
+		fd = open(pathname, O_RDONLY);
+	}
+	if (fd < 0)
+		goto err_out_errno;
+
+	if (fstat(fd, &map->st) < 0)
+		goto err_out_errno_fd;
+
+	if (map->st.st_size < sizeof(struct pgdb_file_header)) {
+		*errptr = strdup("File too small for header");
+		goto err_out_fd;
+	}
+
+	size_t len = map->st.st_size;
+	if (!pool_reserve(pool, len)) {
+		close(fd);
+		pgmap_free(map);
+		return pgmap_open(pathname, errptr);
+	}
+	map->pool = pool;
+
+	// O_DIRECT reads whole aligned blocks, into aligned memory
+	size_t alloc_len = (len + PGDB_DIRECT_ALIGN - 1) &
+			   ~((size_t) PGDB_DIRECT_ALIGN - 1);
+	if (posix_memalign(&map->mem, PGDB_DIRECT_ALIGN, alloc_len)) {
+		map->mem = NULL;
+		*errptr = strdup("OOM");
+		goto err_out_fd;
+	}
+
+	size_t done = 0;
+	while (done < len) {
+		ssize_t n = pread(fd, map->mem + done, alloc_len - done, done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && direct && errno == EINVAL) {
+			// stricter alignment than ours; read through the cache
+			direct = false;
+			fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+			continue;
+		}
+		if (n < 0)
+			goto err_out_errno_fd;
+		if (n == 0) {
+			*errptr = strdup("File shorter than its size");
+			goto err_out_fd;
+		}
+		done += n;
+	}
+
+	close(fd);
+	return map;
+
+err_out_errno_fd:
+	*errptr = strdup(strerror(errno));
+err_out_fd:
+	close(fd);
+err_out:
+	pgmap_free(map);
+	return NULL;
+
+err_out_errno:
+	*errptr = strdup(strerror(errno));
+	goto err_out;
+}
+
+// an madvise(2) hint for the whole mapping; failure is harmless
+void pgmap_advise(struct pgdb_map *map, int advice)
+{
+	// nothing to hint of memory we read ourselves
+	if (map->pool)
+		return;
+
+	madvise(map->mem, map->st.st_size, advice);
+}
+
+// [offset, offset + len) of map, widened to whole pages, cut to its end
+static bool map_range(struct pgdb_map *map, uint64_t offset, uint64_t len,
+		      void **start, size_t *range_len)
+{
+	uint64_t page = sysconf(_SC_PAGESIZE);
+	uint64_t end = offset + len;
+
+	if (end > map->st.st_size)
+		end = map->st.st_size;
+	if (offset >= end)
+		return false;
+
+	offset &= ~(page - 1);
+	*start = map->mem + offset;
+	*range_len = end - offset;
+	return true;
+}
+
+// start reading [offset, offset + len) in; failure is harmless
+void pgmap_prefetch(struct pgdb_map *map, uint64_t offset, uint64_t len)
+{
+	void *start;
+	size_t range_len;
+
+	if (!map->pool && map_range(map, offset, len, &start, &range_len))
+		madvise(start, range_len, MADV_WILLNEED);
+}
+
+// fault [offset, offset + len) in now, so that lookups will not
+void pgmap_populate(struct pgdb_map *map, uint64_t offset, uint64_t len)
+{
+	uint64_t page = sysconf(_SC_PAGESIZE);
+	void *start;
+	size_t range_len, i;
+
+	if (map->pool || !map_range(map, offset, len, &start, &range_len))
+		return;
+
+	for (i = 0; i < range_len; i += page)
+		(void) *(volatile const char *) (start + i);
+}
+
+// keep [offset, offset + len) resident for as long as map is
+bool pgmap_lock(struct pgdb_map *map, uint64_t offset, uint64_t len,
+		char **errptr)
+{
+	void *start;
+	size_t range_len;
+
+	if (!map_range(map, offset, len, &start, &range_len))
+		return true;
+
+	if (mlock(start, range_len) < 0) {
+		*errptr = strdup(strerror(errno));
+		return false;
+	}
+
+	map->locked = true;
+	return true;
+}
+
+// a private, writable mapping of size zeroed bytes, backed by no file
+struct pgdb_map *pgmap_anon(size_t size, char **errptr)
+{
+	struct pgdb_map *map = calloc(1, sizeof(struct pgdb_map));
+	if (!map) {
+		*errptr = strdup("OOM");
+		return NULL;
+	}
+
+	map->fd = -1;
+	map->st.st_size = size;
+
+	map->mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map->mem == MAP_FAILED) {
+		map->mem = NULL;
+		*errptr = strdup(strerror(errno));
+		pgmap_free(map);
+		return NULL;
+	}
+
+	return map;
+}
+
+// make an anonymous mapping read-only, once filled; failure is harmless
+void pgmap_seal(struct pgdb_map *map)
+{
+	mprotect(map->mem, map->st.st_size, PROT_READ);
+}
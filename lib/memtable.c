@@ -0,0 +1,391 @@
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "pgdb-internal.h"
+
+/*
+ * In-memory write buffer: an arena-backed skiplist ordered by key
+ * ascending, then sequence number descending, so the newest version of
+ * a key is met first.  Deletes are stored as tombstone records.
+ *
+ * One writer at a time inserts (the caller serializes writers), while
+ * any number of readers traverse without locks: a node is fully built
+ * before a release-store links it in, and readers follow links with
+ * acquire loads.  Nodes are never removed; the whole memtable is freed
+ * once its last reference is dropped.
+ */
+
+enum {
+	MT_ARENA_BLOCK		= 64 * 1024,
+	MT_BRANCHING		= 4,
+};
+
+struct mt_arena_blk {
+	struct mt_arena_blk	*next;
+	char			data[];
+};
+
+static void *arena_alloc(struct pgdb_memtable *mt, size_t bytes)
+{
+	bytes = (bytes + 7) & ~(size_t) 7;
+
+	if (bytes > mt->arena_left) {
+		// large records get a block of their own, keeping the
+		// remainder of the current block for later small ones
+		size_t blk_len = (bytes > (MT_ARENA_BLOCK / 4)) ?
+				 bytes : MT_ARENA_BLOCK;
+
+		struct mt_arena_blk *blk = malloc(sizeof(*blk) + blk_len);
+		if (!blk)
+			return NULL;
+
+		blk->next = mt->arena;
+		mt->arena = blk;
+
+		if (blk_len != MT_ARENA_BLOCK) {
+			mt->mem_usage += bytes;
+			return blk->data;
+		}
+
+		mt->arena_cur = blk->data;
+		mt->arena_left = blk_len;
+	}
+
+	void *p = mt->arena_cur;
+	mt->arena_cur += bytes;
+	mt->arena_left -= bytes;
+	mt->mem_usage += bytes;
+	return p;
+}
+
+static inline struct pgdb_mt_node *node_next(struct pgdb_mt_node *n,
+					     unsigned int level)
+{
+	return __atomic_load_n(&n->next[level], __ATOMIC_ACQUIRE);
+}
+
+static inline int node_cmp(struct pgdb_mt_node *n, const void *key,
+			   size_t klen, uint64_t seq)
+{
+	int cmp = pg_key_cmp(pg_mt_key(n), n->k_len, key, klen);
+	if (cmp)
+		return cmp;
+	if (n->seq == seq)
+		return 0;
+	return (n->seq > seq) ? -1 : 1;
+}
+
+/*
+ * Return the first node at or after (key, seq), optionally recording
+ * the rightmost node before it at each level in prev[].
+ */
+static struct pgdb_mt_node *find_ge(struct pgdb_memtable *mt,
+				    const void *key, size_t klen, uint64_t seq,
+				    struct pgdb_mt_node **prev)
+{
+	struct pgdb_mt_node *x = mt->head;
+	int level = __atomic_load_n(&mt->height, __ATOMIC_RELAXED) - 1;
+
+	while (1) {
+		struct pgdb_mt_node *next = node_next(x, level);
+		if (next && node_cmp(next, key, klen, seq) < 0) {
+			x = next;
+			continue;
+		}
+
+		if (prev)
+			prev[level] = x;
+		if (level == 0)
+			return next;
+		level--;
+	}
+}
+
+// last node strictly before key (any sequence); head if none
+static struct pgdb_mt_node *find_lt(struct pgdb_memtable *mt,
+				    const void *key, size_t klen)
+{
+	struct pgdb_mt_node *x = mt->head;
+	int level = __atomic_load_n(&mt->height, __ATOMIC_RELAXED) - 1;
+
+	while (1) {
+		struct pgdb_mt_node *next = node_next(x, level);
+		if (next && node_cmp(next, key, klen, UINT64_MAX) < 0) {
+			x = next;
+			continue;
+		}
+
+		if (level == 0)
+			return x;
+		level--;
+	}
+}
+
+static unsigned int random_height(struct pgdb_memtable *mt)
+{
+	unsigned int height = 1;
+
+	while (height < PGDB_MT_MAX_HEIGHT) {
+		// xorshift32
+		uint32_t x = mt->rng;
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		mt->rng = x;
+
+		if (x % MT_BRANCHING)
+			break;
+		height++;
+	}
+
+	return height;
+}
+
+static struct pgdb_mt_node *node_new(struct pgdb_memtable *mt,
+				     unsigned int height, size_t extra)
+{
+	struct pgdb_mt_node *n = arena_alloc(mt, sizeof(*n) +
+				 (height * sizeof(struct pgdb_mt_node *)) +
+				 extra);
+	if (!n)
+		return NULL;
+
+	memset(n, 0, sizeof(*n) + (height * sizeof(struct pgdb_mt_node *)));
+	n->height = height;
+	return n;
+}
+
+bool pg_memtable_add(struct pgdb_memtable *mt, uint64_t seq,
+		     enum pgdb_rec_type type,
+		     const void *key, size_t klen,
+		     const void *val, size_t vlen)
+{
+	struct pgdb_mt_node *prev[PGDB_MT_MAX_HEIGHT];
+
+	find_ge(mt, key, klen, seq, prev);
+
+	unsigned int height = random_height(mt);
+	struct pgdb_mt_node *n = node_new(mt, height, klen + vlen);
+	if (!n)
+		return false;
+
+	n->seq = seq;
+	n->k_len = klen;
+	n->v_len = vlen;
+	n->type = type;
+	memcpy((char *) pg_mt_key(n), key, klen);
+	if (vlen)
+		memcpy((char *) pg_mt_val(n), val, vlen);
+
+	unsigned int cur_height = mt->height;
+	if (height > cur_height) {
+		unsigned int i;
+		for (i = cur_height; i < height; i++)
+			prev[i] = mt->head;
+
+		// readers seeing the old height just skip the new levels
+		__atomic_store_n(&mt->height, height, __ATOMIC_RELAXED);
+	}
+
+	unsigned int i;
+	for (i = 0; i < height; i++) {
+		n->next[i] = prev[i]->next[i];
+		__atomic_store_n(&prev[i]->next[i], n, __ATOMIC_RELEASE);
+	}
+
+	mt->n_entries++;
+	return true;
+}
+
+/*
+ * Find the newest version of key visible at sequence seq.  On a put,
+ * *val and *vlen point at the value inside the memtable, valid for as
+ * long as the caller holds a reference.
+ */
+enum pgdb_mt_result pg_memtable_get(struct pgdb_memtable *mt,
+				    const void *key, size_t klen, uint64_t seq,
+				    const void **val, size_t *vlen)
+{
+	struct pgdb_mt_node *n = find_ge(mt, key, klen, seq, NULL);
+
+	if (!n || pg_key_cmp(pg_mt_key(n), n->k_len, key, klen))
+		return PGDB_MT_MISS;
+
+	if (n->type == PGDB_REC_DEL)
+		return PGDB_MT_DELETED;
+
+	*val = pg_mt_val(n);
+	*vlen = n->v_len;
+	return PGDB_MT_FOUND;
+}
+
+struct pgdb_mt_node *pg_memtable_first(struct pgdb_memtable *mt)
+{
+	return node_next(mt->head, 0);
+}
+
+struct pgdb_mt_node *pg_memtable_next(struct pgdb_mt_node *n)
+{
+	return node_next(n, 0);
+}
+
+// first node whose key is >= key
+struct pgdb_mt_node *pg_memtable_seek(struct pgdb_memtable *mt,
+				      const void *key, size_t klen)
+{
+	return find_ge(mt, key, klen, UINT64_MAX, NULL);
+}
+
+// newest node of the last key strictly before key, or NULL
+struct pgdb_mt_node *pg_memtable_seek_lt(struct pgdb_memtable *mt,
+					 const void *key, size_t klen)
+{
+	struct pgdb_mt_node *x = find_lt(mt, key, klen);
+	if (x == mt->head)
+		return NULL;
+
+	// x is the oldest version of its key; step back to the newest
+	return find_ge(mt, pg_mt_key(x), x->k_len, UINT64_MAX, NULL);
+}
+
+// newest node of the last key, or NULL
+struct pgdb_mt_node *pg_memtable_last(struct pgdb_memtable *mt)
+{
+	struct pgdb_mt_node *x = mt->head;
+	int level = __atomic_load_n(&mt->height, __ATOMIC_RELAXED) - 1;
+
+	while (level >= 0) {
+		struct pgdb_mt_node *next = node_next(x, level);
+		if (next)
+			x = next;
+		else
+			level--;
+	}
+
+	if (x == mt->head)
+		return NULL;
+
+	return find_ge(mt, pg_mt_key(x), x->k_len, UINT64_MAX, NULL);
+}
+
+static void memtable_free(struct pgdb_memtable *mt)
+{
+	struct mt_arena_blk *blk = mt->arena;
+	while (blk) {
+		struct mt_arena_blk *next = blk->next;
+		free(blk);
+		blk = next;
+	}
+
+	memset(mt, 0xff, sizeof(*mt));
+	free(mt);
+}
+
+void pg_memtable_unref(struct pgdb_memtable *mt)
+{
+	if (!mt)
+		return;
+
+	if (__atomic_sub_fetch(&mt->refcnt, 1, __ATOMIC_ACQ_REL) == 0)
+		memtable_free(mt);
+}
+
+void pg_memtable_ref(struct pgdb_memtable *mt)
+{
+	__atomic_add_fetch(&mt->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+static void memtable_pin_release(struct pgdb_pinned_t *pin)
+{
+	pg_memtable_unref(container_of(pin, struct pgdb_memtable, pin));
+}
+
+struct pgdb_memtable *pg_memtable_new(void)
+{
+	struct pgdb_memtable *mt = calloc(1, sizeof(*mt));
+	if (!mt)
+		return NULL;
+
+	mt->refcnt = 1;
+	mt->pin.release = memtable_pin_release;
+	mt->rng = 0xdeadbeef;
+	mt->height = 1;
+
+	mt->head = node_new(mt, PGDB_MT_MAX_HEIGHT, 0);
+	if (!mt->head) {
+		free(mt);
+		return NULL;
+	}
+
+	return mt;
+}
+
+/*
+ * A memset is an immutable list of a table's memtables, the mutable one
+ * first and then any full ones awaiting flush, newest first.  Readers
+ * use the current memset rather than each memtable; rotating the write
+ * buffer publishes a new memset, and retires the old one.
+ */
+
+void pg_memset_unref(struct pgdb_memset *ms)
+{
+	if (!ms)
+		return;
+
+	if (__atomic_sub_fetch(&ms->refcnt, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	unsigned int i;
+	for (i = 0; i < ms->n_mt; i++)
+		pg_memtable_unref(ms->mt[i]);
+
+	memset(ms, 0xff, sizeof(*ms));
+	free(ms);
+}
+
+void pg_memset_ref(struct pgdb_memset *ms)
+{
+	__atomic_add_fetch(&ms->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+static void memset_retired(struct pgdb_retired *node)
+{
+	pg_memset_unref(container_of(node, struct pgdb_memset, retired));
+}
+
+// drop the table's reference on ms, no longer published, after readers
+void pg_memset_retire(pgdb_t *db, struct pgdb_memset *ms)
+{
+	if (ms)
+		pg_epoch_retire(db->epoch, &ms->retired, memset_retired);
+}
+
+/*
+ * Return a new memset holding mt (if non-NULL) ahead of the first n
+ * memtables of old (if non-NULL).  Takes its own memtable references.
+ */
+struct pgdb_memset *pg_memset_new(struct pgdb_memtable *mt,
+				  const struct pgdb_memset *old,
+				  unsigned int n)
+{
+	struct pgdb_memset *ms = calloc(1, sizeof(*ms));
+	if (!ms)
+		return NULL;
+
+	ms->refcnt = 1;
+
+	if (mt) {
+		pg_memtable_ref(mt);
+		ms->mt[ms->n_mt++] = mt;
+	}
+
+	unsigned int i;
+	for (i = 0; old && i < n && i < old->n_mt &&
+		    ms->n_mt < PGDB_MAX_MEMTABLES; i++) {
+		pg_memtable_ref(old->mt[i]);
+		ms->mt[ms->n_mt++] = old->mt[i];
+	}
+
+	return ms;
+}
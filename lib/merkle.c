@@ -0,0 +1,227 @@
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <openssl/sha.h>
+#include <openssl/evp.h>
+
+#include "pgdb-internal.h"
+#include "adt.h"
+
+/*
+ * Chunked hash trees.
+ *
+ * A file is hashed in chunks of 1 << shift bytes, and the digests of
+ * its chunks stored with it, so any chunk can be checked on its own:
+ * all of a large file at once, spread over several threads, or each
+ * chunk only when first read.  Wrapped files (see util.c) hash their
+ * digest list once more into a top digest, which also covers their
+ * header; pagefiles keep theirs after the data.
+ */
+
+// digests of a byte stream, taken as it is written
+struct pgdb_merkle {
+	unsigned int		shift;
+	size_t			fill;		// bytes into the current chunk
+	EVP_MD_CTX		*ctx;
+	struct dstring		*digests;
+};
+
+struct merkle_span {
+	const unsigned char	*data;
+	size_t			len;
+	unsigned int		shift;
+	const unsigned char	*digests;
+	size_t			first;		// chunks [first, end)
+	size_t			end;
+	bool			*failed;	// shared by all spans
+	pthread_t		thread;
+};
+
+size_t pg_merkle_n_chunks(size_t len, unsigned int shift)
+{
+	return (len + (1UL << shift) - 1) >> shift;
+}
+
+struct pgdb_merkle *pg_merkle_new(unsigned int shift)
+{
+	struct pgdb_merkle *mk = calloc(1, sizeof(*mk));
+	if (!mk)
+		return NULL;
+
+	mk->shift = shift;
+	mk->digests = dstr_new(NULL, 0, 0);
+	mk->ctx = EVP_MD_CTX_new();
+	if (!mk->digests || !mk->ctx ||
+	    !EVP_DigestInit_ex(mk->ctx, EVP_sha256(), NULL)) {
+		pg_merkle_free(mk);
+		return NULL;
+	}
+
+	return mk;
+}
+
+void pg_merkle_free(struct pgdb_merkle *mk)
+{
+	if (!mk)
+		return;
+
+	dstr_free(mk->digests);
+	EVP_MD_CTX_free(mk->ctx);
+
+	memset(mk, 0xff, sizeof(*mk));
+	free(mk);
+}
+
+static bool merkle_chunk_done(struct pgdb_merkle *mk)
+{
+	unsigned char *md = dstr_extend(mk->digests, SHA256_DIGEST_LENGTH);
+	if (!md)
+		return false;
+
+	mk->fill = 0;
+
+	return EVP_DigestFinal_ex(mk->ctx, md, NULL) &&
+	       EVP_DigestInit_ex(mk->ctx, EVP_sha256(), NULL);
+}
+
+// digest data[0..len), the bytes following those already added
+bool pg_merkle_update(struct pgdb_merkle *mk, const void *data, size_t len)
+{
+	size_t chunk_sz = 1UL << mk->shift;
+	const unsigned char *p = data;
+
+	while (len) {
+		size_t n = chunk_sz - mk->fill;
+		if (n > len)
+			n = len;
+
+		if (!EVP_DigestUpdate(mk->ctx, p, n))
+			return false;
+		p += n;
+		len -= n;
+		mk->fill += n;
+
+		if (mk->fill == chunk_sz && !merkle_chunk_done(mk))
+			return false;
+	}
+
+	return true;
+}
+
+// digest the last, partial chunk; mk->digests then lists them all
+bool pg_merkle_final(struct pgdb_merkle *mk)
+{
+	return !mk->fill || merkle_chunk_done(mk);
+}
+
+const unsigned char *pg_merkle_digests(const struct pgdb_merkle *mk,
+				       size_t *len)
+{
+	*len = mk->digests->len;
+	return (const unsigned char *) mk->digests->s;
+}
+
+/*
+ * The top digest of a wrapped file: sha256 of its header, then of its
+ * chunk digests.
+ */
+bool pg_merkle_top(unsigned char *md, const void *hdr, size_t hdr_len,
+		   const unsigned char *digests, size_t digests_len)
+{
+	EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+
+	bool rc = ctx && EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) &&
+		  EVP_DigestUpdate(ctx, hdr, hdr_len) &&
+		  EVP_DigestUpdate(ctx, digests, digests_len) &&
+		  EVP_DigestFinal_ex(ctx, md, NULL);
+
+	EVP_MD_CTX_free(ctx);
+	return rc;
+}
+
+// does chunk i of data[0..len) match its digest?
+bool pg_merkle_chunk_ok(const void *data, size_t len, unsigned int shift,
+			const unsigned char *digests, size_t i)
+{
+	size_t offset = i << shift;
+	size_t n = len - offset;
+	if (n > (1UL << shift))
+		n = 1UL << shift;
+
+	unsigned char md[SHA256_DIGEST_LENGTH];
+
+	SHA256((const unsigned char *) data + offset, n, md);
+	return !memcmp(md, digests + (i * SHA256_DIGEST_LENGTH), sizeof(md));
+}
+
+static void *merkle_span_verify(void *arg)
+{
+	struct merkle_span *span = arg;
+	size_t i;
+
+	for (i = span->first; i < span->end; i++) {
+		if (__atomic_load_n(span->failed, __ATOMIC_RELAXED))
+			break;
+		if (!pg_merkle_chunk_ok(span->data, span->len, span->shift,
+					span->digests, i)) {
+			__atomic_store_n(span->failed, true, __ATOMIC_RELAXED);
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Check every chunk of data[0..len) against digests[].  Large inputs
+ * are split into contiguous spans, checked by as many threads as there
+ * are CPUs, up to PGDB_MERKLE_THREADS; the caller takes the first span.
+ */
+bool pg_merkle_verify(const void *data, size_t len, unsigned int shift,
+		      const unsigned char *digests)
+{
+	size_t n_chunks = pg_merkle_n_chunks(len, shift);
+	bool failed = false;
+
+	size_t n_spans = n_chunks / PGDB_MERKLE_SPAN_MIN;
+	long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n_cpus > 0 && n_spans > (size_t) n_cpus)
+		n_spans = n_cpus;
+	if (n_spans > PGDB_MERKLE_THREADS)
+		n_spans = PGDB_MERKLE_THREADS;
+	if (!n_spans)
+		n_spans = 1;
+
+	struct merkle_span spans[PGDB_MERKLE_THREADS];
+	bool started[PGDB_MERKLE_THREADS];
+	size_t i;
+
+	for (i = 0; i < n_spans; i++) {
+		struct merkle_span *span = &spans[i];
+
+		span->data = data;
+		span->len = len;
+		span->shift = shift;
+		span->digests = digests;
+		span->first = (n_chunks * i) / n_spans;
+		span->end = (n_chunks * (i + 1)) / n_spans;
+		span->failed = &failed;
+
+		// no thread to spare: check the span here, later
+		started[i] = (i > 0) &&
+			     !pthread_create(&span->thread, NULL,
+					     merkle_span_verify, span);
+	}
+
+	for (i = 0; i < n_spans; i++)
+		if (!started[i])
+			merkle_span_verify(&spans[i]);
+
+	for (i = 1; i < n_spans; i++)
+		if (started[i])
+			pthread_join(spans[i].thread, NULL);
+
+	return !failed;
+}
@@ -16,31 +16,43 @@
 
 #include "pgdb-internal.h"
 
-static void pgdb_table_free(struct pgdb_table *table)
-{
-	free(table->name);
-	table->name = NULL;
-
-	if (table->root) {
-		pgcodec__root_idx__free_unpacked(table->root, NULL);
-		table->root = NULL;
-	}
-}
-
 static void __pgdb_free(pgdb_t *db)
 {
 	if (!db)
 		return;
 
+	pg_bg_stop(db);
+
+	// what retired still refers to the tables
+	pg_epoch_drain(db->epoch);
+
 	unsigned int i;
 	for (i = 0; i < db->n_tables; i++)
-		pgdb_table_free(&db->tables[i]);
+		pg_table_free(db->tables[i]);
+
+	// closing the tables' pagefiles retires them too
+	pg_epoch_free(db->epoch);
+
+	// a shared cache may keep our blocks; they age out
+	if (db->own_cache)
+		pgdb_cache_destroy(db->cache);
+
+	pg_wal_close(db);
 
 	free(db->pathname);
 
 	if (db->superblock)
 		pgcodec__superblock__free_unpacked(db->superblock, NULL);
 
+	free(db->bg_error);
+
+	pthread_cond_destroy(&db->idle_cv);
+	pthread_cond_destroy(&db->compact_cv);
+	pthread_cond_destroy(&db->bg_cv);
+	pthread_mutex_destroy(&db->compact_lock);
+	pthread_mutex_destroy(&db->root_lock);
+	pthread_mutex_destroy(&db->lock);
+
 	memset(db, 0xff, sizeof(*db));
 	free(db);
 }
@@ -86,10 +98,12 @@ static bool pg_create_db(pgdb_t *db, char **errptr)
 	pg_uuid_str(tab_uuid_s, tab_uuid);
 
 	// generate initial master table
-	PGcodec__TableMeta table;
+	PGcodec__TableMeta table = PGCODEC__TABLE_META__INIT;
 	table.name = "master";
 	table.uuid = tab_uuid_s;
 	table.root_id = 0;
+	table.has_table_id = 1;
+	table.table_id = 0;
 	PGcodec__TableMeta *tables[1] = { &table };
 
 	// generate root superblock UUID
@@ -103,9 +117,11 @@ static bool pg_create_db(pgdb_t *db, char **errptr)
 	sb.uuid = sb_uuid_s;
 	sb.n_tables = 1;
 	sb.tables = tables;
+	sb.has_next_table_id = 1;
+	sb.next_table_id = 1;
 
 	// create database directory
-	if (mkdir(db->pathname, 0666) < 0) {
+	if (mkdir(db->pathname, 0777) < 0) {
 		*errptr = strdup(strerror(errno));
 		return false;
 	}
@@ -127,14 +143,15 @@ struct id_scan_info {
 
 static bool id_scan_iter(const struct dirent *de, void *priv, char **errptr)
 {
-	unsigned int i;
-
-	// only examine all-digit names
-	for (i = 0; i < strlen(de->d_name); i++)
-		if (!isdigit(de->d_name[i]))
-			return true;		// continue dir iteration
+	// only examine all-digit names, logs and manifests
+	if (!isdigit(de->d_name[0]))
+		return true;		// continue dir iteration
 
-	unsigned long long ll = strtoull(de->d_name, NULL, 10);
+	char *suffix;
+	unsigned long long ll = strtoull(de->d_name, &suffix, 10);
+	if (*suffix && strcmp(suffix, PGDB_LOG_SUFFIX) &&
+	    strcmp(suffix, PGDB_MANIFEST_SUFFIX))
+		return true;		// continue dir iteration
 
 	struct id_scan_info *isi = priv;
 	if (ll > isi->file_id)
@@ -155,7 +172,85 @@ static bool pg_scan_file_ids(pgdb_t *db, char **errptr)
 	return true;
 }
 
-static PGcodec__TableMeta *find_tablemeta(PGcodec__Superblock *sb,
+struct orphan_scan_info {
+	pgdb_t			*db;
+	uint64_t		*live;		// sorted
+	size_t			n_live;
+};
+
+static int cmp_u64(const void *a_, const void *b_)
+{
+	const uint64_t *a = a_, *b = b_;
+
+	if (*a == *b)
+		return 0;
+	return (*a < *b) ? -1 : 1;
+}
+
+static bool orphan_scan_iter(const struct dirent *de, void *priv,
+			     char **errptr)
+{
+	// only examine all-digit names, and manifests; logs are handled
+	// by the WAL
+	if (!isdigit(de->d_name[0]))
+		return true;		// continue dir iteration
+
+	char *suffix;
+	uint64_t file_id = strtoull(de->d_name, &suffix, 10);
+	bool manifest = !strcmp(suffix, PGDB_MANIFEST_SUFFIX);
+	if (*suffix && !manifest)
+		return true;		// continue dir iteration
+
+	struct orphan_scan_info *osi = priv;
+	if (bsearch(&file_id, osi->live, osi->n_live, sizeof(uint64_t),
+		    cmp_u64))
+		return true;		// continue dir iteration
+
+	if (manifest)
+		pg_manifest_remove(osi->db, file_id);
+	else
+		pg_remove_file(osi->db, file_id);
+
+	return true;		// continue dir iteration
+}
+
+/*
+ * Remove pagefiles, roots and manifests that no table's root refers
+ * to: the output of a flush or compaction cut short by a crash, or
+ * superseded files not yet deleted.
+ */
+static bool pg_remove_orphans(pgdb_t *db, char **errptr)
+{
+	size_t n_live = 0;
+	unsigned int i;
+	for (i = 0; i < db->n_tables; i++)
+		n_live += db->tables[i]->rootgen->root->n_entries + 1;
+
+	struct orphan_scan_info osi = { db, NULL, 0 };
+	osi.live = malloc(n_live * sizeof(uint64_t));
+	if (!osi.live) {
+		*errptr = strdup("OOM");	// irony, but recoverable
+		return false;
+	}
+
+	for (i = 0; i < db->n_tables; i++) {
+		struct pgdb_rootgen *rg = db->tables[i]->rootgen;
+		size_t j;
+
+		osi.live[osi.n_live++] = rg->root_id;
+		for (j = 0; j < rg->root->n_entries; j++)
+			osi.live[osi.n_live++] = rg->root->entries[j]->file_id;
+	}
+
+	qsort(osi.live, osi.n_live, sizeof(uint64_t), cmp_u64);
+
+	bool rc = pg_iterate_dir(db->pathname, orphan_scan_iter, &osi, errptr);
+
+	free(osi.live);
+	return rc;
+}
+
+PGcodec__TableMeta *pg_find_tablemeta(PGcodec__Superblock *sb,
 				      const char *tbl_name)
 {
 	unsigned int i;
@@ -168,37 +263,26 @@ static PGcodec__TableMeta *find_tablemeta(PGcodec__Superblock *sb,
 	return NULL;
 }
 
-static int pg_open_table(pgdb_t *db, const char *tbl_name, char **errptr)
+// master first, at slot 0
+static bool pg_open_tables(pgdb_t *db, char **errptr)
 {
-	if (db->n_tables >= PGDB_MAX_TABLES) {
-		*errptr = strdup("table limit reached");
-		return -1;
-	}
-
-	struct pgdb_table *table = &db->tables[db->n_tables];
-	memset(table, 0, sizeof(*table));
-
-	PGcodec__TableMeta *tm = find_tablemeta(db->superblock, tbl_name);
-	if (!tm) {
+	PGcodec__Superblock *sb = db->superblock;
+	PGcodec__TableMeta *master = pg_find_tablemeta(sb, "master");
+	if (!master) {
 		*errptr = strdup("table not found");
-		return -1;
+		return false;
 	}
 
-	if (!pg_read_root(db, &table->root, tm->root_id, errptr))
-		return -1;
-	
-	table->root_id = tm->root_id;
-	table->name = strdup(tm->name);
-	if (!table->name) {
-		pgcodec__root_idx__free_unpacked(table->root, NULL);
-		memset(table, 0, sizeof(*table));
-		*errptr = strdup("OOM");	// irony, but recoverable
-		return -1;
-	}
+	if (!pg_table_open(db, master, errptr))
+		return false;
+
+	unsigned int i;
+	for (i = 0; i < sb->n_tables; i++)
+		if (sb->tables[i] != master &&
+		    !pg_table_open(db, sb->tables[i], errptr))
+			return false;
 
-	int slot = db->n_tables;
-	db->n_tables++;
-	return slot;
+	return true;
 }
 
 pgdb_t* pgdb_open(
@@ -235,13 +319,36 @@ pgdb_t* pgdb_open(
 		goto oom;
 
 	db->opt = options;
+	db->log_fd = -1;
+	pthread_mutex_init(&db->lock, NULL);
+	pthread_mutex_init(&db->root_lock, NULL);
+	pthread_mutex_init(&db->compact_lock, NULL);
+	pthread_cond_init(&db->bg_cv, NULL);
+	pthread_cond_init(&db->compact_cv, NULL);
+	pthread_cond_init(&db->idle_cv, NULL);
 
 	db->pathname = strdup(name);
-	if (!db->pathname) {
+	db->epoch = pg_epoch_new();
+	if (!db->pathname || !db->epoch) {
 		*errptr = strdup("OOM");	// irony, but recoverable
 		goto err_out;
 	}
 
+	// mapped pagefiles take none of the pool
+	if (options->io != PGDB_IO_MMAP)
+		db->pool.capacity = options->read_pool_size;
+
+	db->cache_id = pg_cache_new_id();
+	db->cache = options->cache;
+	if (!db->cache) {
+		db->cache = pgdb_cache_create_lru(PGDB_DEF_CACHE_SIZE);
+		db->own_cache = true;
+		if (!db->cache) {
+			*errptr = strdup("OOM");	// irony, but recoverable
+			goto err_out;
+		}
+	}
+
 	if (create && !pg_create_db(db, errptr))
 		goto err_out;
 
@@ -251,11 +358,25 @@ pgdb_t* pgdb_open(
 	if (!pg_scan_file_ids(db, errptr))
 		goto err_out;
 
-	int slot = pg_open_table(db, "master", errptr);
-	if (slot < 0)
+	if (!pg_open_tables(db, errptr))
 		goto err_out;
 
-	assert(slot == 0);
+	if (!options->readonly && !pg_remove_orphans(db, errptr))
+		goto err_out;
+
+	if (!pg_wal_recover(db, errptr))
+		goto err_out;
+
+	// best effort: a database that cannot be warmed up still opens
+	if (options->warmup != PGDB_WARMUP_NONE) {
+		char *err = NULL;
+		pg_warmup(db, options->warmup == PGDB_WARMUP_LOCK, NULL, NULL,
+			  &err);
+		free(err);
+	}
+
+	if (!options->readonly && !pg_bg_start(db, errptr))
+		goto err_out;
 
 	return db;
 
@@ -1,6 +1,30 @@
 
+#include <stdlib.h>
+
 #include "pgdb-internal.h"
 
+pgdb_options_t* pgdb_options_create(void)
+{
+	pgdb_options_t *opt = calloc(1, sizeof(*opt));
+	if (!opt)
+		return NULL;
+
+	opt->restart_interval = PGDB_DEF_RESTART_INTERVAL;
+	opt->max_open_files = PGDB_DEF_MAX_OPEN_FILES;
+	opt->write_buffer_size = PGDB_DEF_WRITE_BUFFER;
+	opt->max_file_size = PGDB_DEF_MAX_FILE_SIZE;
+	opt->csum_type = PGDB_CSUM_CRC32C;
+	opt->compression = PGDB_COMP_NONE;
+	opt->block_size = PGDB_DEF_BLOCK_SIZE;
+
+	return opt;
+}
+
+void pgdb_options_destroy(pgdb_options_t* opt)
+{
+	free(opt);
+}
+
 void pgdb_options_set_create_if_missing(
     pgdb_options_t* opt, bool yn)
 {
@@ -13,3 +37,161 @@ void pgdb_options_set_error_if_exists(
 	opt->error_if_exists = yn;
 }
 
+
+void pgdb_options_set_block_restart_interval(pgdb_options_t* opt, int interval)
+{
+	opt->restart_interval = (interval > 0) ? interval : 0;
+}
+
+void pgdb_options_set_max_open_files(pgdb_options_t* opt, int mof)
+{
+	opt->max_open_files = (mof > 0) ? mof : 1;
+}
+
+void pgdb_options_set_filter_policy(
+    pgdb_options_t* opt,
+    pgdb_filterpolicy_t* fp)
+{
+	opt->filter_policy = fp;
+}
+
+void pgdb_options_set_write_buffer_size(pgdb_options_t* opt, size_t sz)
+{
+	opt->write_buffer_size = sz;
+}
+
+void pgdb_options_set_max_file_size(pgdb_options_t* opt, size_t sz)
+{
+	opt->max_file_size = sz;
+}
+
+void pgdb_options_set_checksum(pgdb_options_t* opt, int type)
+{
+	opt->csum_type = (type == pgdb_sha256_checksum) ? PGDB_CSUM_SHA256 :
+							  PGDB_CSUM_CRC32C;
+}
+
+void pgdb_options_set_bytes_per_sync(pgdb_options_t* opt, size_t bytes)
+{
+	opt->bytes_per_sync = bytes;
+}
+
+// shared by every database opened with opt, which must close before it
+void pgdb_options_set_cache(pgdb_options_t* opt, pgdb_cache_t* cache)
+{
+	opt->cache = cache;
+}
+
+void pgdb_options_set_block_size(pgdb_options_t* opt, size_t blksz)
+{
+	opt->block_size = blksz ? blksz : PGDB_DEF_BLOCK_SIZE;
+}
+
+void pgdb_options_set_io(pgdb_options_t* opt, int io)
+{
+	opt->io = (io == pgdb_direct_io) ? PGDB_IO_DIRECT :
+		  (io == pgdb_read_io) ? PGDB_IO_READ : PGDB_IO_MMAP;
+}
+
+void pgdb_options_set_read_pool_size(pgdb_options_t* opt, size_t sz)
+{
+	opt->read_pool_size = sz;
+}
+
+void pgdb_options_set_warmup(pgdb_options_t* opt, int warmup)
+{
+	opt->warmup = (warmup == pgdb_lock_warmup) ? PGDB_WARMUP_LOCK :
+		      (warmup == pgdb_prefetch_warmup) ? PGDB_WARMUP_PREFETCH :
+		      PGDB_WARMUP_NONE;
+}
+
+void pgdb_options_set_compression(pgdb_options_t* opt, int comp)
+{
+	opt->compression = (comp == pgdb_snappy_compression) ?
+			   PGDB_COMP_SNAPPY : PGDB_COMP_NONE;
+}
+
+pgdb_tableoptions_t* pgdb_tableoptions_create(void)
+{
+	return calloc(1, sizeof(pgdb_tableoptions_t));
+}
+
+void pgdb_tableoptions_destroy(pgdb_tableoptions_t* to)
+{
+	free(to);
+}
+
+void pgdb_tableoptions_set_write_buffer_size(pgdb_tableoptions_t* to,
+					     size_t sz)
+{
+	to->write_buffer_size = sz;
+}
+
+void pgdb_tableoptions_set_max_file_size(pgdb_tableoptions_t* to, size_t sz)
+{
+	to->max_file_size = sz;
+}
+
+void pgdb_tableoptions_set_max_open_files(pgdb_tableoptions_t* to, int mof)
+{
+	to->max_open_files = (mof > 0) ? mof : 0;
+}
+
+void pgdb_tableoptions_set_compaction_trigger(pgdb_tableoptions_t* to,
+					      int runs)
+{
+	// merging fewer than two runs gains nothing
+	to->compact_trigger = (runs > 0) ? ((runs < 2) ? 2 : runs) : 0;
+}
+
+pgdb_writeoptions_t* pgdb_writeoptions_create(void)
+{
+	return calloc(1, sizeof(pgdb_writeoptions_t));
+}
+
+void pgdb_writeoptions_destroy(pgdb_writeoptions_t* wo)
+{
+	free(wo);
+}
+
+void pgdb_writeoptions_set_sync(
+    pgdb_writeoptions_t* wo, unsigned char yn)
+{
+	wo->sync = yn;
+}
+
+pgdb_readoptions_t* pgdb_readoptions_create(void)
+{
+	pgdb_readoptions_t *ro = calloc(1, sizeof(*ro));
+	if (!ro)
+		return NULL;
+
+	ro->fill_cache = true;
+
+	return ro;
+}
+
+void pgdb_readoptions_destroy(pgdb_readoptions_t* ro)
+{
+	free(ro);
+}
+
+void pgdb_readoptions_set_verify_checksums(
+    pgdb_readoptions_t* ro,
+    unsigned char yn)
+{
+	ro->verify_checksums = yn;
+}
+
+void pgdb_readoptions_set_fill_cache(
+    pgdb_readoptions_t* ro, unsigned char yn)
+{
+	ro->fill_cache = yn;
+}
+
+void pgdb_readoptions_set_snapshot(
+    pgdb_readoptions_t* ro,
+    const pgdb_snapshot_t* snap)
+{
+	ro->snapshot = snap;
+}
@@ -0,0 +1,452 @@
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <alloca.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <openssl/sha.h>
+
+#include "pgdb-internal.h"
+
+/*
+ * Pagefile writer.
+ *
+ * Records are added in strictly ascending key order, and buffered until
+ * the next one would take the pagefile past the table's max_file_size.
+ * The pagefile is then written out front to back, laid out as
+ *
+ *	pgdb_page_hdr
+ *	pgdb_page_index[n_entries]
+ *	pgdb_page_meta
+ *	pgdb_page_restart[n_restarts]
+ *	filter block
+ *	key and value bytes
+ *	sha256 of each chunk of all the above (see merkle.c)
+ *
+ * and synced.  With compression on, the keys are kept together instead,
+ * and the values follow in blocks of about block_size bytes, each
+ * compressed on its own and listed in a pgdb_page_vblock table after
+ * them; an index entry names its value's block, and where the value lies
+ * once the block is uncompressed.  A point read then uncompresses a
+ * single block.  Blocks that compression would barely shrink are
+ * stored as they are.
+ *
+ * Each index entry holds checksums of its key and value, of the kind
+ * the meta block names.  Every pagefile written becomes a RootEnt of
+ * the builder's sorted run; nothing refers to the files until the
+ * caller installs a root index listing them.
+ */
+
+struct pgdb_pagebuild *pg_pagebuild_new(pgdb_t *db, uint64_t run_id,
+					size_t max_file_size)
+{
+	struct pgdb_pagebuild *pb = calloc(1, sizeof(*pb));
+	if (!pb)
+		return NULL;
+
+	pb->db = db;
+	pb->run_id = run_id;
+	pb->max_file_size = max_file_size;
+
+	return pb;
+}
+
+static void rootent_free(PGcodec__RootEnt *ent)
+{
+	free(ent->key.data);
+	free(ent);
+}
+
+void pg_pagebuild_free(struct pgdb_pagebuild *pb, bool remove_files)
+{
+	if (!pb)
+		return;
+
+	unsigned int i;
+	for (i = 0; i < pb->n_ents; i++) {
+		if (remove_files)
+			pg_remove_file(pb->db, pb->ents[i]->file_id);
+		rootent_free(pb->ents[i]);
+	}
+
+	free(pb->ents);
+	free(pb->pi);
+	free(pb->data);
+
+	memset(pb, 0xff, sizeof(*pb));
+	free(pb);
+}
+
+static bool add_rootent(struct pgdb_pagebuild *pb, uint64_t file_id,
+			const void *key, size_t klen)
+{
+	if (pb->n_ents == pb->alloc_ents) {
+		unsigned int alloc_ents = pb->alloc_ents ? pb->alloc_ents * 2 : 8;
+		PGcodec__RootEnt **ents = realloc(pb->ents, alloc_ents *
+						  sizeof(PGcodec__RootEnt *));
+		if (!ents)
+			return false;
+		pb->ents = ents;
+		pb->alloc_ents = alloc_ents;
+	}
+
+	PGcodec__RootEnt *ent = malloc(sizeof(*ent));
+	if (!ent)
+		return false;
+
+	PGcodec__RootEnt init = PGCODEC__ROOT_ENT__INIT;
+	*ent = init;
+
+	ent->key.data = malloc(klen ? klen : 1);
+	if (!ent->key.data) {
+		free(ent);
+		return false;
+	}
+	memcpy(ent->key.data, key, klen);
+	ent->key.len = klen;
+	ent->n_records = pb->n_entries;
+	ent->file_id = file_id;
+	ent->has_run_id = 1;
+	ent->run_id = pb->run_id;
+
+	pb->ents[pb->n_ents++] = ent;
+	return true;
+}
+
+// the values of the buffered records, packed into blocks
+struct vpack {
+	char			*data;		// blocks, back to back
+	size_t			len;
+	struct pgdb_page_vblock	*vb;		// offsets into data
+	uint32_t		n_vblocks;
+	size_t			keys_len;
+};
+
+static void vpack_block(struct vpack *vp, const char *raw, size_t raw_len)
+{
+	char *out = vp->data + vp->len;
+	struct pgdb_page_vblock *vb = &vp->vb[vp->n_vblocks++];
+
+	vb->offset = vp->len;
+	vb->raw_len = raw_len;
+	vb->c_len = pg_snappy_compress(raw, raw_len, out);
+	vb->flags = 0;
+
+	// not worth uncompressing unless it saves an eighth
+	if (vb->c_len > (raw_len - (raw_len / 8))) {
+		memcpy(out, raw, raw_len);
+		vb->c_len = raw_len;
+		vb->flags = PGDB_VB_RAW;
+	}
+
+	vp->len += vb->c_len;
+}
+
+/*
+ * Pack the buffered values into blocks, closing each once it holds
+ * block_size bytes, and point the index entries at them: v_block, and
+ * v_offset within the block.
+ */
+static bool vpack_build(struct pgdb_pagebuild *pb, struct vpack *vp)
+{
+	size_t block_size = pb->db->opt->block_size;
+	uint32_t n = pb->n_entries, i;
+	size_t values_len = 0, max_vlen = 0;
+
+	for (i = 0; i < n; i++) {
+		values_len += pb->pi[i].v_len;
+		vp->keys_len += pb->pi[i].k_len;
+		if (pb->pi[i].v_len > max_vlen)
+			max_vlen = pb->pi[i].v_len;
+	}
+
+	// blocks stored raw never grow, so only the last can overrun
+	vp->data = malloc(pg_snappy_max_compressed(values_len));
+	vp->vb = malloc(n * sizeof(struct pgdb_page_vblock));
+	char *raw = malloc(block_size + max_vlen);
+	size_t raw_len = 0;
+
+	if (!vp->data || !vp->vb || !raw) {
+		free(raw);
+		return false;
+	}
+
+	for (i = 0; i < n; i++) {
+		struct pgdb_page_index *pi = &pb->pi[i];
+
+		memcpy(raw + raw_len, pb->data + pi->v_offset, pi->v_len);
+		pi->v_block = vp->n_vblocks;
+		pi->v_offset = raw_len;
+		raw_len += pi->v_len;
+
+		if (raw_len >= block_size) {
+			vpack_block(vp, raw, raw_len);
+			raw_len = 0;
+		}
+	}
+	if (raw_len)
+		vpack_block(vp, raw, raw_len);
+
+	free(raw);
+	return true;
+}
+
+// write the buffered records out as one pagefile
+static bool pagebuild_emit(struct pgdb_pagebuild *pb, char **errptr)
+{
+	pgdb_t *db = pb->db;
+	uint32_t n = pb->n_entries;
+
+	if (!n)
+		return true;
+
+	bool rc = false;
+	unsigned int ri = db->opt->restart_interval;
+	uint32_t n_restarts = ri ? ((n + ri - 1) / ri) : 0;
+
+	struct pgdb_page_restart *rs = calloc(n_restarts + 1, sizeof(*rs));
+	const char **keys = malloc(n * sizeof(char *));
+	size_t *key_lens = malloc(n * sizeof(size_t));
+	char *filter = NULL;
+	size_t filter_len = 0;
+	struct pgdb_filewriter *fw = NULL;
+	bool compress = (db->opt->compression != PGDB_COMP_NONE);
+	struct vpack vp;
+
+	memset(&vp, 0, sizeof(vp));
+
+	if (!rs || !keys || !key_lens)
+		goto oom;
+
+	uint32_t i;
+	for (i = 0; i < n; i++) {
+		keys[i] = pb->data + pb->pi[i].k_offset;
+		key_lens[i] = pb->pi[i].k_len;
+	}
+
+	filter = pg_filter_create(db->opt, keys, key_lens, n, &filter_len);
+
+	if (compress && !vpack_build(pb, &vp))
+		goto oom;
+
+	size_t meta_offset = sizeof(struct pgdb_page_hdr) +
+			     (n * sizeof(struct pgdb_page_index));
+	size_t rs_offset = meta_offset + sizeof(struct pgdb_page_meta);
+	size_t filter_offset = rs_offset +
+			       (n_restarts * sizeof(struct pgdb_page_restart));
+	size_t data_offset = filter_offset + filter_len;
+	size_t vblocks_end = data_offset + vp.keys_len + vp.len;
+	size_t vblock_offset = (vblocks_end + 3) & ~3UL;	// table aligned
+	size_t digest_offset = data_offset + pb->data_len;
+	if (compress)
+		digest_offset = vblock_offset +
+			(vp.n_vblocks * sizeof(struct pgdb_page_vblock));
+	size_t n_chunks = pg_merkle_n_chunks(digest_offset, PGDB_CHUNK_SHIFT);
+	size_t digests_len = n_chunks * SHA256_DIGEST_LENGTH;
+
+	if ((digest_offset + digests_len) > UINT32_MAX) {
+		*errptr = strdup("pagefile too large");
+		goto out;
+	}
+
+	for (i = 0; i < n_restarts; i++) {
+		uint32_t index = i * ri;
+		rs[i].prefix = htobe64(pg_key_prefix(keys[index],
+						     key_lens[index]));
+		rs[i].index = htole32(index);
+	}
+
+	size_t k_offset = data_offset;
+	for (i = 0; i < n; i++) {
+		struct pgdb_page_index *pi = &pb->pi[i];
+
+		if (compress) {
+			pi->k_offset = htole32(k_offset);
+			k_offset += pi->k_len;
+			pi->v_offset = htole32(pi->v_offset);
+			pi->v_block = htole32(pi->v_block);
+		} else {
+			pi->k_offset = htole32(pi->k_offset + data_offset);
+			pi->v_offset = htole32(pi->v_offset + data_offset);
+		}
+		pi->k_len = htole32(pi->k_len);
+		pi->v_len = htole32(pi->v_len);
+		pi->flags = htole32(pi->flags);
+	}
+
+	for (i = 0; i < vp.n_vblocks; i++) {
+		struct pgdb_page_vblock *vb = &vp.vb[i];
+
+		vb->offset = htole32(vb->offset + data_offset + vp.keys_len);
+		vb->c_len = htole32(vb->c_len);
+		vb->raw_len = htole32(vb->raw_len);
+		vb->flags = htole32(vb->flags);
+	}
+
+	struct pgdb_page_hdr hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, PGDB_PAGE_MAGIC, sizeof(hdr.magic));
+	hdr.n_entries = htole32(n);
+	// uncompressed pagefiles stay readable by V1 readers
+	hdr.version = htole32(compress ? PGDB_PAGE_V2 : PGDB_PAGE_V1);
+	hdr.meta_offset = htole32(meta_offset);
+
+	struct pgdb_page_meta meta;
+	memset(&meta, 0, sizeof(meta));
+	meta.restart_interval = htole32(ri);
+	meta.n_restarts = htole32(n_restarts);
+	meta.restart_offset = htole32(rs_offset);
+	meta.filter_offset = htole32(filter_offset);
+	meta.filter_len = htole32(filter_len);
+	if (filter_len)
+		meta.filter_id = htole32(pg_filter_id(db->opt->filter_policy));
+	meta.csum_type = htole32(db->opt->csum_type);
+	meta.chunk_shift = htole32(PGDB_CHUNK_SHIFT);
+	meta.digest_offset = htole32(digest_offset);
+	if (compress) {
+		meta.compression = htole32(db->opt->compression);
+		meta.vblock_offset = htole32(vblock_offset);
+		meta.n_vblocks = htole32(vp.n_vblocks);
+	}
+
+	uint64_t file_id = pg_alloc_file_id(db);
+	size_t fn_len = strlen(db->pathname) + 64 + 2;
+	char *fn = alloca(fn_len);
+	snprintf(fn, fn_len, "%s/%llu", db->pathname,
+		 (unsigned long long) file_id);
+
+	fw = pg_fw_create(db, fn, digest_offset + digests_len, true, errptr);
+	if (!fw)
+		goto out;
+
+	pg_fw_append(fw, &hdr, sizeof(hdr));
+	pg_fw_append(fw, pb->pi, n * sizeof(struct pgdb_page_index));
+	pg_fw_append(fw, &meta, sizeof(meta));
+	pg_fw_append(fw, rs, n_restarts * sizeof(struct pgdb_page_restart));
+	pg_fw_append(fw, filter, filter_len);
+	if (compress) {
+		for (i = 0; i < n; i++)
+			pg_fw_append(fw, keys[i], key_lens[i]);
+		pg_fw_append(fw, vp.data, vp.len);
+		pg_fw_append(fw, "\0\0\0", vblock_offset - vblocks_end);
+		pg_fw_append(fw, vp.vb,
+			     vp.n_vblocks * sizeof(struct pgdb_page_vblock));
+	} else {
+		pg_fw_append(fw, pb->data, pb->data_len);
+	}
+	pg_fw_append_digests(fw);
+
+	if (!pg_fw_finish(fw, errptr))
+		goto out;
+
+	if (!add_rootent(pb, file_id, keys[n - 1], key_lens[n - 1]))
+		goto oom;
+
+	pb->n_entries = 0;
+	pb->data_len = 0;
+	rc = true;
+	goto out;
+
+oom:
+	*errptr = strdup("OOM");	// irony, but recoverable
+out:
+	pg_fw_free(fw, !rc);
+	free(vp.vb);
+	free(vp.data);
+	free(filter);
+	free(key_lens);
+	free(keys);
+	free(rs);
+	return rc;
+}
+
+static bool grow_buffers(struct pgdb_pagebuild *pb, size_t bytes)
+{
+	if (pb->n_entries == pb->alloc_entries) {
+		uint32_t alloc_entries = pb->alloc_entries ?
+					 pb->alloc_entries * 2 : 256;
+		struct pgdb_page_index *pi = realloc(pb->pi, alloc_entries *
+						sizeof(struct pgdb_page_index));
+		if (!pi)
+			return false;
+		pb->pi = pi;
+		pb->alloc_entries = alloc_entries;
+	}
+
+	if ((pb->data_len + bytes) > pb->data_alloc) {
+		size_t data_alloc = pb->data_alloc ? pb->data_alloc : 65536;
+		while (data_alloc < (pb->data_len + bytes))
+			data_alloc *= 2;
+
+		char *data = realloc(pb->data, data_alloc);
+		if (!data)
+			return false;
+		pb->data = data;
+		pb->data_alloc = data_alloc;
+	}
+
+	return true;
+}
+
+/*
+ * Append a record.  Keys must arrive in strictly ascending order; a
+ * delete is kept as a tombstone, since older runs may hold the key.
+ */
+bool pg_pagebuild_add(struct pgdb_pagebuild *pb, enum pgdb_rec_type type,
+		      const void *key, size_t klen,
+		      const void *val, size_t vlen, char **errptr)
+{
+	if (type != PGDB_REC_PUT)
+		vlen = 0;
+
+	size_t rec_len = sizeof(struct pgdb_page_index) + klen + vlen;
+	if (rec_len > (UINT32_MAX / 2)) {
+		*errptr = strdup("record too large for pagefile");
+		return false;
+	}
+
+	size_t cur_len = sizeof(struct pgdb_page_hdr) +
+			 (pb->n_entries * sizeof(struct pgdb_page_index)) +
+			 pb->data_len;
+	if (pb->n_entries &&
+	    (cur_len + rec_len) > pb->max_file_size &&
+	    !pagebuild_emit(pb, errptr))
+		return false;
+
+	if (!grow_buffers(pb, klen + vlen)) {
+		*errptr = strdup("OOM");	// irony, but recoverable
+		return false;
+	}
+
+	// offsets stay buffer-relative, host order until emitted
+	struct pgdb_page_index *pi = &pb->pi[pb->n_entries++];
+	memset(pi, 0, sizeof(*pi));
+
+	pi->k_offset = pb->data_len;
+	pi->k_len = klen;
+	pg_page_csum(pb->db->opt->csum_type, pi->k_csum, key, klen);
+	memcpy(pb->data + pb->data_len, key, klen);
+	pb->data_len += klen;
+
+	pi->v_offset = pb->data_len;
+	pi->v_len = vlen;
+	pg_page_csum(pb->db->opt->csum_type, pi->v_csum, val, vlen);
+	if (vlen)
+		memcpy(pb->data + pb->data_len, val, vlen);
+	pb->data_len += vlen;
+
+	if (type == PGDB_REC_DEL)
+		pi->flags = PGDB_PI_DELETED;
+
+	return true;
+}
+
+// write out any buffered records
+bool pg_pagebuild_finish(struct pgdb_pagebuild *pb, char **errptr)
+{
+	return pagebuild_emit(pb, errptr);
+}
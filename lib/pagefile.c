@@ -3,16 +3,100 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <alloca.h>
+#include <assert.h>
+#include <openssl/sha.h>
 
 #include "pgdb-internal.h"
 
-static struct pgdb_map *open_map(pgdb_t *db, unsigned int n, char **errptr)
+static struct pgdb_map *open_map(pgdb_t *db, uint64_t file_id, char **errptr)
 {
 	size_t fn_len = strlen(db->pathname) + 64 + 2;
 	char *fn = alloca(fn_len);
-	snprintf(fn, fn_len, "%s/%u", db->pathname, n);
+	snprintf(fn, fn_len, "%s/%llu", db->pathname,
+		 (unsigned long long) file_id);
 
-	return pgmap_open(fn, errptr);
+	if (db->opt->io == PGDB_IO_MMAP)
+		return pgmap_open(fn, errptr);
+
+	return pgmap_read(fn, db->opt->io == PGDB_IO_DIRECT, &db->pool,
+			  errptr);
+}
+
+static bool read_meta(struct pgdb_pagefile *pf, struct pgdb_page_hdr *phdr,
+		      char **errptr)
+{
+	size_t file_len = pf->map->st.st_size;
+	size_t meta_offset = le32toh(phdr->meta_offset);
+	if ((meta_offset + sizeof(struct pgdb_page_meta)) > file_len) {
+		*errptr = strdup("pagefile meta out of range");
+		return false;
+	}
+
+	struct pgdb_page_meta *meta = pf->map->mem + meta_offset;
+
+	pf->n_restarts = le32toh(meta->n_restarts);
+	size_t rs_offset = le32toh(meta->restart_offset);
+	size_t rs_len = pf->n_restarts * sizeof(struct pgdb_page_restart);
+	if ((rs_offset + rs_len) > file_len) {
+		*errptr = strdup("pagefile restarts out of range");
+		return false;
+	}
+
+	pf->rs = pf->map->mem + rs_offset;
+
+	pf->csum_type = le32toh(meta->csum_type);
+	if (pf->csum_type != PGDB_CSUM_SHA256 &&
+	    pf->csum_type != PGDB_CSUM_CRC32C) {
+		*errptr = strdup("pagefile checksum type unsupported");
+		return false;
+	}
+
+	pf->compression = le32toh(meta->compression);
+	if (pf->compression != PGDB_COMP_NONE) {
+		if (pf->compression != PGDB_COMP_SNAPPY) {
+			*errptr = strdup("pagefile compression unsupported");
+			return false;
+		}
+
+		pf->n_vblocks = le32toh(meta->n_vblocks);
+		size_t vb_offset = le32toh(meta->vblock_offset);
+		size_t vb_len = pf->n_vblocks *
+				sizeof(struct pgdb_page_vblock);
+		if ((vb_offset + vb_len) > file_len) {
+			*errptr = strdup("pagefile value blocks out of range");
+			return false;
+		}
+
+		pf->vb = pf->map->mem + vb_offset;
+	}
+
+	pf->chunk_shift = le32toh(meta->chunk_shift);
+	if (!pf->chunk_shift)
+		return true;
+
+	if (pf->chunk_shift < PGDB_CHUNK_SHIFT_MIN ||
+	    pf->chunk_shift > PGDB_CHUNK_SHIFT_MAX) {
+		*errptr = strdup("pagefile chunk size unsupported");
+		return false;
+	}
+
+	pf->digest_offset = le32toh(meta->digest_offset);
+	size_t n_chunks = pg_merkle_n_chunks(pf->digest_offset,
+					     pf->chunk_shift);
+	if ((pf->digest_offset + (n_chunks * SHA256_DIGEST_LENGTH)) >
+	    file_len) {
+		*errptr = strdup("pagefile chunk digests out of range");
+		return false;
+	}
+
+	pf->digests = pf->map->mem + pf->digest_offset;
+	pf->verified = calloc((n_chunks + 63) / 64 + 1, sizeof(uint64_t));
+	if (!pf->verified) {
+		*errptr = strdup("OOM");	// irony, but recoverable
+		return false;
+	}
+
+	return true;
 }
 
 void pg_pagefile_close(struct pgdb_pagefile *pf)
@@ -21,12 +105,13 @@ void pg_pagefile_close(struct pgdb_pagefile *pf)
 		return;
 
 	pgmap_free(pf->map);
+	free(pf->verified);
 	
 	memset(pf, 0xff, sizeof(*pf));
 	free(pf);
 }
 
-struct pgdb_pagefile *pg_pagefile_open(pgdb_t *db, unsigned int n,
+struct pgdb_pagefile *pg_pagefile_open(pgdb_t *db, uint64_t file_id,
 					char **errptr)
 {
 	struct pgdb_pagefile *pf = calloc(1, sizeof(struct pgdb_pagefile));
@@ -35,7 +120,11 @@ struct pgdb_pagefile *pg_pagefile_open(pgdb_t *db, unsigned int n,
 		return NULL;
 	}
 
-	pf->map = open_map(db, n, errptr);
+	pf->file_id = file_id;
+	pf->cache = db->cache;
+	pf->cache_id = db->cache_id;
+	pf->epoch = db->epoch;
+	pf->map = open_map(db, file_id, errptr);
 	if (!pf->map)
 		goto err_out;
 
@@ -63,6 +152,15 @@ struct pgdb_pagefile *pg_pagefile_open(pgdb_t *db, unsigned int n,
 	pi++;
 	pf->pi = pi;
 
+	pf->version = le32toh(phdr->version);
+	if (pf->version > PGDB_PAGE_VERSION) {
+		*errptr = strdup("pagefile version unsupported");
+		goto err_out;
+	}
+
+	if (pf->version >= PGDB_PAGE_V1 && !read_meta(pf, phdr, errptr))
+		goto err_out;
+
 	return pf;
 
 err_out:
@@ -70,27 +168,379 @@ err_out:
 	return NULL;
 }
 
+static inline int pi_cmp(struct pgdb_pagefile *pf, unsigned int slot,
+			 const void *key, size_t klen)
+{
+	struct pgdb_page_index *pi = &pf->pi[slot];
+
+	return pg_key_cmp(pf->map->mem + le32toh(pi->k_offset),
+			  le32toh(pi->k_len), key, klen);
+}
+
+static inline unsigned int rs_index(struct pgdb_pagefile *pf, unsigned int r)
+{
+	uint32_t index = le32toh(pf->rs[r].index);
+
+	return (index < pf->n_entries) ? index : pf->n_entries;
+}
+
+// first slot in [lo, hi) whose key is >= key; hi if none
+static unsigned int pi_lower_bound(struct pgdb_pagefile *pf,
+				   unsigned int lo, unsigned int hi,
+				   const void *key, size_t klen)
+{
+	while (lo < hi) {
+		unsigned int mid = lo + ((hi - lo) / 2);
+		if (pi_cmp(pf, mid, key, klen) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+// first restart whose fence key is >= key; n_restarts if none
+static unsigned int rs_lower_bound(struct pgdb_pagefile *pf,
+				   const void *key, size_t klen)
+{
+	uint64_t prefix = pg_key_prefix(key, klen);
+	unsigned int lo = 0, hi = pf->n_restarts;
+
+	while (lo < hi) {
+		unsigned int mid = lo + ((hi - lo) / 2);
+		uint64_t rs_prefix = be64toh(pf->rs[mid].prefix);
+
+		int cmp;
+		if (rs_prefix != prefix)
+			cmp = (rs_prefix < prefix) ? -1 : 1;
+		else
+			cmp = pi_cmp(pf, rs_index(pf, mid), key, klen);
+
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/*
+ * The parts of pf every lookup reads, wherever its key lies: the header,
+ * index, meta block, restart points and filters, all ahead of the first
+ * key; with compression, the keys too, kept together then, and the
+ * value block table.  Stores them in r[PGDB_PAGE_REGIONS], returning how
+ * many there are.
+ */
+unsigned int pg_pagefile_regions(struct pgdb_pagefile *pf,
+				 struct pgdb_region *r)
+{
+	uint64_t file_len = pf->map->st.st_size;
+	uint64_t head = sizeof(struct pgdb_page_hdr) +
+			((uint64_t) pf->n_entries * sizeof(struct pgdb_page_index));
+	unsigned int n = 0;
+
+	uint64_t keys = head, keys_end = head;
+	if (pf->n_entries) {
+		const struct pgdb_page_index *last = &pf->pi[pf->n_entries - 1];
+
+		keys = le32toh(pf->pi[0].k_offset);
+		keys_end = (uint64_t) le32toh(last->k_offset) +
+			   le32toh(last->k_len);
+	}
+	if (keys > head && keys <= file_len)
+		head = keys;
+
+	r[n].offset = 0;
+	r[n++].len = head;
+
+	if (pf->compression != PGDB_COMP_NONE && keys_end > keys &&
+	    keys_end <= file_len) {
+		r[n].offset = keys;
+		r[n++].len = keys_end - keys;
+	}
+
+	if (pf->n_vblocks) {
+		r[n].offset = (void *) pf->vb - pf->map->mem;
+		r[n++].len = pf->n_vblocks * sizeof(struct pgdb_page_vblock);
+	}
+
+	return n;
+}
+
+/*
+ * Narrow the search for key to the entries between two restart points:
+ * its slot, if any, is the first in [*lo, *hi) whose key is >= key, or
+ * else *hi itself.
+ */
+void pg_pagefile_window(struct pgdb_pagefile *pf, const void *key,
+			size_t klen, unsigned int *lo, unsigned int *hi)
+{
+	*lo = 0;
+	*hi = pf->n_entries;
+
+	if (pf->n_restarts) {
+		unsigned int r = rs_lower_bound(pf, key, klen);
+		if (r > 0)
+			*lo = rs_index(pf, r - 1) + 1;
+		if (r < pf->n_restarts)
+			*hi = rs_index(pf, r);
+	}
+}
+
 int pg_pagefile_find(struct pgdb_pagefile *pf, const void *key_a, size_t alen,
 		     bool exact_match)
 {
-	unsigned int i;
-
-	for (i = 0; i < pf->n_entries; i++) {
-		struct pgdb_page_index *pi = &pf->pi[i];
-		void *key_b = pf->map->mem + le32toh(pi->k_offset);
-		size_t blen = le32toh(pi->k_len);
-
-		size_t len = (alen < blen) ? alen : blen;
-		int cmp = memcmp(key_a, key_b, len);
-		if (cmp <= 0) {
-			if (!exact_match)
-				return i;
-			if (exact_match && (cmp == 0) && (alen == blen))
-				return i;
-			return -1;
-		}
-	}
+	unsigned int lo, hi;
+
+	pg_pagefile_window(pf, key_a, alen, &lo, &hi);
 
+	unsigned int slot = pi_lower_bound(pf, lo, hi, key_a, alen);
+	if (slot >= pf->n_entries)
+		return -1;
+	if (!exact_match)
+		return slot;
+	if (pi_cmp(pf, slot, key_a, alen) == 0)
+		return slot;
 	return -1;
 }
 
+void pg_page_csum(enum pgdb_csum_type csum_type, unsigned char *csum,
+		  const void *data, size_t len)
+{
+	if (csum_type == PGDB_CSUM_CRC32C) {
+		uint32_t crc = htole32(pg_crc32c(0, data, len));
+		memcpy(csum, &crc, 4);
+		return;
+	}
+
+	unsigned char md[SHA256_DIGEST_LENGTH];
+
+	SHA256(data, len, md);
+	memcpy(csum, md, 4);
+}
+
+static bool csum_ok(struct pgdb_pagefile *pf, const unsigned char *want,
+		    const void *data, size_t len)
+{
+	unsigned char csum[4];
+
+	pg_page_csum(pf->csum_type, csum, data, len);
+	return !memcmp(csum, want, sizeof(csum));
+}
+
+void pg_vblock_ref(struct pgdb_vblock *blk)
+{
+	__atomic_add_fetch(&blk->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+void pg_vblock_unref(struct pgdb_vblock *blk)
+{
+	if (!blk || __atomic_sub_fetch(&blk->refcnt, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	memset(blk, 0xff, sizeof(*blk));
+	free(blk);
+}
+
+static void vblock_pin_release(struct pgdb_pinned_t *pin)
+{
+	pg_vblock_unref(container_of(pin, struct pgdb_vblock, pin));
+}
+
+/*
+ * Uncompress value block, stored as c_data: in the mapping, or a copy
+ * read from the file.
+ */
+struct pgdb_vblock *pg_vblock_load(struct pgdb_pagefile *pf, uint32_t block,
+				   const void *c_data, char **errptr)
+{
+	const struct pgdb_page_vblock *vb = &pf->vb[block];
+	uint32_t raw_len = le32toh(vb->raw_len);
+
+	struct pgdb_vblock *blk = calloc(1, sizeof(*blk) + raw_len);
+	if (!blk) {
+		*errptr = strdup("OOM");	// irony, but recoverable
+		return NULL;
+	}
+
+	blk->refcnt = 1;
+	blk->file_id = pf->file_id;
+	blk->block = block;
+	blk->len = raw_len;
+	blk->cache_id = pf->cache_id;
+	blk->pin.release = vblock_pin_release;
+
+	if (!pg_snappy_uncompress(c_data, le32toh(vb->c_len), blk->data,
+				  raw_len)) {
+		free(blk);
+		*errptr = strdup("pagefile value block corrupt");
+		return NULL;
+	}
+
+	return blk;
+}
+
+/*
+ * The value of the record in slot, and its length in *vlen.  Values of
+ * compressed pagefiles are read out of their uncompressed block, which
+ * *blk then references: a block already in *blk is used again, else it
+ * is released and the new block put in its place.  Blocks come from
+ * the block cache when there, and go in it with fill_cache set.  Values
+ * read straight from the map leave *blk NULL.  NULL on error.
+ */
+const void *pg_pagefile_value(struct pgdb_pagefile *pf, unsigned int slot,
+			      struct pgdb_vblock **blk, size_t *vlen,
+			      bool fill_cache, char **errptr)
+{
+	struct pgdb_page_index *pi = &pf->pi[slot];
+	uint64_t file_len = pf->map->st.st_size;
+	uint32_t v_offset = le32toh(pi->v_offset);
+	uint32_t v_len = le32toh(pi->v_len);
+
+	*vlen = v_len;
+
+	if (pf->compression == PGDB_COMP_NONE || !v_len) {
+		if (!pf->compression &&
+		    ((uint64_t) v_offset + v_len) > file_len)
+			goto range_err;
+
+		pg_vblock_unref(*blk);
+		*blk = NULL;
+		return pf->compression ? pf->map->mem :
+		       pf->map->mem + v_offset;
+	}
+
+	uint32_t block = le32toh(pi->v_block);
+	if (block >= pf->n_vblocks)
+		goto range_err;
+
+	const struct pgdb_page_vblock *vb = &pf->vb[block];
+	uint32_t vb_offset = le32toh(vb->offset);
+	uint32_t c_len = le32toh(vb->c_len);
+	uint32_t raw_len = le32toh(vb->raw_len);
+
+	if (((uint64_t) vb_offset + c_len) > file_len ||
+	    ((uint64_t) v_offset + v_len) > raw_len)
+		goto range_err;
+
+	if (le32toh(vb->flags) & PGDB_VB_RAW) {
+		if (c_len != raw_len)
+			goto range_err;
+
+		pg_vblock_unref(*blk);
+		*blk = NULL;
+		return pf->map->mem + vb_offset + v_offset;
+	}
+
+	if (*blk && (*blk)->file_id == pf->file_id && (*blk)->block == block)
+		return (*blk)->data + v_offset;
+
+	struct pgdb_vblock *nblk = pg_cache_lookup(pf->cache, pf->cache_id,
+						   pf->file_id, block);
+	if (!nblk) {
+		nblk = pg_vblock_load(pf, block, pf->map->mem + vb_offset,
+				      errptr);
+		if (!nblk)
+			return NULL;
+		if (fill_cache)
+			pg_cache_insert(pf->cache, nblk);
+	}
+
+	pg_vblock_unref(*blk);
+	*blk = nblk;
+	return nblk->data + v_offset;
+
+range_err:
+	*errptr = strdup("pagefile value out of range");
+	return NULL;
+}
+
+/*
+ * Check the chunks holding [offset, offset + len) against their digests,
+ * each just once: the first reader to touch a chunk checks it, and the
+ * pagefile remembers it was, for as long as it stays open.
+ */
+static bool chunks_ok(struct pgdb_pagefile *pf, uint64_t offset,
+		      uint64_t len)
+{
+	if (!pf->chunk_shift || !len)
+		return true;
+	if ((offset + len) > pf->digest_offset)
+		return false;
+
+	size_t i = offset >> pf->chunk_shift;
+	size_t last = (offset + len - 1) >> pf->chunk_shift;
+
+	for (; i <= last; i++) {
+		uint64_t *word = &pf->verified[i / 64];
+		uint64_t bit = 1ULL << (i % 64);
+
+		if (__atomic_load_n(word, __ATOMIC_ACQUIRE) & bit)
+			continue;
+		if (!pg_merkle_chunk_ok(pf->map->mem, pf->digest_offset,
+					pf->chunk_shift, pf->digests, i))
+			return false;
+		__atomic_fetch_or(word, bit, __ATOMIC_RELEASE);
+	}
+
+	return true;
+}
+
+/*
+ * Check the record in slot, whose value pg_pagefile_value() returned as
+ * val: the chunks holding the header, its index entry, key and value
+ * (for compressed pagefiles, the value's block as stored) the first time
+ * each is read, then the record against the checksums its index entry
+ * holds.
+ */
+bool pg_pagefile_verify(struct pgdb_pagefile *pf, unsigned int slot,
+			const void *val, size_t vlen, char **errptr)
+{
+	struct pgdb_page_index *pi = &pf->pi[slot];
+	uint64_t file_len = pf->map->st.st_size;
+
+	uint32_t k_offset = le32toh(pi->k_offset);
+	uint32_t k_len = le32toh(pi->k_len);
+	uint64_t v_offset = le32toh(pi->v_offset);
+	uint64_t v_len = vlen;
+
+	if (pf->compression != PGDB_COMP_NONE && vlen) {
+		const struct pgdb_page_vblock *vb =
+			&pf->vb[le32toh(pi->v_block)];
+
+		if (!chunks_ok(pf, (void *) vb - pf->map->mem, sizeof(*vb))) {
+			*errptr = strdup("pagefile chunk checksum mismatch");
+			return false;
+		}
+		v_offset = le32toh(vb->offset);
+		v_len = le32toh(vb->c_len);
+	} else if (pf->compression != PGDB_COMP_NONE) {
+		v_offset = 0;
+	}
+
+	if (((uint64_t) k_offset + k_len) > file_len ||
+	    (v_offset + v_len) > file_len) {
+		*errptr = strdup("pagefile record out of range");
+		return false;
+	}
+
+	uint64_t pi_offset = (void *) pi - pf->map->mem;
+
+	if (!chunks_ok(pf, 0, sizeof(struct pgdb_page_hdr)) ||
+	    !chunks_ok(pf, pi_offset, sizeof(*pi)) ||
+	    !chunks_ok(pf, k_offset, k_len) ||
+	    !chunks_ok(pf, v_offset, v_len)) {
+		*errptr = strdup("pagefile chunk checksum mismatch");
+		return false;
+	}
+
+	if (!csum_ok(pf, pi->k_csum, pf->map->mem + k_offset, k_len) ||
+	    !csum_ok(pf, pi->v_csum, val, vlen)) {
+		*errptr = strdup("pagefile checksum mismatch");
+		return false;
+	}
+
+	return true;
+}
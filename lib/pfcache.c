@@ -0,0 +1,360 @@
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "pgdb-internal.h"
+
+/*
+ * Open-pagefile cache.
+ *
+ * Mapped pagefiles are kept open across reads, in shards keyed by file
+ * id: PGDB_PFCACHE_SHARDS of them, or fewer for a budget too small to
+ * give each a file.  Each cached pagefile holds one reference owned by
+ * the cache, plus one per reader currently using it.  A file evicted
+ * while in use stays mapped until its last reader drops it.
+ *
+ * A hit takes no lock: the hash chains are searched inside an epoch
+ * (see epoch.c), and a reference taken only while the count is not yet
+ * zero.  Only opening a file, and evicting one, take the shard lock.
+ * Hits do not reorder the LRU list, they mark the file referenced, and
+ * eviction gives a referenced file one more pass before closing it.  A
+ * pagefile is closed, never before its last reference is dropped, once
+ * no reader still searching a chain can reach it; unlinking it leaves
+ * its own chain link intact for those readers.
+ *
+ * Pagefiles read into memory rather than mapped hold room in their
+ * database's pool (see map.c), shared by all its tables' caches, until
+ * closed: while cached, and after eviction for as long as a reader
+ * still holds them.  One the pool had no room for is mapped instead;
+ * the shard caching it then evicts from its own LRU list until the
+ * pool would have room for it, or it has no more to give, so that it
+ * can be read in next time it is opened.
+ */
+
+static inline uint64_t file_hash(uint64_t file_id)
+{
+	return file_id * 0x9e3779b97f4a7c15ULL;
+}
+
+static inline struct pgdb_pfcache_shard *shard_of(struct pgdb_pfcache *cache,
+						  uint64_t hash)
+{
+	return &cache->shard[(hash >> 60) & cache->shard_mask];
+}
+
+static inline struct pgdb_pagefile **bucket_of(struct pgdb_pfcache_shard *sh,
+					       uint64_t hash)
+{
+	return &sh->hash[hash & sh->hash_mask];
+}
+
+static void lru_unlink(struct pgdb_pfcache_shard *sh, struct pgdb_pagefile *pf)
+{
+	if (pf->lru_prev)
+		pf->lru_prev->lru_next = pf->lru_next;
+	else
+		sh->lru_head = pf->lru_next;
+	if (pf->lru_next)
+		pf->lru_next->lru_prev = pf->lru_prev;
+	else
+		sh->lru_tail = pf->lru_prev;
+
+	pf->lru_prev = pf->lru_next = NULL;
+}
+
+static void lru_push(struct pgdb_pfcache_shard *sh, struct pgdb_pagefile *pf)
+{
+	pf->lru_prev = NULL;
+	pf->lru_next = sh->lru_head;
+	if (sh->lru_head)
+		sh->lru_head->lru_prev = pf;
+	else
+		sh->lru_tail = pf;
+	sh->lru_head = pf;
+}
+
+// readers may be walking past pf; its own hnext stays as it was
+static void hash_unlink(struct pgdb_pfcache_shard *sh, struct pgdb_pagefile *pf)
+{
+	struct pgdb_pagefile **pp = bucket_of(sh, file_hash(pf->file_id));
+
+	while (*pp != pf)
+		pp = &(*pp)->hnext;
+	__atomic_store_n(pp, pf->hnext, __ATOMIC_SEQ_CST);
+}
+
+// with the shard lock held, or inside an epoch
+static struct pgdb_pagefile *shard_lookup(struct pgdb_pfcache_shard *sh,
+					  uint64_t file_id, uint64_t hash)
+{
+	struct pgdb_pagefile *pf = __atomic_load_n(bucket_of(sh, hash),
+						   __ATOMIC_SEQ_CST);
+
+	while (pf && pf->file_id != file_id)
+		pf = __atomic_load_n(&pf->hnext, __ATOMIC_SEQ_CST);
+
+	return pf;
+}
+
+// take a reference, unless the last one is already gone
+static inline bool pf_tryref(struct pgdb_pagefile *pf)
+{
+	unsigned int n = __atomic_load_n(&pf->refcnt, __ATOMIC_RELAXED);
+
+	do {
+		if (!n)
+			return false;
+	} while (!__atomic_compare_exchange_n(&pf->refcnt, &n, n + 1, true,
+					      __ATOMIC_ACQUIRE,
+					      __ATOMIC_RELAXED));
+
+	return true;
+}
+
+// drop a reference; returns true if the caller must close the pagefile
+static inline bool pf_unref(struct pgdb_pagefile *pf)
+{
+	return __atomic_sub_fetch(&pf->refcnt, 1, __ATOMIC_ACQ_REL) == 0;
+}
+
+/*
+ * Remove LRU entries until the shard fits its capacity, and the pool
+ * would have room for want bytes more once those removed are closed,
+ * sparing those hit since they were last passed over.  Returns the
+ * list of pagefiles, chained through lru_next, whose last reference
+ * was the cache's own; the caller closes them once the lock is dropped.
+ */
+static struct pgdb_pagefile *shard_evict(struct pgdb_pfcache_shard *sh,
+					 struct pgdb_pool *pool, size_t want)
+{
+	struct pgdb_pagefile *dead = NULL;
+	unsigned int spared = 0;
+	size_t freeing = 0;
+
+	while ((sh->n_open > sh->capacity ||
+		!pg_pool_room(pool, want, freeing)) && sh->lru_tail) {
+		struct pgdb_pagefile *victim = sh->lru_tail;
+		lru_unlink(sh, victim);
+
+		if (spared < sh->n_open &&
+		    __atomic_exchange_n(&victim->referenced, false,
+					__ATOMIC_RELAXED)) {
+			lru_push(sh, victim);
+			spared++;
+			continue;
+		}
+
+		hash_unlink(sh, victim);
+		sh->n_open--;
+		freeing += victim->charge;
+
+		if (pf_unref(victim)) {
+			victim->lru_next = dead;
+			dead = victim;
+		}
+	}
+
+	return dead;
+}
+
+static void pf_retired(struct pgdb_retired *node)
+{
+	pg_pagefile_close(container_of(node, struct pgdb_pagefile, retired));
+}
+
+// close pf, its last reference dropped, once no reader can reach it
+static void pf_retire(struct pgdb_pagefile *pf)
+{
+	struct pgdb_epoch *ep = pf->epoch;
+	bool charged = pf->charge;
+
+	pg_epoch_retire(ep, &pf->retired, pf_retired);
+
+	// memory read into is given back as soon as it can be
+	if (charged)
+		pg_epoch_collect(ep);
+}
+
+static void pf_pin_release(struct pgdb_pinned_t *pin)
+{
+	pg_pagefile_put(container_of(pin, struct pgdb_pagefile, pin));
+}
+
+static void retire_list(struct pgdb_pagefile *dead)
+{
+	while (dead) {
+		struct pgdb_pagefile *next = dead->lru_next;
+		pf_retire(dead);
+		dead = next;
+	}
+}
+
+// no reader is left to reach these
+static void close_list(struct pgdb_pagefile *dead)
+{
+	while (dead) {
+		struct pgdb_pagefile *next = dead->lru_next;
+		pg_pagefile_close(dead);
+		dead = next;
+	}
+}
+
+void pg_pfcache_free(struct pgdb_pfcache *cache)
+{
+	if (!cache)
+		return;
+
+	unsigned int i;
+	for (i = 0; i < PGDB_PFCACHE_SHARDS; i++) {
+		struct pgdb_pfcache_shard *sh = &cache->shard[i];
+
+		sh->capacity = 0;
+		close_list(shard_evict(sh, cache->pool, 0));
+
+		free(sh->hash);
+		pthread_mutex_destroy(&sh->lock);
+	}
+
+	memset(cache, 0xff, sizeof(*cache));
+	free(cache);
+}
+
+struct pgdb_pfcache *pg_pfcache_new(unsigned int max_open_files,
+				    struct pgdb_pool *pool)
+{
+	struct pgdb_pfcache *cache = NULL;
+	if (posix_memalign((void **) &cache, 64, sizeof(*cache)))
+		return NULL;
+	memset(cache, 0, sizeof(*cache));
+
+	cache->pool = pool;
+
+	// fewer shards for a small budget, so each has a file or more;
+	// the budget is spread exactly, the first shards taking the rest
+	unsigned int n_shards = PGDB_PFCACHE_SHARDS;
+	while (n_shards > 1 && n_shards > max_open_files)
+		n_shards >>= 1;
+	cache->shard_mask = n_shards - 1;
+
+	unsigned int per_shard = max_open_files / n_shards;
+	unsigned int extra = max_open_files % n_shards;
+
+	unsigned int n_buckets = 16;
+	while (n_buckets < per_shard + 1)
+		n_buckets <<= 1;
+
+	unsigned int i;
+	for (i = 0; i < PGDB_PFCACHE_SHARDS; i++) {
+		struct pgdb_pfcache_shard *sh = &cache->shard[i];
+
+		pthread_mutex_init(&sh->lock, NULL);
+		if (i < n_shards)
+			sh->capacity = per_shard + (i < extra);
+		sh->hash_mask = n_buckets - 1;
+		sh->hash = calloc(n_buckets, sizeof(struct pgdb_pagefile *));
+		if (!sh->hash) {
+			pg_pfcache_free(cache);
+			return NULL;
+		}
+	}
+
+	return cache;
+}
+
+/*
+ * Return the open pagefile for file_id, opening and caching it if
+ * needed.  The caller owns one reference, dropped by pg_pagefile_put().
+ */
+struct pgdb_pagefile *pg_pagefile_get(struct pgdb_table_t *table,
+				      uint64_t file_id, char **errptr)
+{
+	struct pgdb_pfcache *cache = table->pfcache;
+	uint64_t hash = file_hash(file_id);
+	struct pgdb_pfcache_shard *sh = shard_of(cache, hash);
+	struct pgdb_guard guard;
+
+	pg_epoch_enter(table->db->epoch, &guard);
+
+	struct pgdb_pagefile *pf = shard_lookup(sh, file_id, hash);
+	if (pf && !pf_tryref(pf))
+		pf = NULL;		// being evicted; open it anew
+
+	pg_epoch_leave(&guard);
+
+	if (pf) {
+		if (!__atomic_load_n(&pf->referenced, __ATOMIC_RELAXED))
+			__atomic_store_n(&pf->referenced, true,
+					 __ATOMIC_RELAXED);
+		return pf;
+	}
+
+	// miss: open and map outside the lock
+	struct pgdb_pagefile *new_pf = pg_pagefile_open(table->db, file_id,
+							    errptr);
+	if (!new_pf)
+		return NULL;
+
+	pthread_mutex_lock(&sh->lock);
+
+	// another reader may have opened the same file meanwhile
+	pf = shard_lookup(sh, file_id, hash);
+	if (pf) {
+		__atomic_add_fetch(&pf->refcnt, 1, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&sh->lock);
+		pg_pagefile_close(new_pf);
+		return pf;
+	}
+
+	pf = new_pf;
+	pf->refcnt = 2;			// cache + caller
+	pf->pin.release = pf_pin_release;
+	pf->charge = pf->map->pool ? pf->map->st.st_size : 0;
+	struct pgdb_pagefile **bucket = bucket_of(sh, hash);
+	pf->hnext = *bucket;
+	__atomic_store_n(bucket, pf, __ATOMIC_RELEASE);
+	lru_push(sh, pf);
+	sh->n_open++;
+
+	// read in, but mapped for want of room: make room for next time
+	size_t want = 0;
+	if (table->db->opt->io != PGDB_IO_MMAP && !pf->charge &&
+	    pf->map->st.st_size <= cache->pool->capacity)
+		want = pf->map->st.st_size;
+
+	struct pgdb_pagefile *dead = shard_evict(sh, cache->pool, want);
+
+	pthread_mutex_unlock(&sh->lock);
+
+	retire_list(dead);
+
+	return pf;
+}
+
+void pg_pagefile_put(struct pgdb_pagefile *pf)
+{
+	if (!pf)
+		return;
+
+	if (pf_unref(pf))
+		pf_retire(pf);
+}
+
+// forget a pagefile about to be deleted; current readers keep it mapped
+void pg_pfcache_evict(struct pgdb_pfcache *cache, uint64_t file_id)
+{
+	uint64_t hash = file_hash(file_id);
+	struct pgdb_pfcache_shard *sh = shard_of(cache, hash);
+
+	pthread_mutex_lock(&sh->lock);
+
+	struct pgdb_pagefile *pf = shard_lookup(sh, file_id, hash);
+	if (pf) {
+		lru_unlink(sh, pf);
+		hash_unlink(sh, pf);
+		sh->n_open--;
+	}
+
+	pthread_mutex_unlock(&sh->lock);
+
+	pg_pagefile_put(pf);
+}
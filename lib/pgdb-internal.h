@@ -2,21 +2,130 @@
 #define __PGDB_INTERNAL_H__
 
 #include <sys/stat.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <pthread.h>
+#include <string.h>
+#include <endian.h>
 #include "pgdb.h"
 #include "PGcodec.pb-c.h"
 
 struct dirent;
+struct dstring;
+
+#define container_of(ptr, type, member) \
+	((type *) ((char *) (ptr) - offsetof(type, member)))
 
 #define PGDB_SB_FN		"superblock"
 #define PGDB_SB_MAGIC		"PGDBSUPR"
 #define PGDB_ROOT_MAGIC		"PGDBROOT"
+#define PGDB_ROOT_FLAT_MAGIC	"PGDBRFLT"	// in a PGDB_ROOT_MAGIC file
 #define PGDB_PAGE_MAGIC		"PGDBPAGE"
+#define PGDB_LOG_MAGIC		"PGDBWLOG"
+#define PGDB_LOG_SUFFIX		".log"
+#define PGDB_MANIFEST_MAGIC	"PGDBMNFS"
+#define PGDB_MANIFEST_SUFFIX	".manifest"
 
 enum {
 	PGDB_TRAIL_SZ		= 32,		// sha256
 
-	PGDB_MAX_TABLES		= 1,
+	PGDB_CHUNK_SHIFT	= 16,		// hashed in 64K chunks
+	PGDB_CHUNK_SHIFT_MIN	= 12,
+	PGDB_CHUNK_SHIFT_MAX	= 30,
+	PGDB_MERKLE_THREADS	= 8,		// per file verified
+	PGDB_MERKLE_SPAN_MIN	= 16,		// chunks per thread
+
+	PGDB_MAX_TABLES		= 256,		// per session, dropped included
+
+	PGDB_PAGE_V0		= 0,		// bare sorted index
+	PGDB_PAGE_V1		= 1,		// + meta block, restart points
+	PGDB_PAGE_V2		= 2,		// + compressed value blocks
+	PGDB_PAGE_VERSION	= PGDB_PAGE_V2,
+
+	PGDB_DEF_RESTART_INTERVAL = 16,
+	PGDB_DEF_BLOCK_SIZE	= 4096,		// compressed value blocks
+	PGDB_DEF_MAX_OPEN_FILES	= 1000,
+
+	PGDB_PFCACHE_SHARDS	= 16,		// power of 2
+	PGDB_DIRECT_ALIGN	= 4096,		// O_DIRECT buffers and lengths
+	PGDB_PAGE_REGIONS	= 3,		// see pg_pagefile_regions()
+
+	PGDB_DEF_CACHE_SIZE	= 8 * 1024 * 1024,	// per db, if not shared
+	PGDB_CACHE_SHARDS	= 16,		// power of 2
+	PGDB_CACHE_HOT_PCT	= 50,		// of a shard, at most
+
+	PGDB_DEF_WRITE_BUFFER	= 4 * 1024 * 1024,
+	PGDB_MT_MAX_HEIGHT	= 12,
+	PGDB_MAX_MEMTABLES	= 8,		// mutable + immutables
+
+	PGDB_WAL_GROUP_MAX	= 128,		// writers per commit group
+	PGDB_WAL_GROUP_BYTES	= 1024 * 1024,
+	PGDB_WAL_MAX_LOGS	= 16,		// a write buffer may span
+
+	PGDB_DEF_MAX_FILE_SIZE	= 2 * 1024 * 1024,
+
+	PGDB_FW_BUF_SIZE	= 1024 * 1024,	// file writer buffer
+	PGDB_FW_BUF_MIN		= 4096,
+	PGDB_FW_RESERVE_STEP	= 8 * 1024 * 1024,	// fallocate ahead
+
+	PGDB_COMPACT_TRIGGER	= 4,		// runs per table
+	PGDB_COMPACT_SIZE_RATIO	= 2,
+
+	PGDB_MANIFEST_MIN	= 64 * 1024,	// bytes, before a checkpoint
+
+	PGDB_EPOCH_SLOTS	= 64,		// power of 2
+	PGDB_EPOCH_BATCH	= 64,		// retired, before readers collect
+
+	PGDB_GETQ_DEF_DEPTH	= 128,		// lookups in flight
+	PGDB_GETQ_MAX_DEPTH	= 4096,
+	PGDB_AGET_SPAN_MAX	= 64 * 1024,	// keys read, per pagefile
+};
+
+// pgdb_page_index.flags
+enum {
+	PGDB_PI_DELETED		= (1U << 0),	// tombstone; no value
+};
+
+// pgdb_page_meta.compression
+enum pgdb_compression {
+	PGDB_COMP_NONE		= 0,		// keys and values interleaved
+	PGDB_COMP_SNAPPY	= 1,		// values in snappy blocks
+};
+
+// pgdb_options_t.io: how pagefiles are read
+enum pgdb_io {
+	PGDB_IO_MMAP		= 0,		// mapped, cached by the kernel
+	PGDB_IO_READ		= 1,		// read whole, into the pool
+	PGDB_IO_DIRECT		= 2,		// likewise, past the page cache
+};
+
+// pgdb_options_t.warmup
+enum pgdb_warmup {
+	PGDB_WARMUP_NONE	= 0,
+	PGDB_WARMUP_PREFETCH	= 1,		// fault in pagefile indexes
+	PGDB_WARMUP_LOCK	= 2,		// and mlock them, and roots
+};
+
+// pgdb_page_vblock.flags
+enum {
+	PGDB_VB_RAW		= (1U << 0),	// stored uncompressed
+};
+
+// pgdb_page_meta.csum_type: what pgdb_page_index k_csum/v_csum hold
+enum pgdb_csum_type {
+	PGDB_CSUM_SHA256	= 0,		// first 4 of sha256
+	PGDB_CSUM_CRC32C	= 1,		// crc32c, little-endian
+};
+
+enum pgdb_rec_type {
+	PGDB_REC_DEL		= 0,
+	PGDB_REC_PUT		= 1,
+};
+
+enum pgdb_mt_result {
+	PGDB_MT_MISS,
+	PGDB_MT_FOUND,
+	PGDB_MT_DELETED,
 };
 
 typedef unsigned char pg_uuid_t[16];
@@ -24,6 +133,50 @@ typedef unsigned char pg_uuid_t[16];
 struct pgdb_file_header {
 	unsigned char		magic[8];
 	uint32_t		len;
+	uint32_t		chunk_shift;	// 0 == one trailing digest
+};
+
+// pgdb_root_hdr.version
+enum {
+	PGDB_ROOT_V0		= 0,		// RootIdx message; no header
+	PGDB_ROOT_V1		= 1,		// flat
+	PGDB_ROOT_VERSION	= PGDB_ROOT_V1,
+};
+
+/*
+ * A flat root index, the data of a PGDB_ROOT_MAGIC file: this header,
+ * pgdb_root_ent[n_entries] grouped by run, newest first, and by key
+ * within a run, then their key bytes.  Offsets are from the header.
+ */
+struct pgdb_root_hdr {
+	unsigned char		magic[8];	// PGDB_ROOT_FLAT_MAGIC
+	uint32_t		version;	// PGDB_ROOT_V*
+	uint32_t		n_entries;
+	uint32_t		key_offset;
+	uint32_t		reserved[3];
+};
+
+struct pgdb_root_ent {
+	uint64_t		file_id;
+	uint64_t		run_id;
+	uint32_t		k_offset;
+	uint32_t		k_len;
+	uint32_t		n_records;
+	uint32_t		reserved;
+};
+
+/*
+ * A manifest record, in a "<root id>.manifest" file after its
+ * pgdb_file_header: the ids of the pagefiles removed from the root,
+ * n_del little-endian uint64s, then the entries added to it, as
+ * pgdb_root_ent[n_add] with offsets from the payload, then their keys.
+ */
+struct pgdb_manifest_hdr {
+	uint32_t		len;		// payload bytes
+	uint32_t		n_del;
+	uint32_t		n_add;
+	uint32_t		crc;		// crc32c of payload
+	uint32_t		hdr_crc;	// crc32c of the fields above
 	uint32_t		reserved;
 };
 
@@ -31,6 +184,64 @@ struct pgdb_options_t {
 	bool			readonly;
 	bool			create_missing;
 	bool			error_if_exists;
+	unsigned int		restart_interval;
+	unsigned int		max_open_files;
+	pgdb_filterpolicy_t	*filter_policy;
+	size_t			write_buffer_size;
+	size_t			max_file_size;
+	enum pgdb_csum_type	csum_type;		// of pagefiles written
+	size_t			bytes_per_sync;		// 0 == at the end
+	enum pgdb_compression	compression;		// of pagefiles written
+	size_t			block_size;
+	pgdb_cache_t		*cache;			// NULL: one per db
+	enum pgdb_io		io;			// of pagefiles
+	size_t			read_pool_size;		// 0: unlimited
+	enum pgdb_warmup	warmup;			// at open
+};
+
+// per-table settings; zero takes the database's
+struct pgdb_tableoptions_t {
+	size_t			write_buffer_size;
+	size_t			max_file_size;
+	unsigned int		max_open_files;
+	unsigned int		compact_trigger;
+};
+
+struct pgdb_writeoptions_t {
+	bool			sync;
+};
+
+// records encoded back to back, as in a log entry; see wal.c
+struct pgdb_writebatch_t {
+	struct dstring		*rep;
+	unsigned int		count;
+	char			*err;		// first failure, for pgdb_write
+};
+
+struct pgdb_readoptions_t {
+	bool			verify_checksums;
+	bool			fill_cache;
+	const pgdb_snapshot_t	*snapshot;
+};
+
+struct pgdb_filterpolicy_t {
+	void			*state;
+	void			(*destructor)(void *);
+	char			*(*create_filter)(void *,
+					const char * const *key_array,
+					const size_t *key_length_array,
+					int num_keys, size_t *filter_length);
+	unsigned char		(*key_may_match)(void *,
+					const char *key, size_t length,
+					const char *filter,
+					size_t filter_length);
+	const char		*(*name)(void *);
+};
+
+struct pgdb_filter_blk {
+	unsigned int		refcnt;
+	size_t			len;
+	char			data[];
 };
 
 struct pgdb_map {
@@ -38,36 +249,407 @@ struct pgdb_map {
 	int			fd;
 	struct stat		st;
 	void			*mem;
+	struct pgdb_pool	*pool;		// read into, not mapped
+	bool			locked;		// partly mlock()ed
+};
+
+// a byte range of a file, or of its mapping
+struct pgdb_region {
+	uint64_t		offset;
+	uint64_t		len;
+};
+
+// memory pagefiles are read into, rather than mapped; see map.c
+struct pgdb_pool {
+	size_t			capacity;	// 0: any
+	size_t			used;		// by pagefiles read, until freed
 };
 
+// room in pool for len bytes more, once freeing bytes are given back?
+static inline bool pg_pool_room(struct pgdb_pool *pool, size_t len,
+				size_t freeing)
+{
+	return !pool->capacity ||
+	       __atomic_load_n(&pool->used, __ATOMIC_RELAXED) + len <=
+	       pool->capacity + freeing;
+}
+
 struct pgdb_page_hdr {
 	unsigned char		magic[8];
 	uint32_t		n_entries;
-	unsigned char		reserved[20];
+	uint32_t		version;		// PGDB_PAGE_V*
+	uint32_t		meta_offset;		// v1+: pgdb_page_meta
+	unsigned char		reserved[12];
+};
+
+struct pgdb_page_meta {
+	uint32_t		restart_interval;
+	uint32_t		n_restarts;
+	uint32_t		restart_offset;		// pgdb_page_restart[]
+	uint32_t		filter_offset;
+	uint32_t		filter_len;		// 0 == no filter
+	uint32_t		filter_id;		// pg_filter_id() of policy
+	uint32_t		csum_type;		// PGDB_CSUM_*
+	uint32_t		chunk_shift;		// 0 == no chunk digests
+	uint32_t		digest_offset;		// chunk digests of [0, here)
+	uint32_t		compression;		// PGDB_COMP_*
+	uint32_t		vblock_offset;		// pgdb_page_vblock[]
+	uint32_t		n_vblocks;
+	uint32_t		reserved[4];
+};
+
+// fence key of every restart_interval'th index entry, packed so that a
+// binary search over them touches a few cache lines, not the whole index
+struct pgdb_page_restart {
+	uint64_t		prefix;			// big-endian key prefix
+	uint32_t		index;			// page index slot
+	uint32_t		reserved;
 };
 
 struct pgdb_page_index {
 	uint32_t		k_offset;
 	uint32_t		k_len;
-	unsigned char		k_csum[4];		// first 4 of sha256
-	uint32_t		reserved1;
+	unsigned char		k_csum[4];		// PGDB_CSUM_*
+	uint32_t		v_block;		// compressed: value block
 
-	uint32_t		v_offset;
+	uint32_t		v_offset;		// compressed: in v_block
 	uint32_t		v_len;
-	unsigned char		v_csum[4];		// first 4 of sha256
-	uint32_t		reserved2;
+	unsigned char		v_csum[4];		// PGDB_CSUM_*
+	uint32_t		flags;			// PGDB_PI_*
+};
+
+// a block of values, of a compressed pagefile; all of the values of
+// the block's records, back to back
+struct pgdb_page_vblock {
+	uint32_t		offset;
+	uint32_t		c_len;			// as stored
+	uint32_t		raw_len;
+	uint32_t		flags;			// PGDB_VB_*
+};
+
+// an unpublished object, freed once no reader can reach it; see epoch.c
+struct pgdb_retired {
+	struct pgdb_retired	*next;
+	uint64_t		epoch;		// when retired
+	void			(*free)(struct pgdb_retired *node);
+};
+
+struct pgdb_epoch_slot {
+	unsigned int		readers[2];	// by epoch parity
+} __attribute__((aligned(64)));
+
+struct pgdb_epoch {
+	uint64_t		global;
+	struct pgdb_epoch_slot	slot[PGDB_EPOCH_SLOTS];
+
+	pthread_mutex_t		lock;
+	struct pgdb_retired	*retired;	// newest first
+	unsigned int		n_retired;
+};
+
+// a reader's stay in an epoch
+struct pgdb_guard {
+	struct pgdb_epoch	*ep;
+	unsigned int		*readers;
+};
+
+// a reference keeping a value returned by pgdb_get_pinned() in place
+struct pgdb_pinned_t {
+	void			(*release)(struct pgdb_pinned_t *pin);
+};
+
+// a value block, uncompressed
+struct pgdb_vblock {
+	unsigned int		refcnt;
+	uint64_t		file_id;
+	uint32_t		block;
+	size_t			len;
+
+	// block cache linkage; see cache.c
+	uint64_t		cache_id;	// of the db
+	size_t			charge;
+	bool			hot;		// in the hot pool
+	struct pgdb_vblock	*hnext;
+	struct pgdb_vblock	*lru_prev;
+	struct pgdb_vblock	*lru_next;
+
+	struct pgdb_pinned_t	pin;
+	char			data[];
+};
+
+struct pgdb_cache_lru {
+	struct pgdb_vblock	*head;		// most recently used
+	struct pgdb_vblock	*tail;
+	size_t			usage;
+};
+
+struct pgdb_cache_shard {
+	pthread_mutex_t		lock;
+	size_t			capacity;
+	size_t			usage;
+	unsigned int		n_ents;
+	unsigned int		hash_mask;
+	struct pgdb_vblock	**hash;
+	struct pgdb_cache_lru	hot;		// hit since cached
+	struct pgdb_cache_lru	cold;		// not yet
+} __attribute__((aligned(64)));
+
+struct pgdb_cache_t {
+	struct pgdb_cache_shard	shard[PGDB_CACHE_SHARDS];
 };
 
 struct pgdb_pagefile {
 	struct pgdb_map		*map;
 	uint32_t		n_entries;
 	struct pgdb_page_index	*pi;
+
+	uint32_t		version;
+	uint32_t		n_restarts;
+	struct pgdb_page_restart *rs;
+	enum pgdb_csum_type	csum_type;
+
+	// chunks checked so far, one bit each; see merkle.c
+	unsigned int		chunk_shift;
+	uint32_t		digest_offset;
+	const unsigned char	*digests;
+	uint64_t		*verified;
+
+	enum pgdb_compression	compression;
+	uint32_t		n_vblocks;
+	struct pgdb_page_vblock	*vb;
+	pgdb_cache_t		*cache;		// of uncompressed blocks
+	uint64_t		cache_id;
+
+	// open-pagefile cache linkage; see pfcache.c
+	uint64_t		file_id;
+	unsigned int		refcnt;
+	size_t			charge;		// held of the pool
+	bool			referenced;	// hit since last passed over
+	struct pgdb_pagefile	*hnext;
+	struct pgdb_pagefile	*lru_prev;
+	struct pgdb_pagefile	*lru_next;
+	struct pgdb_epoch	*epoch;		// closed through
+	struct pgdb_retired	retired;
+
+	struct pgdb_pinned_t	pin;
+};
+
+struct pgdb_pfcache_shard {
+	pthread_mutex_t		lock;
+	unsigned int		n_open;
+	unsigned int		capacity;
+	unsigned int		hash_mask;
+	struct pgdb_pagefile	**hash;
+	struct pgdb_pagefile	*lru_head;	// most recently used
+	struct pgdb_pagefile	*lru_tail;
+} __attribute__((aligned(64)));
+
+struct pgdb_pfcache {
+	struct pgdb_pfcache_shard shard[PGDB_PFCACHE_SHARDS];
+	unsigned int		shard_mask;	// of the shards in use
+	struct pgdb_pool	*pool;		// of the db
+};
+
+struct pgdb_mt_node {
+	uint64_t		seq;
+	uint32_t		k_len;
+	uint32_t		v_len;
+	uint8_t			type;		// enum pgdb_rec_type
+	uint8_t			height;
+	struct pgdb_mt_node	*next[];	// then key, value bytes
+};
+
+struct mt_arena_blk;
+
+struct pgdb_memtable {
+	unsigned int		refcnt;
+	struct pgdb_pinned_t	pin;
+
+	struct pgdb_mt_node	*head;
+	unsigned int		height;
+	uint32_t		rng;
+	size_t			n_entries;
+	size_t			mem_usage;	// arena bytes handed out
+	uint64_t		log_id;		// first log holding its data,
+						// 0 while empty
+	uint64_t		log_seq;	// db->log_seq of log_id
+
+	struct mt_arena_blk	*arena;
+	char			*arena_cur;
+	size_t			arena_left;
+};
+
+struct pgdb_memset {
+	unsigned int		refcnt;
+	unsigned int		n_mt;
+	struct pgdb_memtable	*mt[PGDB_MAX_MEMTABLES];
+	struct pgdb_retired	retired;	// once replaced
+};
+
+static inline const char *pg_mt_key(const struct pgdb_mt_node *n)
+{
+	return (const char *) &n->next[n->height];
+}
+
+static inline const char *pg_mt_val(const struct pgdb_mt_node *n)
+{
+	return pg_mt_key(n) + n->k_len;
+}
+
+struct pgdb_wal_hdr {
+	uint32_t		len;		// payload bytes
+	uint32_t		crc;		// crc32c of payload
+	uint64_t		seq;		// sequence of first record
+	uint32_t		count;		// records in payload
+	uint32_t		table_id;	// TableMeta.table_id
+	uint32_t		hdr_crc;	// crc32c of the fields above
+	uint32_t		reserved;
+};
+
+// one pending pgdb_write, queued for group commit
+struct pgdb_writer {
+	const void		*rep;		// encoded records
+	size_t			rep_len;
+	unsigned int		count;
+	unsigned int		table_slot;
+	bool			sync;
+
+	bool			done;
+	bool			ok;
+	char			*err;
+	uint64_t		seq;
+	pthread_cond_t		cv;
+	struct pgdb_writer	*next;
+};
+
+struct pgdb_fence_ent {
+	uint64_t		prefix;		// first 8 key bytes, big-endian
+	const void		*key;		// points into RootIdx
+	uint64_t		file_id;
+	uint32_t		k_len;
+	uint32_t		rank;		// index into RootIdx entries
+};
+
+struct pgdb_fence {
+	unsigned int		n_entries;
+	struct pgdb_fence_ent	*ent;		// Eytzinger order, 1-based
+};
+
+// one sorted run: pagefiles with disjoint key ranges, written together
+struct pgdb_run {
+	uint64_t		run_id;		// higher is newer
+	unsigned int		n_ents;
+	PGcodec__RootEnt	**ents;		// by key; point into root
+	struct pgdb_fence	*fence;
+	struct pgdb_filter_blk	**filters;	// by rank, lazy
+};
+
+/*
+ * An immutable, refcounted view of a table's root index.  Installing a
+ * new root publishes a new generation; readers keep using the one they
+ * referenced until done.  Each superseded generation holds a reference
+ * on its successor, so generations die oldest first, and each deletes
+ * the files its successor dropped.
+ */
+struct pgdb_rootgen {
+	unsigned int		refcnt;
+	pgdb_t			*db;
+	struct pgdb_table_t	*table;
+	struct pgdb_rootgen	*next;		// successor, once superseded
+	uint64_t		*obsolete;	// files to remove when freed
+	unsigned int		n_obsolete;
+
+	uint64_t		root_id;	// last checkpoint
+	PGcodec__RootIdx	*root;		// with its manifest applied
+	struct pgdb_map		*root_map;	// flat roots: keys point here
+	PGcodec__RootEnt	**ents;		// root entries, grouped by run
+	uint64_t		max_run_id;
+	unsigned int		n_runs;
+	struct pgdb_run		*runs;		// newest first
+
+	struct pgdb_retired	retired;	// once superseded
+};
+
+// writes a new file front to back, through a fixed buffer; see filewriter.c
+struct pgdb_filewriter {
+	ProtobufCBuffer		pbuf;		// for *__pack_to_buffer()
+	int			fd;
+	char			*pathname;
+	char			*err;		// first failure; sticky
+	size_t			bytes_per_sync;
+
+	char			*buf;
+	size_t			buf_len;
+	size_t			buf_size;
+
+	uint64_t		offset;		// bytes appended
+	uint64_t		flushed;	// bytes written out
+	uint64_t		reserved;	// fallocate(2)d up to
+	uint64_t		synced;		// writeback started up to
+	bool			no_reserve;
+
+	struct pgdb_merkle	*merkle;	// digests of what is appended
+	char			magic[8];	// of a wrapped file
+};
+
+// accumulates sorted records into a run of new pagefiles
+struct pgdb_pagebuild {
+	pgdb_t			*db;
+	uint64_t		run_id;
+	size_t			max_file_size;
+
+	struct pgdb_page_index	*pi;		// offsets relative to data
+	uint32_t		n_entries;
+	uint32_t		alloc_entries;
+	char			*data;		// key and value bytes
+	size_t			data_len;
+	size_t			data_alloc;
+
+	PGcodec__RootEnt	**ents;		// finished pagefiles
+	unsigned int		n_ents;
+	unsigned int		alloc_ents;
+};
+
+// what a read of one table sees: its memtables and runs, up to seq;
+// none, if the table was dropped
+struct pgdb_view {
+	struct pgdb_memset	*ms;
+	struct pgdb_rootgen	*rg;
+	uint64_t		seq;
+	struct pgdb_guard	guard;		// see pg_view_enter()
+};
+
+// every table's view, taken at one instant
+struct pgdb_snapshot_t {
+	pgdb_t			*db;		// taken of
+	unsigned int		n_tables;
+	struct pgdb_view	view[];		// by table slot
 };
 
-struct pgdb_table {
+/*
+ * A table, or column family: a key space of its own, with its own root
+ * index, memtables, open-pagefile cache and settings, sharing the log
+ * and the background threads.  Once opened, a table stays allocated
+ * until the database closes, so handles never dangle; dropping it
+ * only detaches its data.
+ */
+struct pgdb_table_t {
+	pgdb_t				*db;
+	unsigned int			slot;		// in db->tables
+	uint32_t			id;		// TableMeta.table_id
 	char				*name;
-	uint64_t			root_id;
-	PGcodec__RootIdx		*root;
+	struct pgdb_tableoptions_t	opt;		// resolved
+	struct pgdb_pfcache		*pfcache;
+
+	int				manifest_fd;	// under root_lock
+	uint64_t			manifest_len;
+	bool				manifest_broken;
+
+	// set under db->lock; readers load the pointers atomically,
+	// both NULL once dropped
+	bool				dropped;
+	struct pgdb_rootgen		*rootgen;
+	struct pgdb_memset		*memset;
 };
 
 struct pgdb_t {
@@ -76,44 +658,351 @@ struct pgdb_t {
 
 	unsigned long			next_file_id;
 
+	pgdb_cache_t			*cache;
+	bool				own_cache;
+	uint64_t			cache_id;	// keys its blocks
+
+	pthread_mutex_t			lock;
+	uint64_t			last_seq;
+	struct pgdb_epoch		*epoch;		// reclaims for readers
+	struct pgdb_pool		pool;		// pagefiles read
+
+	struct pgdb_writer		*writers_head;	// under lock
+	struct pgdb_writer		*writers_tail;
+	int				log_fd;		// leader only
+	uint64_t			log_id;
+	uint64_t			log_seq;	// logs started
+	bool				log_broken;
+
+	pthread_mutex_t			root_lock;	// root installs
+	pthread_mutex_t			compact_lock;	// one compaction
+
+	pthread_t			bg_thread;	// flushes
+	pthread_t			compact_thread;
+	bool				bg_started;
+	pthread_cond_t			bg_cv;		// under lock
+	pthread_cond_t			compact_cv;	// under lock
+	pthread_cond_t			idle_cv;	// under lock
+	bool				flushing;	// under lock
+	bool				compacting;	// under lock
+	bool				bg_shutdown;
+	char				*bg_error;
+
 	PGcodec__Superblock		*superblock;
-	unsigned int			n_tables;
-	struct pgdb_table		tables[PGDB_MAX_TABLES];
+	unsigned int			n_tables;	// under lock
+	struct pgdb_table_t		*tables[PGDB_MAX_TABLES];
 };
 
 extern void pgmap_free(struct pgdb_map *map);
 extern struct pgdb_map *pgmap_open(const char *pathname, char **errptr);
+extern struct pgdb_map *pgmap_read(const char *pathname, bool direct,
+				   struct pgdb_pool *pool, char **errptr);
+extern void pgmap_advise(struct pgdb_map *map, int advice);
+extern void pgmap_prefetch(struct pgdb_map *map, uint64_t offset,
+			   uint64_t len);
+extern void pgmap_populate(struct pgdb_map *map, uint64_t offset,
+			   uint64_t len);
+extern bool pgmap_lock(struct pgdb_map *map, uint64_t offset, uint64_t len,
+		       char **errptr);
+extern struct pgdb_map *pgmap_anon(size_t size, char **errptr);
+extern void pgmap_seal(struct pgdb_map *map);
+
+// manifest.c
+extern bool pg_manifest_replay(struct pgdb_table_t *table, uint64_t root_id,
+			       PGcodec__RootIdx **root,
+			       struct pgdb_map **root_map, char **errptr);
+extern bool pg_manifest_due(const struct pgdb_table_t *table,
+			    size_t root_len);
+extern bool pg_manifest_append(struct pgdb_table_t *table, uint64_t root_id,
+			       PGcodec__RootEnt **add, unsigned int n_add,
+			       const uint64_t *del, unsigned int n_del,
+			       char **errptr);
+extern void pg_manifest_close(struct pgdb_table_t *table);
+extern void pg_manifest_reset(struct pgdb_table_t *table,
+			      uint64_t old_root_id);
+extern bool pg_manifest_remove(pgdb_t *db, uint64_t root_id);
 
-extern bool pg_write_root(pgdb_t *db, PGcodec__RootIdx *root, unsigned int n,
+// root.c
+extern int pg_root_ent_cmp(const void *a, const void *b);
+extern void pg_root_ent_encode(struct pgdb_root_ent *re,
+			       const PGcodec__RootEnt *ent, uint32_t k_offset);
+extern void pg_root_ent_decode(PGcodec__RootEnt *ent,
+			       const struct pgdb_root_ent *re, const void *data);
+extern bool pg_write_root(pgdb_t *db, PGcodec__RootIdx *root, uint64_t n,
 		   char **errptr);
-extern bool pg_read_root(pgdb_t *db, PGcodec__RootIdx **root, unsigned int n,
-		  char **errptr);
-extern int pg_find_rootent(PGcodec__RootIdx *root, const void *key, size_t klen);
+extern bool pg_read_root(pgdb_t *db, PGcodec__RootIdx **root,
+			 struct pgdb_map **map, uint64_t n, char **errptr);
+extern void pg_root_free(PGcodec__RootIdx *root, struct pgdb_map *map);
+extern size_t pg_root_size(PGcodec__RootEnt **ents, size_t n);
+extern PGcodec__RootIdx *pg_root_build(PGcodec__RootEnt **ents, size_t n,
+				       struct pgdb_map **map, char **errptr);
+
+// rootgen.c
+extern struct pgdb_rootgen *pg_rootgen_new(struct pgdb_table_t *table,
+					   PGcodec__RootIdx *root,
+					   struct pgdb_map *root_map,
+					   uint64_t root_id,
+					   const struct pgdb_rootgen *prev,
+					   char **errptr);
+extern void pg_rootgen_ref(struct pgdb_rootgen *rg);
+extern void pg_rootgen_unref(struct pgdb_rootgen *rg);
+extern struct pgdb_rootgen *pg_rootgen_write(pgdb_t *db,
+				struct pgdb_table_t *table,
+				PGcodec__RootEnt **add, unsigned int n_add,
+				const uint64_t *del, unsigned int n_del,
+				char **errptr);
+extern struct pgdb_rootgen *pg_rootgen_swap(struct pgdb_table_t *table,
+					    struct pgdb_rootgen *rg);
+extern void pg_rootgen_retire(struct pgdb_rootgen *rg);
+
+// table.c
+extern void pg_table_free(struct pgdb_table_t *table);
+extern struct pgdb_table_t *pg_table_open(pgdb_t *db, PGcodec__TableMeta *tm,
+					  char **errptr);
+extern struct pgdb_table_t *pg_find_table(pgdb_t *db, uint32_t table_id);
+extern uint64_t pg_min_log_id(pgdb_t *db);
+
+// snapshot.c
+extern bool pg_view_enter(pgdb_t *db, unsigned int table_slot,
+			  const pgdb_readoptions_t *options,
+			  struct pgdb_view *view, char **errptr);
+extern void pg_view_leave(struct pgdb_view *view);
+extern bool pg_view_get(pgdb_t *db, unsigned int table_slot,
+			const pgdb_readoptions_t *options,
+			struct pgdb_view *view, char **errptr);
+extern void pg_view_put(struct pgdb_view *view);
+
+// epoch.c
+extern struct pgdb_epoch *pg_epoch_new(void);
+extern void pg_epoch_free(struct pgdb_epoch *ep);
+extern void pg_epoch_enter(struct pgdb_epoch *ep, struct pgdb_guard *g);
+extern void pg_epoch_leave(struct pgdb_guard *g);
+extern void pg_epoch_retire(struct pgdb_epoch *ep, struct pgdb_retired *node,
+			    void (*free_fn)(struct pgdb_retired *));
+extern void pg_epoch_collect(struct pgdb_epoch *ep);
+extern void pg_epoch_drain(struct pgdb_epoch *ep);
+
+// pagebuild.c
+extern struct pgdb_pagebuild *pg_pagebuild_new(pgdb_t *db, uint64_t run_id,
+					       size_t max_file_size);
+extern bool pg_pagebuild_add(struct pgdb_pagebuild *pb,
+			     enum pgdb_rec_type type,
+			     const void *key, size_t klen,
+			     const void *val, size_t vlen, char **errptr);
+extern bool pg_pagebuild_finish(struct pgdb_pagebuild *pb, char **errptr);
+extern void pg_pagebuild_free(struct pgdb_pagebuild *pb, bool remove_files);
+
+// flush.c
+extern bool pg_bg_start(pgdb_t *db, char **errptr);
+extern void pg_bg_stop(pgdb_t *db);
+
+// compact.c
+extern bool pg_compact_needed(const struct pgdb_rootgen *rg);
+extern struct pgdb_table_t *pg_compact_pick(pgdb_t *db);
+extern void *pg_compact_thread(void *arg);
+
+// fence.c
+extern void pg_fence_free(struct pgdb_fence *fence);
+extern struct pgdb_fence *pg_fence_build(PGcodec__RootEnt **ents, size_t n_ents,
+				  char **errptr);
+extern const struct pgdb_fence_ent *pg_fence_find(const struct pgdb_fence *fence,
+					   const void *key, size_t klen);
 
 extern void pg_pagefile_close(struct pgdb_pagefile *pf);
-extern struct pgdb_pagefile *pg_pagefile_open(pgdb_t *db, unsigned int n,
+extern struct pgdb_pagefile *pg_pagefile_open(pgdb_t *db, uint64_t file_id,
 					char **errptr);
+
+// filter.c
+extern uint32_t pg_hash32(const void *data, size_t n, uint32_t seed);
+extern uint32_t pg_filter_id(const pgdb_filterpolicy_t *fp);
+extern void pg_filter_ref(struct pgdb_filter_blk *blk);
+extern void pg_filters_free(struct pgdb_filter_blk **filters, unsigned int n);
+extern bool pg_filter_may_match(pgdb_t *db, struct pgdb_run *run,
+				const struct pgdb_fence_ent *fe,
+				const void *key, size_t klen);
+extern char *pg_filter_create(const pgdb_options_t *opt,
+			      const char * const *keys, const size_t *key_lens,
+			      unsigned int n_keys, size_t *filter_len);
+
+// memtable.c
+extern bool pg_memtable_add(struct pgdb_memtable *mt, uint64_t seq,
+			    enum pgdb_rec_type type,
+			    const void *key, size_t klen,
+			    const void *val, size_t vlen);
+extern enum pgdb_mt_result pg_memtable_get(struct pgdb_memtable *mt,
+				const void *key, size_t klen, uint64_t seq,
+				const void **val, size_t *vlen);
+extern struct pgdb_mt_node *pg_memtable_first(struct pgdb_memtable *mt);
+extern struct pgdb_mt_node *pg_memtable_last(struct pgdb_memtable *mt);
+extern struct pgdb_mt_node *pg_memtable_next(struct pgdb_mt_node *n);
+extern struct pgdb_mt_node *pg_memtable_seek(struct pgdb_memtable *mt,
+					     const void *key, size_t klen);
+extern struct pgdb_mt_node *pg_memtable_seek_lt(struct pgdb_memtable *mt,
+						const void *key, size_t klen);
+extern void pg_memtable_unref(struct pgdb_memtable *mt);
+extern void pg_memtable_ref(struct pgdb_memtable *mt);
+extern struct pgdb_memtable *pg_memtable_new(void);
+extern void pg_memset_unref(struct pgdb_memset *ms);
+extern void pg_memset_ref(struct pgdb_memset *ms);
+extern void pg_memset_retire(pgdb_t *db, struct pgdb_memset *ms);
+extern struct pgdb_memset *pg_memset_new(struct pgdb_memtable *mt,
+					 const struct pgdb_memset *old,
+					 unsigned int n);
+
+// pfcache.c
+extern void pg_pfcache_free(struct pgdb_pfcache *cache);
+extern struct pgdb_pfcache *pg_pfcache_new(unsigned int max_open_files,
+					   struct pgdb_pool *pool);
+extern struct pgdb_pagefile *pg_pagefile_get(struct pgdb_table_t *table,
+					     uint64_t file_id, char **errptr);
+extern void pg_pagefile_put(struct pgdb_pagefile *pf);
+extern void pg_pfcache_evict(struct pgdb_pfcache *cache, uint64_t file_id);
+
+extern void pg_pagefile_window(struct pgdb_pagefile *pf, const void *key,
+			       size_t klen, unsigned int *lo,
+			       unsigned int *hi);
+extern unsigned int pg_pagefile_regions(struct pgdb_pagefile *pf,
+					struct pgdb_region *r);
 extern int pg_pagefile_find(struct pgdb_pagefile *pf, const void *key_a, size_t alen,
 		     bool exact_match);
+extern const void *pg_pagefile_value(struct pgdb_pagefile *pf,
+				     unsigned int slot,
+				     struct pgdb_vblock **blk, size_t *vlen,
+				     bool fill_cache, char **errptr);
+extern bool pg_pagefile_verify(struct pgdb_pagefile *pf, unsigned int slot,
+			       const void *val, size_t vlen, char **errptr);
+extern struct pgdb_vblock *pg_vblock_load(struct pgdb_pagefile *pf,
+					  uint32_t block, const void *c_data,
+					  char **errptr);
+extern void pg_vblock_ref(struct pgdb_vblock *blk);
+extern void pg_vblock_unref(struct pgdb_vblock *blk);
+extern void pg_page_csum(enum pgdb_csum_type csum_type, unsigned char *csum,
+			 const void *data, size_t len);
+
+// get.c
+extern enum pgdb_mt_result pg_pagefile_lookup(struct pgdb_pagefile *pf,
+				const char *key, size_t keylen,
+				const void **val, size_t *vallen,
+				pgdb_pinned_t **pin, bool verify,
+				bool fill_cache, char **errptr);
+
+// warmup.c
+extern void pg_warmup(pgdb_t *db, bool lock,
+		      void (*progress)(void *arg, uint64_t done,
+				       uint64_t total),
+		      void *arg, char **errptr);
+
+// crc32c.c
+extern uint32_t pg_crc32c(uint32_t crc, const void *data, size_t len);
+extern uint32_t pg_crc32c_sw(uint32_t crc, const void *data, size_t len);
+
+// filewriter.c
+extern struct pgdb_filewriter *pg_fw_create(pgdb_t *db, const char *pathname,
+					    uint64_t size_hint, bool hash,
+					    char **errptr);
+extern bool pg_fw_append(struct pgdb_filewriter *fw, const void *data,
+			 size_t len);
+extern bool pg_fw_append_digests(struct pgdb_filewriter *fw);
+extern uint64_t pg_fw_wrap_size(size_t data_len);
+extern bool pg_fw_wrap_begin(struct pgdb_filewriter *fw, const char *magic);
+extern bool pg_fw_wrap_end(struct pgdb_filewriter *fw);
+extern bool pg_fw_finish(struct pgdb_filewriter *fw, char **errptr);
+extern void pg_fw_free(struct pgdb_filewriter *fw, bool remove_file);
+
+// cache.c
+extern uint64_t pg_cache_new_id(void);
+extern struct pgdb_vblock *pg_cache_lookup(pgdb_cache_t *cache,
+					   uint64_t cache_id, uint64_t file_id,
+					   uint32_t block);
+extern void pg_cache_insert(pgdb_cache_t *cache, struct pgdb_vblock *blk);
+
+// snappy.c
+extern size_t pg_snappy_max_compressed(size_t len);
+extern size_t pg_snappy_compress(const void *in, size_t len, void *out);
+extern bool pg_snappy_uncompressed_len(const void *in, size_t len,
+				       size_t *out_len);
+extern bool pg_snappy_uncompress(const void *in, size_t len, void *out,
+				 size_t out_len);
+
+// merkle.c
+extern size_t pg_merkle_n_chunks(size_t len, unsigned int shift);
+extern struct pgdb_merkle *pg_merkle_new(unsigned int shift);
+extern void pg_merkle_free(struct pgdb_merkle *mk);
+extern bool pg_merkle_update(struct pgdb_merkle *mk, const void *data,
+			     size_t len);
+extern bool pg_merkle_final(struct pgdb_merkle *mk);
+extern const unsigned char *pg_merkle_digests(const struct pgdb_merkle *mk,
+					      size_t *len);
+extern bool pg_merkle_top(unsigned char *md, const void *hdr, size_t hdr_len,
+			  const unsigned char *digests, size_t digests_len);
+extern bool pg_merkle_chunk_ok(const void *data, size_t len,
+			       unsigned int shift,
+			       const unsigned char *digests, size_t i);
+extern bool pg_merkle_verify(const void *data, size_t len, unsigned int shift,
+			     const unsigned char *digests);
 
 extern bool pg_have_superblock(const char *dirname);
 extern bool pg_write_superblock(pgdb_t *db, PGcodec__Superblock *sb,
 				char **errptr);
 extern bool pg_read_superblock(pgdb_t *db, char **errptr);
+extern PGcodec__TableMeta *pg_find_tablemeta(PGcodec__Superblock *sb,
+					     const char *tbl_name);
 
-extern bool pg_wrap_file(int fd, char *magic, const void *data,
-	      size_t data_len, char **errptr);
 extern bool pg_verify_file(char *magic, const void *file_data,
 		unsigned long file_len, char **errptr);
 extern bool pg_iterate_dir(const char *dirname,
 		 bool (*actor)(const struct dirent *de, void *priv,
 		 	       char **errptr),
 		 void *priv, char **errptr);
+extern uint64_t pg_alloc_file_id(pgdb_t *db);
+extern bool pg_sync_dir(pgdb_t *db, char **errptr);
+extern bool pg_remove_file(pgdb_t *db, uint64_t file_id);
 extern bool pg_uuid(pg_uuid_t uuid);
 extern void pg_uuid_str(char *uuid, const pg_uuid_t uuid_in);
 
+// wal.c
+extern size_t pg_rec_size(enum pgdb_rec_type type, size_t klen, size_t vlen);
+extern void *pg_rec_encode(void *p, enum pgdb_rec_type type,
+			   const void *key, size_t klen,
+			   const void *val, size_t vlen);
+extern bool pg_rec_decode(const void **pp, const void *end,
+			  enum pgdb_rec_type *type,
+			  const void **key, size_t *klen,
+			  const void **val, size_t *vlen);
+extern bool pg_wal_create(pgdb_t *db, uint64_t log_id, char **errptr);
+extern void pg_wal_close(pgdb_t *db);
+extern bool pg_wal_remove(pgdb_t *db, uint64_t log_id);
+extern void pg_wal_remove_obsolete(pgdb_t *db, uint64_t min_log_id);
+extern bool pg_wal_append(pgdb_t *db, uint32_t table_id,
+			  struct pgdb_writer **group, unsigned int n,
+			  struct pgdb_wal_hdr *hdrs, bool sync, char **errptr);
+extern bool pg_wal_apply(struct pgdb_memtable *mt, uint64_t seq,
+			 const void *rep, size_t rep_len, unsigned int count);
+extern bool pg_wal_recover(pgdb_t *db, char **errptr);
+
 // rand.c
 extern bool pg_rand_bytes(void *p, size_t len);
 extern bool pg_seed_libc_rng(void);
 
+static inline int pg_key_cmp(const void *a, size_t alen,
+			     const void *b, size_t blen)
+{
+	size_t len = (alen < blen) ? alen : blen;
+	int cmp = memcmp(a, b, len);
+	if (cmp)
+		return cmp;
+	if (alen == blen)
+		return 0;
+	return (alen < blen) ? -1 : 1;
+}
+
+// first 8 key bytes as a big-endian integer, zero padded; integer order
+// matches memcmp order, so unequal prefixes decide a key comparison
+static inline uint64_t pg_key_prefix(const void *key, size_t klen)
+{
+	uint64_t v = 0;
+	memcpy(&v, key, (klen < sizeof(v)) ? klen : sizeof(v));
+	return be64toh(v);
+}
+
 #endif // __PGDB_INTERNAL_H__
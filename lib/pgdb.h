@@ -25,18 +25,28 @@ typedef struct pgdb_comparator_t    pgdb_comparator_t;
 typedef struct pgdb_env_t           pgdb_env_t;
 typedef struct pgdb_filelock_t      pgdb_filelock_t;
 typedef struct pgdb_filterpolicy_t  pgdb_filterpolicy_t;
+typedef struct pgdb_getq_t          pgdb_getq_t;
 typedef struct pgdb_iterator_t      pgdb_iterator_t;
 typedef struct pgdb_logger_t        pgdb_logger_t;
 typedef struct pgdb_options_t       pgdb_options_t;
+typedef struct pgdb_pinned_t        pgdb_pinned_t;
 typedef struct pgdb_randomfile_t    pgdb_randomfile_t;
 typedef struct pgdb_readoptions_t   pgdb_readoptions_t;
 typedef struct pgdb_seqfile_t       pgdb_seqfile_t;
 typedef struct pgdb_snapshot_t      pgdb_snapshot_t;
+typedef struct pgdb_table_t         pgdb_table_t;
+typedef struct pgdb_tableoptions_t  pgdb_tableoptions_t;
 typedef struct pgdb_writablefile_t  pgdb_writablefile_t;
 typedef struct pgdb_writebatch_t    pgdb_writebatch_t;
 typedef struct pgdb_writeoptions_t  pgdb_writeoptions_t;
 
-/* DB operations */
+/* DB operations
+
+   Any number of threads may call the functions below on one database
+   at once, except pgdb_close().  Reads take no lock: a get sees every
+   write that returned before it began, and never part of a batch.  An
+   iterator, a write batch or an options object is for one thread at a
+   time. */
 
 extern pgdb_t* pgdb_open(
     const pgdb_options_t* options,
@@ -73,6 +83,42 @@ extern char* pgdb_get(
     size_t* vallen,
     char** errptr);
 
+/* Returns NULL if not found.  Otherwise a pointer to the value in place,
+   with no copy and no allocation; it stays valid until the caller passes
+   *pin to pgdb_pinned_release(). */
+extern const char* pgdb_get_pinned(
+    pgdb_t* db,
+    const pgdb_readoptions_t* options,
+    const char* key, size_t keylen,
+    size_t* vallen,
+    pgdb_pinned_t** pin,
+    char** errptr);
+
+extern void pgdb_pinned_release(pgdb_pinned_t* pin);
+
+/* Returns false if not found.  Otherwise copies up to buflen bytes of the
+   value into buf and stores the full value length in *vallen; if that
+   exceeds buflen, the value was truncated. */
+extern bool pgdb_get_into(
+    pgdb_t* db,
+    const pgdb_readoptions_t* options,
+    const char* key, size_t keylen,
+    char* buf, size_t buflen,
+    size_t* vallen,
+    char** errptr);
+
+/* Looks up num_keys keys together.  Returns one malloc()ed buffer
+   holding every value found, back to back: vals[i] points into it, with
+   the length in vallens[i], or is NULL if keys[i] was not found.  Free
+   the buffer with pgdb_free().  Returns NULL if no key was found. */
+extern char* pgdb_multi_get(
+    pgdb_t* db,
+    const pgdb_readoptions_t* options,
+    size_t num_keys,
+    const char* const* keys, const size_t* keylens,
+    const char** vals, size_t* vallens,
+    char** errptr);
+
 extern pgdb_iterator_t* pgdb_create_iterator(
     pgdb_t* db,
     const pgdb_readoptions_t* options);
@@ -102,6 +148,175 @@ extern void pgdb_compact_range(
     const char* start_key, size_t start_key_len,
     const char* limit_key, size_t limit_key_len);
 
+/* Like pgdb_compact_range(), calling progress(arg, done, total) as the
+   merge proceeds, where total counts input records.  A NULL start or
+   limit key leaves that end of the range open. */
+extern void pgdb_compact_range_progress(
+    pgdb_t* db,
+    const char* start_key, size_t start_key_len,
+    const char* limit_key, size_t limit_key_len,
+    void (*progress)(void* arg, uint64_t done, uint64_t total),
+    void* arg,
+    char** errptr);
+
+/* Faults in, ahead of the first lookups, the parts of each table's
+   pagefiles that every lookup reads -- headers, indexes, restart points
+   and filters, and the keys of compressed pagefiles -- newest first and
+   no more pagefiles than the table keeps open, calling progress(arg,
+   done, total) as each is done.  With lock set, those parts and each
+   table's root index are also mlock()ed, for as long as they stay open;
+   if RLIMIT_MEMLOCK refuses, the rest is still prefetched and the
+   refusal reported. */
+extern void pgdb_warmup(
+    pgdb_t* db,
+    unsigned char lock,
+    void (*progress)(void* arg, uint64_t done, uint64_t total),
+    void* arg,
+    char** errptr);
+
+/* Waits until no flush or compaction is running or due: every write
+   buffer that filled before the call has been flushed, and compaction
+   has caught up.  Writes made meanwhile may extend the wait.  Reports
+   the error that stopped background work, if any; returns at once on
+   a read-only database. */
+extern void pgdb_wait_background(
+    pgdb_t* db,
+    char** errptr);
+
+/* Tables
+
+   Every database has a "master" table, which the functions above work
+   on.  Further tables each have a key space, root index, write buffer
+   and open-file cache of their own, and settings that persist with
+   them.  Table handles stay valid until pgdb_close(). */
+
+/* Creates table name.  NULL options, or any setting left at zero, take
+   the database's settings. */
+extern pgdb_table_t* pgdb_create_table(
+    pgdb_t* db,
+    const char* name,
+    const pgdb_tableoptions_t* options,
+    char** errptr);
+
+/* Returns the handle of an existing table, or NULL if there is none. */
+extern pgdb_table_t* pgdb_open_table(
+    pgdb_t* db,
+    const char* name,
+    char** errptr);
+
+/* Removes table and its data.  Iterators and snapshots taken earlier
+   still read it; anything else on the handle fails.  The master table
+   cannot be dropped. */
+extern void pgdb_drop_table(
+    pgdb_t* db,
+    pgdb_table_t* table,
+    char** errptr);
+
+extern const char* pgdb_table_name(const pgdb_table_t* table);
+
+extern void pgdb_put_cf(
+    pgdb_t* db,
+    const pgdb_writeoptions_t* options,
+    pgdb_table_t* table,
+    const char* key, size_t keylen,
+    const char* val, size_t vallen,
+    char** errptr);
+
+extern void pgdb_delete_cf(
+    pgdb_t* db,
+    const pgdb_writeoptions_t* options,
+    pgdb_table_t* table,
+    const char* key, size_t keylen,
+    char** errptr);
+
+/* Applies the whole batch to table. */
+extern void pgdb_write_cf(
+    pgdb_t* db,
+    const pgdb_writeoptions_t* options,
+    pgdb_table_t* table,
+    pgdb_writebatch_t* batch,
+    char** errptr);
+
+extern char* pgdb_get_cf(
+    pgdb_t* db,
+    const pgdb_readoptions_t* options,
+    pgdb_table_t* table,
+    const char* key, size_t keylen,
+    size_t* vallen,
+    char** errptr);
+
+extern char* pgdb_multi_get_cf(
+    pgdb_t* db,
+    const pgdb_readoptions_t* options,
+    pgdb_table_t* table,
+    size_t num_keys,
+    const char* const* keys, const size_t* keylens,
+    const char** vals, size_t* vallens,
+    char** errptr);
+
+/* On error, returns an iterator that is never valid; see
+   pgdb_iter_get_error(). */
+extern pgdb_iterator_t* pgdb_create_iterator_cf(
+    pgdb_t* db,
+    const pgdb_readoptions_t* options,
+    pgdb_table_t* table);
+
+extern void pgdb_compact_range_cf(
+    pgdb_t* db,
+    pgdb_table_t* table,
+    const char* start_key, size_t start_key_len,
+    const char* limit_key, size_t limit_key_len,
+    char** errptr);
+
+/* Asynchronous gets
+
+   A get queue keeps up to depth lookups in flight from one thread,
+   reading cold pagefiles through io_uring where the kernel offers it.
+   Each lookup's result is passed to done(arg, val, vallen, err) from
+   pgdb_getq_reap(): val is NULL if the key was not found, and else
+   malloc()ed, as is err on error; free both with pgdb_free().  Callbacks
+   may submit further lookups.  A queue is for one thread at a time, and
+   must be destroyed before its database is closed. */
+
+/* 0 takes the default depth, 128. */
+extern pgdb_getq_t* pgdb_getq_create(
+    pgdb_t* db,
+    unsigned int depth,
+    char** errptr);
+
+/* Waits for every lookup pending, making their callbacks. */
+extern void pgdb_getq_destroy(pgdb_getq_t* q);
+
+/* Returns false, with no callback to come, if the lookup could not be
+   submitted.  With depth lookups pending, reaps one first. */
+extern bool pgdb_get_async(
+    pgdb_getq_t* q,
+    const pgdb_readoptions_t* options,
+    const char* key, size_t keylen,
+    void (*done)(void* arg, char* val, size_t vallen, char* err),
+    void* arg,
+    char** errptr);
+
+extern bool pgdb_get_async_cf(
+    pgdb_getq_t* q,
+    const pgdb_readoptions_t* options,
+    pgdb_table_t* table,
+    const char* key, size_t keylen,
+    void (*done)(void* arg, char* val, size_t vallen, char* err),
+    void* arg,
+    char** errptr);
+
+/* Makes the callbacks of completed lookups, waiting until at least
+   min_done are made or none is pending.  Returns the number made. */
+extern unsigned int pgdb_getq_reap(pgdb_getq_t* q, unsigned int min_done);
+
+extern unsigned int pgdb_getq_pending(pgdb_getq_t* q);
+
+/* A file descriptor which polls readable once lookups have completed,
+   for an event loop to wait on; -1 if the queue has no ring, and so
+   completes lookups as they are submitted. */
+extern int pgdb_getq_fd(pgdb_getq_t* q);
+
 /* Management operations */
 
 extern void pgdb_destroy_db(
@@ -164,17 +379,62 @@ extern void pgdb_options_set_paranoid_checks(
 extern void pgdb_options_set_env(pgdb_options_t*, pgdb_env_t*);
 extern void pgdb_options_set_info_log(pgdb_options_t*, pgdb_logger_t*);
 extern void pgdb_options_set_write_buffer_size(pgdb_options_t*, size_t);
+extern void pgdb_options_set_max_file_size(pgdb_options_t*, size_t);
+/* Start writeback of new files every so many bytes written, rather
+   than all at once when each is complete.  0, the default, disables. */
+extern void pgdb_options_set_bytes_per_sync(pgdb_options_t*, size_t);
 extern void pgdb_options_set_max_open_files(pgdb_options_t*, int);
 extern void pgdb_options_set_cache(pgdb_options_t*, pgdb_cache_t*);
 extern void pgdb_options_set_block_size(pgdb_options_t*, size_t);
 extern void pgdb_options_set_block_restart_interval(pgdb_options_t*, int);
 
+/* Compression of the values of pagefiles written, in blocks of about
+   block_size bytes (4K by default), each read back on its own.  Keys
+   stay uncompressed.  Pagefiles of either kind are read back. */
 enum {
   pgdb_no_compression = 0,
   pgdb_snappy_compression = 1
 };
 extern void pgdb_options_set_compression(pgdb_options_t*, int);
 
+/* Checksums kept of each key and value in pagefiles written.  Either
+   kind is read back; CRC32C, the default, is far cheaper to verify. */
+enum {
+  pgdb_sha256_checksum = 0,
+  pgdb_crc32c_checksum = 1
+};
+extern void pgdb_options_set_checksum(pgdb_options_t*, int);
+
+/* How pagefiles are read.  By default they are mapped, and cached by
+   the kernel.  Otherwise each is read whole, when opened, into memory
+   the database allocates -- with O_DIRECT, bypassing the page cache,
+   where the filesystem allows it -- and lookups never fault.  Memory
+   read into never exceeds read_pool_size bytes (0, the default, for no
+   limit) in all, counting every pagefile from its read until it is
+   closed: those cached, and those evicted but still held by iterators,
+   snapshots or pending lookups.  A pagefile the pool has no room for
+   is mapped instead, as with pgdb_mmap_io, and the least recently used
+   closed to make room for it next time; one larger than the pool is
+   always mapped.  Past max_open_files, too, the least recently used
+   are closed, once no reader still uses them. */
+enum {
+  pgdb_mmap_io = 0,
+  pgdb_read_io = 1,
+  pgdb_direct_io = 2
+};
+extern void pgdb_options_set_io(pgdb_options_t*, int);
+extern void pgdb_options_set_read_pool_size(pgdb_options_t*, size_t);
+
+/* Warm up as pgdb_warmup() does, with lock set for pgdb_lock_warmup,
+   before pgdb_open() returns.  Failure to is not an error.  Off by
+   default. */
+enum {
+  pgdb_no_warmup = 0,
+  pgdb_prefetch_warmup = 1,
+  pgdb_lock_warmup = 2
+};
+extern void pgdb_options_set_warmup(pgdb_options_t*, int);
+
 /* Comparator */
 
 extern pgdb_comparator_t* pgdb_comparator_create(
@@ -207,6 +467,20 @@ extern void pgdb_filterpolicy_destroy(pgdb_filterpolicy_t*);
 extern pgdb_filterpolicy_t* pgdb_filterpolicy_create_bloom(
     int bits_per_key);
 
+/* Table options */
+
+extern pgdb_tableoptions_t* pgdb_tableoptions_create();
+extern void pgdb_tableoptions_destroy(pgdb_tableoptions_t*);
+extern void pgdb_tableoptions_set_write_buffer_size(
+    pgdb_tableoptions_t*, size_t);
+extern void pgdb_tableoptions_set_max_file_size(
+    pgdb_tableoptions_t*, size_t);
+extern void pgdb_tableoptions_set_max_open_files(
+    pgdb_tableoptions_t*, int);
+/* Sorted runs a table gathers before they are merged. */
+extern void pgdb_tableoptions_set_compaction_trigger(
+    pgdb_tableoptions_t*, int);
+
 /* Read options */
 
 extern pgdb_readoptions_t* pgdb_readoptions_create();
@@ -229,6 +503,10 @@ extern void pgdb_writeoptions_set_sync(
 
 /* Cache */
 
+/* A cache of uncompressed blocks holding up to capacity bytes, which
+   any number of databases may share through pgdb_options_set_cache().
+   Each database not given one has its own, of 8MB.  Destroy it only
+   once every database using it is closed. */
 extern pgdb_cache_t* pgdb_cache_create_lru(size_t capacity);
 extern void pgdb_cache_destroy(pgdb_cache_t* cache);
 
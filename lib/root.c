@@ -1,4 +1,3 @@
-
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -8,58 +7,285 @@
 
 #include "pgdb-internal.h"
 
-bool pg_write_root(pgdb_t *db, PGcodec__RootIdx *root, unsigned int n,
+/*
+ * Root indexes.
+ *
+ * Roots used to be written as a RootIdx message, which has to be
+ * unpacked whole -- an allocation for every entry and every key --
+ * before its table can open.  They are now written flat (see struct
+ * pgdb_root_hdr), already in the order a generation groups them, so
+ * reading one back is a single pass over the mapped file: one
+ * allocation holds every RootEnt, their keys point into the mapping,
+ * and the mapping stays open for as long as the root.  Roots of either
+ * kind are read.  Roots built in memory, from a root and its manifest
+ * (see manifest.c), take the same flat form, in anonymous memory.
+ *
+ * Opening a root is still linear in its entries, and meant to be: the
+ * file is verified whole, as every file is before it is trusted, and
+ * each run's fence index is built over its entries (see rootgen.c), in
+ * the Eytzinger order lookups search.  The flat entries themselves are
+ * not searched in place; what the flat form saves is the unpacking,
+ * with its allocation per entry and per key, not the pass.
+ */
+
+static inline uint64_t ent_run_id(const PGcodec__RootEnt *ent)
+{
+	return ent->has_run_id ? ent->run_id : 0;
+}
+
+// by run, newest first, then by key; for qsort() of RootEnt pointers
+int pg_root_ent_cmp(const void *a_, const void *b_)
+{
+	const PGcodec__RootEnt *a = *(PGcodec__RootEnt * const *) a_;
+	const PGcodec__RootEnt *b = *(PGcodec__RootEnt * const *) b_;
+	uint64_t ra = ent_run_id(a), rb = ent_run_id(b);
+
+	if (ra != rb)
+		return (ra > rb) ? -1 : 1;	// newest run first
+	return pg_key_cmp(a->key.data, a->key.len, b->key.data, b->key.len);
+}
+
+void pg_root_ent_encode(struct pgdb_root_ent *re, const PGcodec__RootEnt *ent,
+			uint32_t k_offset)
+{
+	memset(re, 0, sizeof(*re));
+	re->file_id = htole64(ent->file_id);
+	re->run_id = htole64(ent_run_id(ent));
+	re->k_offset = htole32(k_offset);
+	re->k_len = htole32(ent->key.len);
+	re->n_records = htole32(ent->n_records);
+}
+
+// ent, its key in data, from re; the caller checks the key is in range
+void pg_root_ent_decode(PGcodec__RootEnt *ent, const struct pgdb_root_ent *re,
+			const void *data)
+{
+	PGcodec__RootEnt ent_init = PGCODEC__ROOT_ENT__INIT;
+
+	*ent = ent_init;
+	ent->key.data = (uint8_t *) data + le32toh(re->k_offset);
+	ent->key.len = le32toh(re->k_len);
+	ent->n_records = le32toh(re->n_records);
+	ent->file_id = le64toh(re->file_id);
+	ent->has_run_id = 1;
+	ent->run_id = le64toh(re->run_id);
+}
+
+// bytes of flat root data listing ents[0..n)
+size_t pg_root_size(PGcodec__RootEnt **ents, size_t n)
+{
+	size_t len = sizeof(struct pgdb_root_hdr) +
+		     (n * sizeof(struct pgdb_root_ent));
+	size_t i;
+	for (i = 0; i < n; i++)
+		len += ents[i]->key.len;
+
+	return len;
+}
+
+// a sorted copy of ents[0..n)
+static PGcodec__RootEnt **root_sorted(PGcodec__RootEnt **ents, size_t n,
+				      char **errptr)
+{
+	PGcodec__RootEnt **sorted = malloc((n + 1) * sizeof(PGcodec__RootEnt *));
+	if (!sorted) {
+		*errptr = strdup("OOM");	// irony, but recoverable
+		return NULL;
+	}
+	if (n)
+		memcpy(sorted, ents, n * sizeof(PGcodec__RootEnt *));
+	qsort(sorted, n, sizeof(PGcodec__RootEnt *), pg_root_ent_cmp);
+
+	return sorted;
+}
+
+static void root_hdr_encode(struct pgdb_root_hdr *hdr, size_t n,
+			    size_t key_offset)
+{
+	memset(hdr, 0, sizeof(*hdr));
+	memcpy(hdr->magic, PGDB_ROOT_FLAT_MAGIC, sizeof(hdr->magic));
+	hdr->version = htole32(PGDB_ROOT_VERSION);
+	hdr->n_entries = htole32(n);
+	hdr->key_offset = htole32(key_offset);
+}
+
+bool pg_write_root(pgdb_t *db, PGcodec__RootIdx *root, uint64_t n,
 		   char **errptr)
 {
 	// build pathname
 	size_t fn_len = strlen(db->pathname) + 64 + 2;
 	char *fn = alloca(fn_len);
-	snprintf(fn, fn_len, "%s/%u", db->pathname, n);
+	snprintf(fn, fn_len, "%s/%llu", db->pathname, (unsigned long long) n);
+
+	size_t n_ents = root->n_entries;
+	PGcodec__RootEnt **ents = root_sorted(root->entries, n_ents, errptr);
+	if (!ents)
+		return false;
+
+	size_t key_offset = sizeof(struct pgdb_root_hdr) +
+			    (n_ents * sizeof(struct pgdb_root_ent));
+	size_t data_len = pg_root_size(ents, n_ents);
+	size_t i;
 
+	struct pgdb_filewriter *fw = NULL;
 	bool rc = false;
 
-	// serialize root index
-	size_t plen = pgcodec__root_idx__get_packed_size(root);
-	void *pbuf = malloc(plen);
-	if (!pbuf) {
-		*errptr = strdup("OOM");	// irony, but recoverable
+	if (data_len > UINT32_MAX) {
+		*errptr = strdup("root index too large");
 		goto out;
 	}
-	pgcodec__root_idx__pack(root, pbuf);
 
-	// open new file
-	int fd = open(fn, O_WRONLY | O_CREAT | O_EXCL, 0666);
-	if (fd < 0) {
-		*errptr = strdup(strerror(errno));
-		goto out_pbuf;
+	fw = pg_fw_create(db, fn, pg_fw_wrap_size(data_len), false, errptr);
+	if (!fw)
+		goto out;
+
+	struct pgdb_root_hdr hdr;
+	root_hdr_encode(&hdr, n_ents, key_offset);
+
+	pg_fw_wrap_begin(fw, PGDB_ROOT_MAGIC);
+	pg_fw_append(fw, &hdr, sizeof(hdr));
+
+	size_t k_offset = key_offset;
+	for (i = 0; i < n_ents; i++) {
+		struct pgdb_root_ent re;
+		pg_root_ent_encode(&re, ents[i], k_offset);
+		pg_fw_append(fw, &re, sizeof(re));
+
+		k_offset += ents[i]->key.len;
 	}
 
-	// write serialized data to temp file
-	if (!pg_wrap_file(fd, PGDB_ROOT_MAGIC, pbuf, plen, errptr))
-		goto out_fd;
+	for (i = 0; i < n_ents; i++)
+		pg_fw_append(fw, ents[i]->key.data, ents[i]->key.len);
 
-	close(fd);
-	fd = -1;
+	pg_fw_wrap_end(fw);
 
-	rc = true;
+	// the superblock will point here; must be durable first
+	rc = pg_fw_finish(fw, errptr);
 
-out_fd:
-	if (fd >= 0)
-		close(fd);
-	if (!rc)
-		unlink(fn);
-out_pbuf:
-	free(pbuf);
 out:
+	pg_fw_free(fw, !rc);
+	free(ents);
 	return rc;
 }
 
-bool pg_read_root(pgdb_t *db, PGcodec__RootIdx **root, unsigned int n,
-		  char **errptr)
+// a RootIdx over the flat root data[0..len), keys pointing into data
+static PGcodec__RootIdx *root_view(const void *data, size_t len,
+				   char **errptr)
 {
-	size_t fn_len = strlen(db->pathname) + strlen(PGDB_SB_FN) + 2;
+	const struct pgdb_root_hdr *hdr = data;
+
+	if (len < sizeof(*hdr) || le32toh(hdr->version) != PGDB_ROOT_V1) {
+		*errptr = strdup("root index version unsupported");
+		return NULL;
+	}
+
+	size_t n = le32toh(hdr->n_entries);
+	size_t key_offset = le32toh(hdr->key_offset);
+	if (key_offset > len || key_offset < sizeof(*hdr) ||
+	    n > ((key_offset - sizeof(*hdr)) / sizeof(struct pgdb_root_ent))) {
+		*errptr = strdup("root index entries out of range");
+		return NULL;
+	}
+
+	// one allocation: the RootIdx, its entry pointers, the entries
+	PGcodec__RootIdx *root = malloc(sizeof(*root) +
+					(n * (sizeof(PGcodec__RootEnt *) +
+					      sizeof(PGcodec__RootEnt))));
+	if (!root) {
+		*errptr = strdup("OOM");	// irony, but recoverable
+		return NULL;
+	}
+
+	PGcodec__RootEnt **ptrs = (PGcodec__RootEnt **) (root + 1);
+	PGcodec__RootEnt *ents = (PGcodec__RootEnt *) (ptrs + n);
+
+	PGcodec__RootIdx root_init = PGCODEC__ROOT_IDX__INIT;
+	*root = root_init;
+	root->n_entries = n;
+	root->entries = ptrs;
+
+	const struct pgdb_root_ent *re = (const void *) (hdr + 1);
+	size_t i;
+
+	for (i = 0; i < n; i++, re++) {
+		uint64_t k_offset = le32toh(re->k_offset);
+		uint64_t k_len = le32toh(re->k_len);
+		if (k_offset < key_offset || (k_offset + k_len) > len) {
+			free(root);
+			*errptr = strdup("root index key out of range");
+			return NULL;
+		}
+
+		pg_root_ent_decode(&ents[i], re, data);
+		ptrs[i] = &ents[i];
+	}
+
+	return root;
+}
+
+/*
+ * A flat root listing ents[0..n), built in anonymous memory returned in
+ * *map; its keys are copies.  Free both with pg_root_free().
+ */
+PGcodec__RootIdx *pg_root_build(PGcodec__RootEnt **ents, size_t n,
+				struct pgdb_map **map_out, char **errptr)
+{
+	PGcodec__RootEnt **sorted = root_sorted(ents, n, errptr);
+	if (!sorted)
+		return NULL;
+
+	size_t key_offset = sizeof(struct pgdb_root_hdr) +
+			    (n * sizeof(struct pgdb_root_ent));
+	size_t len = pg_root_size(sorted, n);
+	PGcodec__RootIdx *root = NULL;
+
+	if (len > UINT32_MAX) {
+		*errptr = strdup("root index too large");
+		goto out;
+	}
+
+	struct pgdb_map *map = pgmap_anon(len, errptr);
+	if (!map)
+		goto out;
+
+	root_hdr_encode(map->mem, n, key_offset);
+
+	struct pgdb_root_ent *re = map->mem + sizeof(struct pgdb_root_hdr);
+	unsigned char *key = map->mem + key_offset;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		pg_root_ent_encode(&re[i], sorted[i],
+				   key - (unsigned char *) map->mem);
+		memcpy(key, sorted[i]->key.data, sorted[i]->key.len);
+		key += sorted[i]->key.len;
+	}
+
+	pgmap_seal(map);
+
+	root = root_view(map->mem, len, errptr);
+	if (!root) {
+		pgmap_free(map);
+		goto out;
+	}
+
+	*map_out = map;
+
+out:
+	free(sorted);
+	return root;
+}
+
+/*
+ * Read root index n.  A flat root comes back with *map set: its entries
+ * point into that mapping.  Free both with pg_root_free().
+ */
+bool pg_read_root(pgdb_t *db, PGcodec__RootIdx **root,
+		  struct pgdb_map **map_out, uint64_t n, char **errptr)
+{
+	size_t fn_len = strlen(db->pathname) + 64 + 2;
 	char *fn = alloca(fn_len);
-	snprintf(fn, fn_len, "%s/%u", db->pathname, n);
+	snprintf(fn, fn_len, "%s/%llu", db->pathname, (unsigned long long) n);
 
 	struct pgdb_map *map = pgmap_open(fn, errptr);
 	if (!map)
@@ -69,16 +295,28 @@ bool pg_read_root(pgdb_t *db, PGcodec__RootIdx **root, unsigned int n,
 		goto err_out;
 
 	struct pgdb_file_header *hdr = map->mem;
+	const void *data = map->mem + sizeof(*hdr);
+	size_t len = le32toh(hdr->len);
+
+	// a RootIdx message never starts so: its first field tag is 0x0a
+	if (len >= sizeof(struct pgdb_root_hdr) &&
+	    !memcmp(data, PGDB_ROOT_FLAT_MAGIC, 8)) {
+		*root = root_view(data, len, errptr);
+		if (!*root)
+			goto err_out;
 
-	*root = pgcodec__root_idx__unpack(NULL,
-					  le32toh(hdr->len),
-					  map->mem + sizeof(*hdr));
+		*map_out = map;
+		return true;
+	}
+
+	*root = pgcodec__root_idx__unpack(NULL, len, data);
 	if (!*root) {
 		*errptr = strdup("rootidx deser failed");
 		goto err_out;
 	}
-	
+
 	pgmap_free(map);
+	*map_out = NULL;
 	return true;
 
 err_out:
@@ -86,18 +324,12 @@ err_out:
 	return false;
 }
 
-int pg_find_rootent(PGcodec__RootIdx *root, const void *key, size_t klen)
+void pg_root_free(PGcodec__RootIdx *root, struct pgdb_map *map)
 {
-	unsigned int i;
-
-	for (i = 0; i < root->n_entries; i++) {
-		PGcodec__RootEnt *ent = root->entries[i];
-		unsigned int len = (klen < ent->key.len) ? klen : ent->key.len;
-		int cmp = memcmp(key, ent->key.data, len);
-		if (cmp <= 0)
-			return i;
+	if (map) {
+		free(root);
+		pgmap_free(map);
+	} else if (root) {
+		pgcodec__root_idx__free_unpacked(root, NULL);
 	}
-
-	return -1;
 }
-
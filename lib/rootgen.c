@@ -0,0 +1,394 @@
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "pgdb-internal.h"
+
+/*
+ * Root generations.
+ *
+ * A table's root index lists its pagefiles, each tagged with the sorted
+ * run it was written in.  Pagefiles of one run never overlap; those of
+ * different runs may, and the newer run wins.  A generation groups the
+ * root entries by run, newest run first, each run with its own fence
+ * index and filter slots.  Entries written before runs existed belong
+ * to run 0.
+ */
+
+static inline uint64_t ent_run_id(const PGcodec__RootEnt *ent)
+{
+	return ent->has_run_id ? ent->run_id : 0;
+}
+
+static bool ents_sorted(PGcodec__RootEnt **ents, size_t n)
+{
+	size_t i;
+	for (i = 1; i < n; i++)
+		if (pg_root_ent_cmp(&ents[i - 1], &ents[i]) > 0)
+			return false;
+
+	return true;
+}
+
+static void rootgen_free(struct pgdb_rootgen *rg)
+{
+	pgdb_t *db = rg->db;
+	unsigned int i;
+
+	// no reader can reach these files any longer
+	for (i = 0; i < rg->n_obsolete; i++) {
+		pg_pfcache_evict(rg->table->pfcache, rg->obsolete[i]);
+		pg_remove_file(db, rg->obsolete[i]);
+	}
+	free(rg->obsolete);
+
+	for (i = 0; i < rg->n_runs; i++) {
+		struct pgdb_run *run = &rg->runs[i];
+
+		pg_filters_free(run->filters, run->n_ents);
+		pg_fence_free(run->fence);
+	}
+
+	free(rg->runs);
+	free(rg->ents);
+
+	pg_root_free(rg->root, rg->root_map);
+
+	memset(rg, 0xff, sizeof(*rg));
+	free(rg);
+}
+
+void pg_rootgen_unref(struct pgdb_rootgen *rg)
+{
+	// freeing a generation drops its reference on the next
+	while (rg && __atomic_sub_fetch(&rg->refcnt, 1, __ATOMIC_ACQ_REL) == 0) {
+		struct pgdb_rootgen *next = rg->next;
+		rootgen_free(rg);
+		rg = next;
+	}
+}
+
+void pg_rootgen_ref(struct pgdb_rootgen *rg)
+{
+	__atomic_add_fetch(&rg->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+static const struct pgdb_run *find_run(const struct pgdb_rootgen *rg,
+				       uint64_t run_id)
+{
+	unsigned int i;
+	for (i = 0; i < rg->n_runs; i++)
+		if (rg->runs[i].run_id == run_id)
+			return &rg->runs[i];
+
+	return NULL;
+}
+
+// share the filter blocks prev already loaded, for files still listed
+static void inherit_filters(struct pgdb_rootgen *rg,
+			    const struct pgdb_rootgen *prev)
+{
+	unsigned int i, j;
+	for (i = 0; i < rg->n_runs; i++) {
+		struct pgdb_run *run = &rg->runs[i];
+		const struct pgdb_run *old = find_run(prev, run->run_id);
+		if (!old)
+			continue;
+
+		for (j = 0; j < run->n_ents; j++) {
+			PGcodec__RootEnt *ent = run->ents[j];
+			const struct pgdb_fence_ent *fe =
+				pg_fence_find(old->fence, ent->key.data,
+					      ent->key.len);
+			if (!fe || fe->file_id != ent->file_id)
+				continue;
+
+			struct pgdb_filter_blk *blk =
+				__atomic_load_n(&old->filters[fe->rank],
+						__ATOMIC_ACQUIRE);
+			if (!blk)
+				continue;
+
+			pg_filter_ref(blk);
+			run->filters[j] = blk;
+		}
+	}
+}
+
+/*
+ * Build the generation for root, and root_map if it is flat, which it
+ * takes ownership of (freeing them on failure).  If prev is given,
+ * filter blocks it has loaded are carried over.
+ */
+struct pgdb_rootgen *pg_rootgen_new(struct pgdb_table_t *table,
+				    PGcodec__RootIdx *root,
+				    struct pgdb_map *root_map,
+				    uint64_t root_id,
+				    const struct pgdb_rootgen *prev,
+				    char **errptr)
+{
+	struct pgdb_rootgen *rg = calloc(1, sizeof(*rg));
+	if (!rg) {
+		pg_root_free(root, root_map);
+		goto oom;
+	}
+
+	rg->refcnt = 1;
+	rg->db = table->db;
+	rg->table = table;
+	rg->root_id = root_id;
+	rg->root = root;
+	rg->root_map = root_map;
+
+	size_t n = root->n_entries;
+	rg->ents = malloc((n + 1) * sizeof(PGcodec__RootEnt *));
+	if (!rg->ents)
+		goto oom_rg;
+	if (n)
+		memcpy(rg->ents, root->entries, n * sizeof(PGcodec__RootEnt *));
+
+	// flat roots are stored in this order
+	if (!ents_sorted(rg->ents, n))
+		qsort(rg->ents, n, sizeof(PGcodec__RootEnt *),
+		      pg_root_ent_cmp);
+
+	size_t i;
+	unsigned int n_runs = 0;
+	for (i = 0; i < n; i++)
+		if (i == 0 || ent_run_id(rg->ents[i]) != ent_run_id(rg->ents[i - 1]))
+			n_runs++;
+
+	rg->runs = calloc(n_runs + 1, sizeof(struct pgdb_run));
+	if (!rg->runs)
+		goto oom_rg;
+
+	for (i = 0; i < n; i++) {
+		uint64_t run_id = ent_run_id(rg->ents[i]);
+
+		if (!rg->n_runs || rg->runs[rg->n_runs - 1].run_id != run_id) {
+			struct pgdb_run *run = &rg->runs[rg->n_runs++];
+			run->run_id = run_id;
+			run->ents = &rg->ents[i];
+		}
+		rg->runs[rg->n_runs - 1].n_ents++;
+	}
+
+	if (rg->n_runs)
+		rg->max_run_id = rg->runs[0].run_id;
+
+	unsigned int r;
+	for (r = 0; r < rg->n_runs; r++) {
+		struct pgdb_run *run = &rg->runs[r];
+
+		run->fence = pg_fence_build(run->ents, run->n_ents, errptr);
+		if (!run->fence)
+			goto err_out;
+
+		run->filters = calloc(run->n_ents + 1,
+				      sizeof(struct pgdb_filter_blk *));
+		if (!run->filters)
+			goto oom_rg;
+	}
+
+	if (prev)
+		inherit_filters(rg, prev);
+
+	return rg;
+
+oom_rg:
+	*errptr = strdup("OOM");	// irony, but recoverable
+err_out:
+	rootgen_free(rg);
+	return NULL;
+
+oom:
+	*errptr = strdup("OOM");	// irony, but recoverable
+	return NULL;
+}
+
+static int cmp_u64(const void *a_, const void *b_)
+{
+	const uint64_t *a = a_, *b = b_;
+
+	if (*a == *b)
+		return 0;
+	return (*a < *b) ? -1 : 1;
+}
+
+/*
+ * The generation for ents[0..n), base changed by add[] and del[],
+ * recorded in the manifest of base's root.
+ */
+static struct pgdb_rootgen *rootgen_log(struct pgdb_table_t *table,
+					struct pgdb_rootgen *base,
+					PGcodec__RootEnt **ents, size_t n,
+					PGcodec__RootEnt **add,
+					unsigned int n_add,
+					const uint64_t *del, unsigned int n_del,
+					char **errptr)
+{
+	struct pgdb_map *map;
+	PGcodec__RootIdx *root = pg_root_build(ents, n, &map, errptr);
+	if (!root)
+		return NULL;
+
+	// built first: once the edit is durable, it has to be installed
+	struct pgdb_rootgen *rg = pg_rootgen_new(table, root, map,
+						 base->root_id, base, errptr);
+	if (!rg)
+		return NULL;
+
+	if (!pg_manifest_append(table, base->root_id, add, n_add, del, n_del,
+				errptr)) {
+		pg_rootgen_unref(rg);
+		return NULL;
+	}
+
+	return rg;
+}
+
+// the generation for ents[0..n), written out whole as a new root
+static struct pgdb_rootgen *rootgen_checkpoint(pgdb_t *db,
+					       struct pgdb_table_t *table,
+					       PGcodec__TableMeta *tm,
+					       struct pgdb_rootgen *base,
+					       PGcodec__RootEnt **ents,
+					       size_t n, char **errptr)
+{
+	PGcodec__RootIdx root = PGCODEC__ROOT_IDX__INIT;
+	root.n_entries = n;
+	root.entries = ents;
+
+	struct pgdb_rootgen *rg = NULL;
+	uint64_t root_id = pg_alloc_file_id(db);
+
+	if (!pg_write_root(db, &root, root_id, errptr))
+		return NULL;
+
+	// read back what was written: verifies it, and gives the
+	// generation a root of its own
+	PGcodec__RootIdx *new_root;
+	struct pgdb_map *new_map;
+	if (!pg_read_root(db, &new_root, &new_map, root_id, errptr))
+		goto err_out;
+
+	rg = pg_rootgen_new(table, new_root, new_map, root_id, base, errptr);
+	if (!rg)
+		goto err_out;
+
+	uint64_t old_root_id = tm->root_id;
+	tm->root_id = root_id;
+	if (!pg_write_superblock(db, db->superblock, errptr)) {
+		tm->root_id = old_root_id;
+		goto err_out;
+	}
+
+	pg_manifest_reset(table, old_root_id);
+
+	return rg;
+
+err_out:
+	pg_rootgen_unref(rg);
+	pg_remove_file(db, root_id);
+	return NULL;
+}
+
+/*
+ * A new root index for table: the current generation's entries, less
+ * the files listed in del[], plus add[].  Records the change in the
+ * manifest, or once that is due, checkpoints the whole root and points
+ * the superblock at it.  Returns the new generation, for the caller to
+ * publish with pg_rootgen_swap().  Caller holds db->root_lock.
+ */
+struct pgdb_rootgen *pg_rootgen_write(pgdb_t *db, struct pgdb_table_t *table,
+				      PGcodec__RootEnt **add, unsigned int n_add,
+				      const uint64_t *del, unsigned int n_del,
+				      char **errptr)
+{
+	struct pgdb_rootgen *base = table->rootgen;	// stable under root_lock
+
+	PGcodec__TableMeta *tm = pg_find_tablemeta(db->superblock,
+						   table->name);
+	if (!tm) {
+		*errptr = strdup("table not found");
+		return NULL;
+	}
+
+	size_t n_base = base->root->n_entries;
+	PGcodec__RootEnt **ents = malloc((n_base + n_add + 1) *
+					 sizeof(PGcodec__RootEnt *));
+	uint64_t *obsolete = malloc((n_del + 1) * sizeof(uint64_t));
+	if (!ents || !obsolete) {
+		free(ents);
+		free(obsolete);
+		*errptr = strdup("OOM");	// irony, but recoverable
+		return NULL;
+	}
+
+	if (n_del)
+		memcpy(obsolete, del, n_del * sizeof(uint64_t));
+	qsort(obsolete, n_del, sizeof(uint64_t), cmp_u64);
+
+	size_t i, n = 0;
+	for (i = 0; i < n_base; i++) {
+		PGcodec__RootEnt *ent = base->root->entries[i];
+		if (!bsearch(&ent->file_id, obsolete, n_del, sizeof(uint64_t),
+			     cmp_u64))
+			ents[n++] = ent;
+	}
+	if (n_add)
+		memcpy(&ents[n], add, n_add * sizeof(PGcodec__RootEnt *));
+	n += n_add;
+
+	struct pgdb_rootgen *rg;
+	unsigned int n_obsolete = n_del;
+
+	if (!pg_manifest_due(table, pg_root_size(ents, n))) {
+		rg = rootgen_log(table, base, ents, n, add, n_add, del, n_del,
+				 errptr);
+	} else {
+		rg = rootgen_checkpoint(db, table, tm, base, ents, n, errptr);
+		obsolete[n_obsolete++] = base->root_id;
+	}
+
+	free(ents);
+	if (!rg) {
+		free(obsolete);
+		return NULL;
+	}
+
+	// once base and every older generation are gone, so are these
+	base->obsolete = obsolete;
+	base->n_obsolete = n_obsolete;
+
+	return rg;
+}
+
+/*
+ * Make rg, and the caller's reference on it, table's current generation.
+ * Returns the superseded generation, whose table reference the caller
+ * retires after releasing db->lock, which must be held.
+ */
+struct pgdb_rootgen *pg_rootgen_swap(struct pgdb_table_t *table,
+				     struct pgdb_rootgen *rg)
+{
+	struct pgdb_rootgen *old = table->rootgen;
+
+	pg_rootgen_ref(rg);
+	old->next = rg;
+	__atomic_store_n(&table->rootgen, rg, __ATOMIC_SEQ_CST);
+
+	return old;
+}
+
+static void rootgen_retired(struct pgdb_retired *node)
+{
+	pg_rootgen_unref(container_of(node, struct pgdb_rootgen, retired));
+}
+
+// drop the table's reference on rg, no longer published, after readers
+void pg_rootgen_retire(struct pgdb_rootgen *rg)
+{
+	if (rg)
+		pg_epoch_retire(rg->db->epoch, &rg->retired, rootgen_retired);
+}
@@ -0,0 +1,277 @@
+
+#include <stdint.h>
+#include <string.h>
+
+#include "pgdb-internal.h"
+
+/*
+ * Snappy block compression.
+ *
+ * A self-contained implementation of the Snappy format: a varint of
+ * the uncompressed length, then a sequence of literals and back
+ * references ("copies").  Input is compressed in fragments of 64K, each
+ * with a fresh hash table of recent 4-byte sequences, so that copy
+ * offsets fit in two bytes; matching is greedy.  Output can be read by
+ * any Snappy decoder, and pg_snappy_uncompress() reads any Snappy
+ * block, checking every length and offset against the buffers.
+ */
+
+enum {
+	SNAPPY_LITERAL		= 0,
+	SNAPPY_COPY_1		= 1,		// 11-bit offset, len 4..11
+	SNAPPY_COPY_2		= 2,		// 16-bit offset, len 1..64
+	SNAPPY_COPY_4		= 3,		// 32-bit offset, len 1..64
+
+	SNAPPY_FRAGMENT		= 1 << 16,
+	SNAPPY_HASH_BITS	= 14,
+	SNAPPY_MIN_INPUT	= 15,		// below this, one literal
+};
+
+static inline uint32_t load32(const unsigned char *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32_t snappy_hash(uint32_t v)
+{
+	return (v * 0x1e35a7bd) >> (32 - SNAPPY_HASH_BITS);
+}
+
+size_t pg_snappy_max_compressed(size_t len)
+{
+	return 32 + len + (len / 6);
+}
+
+static unsigned char *emit_varint(unsigned char *op, uint32_t v)
+{
+	while (v >= 0x80) {
+		*op++ = v | 0x80;
+		v >>= 7;
+	}
+	*op++ = v;
+	return op;
+}
+
+static unsigned char *emit_literal(unsigned char *op,
+				   const unsigned char *lit, size_t len)
+{
+	size_t n = len - 1;
+
+	if (n < 60) {
+		*op++ = SNAPPY_LITERAL | (n << 2);
+	} else {
+		unsigned char *tag = op++;
+		unsigned int bytes = 0;
+		while (n) {
+			*op++ = n & 0xff;
+			n >>= 8;
+			bytes++;
+		}
+		*tag = SNAPPY_LITERAL | ((59 + bytes) << 2);
+	}
+
+	memcpy(op, lit, len);
+	return op + len;
+}
+
+static unsigned char *emit_copy_upto64(unsigned char *op, size_t offset,
+				       size_t len)
+{
+	if (len < 12 && offset < 2048) {
+		*op++ = SNAPPY_COPY_1 | ((len - 4) << 2) | ((offset >> 8) << 5);
+		*op++ = offset & 0xff;
+	} else {
+		*op++ = SNAPPY_COPY_2 | ((len - 1) << 2);
+		*op++ = offset & 0xff;
+		*op++ = offset >> 8;
+	}
+	return op;
+}
+
+static unsigned char *emit_copy(unsigned char *op, size_t offset, size_t len)
+{
+	// long matches go out 64 bytes at a time, leaving at least 4
+	while (len >= 68) {
+		op = emit_copy_upto64(op, offset, 64);
+		len -= 64;
+	}
+	if (len > 64) {
+		op = emit_copy_upto64(op, offset, 60);
+		len -= 60;
+	}
+	return emit_copy_upto64(op, offset, len);
+}
+
+static unsigned char *compress_fragment(const unsigned char *in, size_t len,
+					unsigned char *op)
+{
+	uint16_t table[1 << SNAPPY_HASH_BITS];
+	size_t ip = 0, lit = 0;
+
+	if (len < SNAPPY_MIN_INPUT)
+		goto out;
+
+	memset(table, 0, sizeof(table));
+
+	// a match needs 4 bytes at ip; leave the tail to the last literal
+	size_t limit = len - 4;
+	ip = 1;
+	while (ip < limit) {
+		uint32_t v = load32(in + ip);
+		uint32_t h = snappy_hash(v);
+		size_t cand = table[h];
+		table[h] = ip;
+
+		if (cand >= ip || load32(in + cand) != v) {
+			// skip faster through input that does not compress
+			ip += 1 + ((ip - lit) >> 5);
+			continue;
+		}
+
+		if (ip > lit)
+			op = emit_literal(op, in + lit, ip - lit);
+
+		size_t m = 4;
+		while ((ip + m) < len && in[cand + m] == in[ip + m])
+			m++;
+
+		op = emit_copy(op, ip - cand, m);
+		ip += m;
+		lit = ip;
+
+		if (ip < limit)
+			table[snappy_hash(load32(in + ip - 1))] = ip - 1;
+	}
+
+out:
+	if (lit < len)
+		op = emit_literal(op, in + lit, len - lit);
+	return op;
+}
+
+/*
+ * Compress in[0..len) into out, which has room for
+ * pg_snappy_max_compressed(len) bytes; returns the compressed length.
+ */
+size_t pg_snappy_compress(const void *in, size_t len, void *out)
+{
+	const unsigned char *ip = in;
+	unsigned char *op = emit_varint(out, len);
+
+	while (len) {
+		size_t n = (len < SNAPPY_FRAGMENT) ? len : SNAPPY_FRAGMENT;
+
+		op = compress_fragment(ip, n, op);
+		ip += n;
+		len -= n;
+	}
+
+	return op - (unsigned char *) out;
+}
+
+// the uncompressed length in[0..len) declares, and where its body begins
+static bool snappy_header(const unsigned char *in, size_t len,
+			  size_t *out_len, size_t *hdr_len)
+{
+	uint32_t v = 0;
+	size_t i;
+
+	for (i = 0; i < len && i < 5; i++) {
+		v |= (uint32_t) (in[i] & 0x7f) << (7 * i);
+		if (!(in[i] & 0x80)) {
+			*out_len = v;
+			*hdr_len = i + 1;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool pg_snappy_uncompressed_len(const void *in, size_t len, size_t *out_len)
+{
+	size_t hdr_len;
+
+	return snappy_header(in, len, out_len, &hdr_len);
+}
+
+/*
+ * Uncompress in[0..len) into out[0..out_len), out_len being the length
+ * pg_snappy_uncompressed_len() reported.  False if the input is corrupt.
+ */
+bool pg_snappy_uncompress(const void *in, size_t len, void *out,
+			  size_t out_len)
+{
+	const unsigned char *ip = in, *end = ip + len;
+	unsigned char *op = out, *op_end = op + out_len;
+	size_t want, hdr_len;
+
+	if (!snappy_header(ip, len, &want, &hdr_len) || want != out_len)
+		return false;
+	ip += hdr_len;
+
+	while (ip < end) {
+		unsigned char tag = *ip++;
+		size_t n, offset;
+
+		switch (tag & 3) {
+		case SNAPPY_LITERAL:
+			n = tag >> 2;
+			if (n >= 60) {
+				unsigned int bytes = n - 59, i;
+				if ((size_t) (end - ip) < bytes)
+					return false;
+				n = 0;
+				for (i = 0; i < bytes; i++)
+					n |= (size_t) ip[i] << (8 * i);
+				ip += bytes;
+			}
+			n++;
+
+			if ((size_t) (end - ip) < n || (size_t) (op_end - op) < n)
+				return false;
+			memcpy(op, ip, n);
+			ip += n;
+			op += n;
+			continue;
+
+		case SNAPPY_COPY_1:
+			if (end - ip < 1)
+				return false;
+			n = ((tag >> 2) & 7) + 4;
+			offset = ((size_t) (tag >> 5) << 8) | ip[0];
+			ip += 1;
+			break;
+
+		case SNAPPY_COPY_2:
+			if (end - ip < 2)
+				return false;
+			n = (tag >> 2) + 1;
+			offset = ip[0] | ((size_t) ip[1] << 8);
+			ip += 2;
+			break;
+
+		default:
+			if (end - ip < 4)
+				return false;
+			n = (tag >> 2) + 1;
+			offset = ip[0] | ((size_t) ip[1] << 8) |
+				 ((size_t) ip[2] << 16) | ((size_t) ip[3] << 24);
+			ip += 4;
+			break;
+		}
+
+		if (!offset || offset > (size_t) (op - (unsigned char *) out) ||
+		    (size_t) (op_end - op) < n)
+			return false;
+
+		// the source may overlap what is being written
+		const unsigned char *src = op - offset;
+		while (n--)
+			*op++ = *src++;
+	}
+
+	return op == op_end;
+}
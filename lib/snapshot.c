@@ -0,0 +1,172 @@
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "pgdb-internal.h"
+
+/*
+ * Snapshots.
+ *
+ * Nothing a read depends on is ever changed in place: memtables only
+ * gain records newer than any reader's sequence number, pagefiles and
+ * root indexes are immutable, and a superseded root generation keeps
+ * the files it lists until it is freed.  So a snapshot is just a
+ * reference on each table's memset and root generation, with the
+ * sequence number last applied, all taken at one instant.  Writers,
+ * flushes and compactions carry on; the files they replace are deleted
+ * once the last snapshot that can reach them is released.
+ *
+ * A read without a snapshot takes no lock and no reference at all.  It
+ * loads the table's memset and root generation inside an epoch (see
+ * epoch.c): whatever replaces them retires the table's own reference
+ * rather than dropping it, so both outlast every reader that found
+ * them.  Gets, multi-gets and snapshots may run on any number of
+ * threads at once, alongside writers, flushes and compactions; an
+ * iterator takes references, and is for one thread at a time.
+ */
+
+// caller holds db->lock
+static void view_take(pgdb_t *db, unsigned int table_slot,
+		      struct pgdb_view *view)
+{
+	struct pgdb_table_t *table = db->tables[table_slot];
+
+	view->seq = db->last_seq;
+	view->ms = table->memset;
+	view->rg = table->rootgen;
+	if (table->dropped)
+		return;
+
+	pg_memset_ref(view->ms);
+	pg_rootgen_ref(view->rg);
+}
+
+/*
+ * The view a read of table should use: the snapshot's, if options give
+ * one, else the table's current state.  It holds no references, and is
+ * good until pg_view_leave(), which must follow even on failure: a
+ * table dropped, or created after the snapshot, or a snapshot of
+ * another database.
+ */
+bool pg_view_enter(pgdb_t *db, unsigned int table_slot,
+		   const pgdb_readoptions_t *options, struct pgdb_view *view,
+		   char **errptr)
+{
+	const pgdb_snapshot_t *snap = options ? options->snapshot : NULL;
+
+	pg_epoch_enter(db->epoch, &view->guard);
+
+	if (snap) {
+		if (snap->db != db) {
+			*errptr = strdup("snapshot of another database");
+			return false;
+		}
+
+		view->ms = NULL;
+		view->rg = NULL;
+		if (table_slot < snap->n_tables) {
+			view->ms = snap->view[table_slot].ms;
+			view->rg = snap->view[table_slot].rg;
+			view->seq = snap->view[table_slot].seq;
+		}
+		if (!view->rg) {
+			*errptr = strdup("table not in snapshot");
+			return false;
+		}
+		return true;
+	}
+
+	struct pgdb_table_t *table = db->tables[table_slot];
+
+	/*
+	 * In this order, for a consistent view.  A write the sequence
+	 * number covers is in the memset loaded after it, or was flushed
+	 * from it; a flush publishes its root generation before the memset
+	 * without the memtable flushed.
+	 */
+	view->seq = __atomic_load_n(&db->last_seq, __ATOMIC_ACQUIRE);
+	view->ms = __atomic_load_n(&table->memset, __ATOMIC_SEQ_CST);
+	view->rg = __atomic_load_n(&table->rootgen, __ATOMIC_SEQ_CST);
+
+	if (!view->ms || !view->rg) {
+		*errptr = strdup("table dropped");
+		return false;
+	}
+
+	return true;
+}
+
+void pg_view_leave(struct pgdb_view *view)
+{
+	pg_epoch_leave(&view->guard);
+}
+
+/*
+ * pg_view_enter(), for a reader that outlives its epoch: the view
+ * holds references.  Release with pg_view_put(), even on failure.
+ */
+bool pg_view_get(pgdb_t *db, unsigned int table_slot,
+		 const pgdb_readoptions_t *options, struct pgdb_view *view,
+		 char **errptr)
+{
+	bool rc = pg_view_enter(db, table_slot, options, view, errptr);
+	if (rc) {
+		pg_memset_ref(view->ms);
+		pg_rootgen_ref(view->rg);
+	} else {
+		view->ms = NULL;
+		view->rg = NULL;
+	}
+
+	pg_view_leave(view);
+	return rc;
+}
+
+void pg_view_put(struct pgdb_view *view)
+{
+	pg_rootgen_unref(view->rg);
+	pg_memset_unref(view->ms);
+}
+
+const pgdb_snapshot_t* pgdb_create_snapshot(
+    pgdb_t* db)
+{
+	pthread_mutex_lock(&db->lock);
+
+	pgdb_snapshot_t *snap = calloc(1, sizeof(*snap) +
+				       (db->n_tables * sizeof(struct pgdb_view)));
+	if (!snap) {
+		pthread_mutex_unlock(&db->lock);
+		return NULL;
+	}
+
+	unsigned int i;
+	for (i = 0; i < db->n_tables; i++)
+		view_take(db, i, &snap->view[i]);
+	snap->db = db;
+	snap->n_tables = db->n_tables;
+
+	pthread_mutex_unlock(&db->lock);
+
+	return snap;
+}
+
+void pgdb_release_snapshot(
+    pgdb_t* db,
+    const pgdb_snapshot_t* snapshot)
+{
+	pgdb_snapshot_t *snap = (pgdb_snapshot_t *) snapshot;
+
+	if (!snap)
+		return;
+	assert(snap->db == db);
+
+	unsigned int i;
+	for (i = 0; i < snap->n_tables; i++)
+		pg_view_put(&snap->view[i]);
+
+	memset(snap, 0xff, sizeof(*snap) +
+	       (snap->n_tables * sizeof(struct pgdb_view)));
+	free(snap);
+}
@@ -31,45 +31,38 @@ bool pg_write_superblock(pgdb_t *db, PGcodec__Superblock *superblock,
 
 	bool rc = false;
 
-	// serialize superblock
+	// serialize superblock straight into a new temp file
 	size_t plen = pgcodec__superblock__get_packed_size(superblock);
-	void *pbuf = malloc(plen);
-	if (!pbuf) {
-		*errptr = strdup("OOM");	// irony, but recoverable
-		goto out;
-	}
-	pgcodec__superblock__pack(superblock, pbuf);
-
-	// open new temp file
-	int fd = open(tmp_fn, O_WRONLY | O_CREAT | O_EXCL, 0666);
-	if (fd < 0) {
-		*errptr = strdup(strerror(errno));
-		goto out_pbuf;
-	}
+	struct pgdb_filewriter *fw = pg_fw_create(db, tmp_fn,
+						  pg_fw_wrap_size(plen),
+						  false, errptr);
+	if (!fw)
+		return false;
 
-	// write serialized data to temp file
-	if (!pg_wrap_file(fd, PGDB_SB_MAGIC, pbuf, plen, errptr))
-		goto out_fd;
+	pg_fw_wrap_begin(fw, PGDB_SB_MAGIC);
+	pgcodec__superblock__pack_to_buffer(superblock, &fw->pbuf);
+	pg_fw_wrap_end(fw);
 
-	close(fd);
-	fd = -1;
+	if (!pg_fw_finish(fw, errptr))
+		goto out;
 
 	// rename into place
 	if (rename(tmp_fn, fn) < 0) {
 		*errptr = strdup(strerror(errno));
-		goto out_fd;
+		goto out;
+	}
+
+	// make the rename, and every file it refers to, durable
+	int dir_fd = open(db->pathname, O_RDONLY | O_DIRECTORY);
+	if (dir_fd >= 0) {
+		fsync(dir_fd);
+		close(dir_fd);
 	}
 
 	rc = true;
 
-out_fd:
-	if (fd >= 0)
-		close(fd);
-	if (!rc)
-		unlink(tmp_fn);
-out_pbuf:
-	free(pbuf);
 out:
+	pg_fw_free(fw, !rc);
 	return rc;
 }
 
@@ -0,0 +1,418 @@
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "pgdb-internal.h"
+
+/*
+ * Tables.
+ *
+ * Each table of the superblock is a key space of its own: its own root
+ * index of sorted runs, its own memtables, and its own settings, kept
+ * in its TableMeta.  All tables share the write-ahead log, each batch
+ * tagged with the id of the table it belongs to, and one background
+ * thread each for flushes and compactions.  Table ids are never reused,
+ * so batches logged for a dropped table are simply skipped at replay.
+ *
+ * The master table always exists, at slot 0.
+ */
+
+void pg_table_free(struct pgdb_table_t *table)
+{
+	if (!table)
+		return;
+
+	pg_manifest_close(table);
+
+	// evicts from the table's cache; free that last
+	pg_rootgen_unref(table->rootgen);
+	pg_memset_unref(table->memset);
+	pg_pfcache_free(table->pfcache);
+	free(table->name);
+
+	memset(table, 0xff, sizeof(*table));
+	free(table);
+}
+
+// settings stored in tm, the database's otherwise
+static void table_resolve_opts(pgdb_t *db, const PGcodec__TableMeta *tm,
+			       struct pgdb_tableoptions_t *opt)
+{
+	opt->write_buffer_size = tm->has_write_buffer_size ?
+				 tm->write_buffer_size :
+				 db->opt->write_buffer_size;
+	opt->max_file_size = tm->has_max_file_size ?
+			     tm->max_file_size : db->opt->max_file_size;
+	opt->max_open_files = tm->has_max_open_files ?
+			      tm->max_open_files : db->opt->max_open_files;
+	opt->compact_trigger = tm->has_compact_trigger ?
+			       tm->compact_trigger : PGDB_COMPACT_TRIGGER;
+}
+
+/*
+ * Open the table tm describes, and publish it in the next free slot.
+ */
+struct pgdb_table_t *pg_table_open(pgdb_t *db, PGcodec__TableMeta *tm,
+				   char **errptr)
+{
+	struct pgdb_table_t *table = calloc(1, sizeof(*table));
+	if (!table)
+		goto oom;
+
+	table->db = db;
+	table->id = tm->has_table_id ? tm->table_id : 0;
+	table->manifest_fd = -1;
+	table_resolve_opts(db, tm, &table->opt);
+
+	table->name = strdup(tm->name);
+	table->pfcache = pg_pfcache_new(table->opt.max_open_files,
+					 &db->pool);
+	if (!table->name || !table->pfcache)
+		goto oom;
+
+	PGcodec__RootIdx *root;
+	struct pgdb_map *root_map;
+	if (!pg_read_root(db, &root, &root_map, tm->root_id, errptr))
+		goto err_out;
+
+	if (!pg_manifest_replay(table, tm->root_id, &root, &root_map,
+				errptr)) {
+		pg_root_free(root, root_map);
+		goto err_out;
+	}
+
+	table->rootgen = pg_rootgen_new(table, root, root_map, tm->root_id,
+					NULL, errptr);
+	if (!table->rootgen)
+		goto err_out;
+
+	struct pgdb_memtable *mt = pg_memtable_new();
+	if (!mt)
+		goto oom;
+	table->memset = pg_memset_new(mt, NULL, 0);
+	pg_memtable_unref(mt);
+	if (!table->memset)
+		goto oom;
+
+	pthread_mutex_lock(&db->lock);
+
+	if (db->n_tables >= PGDB_MAX_TABLES) {
+		pthread_mutex_unlock(&db->lock);
+		*errptr = strdup("table limit reached");
+		goto err_out;
+	}
+
+	table->slot = db->n_tables;
+	db->tables[db->n_tables++] = table;
+
+	pthread_mutex_unlock(&db->lock);
+
+	return table;
+
+oom:
+	*errptr = strdup("OOM");	// irony, but recoverable
+err_out:
+	pg_table_free(table);
+	return NULL;
+}
+
+// the live table with table_id, or NULL; db->lock held, or during open
+struct pgdb_table_t *pg_find_table(pgdb_t *db, uint32_t table_id)
+{
+	unsigned int i;
+	for (i = 0; i < db->n_tables; i++) {
+		struct pgdb_table_t *table = db->tables[i];
+		if (!table->dropped && table->id == table_id)
+			return table;
+	}
+
+	return NULL;
+}
+
+/*
+ * The oldest log still holding records not yet flushed, by any live
+ * table.  A memtable with no records yet has no log_id.  db->lock held.
+ */
+uint64_t pg_min_log_id(pgdb_t *db)
+{
+	uint64_t min_log_id = db->log_id;
+	unsigned int i, j;
+
+	for (i = 0; i < db->n_tables; i++) {
+		struct pgdb_table_t *table = db->tables[i];
+		if (table->dropped)
+			continue;
+
+		struct pgdb_memset *ms = table->memset;
+		for (j = 0; j < ms->n_mt; j++) {
+			uint64_t log_id = ms->mt[j]->log_id;
+			if (log_id && log_id < min_log_id)
+				min_log_id = log_id;
+		}
+	}
+
+	return min_log_id;
+}
+
+static uint32_t alloc_table_id(PGcodec__Superblock *sb)
+{
+	if (sb->has_next_table_id)
+		return sb->next_table_id;
+
+	// written before table ids were stored; the master is 0
+	uint32_t table_id = 1;
+	unsigned int i;
+	for (i = 0; i < sb->n_tables; i++) {
+		PGcodec__TableMeta *tm = sb->tables[i];
+		if (tm->has_table_id && tm->table_id >= table_id)
+			table_id = tm->table_id + 1;
+	}
+
+	return table_id;
+}
+
+static PGcodec__TableMeta *tablemeta_new(const char *name, uint64_t root_id,
+					 uint32_t table_id,
+					 const pgdb_tableoptions_t *options)
+{
+	PGcodec__TableMeta *tm = malloc(sizeof(*tm));
+	if (!tm)
+		return NULL;
+	pgcodec__table_meta__init(tm);
+
+	pg_uuid_t uuid;
+	char uuid_s[128];
+	pg_uuid(uuid);
+	pg_uuid_str(uuid_s, uuid);
+
+	tm->name = strdup(name);
+	tm->uuid = strdup(uuid_s);
+	if (!tm->name || !tm->uuid) {
+		pgcodec__table_meta__free_unpacked(tm, NULL);
+		return NULL;
+	}
+
+	tm->root_id = root_id;
+	tm->has_table_id = 1;
+	tm->table_id = table_id;
+
+	if (options && options->write_buffer_size) {
+		tm->has_write_buffer_size = 1;
+		tm->write_buffer_size = options->write_buffer_size;
+	}
+	if (options && options->max_file_size) {
+		tm->has_max_file_size = 1;
+		tm->max_file_size = options->max_file_size;
+	}
+	if (options && options->max_open_files) {
+		tm->has_max_open_files = 1;
+		tm->max_open_files = options->max_open_files;
+	}
+	if (options && options->compact_trigger) {
+		tm->has_compact_trigger = 1;
+		tm->compact_trigger = options->compact_trigger;
+	}
+
+	return tm;
+}
+
+pgdb_table_t* pgdb_create_table(
+    pgdb_t* db,
+    const char* name,
+    const pgdb_tableoptions_t* options,
+    char** errptr)
+{
+	*errptr = NULL;
+
+	if (db->opt->readonly) {
+		*errptr = strdup("database is read-only");
+		return NULL;
+	}
+
+	struct pgdb_table_t *table = NULL;
+	PGcodec__Superblock *sb = db->superblock;
+
+	pthread_mutex_lock(&db->root_lock);
+
+	if (pg_find_tablemeta(sb, name)) {
+		*errptr = strdup("table already exists");
+		goto out;
+	}
+
+	// only we add tables, and we hold root_lock: checked before any
+	// file is written, the limit still holds when the table opens
+	pthread_mutex_lock(&db->lock);
+	bool full = (db->n_tables >= PGDB_MAX_TABLES);
+	pthread_mutex_unlock(&db->lock);
+	if (full) {
+		*errptr = strdup("table limit reached");
+		goto out;
+	}
+
+	PGcodec__TableMeta **tables = realloc(sb->tables, (sb->n_tables + 1) *
+					      sizeof(PGcodec__TableMeta *));
+	if (!tables) {
+		*errptr = strdup("OOM");	// irony, but recoverable
+		goto out;
+	}
+	sb->tables = tables;
+
+	// an empty root index
+	PGcodec__RootIdx root = PGCODEC__ROOT_IDX__INIT;
+	uint64_t root_id = pg_alloc_file_id(db);
+	if (!pg_write_root(db, &root, root_id, errptr))
+		goto out;
+
+	uint32_t table_id = alloc_table_id(sb);
+	PGcodec__TableMeta *tm = tablemeta_new(name, root_id, table_id,
+					       options);
+	if (!tm) {
+		*errptr = strdup("OOM");	// irony, but recoverable
+		goto err_root;
+	}
+
+	protobuf_c_boolean had_next_table_id = sb->has_next_table_id;
+	uint32_t next_table_id = sb->next_table_id;
+
+	sb->tables[sb->n_tables++] = tm;
+	sb->has_next_table_id = 1;
+	sb->next_table_id = table_id + 1;
+
+	if (!pg_write_superblock(db, sb, errptr)) {
+		sb->n_tables--;
+		sb->has_next_table_id = had_next_table_id;
+		sb->next_table_id = next_table_id;
+		pgcodec__table_meta__free_unpacked(tm, NULL);
+		goto err_root;
+	}
+
+	// on failure the table exists, and opens with the database
+	table = pg_table_open(db, tm, errptr);
+	goto out;
+
+err_root:
+	pg_remove_file(db, root_id);
+out:
+	pthread_mutex_unlock(&db->root_lock);
+	return table;
+}
+
+pgdb_table_t* pgdb_open_table(
+    pgdb_t* db,
+    const char* name,
+    char** errptr)
+{
+	*errptr = NULL;
+
+	struct pgdb_table_t *table = NULL;
+	unsigned int i;
+
+	pthread_mutex_lock(&db->lock);
+	for (i = 0; i < db->n_tables; i++)
+		if (!db->tables[i]->dropped &&
+		    !strcmp(db->tables[i]->name, name)) {
+			table = db->tables[i];
+			break;
+		}
+	pthread_mutex_unlock(&db->lock);
+
+	if (!table)
+		*errptr = strdup("table not found");
+	return table;
+}
+
+/*
+ * Remove table from the superblock, then detach its memtables and root
+ * generation.  Its files go once the last reader of them is done: an
+ * iterator or snapshot taken earlier keeps reading the table as it was.
+ */
+void pgdb_drop_table(
+    pgdb_t* db,
+    pgdb_table_t* table,
+    char** errptr)
+{
+	*errptr = NULL;
+
+	if (db->opt->readonly) {
+		*errptr = strdup("database is read-only");
+		return;
+	}
+	if (table->slot == 0) {
+		*errptr = strdup("cannot drop master table");
+		return;
+	}
+
+	// no compaction may be running on it, nor a root install
+	pthread_mutex_lock(&db->compact_lock);
+	pthread_mutex_lock(&db->root_lock);
+
+	PGcodec__Superblock *sb = db->superblock;
+	PGcodec__TableMeta *tm = NULL;
+	unsigned int i;
+
+	if (!table->dropped)
+		for (i = 0; i < sb->n_tables; i++)
+			if (!strcmp(sb->tables[i]->name, table->name)) {
+				tm = sb->tables[i];
+				break;
+			}
+	if (!tm) {
+		*errptr = strdup("table dropped");
+		goto out;
+	}
+
+	memmove(&sb->tables[i], &sb->tables[i + 1],
+		(sb->n_tables - i - 1) * sizeof(PGcodec__TableMeta *));
+	sb->n_tables--;
+
+	if (!pg_write_superblock(db, sb, errptr)) {
+		memmove(&sb->tables[i + 1], &sb->tables[i],
+			(sb->n_tables - i) * sizeof(PGcodec__TableMeta *));
+		sb->tables[i] = tm;
+		sb->n_tables++;
+		goto out;
+	}
+
+	pgcodec__table_meta__free_unpacked(tm, NULL);
+
+	pthread_mutex_lock(&db->lock);
+	table->dropped = true;
+	struct pgdb_memset *ms = table->memset;
+	struct pgdb_rootgen *rg = table->rootgen;
+	__atomic_store_n(&table->memset, NULL, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&table->rootgen, NULL, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&db->lock);
+
+	// nothing refers to any of its files now; on OOM, the next open
+	// removes them as orphans
+	PGcodec__RootIdx *root = rg->root;
+	rg->obsolete = malloc((root->n_entries + 1) * sizeof(uint64_t));
+	if (rg->obsolete) {
+		size_t j;
+		for (j = 0; j < root->n_entries; j++)
+			rg->obsolete[j] = root->entries[j]->file_id;
+		rg->obsolete[root->n_entries] = rg->root_id;
+		rg->n_obsolete = root->n_entries + 1;
+	}
+
+	// read only at open, so it can go now
+	pg_manifest_close(table);
+	pg_manifest_remove(db, rg->root_id);
+
+	pthread_mutex_unlock(&db->root_lock);
+	pthread_mutex_unlock(&db->compact_lock);
+
+	pg_rootgen_retire(rg);
+	pg_memset_retire(db, ms);
+	pg_epoch_collect(db->epoch);
+	return;
+
+out:
+	pthread_mutex_unlock(&db->root_lock);
+	pthread_mutex_unlock(&db->compact_lock);
+}
+
+const char* pgdb_table_name(const pgdb_table_t* table)
+{
+	return table->name;
+}
@@ -1,5 +1,7 @@
 
 #include <string.h>
+#include <stdio.h>
+#include <alloca.h>
 #include <sys/uio.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -10,49 +12,7 @@
 
 #include "pgdb-internal.h"
 
-bool pg_wrap_file(int fd, char *magic, const void *data,
-	      size_t data_len, char **errptr)
-{
-	struct pgdb_file_header hdr;
-
-	// compute file header
-	memcpy(&hdr.magic, magic, sizeof(hdr.magic));
-	hdr.len = htole32(data_len);
-	hdr.reserved = 0;
-
-	// compute file trailer
-	SHA256_CTX ctx;
-	unsigned char md[SHA256_DIGEST_LENGTH];
-
-	SHA256_Init(&ctx);
-	SHA256_Update(&ctx, &hdr, sizeof(hdr));
-	SHA256_Update(&ctx, data, data_len);
-	SHA256_Final(md, &ctx);
-
-	// build output data list
-	struct iovec iov[3];
-	iov[0].iov_base = &hdr;		// header
-	iov[0].iov_len = sizeof(hdr);
-	iov[1].iov_base = (void *) data;// data
-	iov[1].iov_len = data_len;
-	iov[2].iov_base = &md[0];	// trailer
-	iov[2].iov_len = sizeof(md);
-
-	size_t total_len =
-		iov[0].iov_len +
-		iov[1].iov_len +
-		iov[2].iov_len;
-
-	// output data to fd
-	ssize_t bwrite = writev(fd, iov, 3);
-	if (bwrite != total_len) {
-		*errptr = strdup(strerror(errno));
-		return false;
-	}
-
-	return true;
-}
-
+// check a wrapped file, laid out as filewriter.c describes
 bool pg_verify_file(char *magic, const void *file_data,
 		unsigned long file_len, char **errptr)
 {
@@ -77,20 +37,47 @@ bool pg_verify_file(char *magic, const void *file_data,
 		return false;
 	}
 
-	// total == header + data + trailer
-	unsigned long want_len = sizeof(*hdr) + len + PGDB_TRAIL_SZ;
+	unsigned int shift = le32toh(hdr->chunk_shift);
+	if (shift && (shift < PGDB_CHUNK_SHIFT_MIN ||
+		      shift > PGDB_CHUNK_SHIFT_MAX)) {
+		*errptr = strdup("chunk size unsupported");
+		return false;
+	}
+
+	size_t digests_len = shift ? (pg_merkle_n_chunks(len, shift) *
+				      SHA256_DIGEST_LENGTH) : 0;
+
+	// total == header + data + chunk digests + trailer
+	unsigned long want_len = sizeof(*hdr) + len + digests_len +
+				 PGDB_TRAIL_SZ;
 	if (want_len > file_len) {
 		*errptr = strdup("file too short for data and metadata");
 		return false;
 	}
 
-	// verify hash(hdr + data)
 	const unsigned char *data = file_data + sizeof(*hdr);
-	const unsigned char *trailer = data + len;
+	const unsigned char *digests = data + len;
+	const unsigned char *trailer = digests + digests_len;
 	unsigned char md[SHA256_DIGEST_LENGTH];
 
-	SHA256(file_data, sizeof(*hdr) + len, md);
-	if (memcmp(md, trailer, SHA256_DIGEST_LENGTH)) {
+	// written before chunking: verify hash(hdr + data)
+	if (!shift) {
+		SHA256(file_data, sizeof(*hdr) + len, md);
+		if (memcmp(md, trailer, SHA256_DIGEST_LENGTH)) {
+			*errptr = strdup("checksum mismatch");
+			return false;
+		}
+		return true;
+	}
+
+	// verify hash(hdr + chunk digests), then each chunk against those
+	if (!pg_merkle_top(md, hdr, sizeof(*hdr), digests, digests_len)) {
+		*errptr = strdup("OOM");	// irony, but recoverable
+		return false;
+	}
+
+	if (memcmp(md, trailer, SHA256_DIGEST_LENGTH) ||
+	    !pg_merkle_verify(data, len, shift, digests)) {
 		*errptr = strdup("checksum mismatch");
 		return false;
 	}
@@ -133,3 +120,36 @@ bool pg_iterate_dir(const char *dirname,
 	return arc;
 }
 
+uint64_t pg_alloc_file_id(pgdb_t *db)
+{
+	pthread_mutex_lock(&db->lock);
+	uint64_t file_id = db->next_file_id++;
+	pthread_mutex_unlock(&db->lock);
+
+	return file_id;
+}
+
+// make the names of files just created in the database directory durable
+bool pg_sync_dir(pgdb_t *db, char **errptr)
+{
+	int dir_fd = open(db->pathname, O_RDONLY | O_DIRECTORY);
+	if (dir_fd < 0 || fsync(dir_fd) < 0) {
+		*errptr = strdup(strerror(errno));
+		if (dir_fd >= 0)
+			close(dir_fd);
+		return false;
+	}
+
+	close(dir_fd);
+	return true;
+}
+
+bool pg_remove_file(pgdb_t *db, uint64_t file_id)
+{
+	size_t fn_len = strlen(db->pathname) + 64 + 2;
+	char *fn = alloca(fn_len);
+	snprintf(fn, fn_len, "%s/%llu", db->pathname,
+		 (unsigned long long) file_id);
+
+	return unlink(fn) == 0;
+}
@@ -0,0 +1,538 @@
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <alloca.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <ctype.h>
+
+#include "pgdb-internal.h"
+
+/*
+ * Write-ahead log.
+ *
+ * A log file is a pgdb_file_header (magic PGDB_LOG_MAGIC) followed by
+ * batch records, each a pgdb_wal_hdr naming its table and an encoded
+ * payload of one or more put/delete records.  Logs are named
+ * "<file id>.log"; a new log is started whenever a write buffer of any
+ * table rotates, and every log found at open time is replayed in id
+ * order.  A log is made durable before the next is started, so only
+ * the last can end in a batch torn by a crash; replay stops quietly
+ * there, and cuts it off.  Each batch header carries a checksum of its
+ * own, so a damaged length cannot pass for a batch running past the
+ * end.  Damage anywhere else, which would drop acknowledged batches
+ * while replaying later ones, fails recovery.
+ */
+
+static void wal_name(pgdb_t *db, uint64_t log_id, char *fn, size_t fn_len)
+{
+	snprintf(fn, fn_len, "%s/%llu" PGDB_LOG_SUFFIX, db->pathname,
+		 (unsigned long long) log_id);
+}
+
+static size_t varint_len(uint32_t v)
+{
+	size_t n = 1;
+	while (v >= 0x80) {
+		v >>= 7;
+		n++;
+	}
+	return n;
+}
+
+static unsigned char *varint_put(unsigned char *p, uint32_t v)
+{
+	while (v >= 0x80) {
+		*p++ = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	return p;
+}
+
+static const unsigned char *varint_get(const unsigned char *p,
+				       const unsigned char *end, uint32_t *v)
+{
+	uint32_t result = 0;
+	unsigned int shift;
+
+	for (shift = 0; shift <= 28 && p < end; shift += 7) {
+		uint32_t byte = *p++;
+		result |= (byte & 0x7f) << shift;
+		if (!(byte & 0x80)) {
+			*v = result;
+			return p;
+		}
+	}
+
+	return NULL;
+}
+
+size_t pg_rec_size(enum pgdb_rec_type type, size_t klen, size_t vlen)
+{
+	size_t sz = 1 + varint_len(klen) + klen;
+	if (type == PGDB_REC_PUT)
+		sz += varint_len(vlen) + vlen;
+	return sz;
+}
+
+// encode one record at p, returning the byte after it
+void *pg_rec_encode(void *p_, enum pgdb_rec_type type,
+		    const void *key, size_t klen,
+		    const void *val, size_t vlen)
+{
+	unsigned char *p = p_;
+
+	*p++ = type;
+	p = varint_put(p, klen);
+	memcpy(p, key, klen);
+	p += klen;
+
+	if (type == PGDB_REC_PUT) {
+		p = varint_put(p, vlen);
+		memcpy(p, val, vlen);
+		p += vlen;
+	}
+
+	return p;
+}
+
+/*
+ * Decode the record at *pp, advancing *pp past it.  Returns false at
+ * the end of the buffer or on a malformed record.
+ */
+bool pg_rec_decode(const void **pp, const void *end_,
+		   enum pgdb_rec_type *type,
+		   const void **key, size_t *klen,
+		   const void **val, size_t *vlen)
+{
+	const unsigned char *p = *pp;
+	const unsigned char *end = end_;
+	uint32_t len;
+
+	if (p >= end)
+		return false;
+
+	*type = *p++;
+	if (*type != PGDB_REC_PUT && *type != PGDB_REC_DEL)
+		return false;
+
+	p = varint_get(p, end, &len);
+	if (!p || len > (end - p))
+		return false;
+	*key = p;
+	*klen = len;
+	p += len;
+
+	*val = NULL;
+	*vlen = 0;
+	if (*type == PGDB_REC_PUT) {
+		p = varint_get(p, end, &len);
+		if (!p || len > (end - p))
+			return false;
+		*val = p;
+		*vlen = len;
+		p += len;
+	}
+
+	*pp = p;
+	return true;
+}
+
+/*
+ * Start log log_id, and write to it from now on.  Whatever the old log
+ * holds is made durable first: replay must never find a batch of the
+ * new log without every batch before it.  The new log's name is made
+ * durable too, so that a sync write to it is.
+ */
+bool pg_wal_create(pgdb_t *db, uint64_t log_id, char **errptr)
+{
+	size_t fn_len = strlen(db->pathname) + 64 + 2;
+	char *fn = alloca(fn_len);
+	wal_name(db, log_id, fn, fn_len);
+
+	if (db->log_fd >= 0 && fdatasync(db->log_fd) < 0) {
+		*errptr = strdup(strerror(errno));
+		return false;
+	}
+
+	int fd = open(fn, O_WRONLY | O_CREAT | O_EXCL | O_APPEND, 0666);
+	if (fd < 0) {
+		*errptr = strdup(strerror(errno));
+		return false;
+	}
+
+	struct pgdb_file_header hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, PGDB_LOG_MAGIC, sizeof(hdr.magic));
+
+	if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+		*errptr = strdup(strerror(errno));
+		close(fd);
+		unlink(fn);
+		return false;
+	}
+
+	if (!pg_sync_dir(db, errptr)) {
+		close(fd);
+		unlink(fn);
+		return false;
+	}
+
+	if (db->log_fd >= 0)
+		close(db->log_fd);
+	db->log_fd = fd;
+	db->log_id = log_id;
+	db->log_seq++;
+
+	return true;
+}
+
+void pg_wal_close(pgdb_t *db)
+{
+	if (db->log_fd >= 0)
+		close(db->log_fd);
+	db->log_fd = -1;
+}
+
+bool pg_wal_remove(pgdb_t *db, uint64_t log_id)
+{
+	size_t fn_len = strlen(db->pathname) + 64 + 2;
+	char *fn = alloca(fn_len);
+	wal_name(db, log_id, fn, fn_len);
+
+	return unlink(fn) == 0;
+}
+
+/*
+ * Append the batches of a whole commit group with one writev(2), then
+ * make them durable with one fdatasync(2) if any writer asked for it.
+ * hdrs[] must have room for n entries.
+ */
+bool pg_wal_append(pgdb_t *db, uint32_t table_id,
+		   struct pgdb_writer **group, unsigned int n,
+		   struct pgdb_wal_hdr *hdrs, bool sync, char **errptr)
+{
+	struct iovec *iov = alloca(2 * n * sizeof(struct iovec));
+	size_t total_len = 0;
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		struct pgdb_writer *w = group[i];
+		struct pgdb_wal_hdr *hdr = &hdrs[i];
+
+		memset(hdr, 0, sizeof(*hdr));
+		hdr->len = htole32(w->rep_len);
+		hdr->seq = htole64(w->seq);
+		hdr->count = htole32(w->count);
+		hdr->table_id = htole32(table_id);
+		hdr->crc = htole32(pg_crc32c(0, w->rep, w->rep_len));
+		hdr->hdr_crc = htole32(pg_crc32c(0, hdr,
+				offsetof(struct pgdb_wal_hdr, hdr_crc)));
+
+		iov[2 * i].iov_base = hdr;
+		iov[2 * i].iov_len = sizeof(*hdr);
+		iov[2 * i + 1].iov_base = (void *) w->rep;
+		iov[2 * i + 1].iov_len = w->rep_len;
+		total_len += sizeof(*hdr) + w->rep_len;
+	}
+
+	ssize_t bwrite = writev(db->log_fd, iov, 2 * n);
+	if (bwrite != total_len) {
+		*errptr = strdup((bwrite < 0) ? strerror(errno) :
+				 "short log write");
+		return false;
+	}
+
+	if (sync && fdatasync(db->log_fd) < 0) {
+		*errptr = strdup(strerror(errno));
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Apply an encoded batch to a memtable, numbering its records from
+ * seq.  The caller guarantees it is the only writer of mt.
+ */
+bool pg_wal_apply(struct pgdb_memtable *mt, uint64_t seq,
+		  const void *rep, size_t rep_len, unsigned int count)
+{
+	const void *p = rep;
+	const void *end = rep + rep_len;
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		enum pgdb_rec_type type;
+		const void *key, *val;
+		size_t klen, vlen;
+
+		if (!pg_rec_decode(&p, end, &type, &key, &klen, &val, &vlen))
+			return false;
+		if (!pg_memtable_add(mt, seq + i, type, key, klen, val, vlen))
+			return false;
+	}
+
+	return true;
+}
+
+// copy the batch header at p to *hdr; is it sound?
+static bool wal_hdr_ok(const void *p, struct pgdb_wal_hdr *hdr)
+{
+	memcpy(hdr, p, sizeof(*hdr));	// batches are not aligned
+
+	return pg_crc32c(0, hdr, offsetof(struct pgdb_wal_hdr, hdr_crc)) ==
+	       le32toh(hdr->hdr_crc);
+}
+
+// is there a sound batch header anywhere in [p, end)?
+static bool wal_hdr_follows(const void *p, const void *end)
+{
+	struct pgdb_wal_hdr hdr;
+
+	for (; (end - p) >= sizeof(hdr); p++)
+		if (wal_hdr_ok(p, &hdr))
+			return true;
+
+	return false;
+}
+
+/*
+ * The length of the sound batch at p, its header copied to *hdr, or 0
+ * if there is none; then *torn tells whether it can only be the tail
+ * of an append cut short.  A batch is taken for one if its header is
+ * cut short; or if its header is sound but its payload runs to the end
+ * of the file or past it; or if its header is damaged and no sound one
+ * follows it.
+ */
+static size_t wal_rec(const void *p, const void *end,
+		      struct pgdb_wal_hdr *hdr, bool *torn)
+{
+	const void *rep = p + sizeof(*hdr);
+
+	*torn = true;
+	if ((end - p) < sizeof(*hdr))
+		return 0;
+
+	if (!wal_hdr_ok(p, hdr)) {
+		*torn = !wal_hdr_follows(p + 1, end);
+		return 0;
+	}
+
+	uint32_t len = le32toh(hdr->len);
+	if (len > (end - rep))
+		return 0;
+
+	*torn = (rep + len == end);
+	if (pg_crc32c(0, rep, len) != le32toh(hdr->crc))
+		return 0;
+
+	*torn = false;
+	return sizeof(*hdr) + len;
+}
+
+// cut log fn back to len, durably: a newer log is about to be started
+static bool wal_truncate(const char *fn, off_t len, char **errptr)
+{
+	int fd = open(fn, O_WRONLY);
+	if (fd < 0 || ftruncate(fd, len) < 0 || fsync(fd) < 0) {
+		*errptr = strdup(strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return false;
+	}
+
+	close(fd);
+	return true;
+}
+
+// replay log log_id; only the last log may end in a torn batch
+static bool wal_replay(pgdb_t *db, uint64_t log_id, bool last,
+		       char **errptr)
+{
+	size_t fn_len = strlen(db->pathname) + 64 + 2;
+	char *fn = alloca(fn_len);
+	wal_name(db, log_id, fn, fn_len);
+
+	// crashed between create and header write: nothing was logged
+	struct stat st;
+	if (stat(fn, &st) < 0) {
+		*errptr = strdup(strerror(errno));
+		return false;
+	}
+	if (st.st_size < sizeof(struct pgdb_file_header))
+		return true;
+
+	struct pgdb_map *map = pgmap_open(fn, errptr);
+	if (!map)
+		return false;
+
+	bool rc = false;
+	off_t valid_len = 0;
+	struct pgdb_file_header *fhdr = map->mem;
+	if (memcmp(fhdr->magic, PGDB_LOG_MAGIC, sizeof(fhdr->magic))) {
+		*errptr = strdup("log magic mismatch");
+		goto out;
+	}
+
+	const void *p = map->mem + sizeof(*fhdr);
+	const void *end = map->mem + map->st.st_size;
+	bool torn = false;
+
+	while (p < end) {
+		struct pgdb_wal_hdr hdr;
+		size_t rec_len = wal_rec(p, end, &hdr, &torn);
+		if (!rec_len)
+			break;
+
+		uint32_t len = le32toh(hdr.len);
+		uint64_t seq = le64toh(hdr.seq);
+		uint32_t count = le32toh(hdr.count);
+		const void *rep = p + sizeof(hdr);
+
+		if (count && (seq + count - 1) > db->last_seq)
+			db->last_seq = seq + count - 1;
+
+		p += rec_len;
+
+		// a table dropped since; its id is never reused
+		struct pgdb_table_t *table = pg_find_table(db,
+						le32toh(hdr.table_id));
+		if (!table)
+			continue;
+
+		struct pgdb_memtable *mt = table->memset->mt[0];
+		if (!pg_wal_apply(mt, seq, rep, len, count)) {
+			*errptr = strdup("log replay failed");
+			goto out;
+		}
+
+		if (!mt->log_id || log_id < mt->log_id)
+			mt->log_id = log_id;
+	}
+
+	if (p < end && (!torn || !last)) {
+		*errptr = strdup("log corrupt");
+		goto out;
+	}
+
+	valid_len = p - map->mem;
+	rc = true;
+
+out:
+	pgmap_free(map);
+
+	// cut off a torn tail, before a newer log can follow it
+	if (rc && valid_len < st.st_size && !db->opt->readonly)
+		rc = wal_truncate(fn, valid_len, errptr);
+
+	return rc;
+}
+
+struct log_scan_info {
+	uint64_t		*ids;
+	unsigned int		n_ids;
+	unsigned int		alloc_ids;
+};
+
+static bool log_scan_iter(const struct dirent *de, void *priv, char **errptr)
+{
+	struct log_scan_info *lsi = priv;
+	const char *s = de->d_name;
+
+	if (!isdigit(*s))
+		return true;		// continue dir iteration
+
+	char *suffix;
+	unsigned long long ll = strtoull(s, &suffix, 10);
+	if (strcmp(suffix, PGDB_LOG_SUFFIX))
+		return true;		// continue dir iteration
+
+	if (lsi->n_ids == lsi->alloc_ids) {
+		unsigned int alloc_ids = lsi->alloc_ids ? lsi->alloc_ids * 2 : 8;
+		uint64_t *ids = realloc(lsi->ids, alloc_ids * sizeof(uint64_t));
+		if (!ids) {
+			*errptr = strdup("OOM");	// irony, but recoverable
+			return false;	// stop dir iteration
+		}
+		lsi->ids = ids;
+		lsi->alloc_ids = alloc_ids;
+	}
+
+	lsi->ids[lsi->n_ids++] = ll;
+
+	return true;		// continue dir iteration
+}
+
+static int cmp_u64(const void *a_, const void *b_)
+{
+	const uint64_t *a = a_, *b = b_;
+
+	if (*a == *b)
+		return 0;
+	return (*a < *b) ? -1 : 1;
+}
+
+/*
+ * Remove the logs whose records have all been flushed to pagefiles,
+ * those older than min_log_id.  Oldest go first, so that a crash part
+ * way through never leaves an old log behind without the newer ones.
+ */
+void pg_wal_remove_obsolete(pgdb_t *db, uint64_t min_log_id)
+{
+	struct log_scan_info lsi = { NULL, 0, 0 };
+	char *err = NULL;
+
+	if (!pg_iterate_dir(db->pathname, log_scan_iter, &lsi, &err)) {
+		free(err);
+		goto out;		// retried after the next flush
+	}
+
+	qsort(lsi.ids, lsi.n_ids, sizeof(uint64_t), cmp_u64);
+
+	unsigned int i;
+	for (i = 0; i < lsi.n_ids && lsi.ids[i] < min_log_id; i++)
+		pg_wal_remove(db, lsi.ids[i]);
+
+out:
+	free(lsi.ids);
+}
+
+/*
+ * Replay every log in the database directory into the write buffers of
+ * the tables its batches belong to, then (unless read-only) start a
+ * fresh log.
+ */
+bool pg_wal_recover(pgdb_t *db, char **errptr)
+{
+	struct log_scan_info lsi = { NULL, 0, 0 };
+	bool rc = false;
+
+	if (!pg_iterate_dir(db->pathname, log_scan_iter, &lsi, errptr))
+		goto out;
+
+	qsort(lsi.ids, lsi.n_ids, sizeof(uint64_t), cmp_u64);
+
+	unsigned int i;
+	for (i = 0; i < lsi.n_ids; i++)
+		if (!wal_replay(db, lsi.ids[i], i + 1 == lsi.n_ids, errptr))
+			goto out;
+
+	if (!db->opt->readonly) {
+		uint64_t log_id = db->next_file_id++;
+		if (!pg_wal_create(db, log_id, errptr))
+			goto out;
+	}
+
+	rc = true;
+
+out:
+	free(lsi.ids);
+	return rc;
+}
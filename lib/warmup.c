@@ -0,0 +1,164 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "pgdb-internal.h"
+
+/*
+ * Warm-up.
+ *
+ * A database just opened has read nothing of its pagefiles: its first
+ * lookups each open the files they touch, and fault in their indexes,
+ * restart points and filters one page at a time.  Warming up does so
+ * ahead of them.  Each table's pagefiles are opened, newest run first,
+ * until its open-pagefile cache (and the read pool, see map.c) is full,
+ * and readahead is started on the parts of each that every lookup reads
+ * (see pg_pagefile_regions()), so the files are read in parallel.  Each
+ * is then faulted in, in turn, progress being reported per pagefile.
+ *
+ * Optionally those parts, and each table's flat root index, are locked
+ * in memory too.  They stay locked until closed: pagefiles evicted, or
+ * roots superseded, are unlocked as they are unmapped.
+ */
+
+// pagefiles of rg to warm: those its table keeps open, newest first
+static unsigned int warm_count(struct pgdb_rootgen *rg)
+{
+	unsigned int max = rg->table->opt.max_open_files;
+	unsigned int n = 0, r;
+
+	for (r = 0; r < rg->n_runs && n < max; r++)
+		n += rg->runs[r].n_ents;
+
+	return (n < max) ? n : max;
+}
+
+// open rg's pagefiles to warm into pfs[], starting readahead of each
+static bool warm_open(struct pgdb_rootgen *rg, struct pgdb_pagefile **pfs,
+		      unsigned int *n_pfs, char **errptr)
+{
+	struct pgdb_table_t *table = rg->table;
+	unsigned int max = warm_count(rg), n = 0, r, i;
+
+	for (r = 0; r < rg->n_runs; r++) {
+		struct pgdb_run *run = &rg->runs[r];
+
+		for (i = 0; i < run->n_ents; i++) {
+			if (n >= max || !pg_pool_room(&table->db->pool,
+						table->opt.max_file_size, 0))
+				return true;
+
+			struct pgdb_pagefile *pf = pg_pagefile_get(table,
+						run->ents[i]->file_id, errptr);
+			if (!pf)
+				return false;
+
+			struct pgdb_region reg[PGDB_PAGE_REGIONS];
+			unsigned int n_reg = pg_pagefile_regions(pf, reg), j;
+			for (j = 0; j < n_reg; j++)
+				pgmap_prefetch(pf->map, reg[j].offset,
+					       reg[j].len);
+
+			pfs[(*n_pfs)++] = pf;
+			n++;
+		}
+	}
+
+	return true;
+}
+
+// fault in, and lock if asked, all of map; false once locking fails
+static bool warm_map(struct pgdb_map *map, uint64_t offset, uint64_t len,
+		     bool lock, char **errptr)
+{
+	pgmap_populate(map, offset, len);
+
+	return !lock || pgmap_lock(map, offset, len, errptr);
+}
+
+void pg_warmup(pgdb_t *db, bool lock,
+	       void (*progress)(void *arg, uint64_t done, uint64_t total),
+	       void *arg, char **errptr)
+{
+	struct pgdb_view *views = NULL;
+	struct pgdb_pagefile **pfs = NULL;
+	unsigned int n_pfs = 0, max_pfs = 0, t, i;
+	char *lock_err = NULL;		// reported once all is prefetched
+
+	pthread_mutex_lock(&db->lock);
+	unsigned int n_tables = db->n_tables;
+	pthread_mutex_unlock(&db->lock);
+
+	views = calloc(n_tables, sizeof(*views));
+	if (!views)
+		goto oom;
+
+	// dropped tables are skipped
+	for (t = 0; t < n_tables; t++) {
+		char *err = NULL;
+		if (!pg_view_get(db, t, NULL, &views[t], &err)) {
+			free(err);
+			continue;
+		}
+		max_pfs += warm_count(views[t].rg);
+	}
+
+	pfs = calloc(max_pfs + 1, sizeof(*pfs));
+	if (!pfs)
+		goto oom;
+
+	for (t = 0; t < n_tables; t++) {
+		struct pgdb_rootgen *rg = views[t].rg;
+		if (!rg)
+			continue;
+
+		struct pgdb_map *root_map = rg->root_map;
+		if (root_map && !warm_map(root_map, 0, root_map->st.st_size,
+					  lock, &lock_err))
+			lock = false;
+
+		if (!warm_open(rg, pfs, &n_pfs, errptr))
+			goto out;
+	}
+
+	for (i = 0; i < n_pfs; i++) {
+		struct pgdb_pagefile *pf = pfs[i];
+		struct pgdb_region reg[PGDB_PAGE_REGIONS];
+		unsigned int n_reg = pg_pagefile_regions(pf, reg), j;
+
+		for (j = 0; j < n_reg; j++)
+			if (!warm_map(pf->map, reg[j].offset, reg[j].len, lock,
+				      &lock_err))
+				lock = false;
+
+		if (progress)
+			progress(arg, i + 1, n_pfs);
+	}
+
+	if (lock_err) {
+		*errptr = lock_err;
+		lock_err = NULL;
+	}
+	goto out;
+
+oom:
+	*errptr = strdup("OOM");	// irony, but recoverable
+out:
+	for (i = 0; i < n_pfs; i++)
+		pg_pagefile_put(pfs[i]);
+	for (t = 0; views && t < n_tables; t++)
+		pg_view_put(&views[t]);
+	free(lock_err);
+	free(pfs);
+	free(views);
+}
+
+void pgdb_warmup(
+    pgdb_t* db,
+    unsigned char lock,
+    void (*progress)(void* arg, uint64_t done, uint64_t total),
+    void* arg,
+    char** errptr)
+{
+	*errptr = NULL;
+	pg_warmup(db, lock, progress, arg, errptr);
+}
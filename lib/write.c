@@ -0,0 +1,352 @@
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "pgdb-internal.h"
+#include "adt.h"
+
+/*
+ * Writers queue up on db->writers.  The writer at the head of the queue
+ * becomes leader: it gathers the batches of the writers queued behind
+ * it, appends them all to the log with a single writev (and at most one
+ * fdatasync), applies them to the memtable, and then wakes the
+ * followers with their results.  Concurrent synchronous writers thus
+ * share one fsync instead of paying one each.
+ */
+
+/*
+ * Swap table's write buffer out for a fresh, empty one.  The full
+ * memtable stays readable, second in the new memset, until the
+ * background thread flushes it.  db->lock held.
+ */
+static void pg_table_swap(pgdb_t *db, struct pgdb_table_t *table)
+{
+	struct pgdb_memset *old = table->memset;
+
+	struct pgdb_memtable *mt = pg_memtable_new();
+	if (!mt)
+		return;
+
+	struct pgdb_memset *ms = pg_memset_new(mt, old, old->n_mt);
+	pg_memtable_unref(mt);
+	if (!ms)
+		return;
+
+	__atomic_store_n(&table->memset, ms, __ATOMIC_SEQ_CST);
+	pg_memset_retire(db, old);
+
+	pthread_cond_signal(&db->bg_cv);
+}
+
+/*
+ * Every table writes to the one log, so a table holding a few records
+ * in an old log keeps every later log alive.  Swap out the write buffer
+ * of any table whose records go back PGDB_WAL_MAX_LOGS logs, however
+ * small, so that flushing it releases them.  db->lock held.
+ */
+static void pg_tables_unpin_logs(pgdb_t *db)
+{
+	unsigned int i;
+	for (i = 0; i < db->n_tables; i++) {
+		struct pgdb_table_t *table = db->tables[i];
+		if (table->dropped)
+			continue;
+
+		struct pgdb_memset *ms = table->memset;
+		struct pgdb_memtable *mt = ms->mt[0];
+		if (mt->log_id &&
+		    (db->log_seq - mt->log_seq) >= PGDB_WAL_MAX_LOGS &&
+		    ms->n_mt < PGDB_MAX_MEMTABLES)
+			pg_table_swap(db, table);
+	}
+}
+
+/*
+ * Swap a full write buffer out for a fresh one, writing to a new log.
+ * Called by the leader with db->lock held.
+ */
+static void pg_table_rotate(pgdb_t *db, struct pgdb_table_t *table)
+{
+	struct pgdb_memset *old = table->memset;
+
+	if (old->mt[0]->mem_usage < table->opt.write_buffer_size)
+		return;
+
+	// too many unflushed buffers; keep filling the current one
+	if (old->n_mt >= PGDB_MAX_MEMTABLES)
+		return;
+
+	char *err = NULL;
+	uint64_t log_id = db->next_file_id++;
+	if (!pg_wal_create(db, log_id, &err)) {
+		free(err);
+		return;
+	}
+
+	pg_table_swap(db, table);
+	pg_tables_unpin_logs(db);
+}
+
+static bool pg_write(pgdb_t *db, struct pgdb_writer *w, char **errptr)
+{
+	*errptr = NULL;
+
+	if (db->opt->readonly) {
+		*errptr = strdup("database is read-only");
+		return false;
+	}
+
+	pthread_cond_init(&w->cv, NULL);
+	w->done = false;
+	w->next = NULL;
+
+	pthread_mutex_lock(&db->lock);
+
+	if (db->writers_tail)
+		db->writers_tail->next = w;
+	else
+		db->writers_head = w;
+	db->writers_tail = w;
+
+	while (!w->done && db->writers_head != w)
+		pthread_cond_wait(&w->cv, &db->lock);
+
+	if (w->done)
+		goto out_unlock;
+
+	// we are the leader: form a commit group from the queue
+	struct pgdb_table_t *table = db->tables[w->table_slot];
+	bool dropped = table->dropped;
+	if (!dropped)
+		pg_table_rotate(db, table);
+
+	struct pgdb_writer *group[PGDB_WAL_GROUP_MAX];
+	struct pgdb_wal_hdr hdrs[PGDB_WAL_GROUP_MAX];
+	unsigned int n = 0;
+	size_t group_bytes = 0;
+	uint64_t seq = db->last_seq + 1;
+	bool sync = false;
+
+	struct pgdb_writer *x;
+	for (x = w; x && n < PGDB_WAL_GROUP_MAX; x = x->next) {
+		if (n && (group_bytes + x->rep_len) > PGDB_WAL_GROUP_BYTES)
+			break;
+		if (x->table_slot != w->table_slot)
+			break;
+
+		group[n++] = x;
+		group_bytes += x->rep_len;
+		x->seq = seq;
+		seq += x->count;
+		sync |= x->sync;
+	}
+
+	// a drop may retire the memtable while we fill it
+	struct pgdb_memtable *mt = NULL;
+	if (!dropped) {
+		mt = table->memset->mt[0];
+		pg_memtable_ref(mt);
+
+		// its records start in the current log
+		if (!mt->log_id) {
+			mt->log_id = db->log_id;
+			mt->log_seq = db->log_seq;
+		}
+	}
+	bool log_broken = db->log_broken;
+	char *err = db->bg_error ? strdup(db->bg_error) : NULL;
+
+	pthread_mutex_unlock(&db->lock);
+
+	// log, then memtable; only the leader writes either
+	bool ok;
+	if (err)
+		ok = false;		// background flush failed
+	else if (dropped) {
+		err = strdup("table dropped");
+		ok = false;
+	} else if (log_broken) {
+		err = strdup("write-ahead log unusable after earlier error");
+		ok = false;
+	} else
+		ok = pg_wal_append(db, table->id, group, n, hdrs, sync, &err);
+
+	bool applied = true;
+	unsigned int i;
+	for (i = 0; ok && i < n; i++)
+		if (!pg_wal_apply(mt, group[i]->seq, group[i]->rep,
+				  group[i]->rep_len, group[i]->count)) {
+			err = strdup("OOM");	// irony, but recoverable
+			ok = applied = false;
+		}
+
+	pg_memtable_unref(mt);
+
+	pthread_mutex_lock(&db->lock);
+
+	if (ok)
+		__atomic_store_n(&db->last_seq, seq - 1, __ATOMIC_RELEASE);
+	else if (!applied)
+		db->log_broken = true;	// logged, but not in the memtable
+	else if (!log_broken && !dropped && !db->bg_error)
+		db->log_broken = true;	// log tail is now unknown
+
+	bool group_ok = (err == NULL);
+	for (i = 0; i < n; i++) {
+		struct pgdb_writer *gw = group[i];
+
+		db->writers_head = gw->next;
+		if (!db->writers_head)
+			db->writers_tail = NULL;
+
+		gw->ok = group_ok;
+		gw->err = (gw == w) ? err : (err ? strdup(err) : NULL);
+		gw->done = true;
+		if (gw != w)
+			pthread_cond_signal(&gw->cv);
+	}
+
+	if (db->writers_head)
+		pthread_cond_signal(&db->writers_head->cv);
+
+out_unlock:
+	pthread_mutex_unlock(&db->lock);
+	pthread_cond_destroy(&w->cv);
+
+	*errptr = w->err;
+	return w->ok;
+}
+
+// commit count encoded records as one log entry
+static bool __pgdb_write_rep(pgdb_t *db, unsigned int table_slot,
+			     const pgdb_writeoptions_t *options,
+			     const void *rep, size_t rep_len,
+			     unsigned int count, char **errptr)
+{
+	struct pgdb_writer w;
+	memset(&w, 0, sizeof(w));
+	w.rep = rep;
+	w.rep_len = rep_len;
+	w.count = count;
+	w.table_slot = table_slot;
+	w.sync = options && options->sync;
+
+	return pg_write(db, &w, errptr);
+}
+
+static bool __pgdb_write_rec(pgdb_t *db, unsigned int table_slot,
+			     const pgdb_writeoptions_t *options,
+			     enum pgdb_rec_type type,
+			     const char *key, size_t keylen,
+			     const char *val, size_t vallen,
+			     char **errptr)
+{
+	if (keylen > UINT32_MAX || vallen > UINT32_MAX) {
+		*errptr = strdup("record too large");
+		return false;
+	}
+
+	size_t rep_len = pg_rec_size(type, keylen, vallen);
+	char stack_buf[256];
+	void *rep = stack_buf;
+	if (rep_len > sizeof(stack_buf)) {
+		rep = malloc(rep_len);
+		if (!rep) {
+			*errptr = strdup("OOM");	// irony, but recoverable
+			return false;
+		}
+	}
+
+	pg_rec_encode(rep, type, key, keylen, val, vallen);
+
+	bool rc = __pgdb_write_rep(db, table_slot, options, rep, rep_len, 1,
+				   errptr);
+
+	if (rep != stack_buf)
+		free(rep);
+	return rc;
+}
+
+void pgdb_put(
+    pgdb_t* db,
+    const pgdb_writeoptions_t* options,
+    const char* key, size_t keylen,
+    const char* val, size_t vallen,
+    char** errptr)
+{
+	__pgdb_write_rec(db, 0, options, PGDB_REC_PUT, key, keylen,
+			 val, vallen, errptr);
+}
+
+void pgdb_put_cf(
+    pgdb_t* db,
+    const pgdb_writeoptions_t* options,
+    pgdb_table_t* table,
+    const char* key, size_t keylen,
+    const char* val, size_t vallen,
+    char** errptr)
+{
+	__pgdb_write_rec(db, table->slot, options, PGDB_REC_PUT, key, keylen,
+			 val, vallen, errptr);
+}
+
+void pgdb_delete(
+    pgdb_t* db,
+    const pgdb_writeoptions_t* options,
+    const char* key, size_t keylen,
+    char** errptr)
+{
+	__pgdb_write_rec(db, 0, options, PGDB_REC_DEL, key, keylen,
+			 NULL, 0, errptr);
+}
+
+void pgdb_delete_cf(
+    pgdb_t* db,
+    const pgdb_writeoptions_t* options,
+    pgdb_table_t* table,
+    const char* key, size_t keylen,
+    char** errptr)
+{
+	__pgdb_write_rec(db, table->slot, options, PGDB_REC_DEL, key, keylen,
+			 NULL, 0, errptr);
+}
+
+/*
+ * Apply a batch atomically: its records share one log entry, written
+ * with the rest of its commit group, and are inserted in one pass.
+ */
+static void __pgdb_write(pgdb_t *db, unsigned int table_slot,
+			 const pgdb_writeoptions_t *options,
+			 pgdb_writebatch_t *batch, char **errptr)
+{
+	*errptr = NULL;
+
+	if (batch->err) {
+		*errptr = strdup(batch->err);
+		return;
+	}
+	if (!batch->count)
+		return;
+
+	__pgdb_write_rep(db, table_slot, options, batch->rep->s,
+			 batch->rep->len, batch->count, errptr);
+}
+
+void pgdb_write(
+    pgdb_t* db,
+    const pgdb_writeoptions_t* options,
+    pgdb_writebatch_t* batch,
+    char** errptr)
+{
+	__pgdb_write(db, 0, options, batch, errptr);
+}
+
+void pgdb_write_cf(
+    pgdb_t* db,
+    const pgdb_writeoptions_t* options,
+    pgdb_table_t* table,
+    pgdb_writebatch_t* batch,
+    char** errptr)
+{
+	__pgdb_write(db, table->slot, options, batch, errptr);
+}
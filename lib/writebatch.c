@@ -0,0 +1,114 @@
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "pgdb-internal.h"
+#include "adt.h"
+
+/*
+ * Write batches.
+ *
+ * A batch is one growable buffer holding its records in log encoding
+ * (see pg_rec_encode()), so adding a record costs a copy and, now and
+ * then, a realloc; pgdb_write() hands the buffer to the log as is.
+ * The put and delete calls cannot return errors; the first one is kept
+ * and reported by pgdb_write().
+ */
+
+pgdb_writebatch_t* pgdb_writebatch_create(void)
+{
+	pgdb_writebatch_t *wb = calloc(1, sizeof(*wb));
+	if (!wb)
+		return NULL;
+
+	wb->rep = dstr_new(NULL, 0, 0);
+	if (!wb->rep) {
+		free(wb);
+		return NULL;
+	}
+
+	return wb;
+}
+
+void pgdb_writebatch_destroy(pgdb_writebatch_t* wb)
+{
+	if (!wb)
+		return;
+
+	dstr_free(wb->rep);
+	free(wb->err);
+
+	memset(wb, 0xff, sizeof(*wb));
+	free(wb);
+}
+
+void pgdb_writebatch_clear(pgdb_writebatch_t* wb)
+{
+	dstr_clear(wb->rep);
+	wb->count = 0;
+	free(wb->err);
+	wb->err = NULL;
+}
+
+static void writebatch_add(pgdb_writebatch_t *wb, enum pgdb_rec_type type,
+			   const char *key, size_t klen,
+			   const char *val, size_t vlen)
+{
+	if (wb->err)
+		return;
+
+	if (klen > UINT32_MAX || vlen > UINT32_MAX) {
+		wb->err = strdup("record too large");
+		return;
+	}
+
+	size_t rec_len = pg_rec_size(type, klen, vlen);
+	void *p = dstr_extend(wb->rep, rec_len);
+	if (!p) {
+		wb->err = strdup("OOM");	// irony, but recoverable
+		return;
+	}
+
+	pg_rec_encode(p, type, key, klen, val, vlen);
+	wb->count++;
+}
+
+void pgdb_writebatch_put(
+    pgdb_writebatch_t* wb,
+    const char* key, size_t klen,
+    const char* val, size_t vlen)
+{
+	writebatch_add(wb, PGDB_REC_PUT, key, klen, val, vlen);
+}
+
+void pgdb_writebatch_delete(
+    pgdb_writebatch_t* wb,
+    const char* key, size_t klen)
+{
+	writebatch_add(wb, PGDB_REC_DEL, key, klen, NULL, 0);
+}
+
+void pgdb_writebatch_iterate(
+    pgdb_writebatch_t* wb,
+    void* state,
+    void (*put)(void*, const char* k, size_t klen, const char* v, size_t vlen),
+    void (*deleted)(void*, const char* k, size_t klen))
+{
+	const void *p = wb->rep->s;
+	const void *end = wb->rep->s + wb->rep->len;
+	unsigned int i;
+
+	for (i = 0; i < wb->count; i++) {
+		enum pgdb_rec_type type;
+		const void *key, *val;
+		size_t klen, vlen;
+
+		if (!pg_rec_decode(&p, end, &type, &key, &klen, &val, &vlen))
+			break;
+
+		if (type == PGDB_REC_PUT)
+			put(state, key, klen, val, vlen);
+		else
+			deleted(state, key, klen);
+	}
+}
@@ -18,6 +18,25 @@ static void test_dstring(void)
 	CHECK(rc);
 	CHECK(!strcmp(s->s, "Hello world"));
 
+	// past the initial allocation
+	unsigned int i;
+	for (i = 0; i < 100; i++)
+		CHECK(dstr_append(s, "0123456789", 0));
+	CHECK(s->len == 1011);
+	CHECK(!memcmp(&s->s[1001], "0123456789", 11));
+
+	char *p = dstr_extend(s, 4);
+	CHECK(p == &s->s[1011]);
+	CHECK(s->len == 1015 && s->s[1015] == 0);
+
+	dstr_clear(s);
+	CHECK(s->len == 0 && !strcmp(s->s, ""));
+
+	dstr_free(s);
+
+	s = dstr_new(NULL, 0, 0);
+	CHECK(s != NULL);
+	CHECK(s->len == 0);
 	dstr_free(s);
 }
 
@@ -0,0 +1,1874 @@
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <openssl/sha.h>
+
+#include "pgdb-internal.h"	// internals under test
+
+#define CHECK(cond) { if (!(cond)) exit(1); }
+
+static const char *db_name = "basic.db";
+
+static pgdb_options_t *opt;
+
+// no flush or compaction may race what follows
+static void wait_background(pgdb_t *db)
+{
+	char *err = NULL;
+
+	pgdb_wait_background(db, &err);
+	CHECK(err == NULL);
+}
+
+static bool db_has(pgdb_t *db, const char *key, const char *want)
+{
+	char *err = NULL;
+	size_t vlen = 0;
+	char *v = pgdb_get(db, NULL, key, strlen(key), &vlen, &err);
+	CHECK(err == NULL);
+
+	bool rc;
+	if (!want)
+		rc = (v == NULL);
+	else
+		rc = v && (vlen == strlen(want)) && !memcmp(v, want, vlen);
+
+	pgdb_free(v);
+	return rc;
+}
+
+static void test_put_get(pgdb_t *db)
+{
+	char *err = NULL;
+
+	CHECK(db_has(db, "alpha", NULL));
+
+	pgdb_put(db, NULL, "alpha", 5, "one", 3, &err);
+	CHECK(err == NULL);
+	pgdb_put(db, NULL, "beta", 4, "two", 3, &err);
+	CHECK(err == NULL);
+	CHECK(db_has(db, "alpha", "one"));
+	CHECK(db_has(db, "beta", "two"));
+	CHECK(db_has(db, "gamma", NULL));
+
+	pgdb_put(db, NULL, "alpha", 5, "uno", 3, &err);
+	CHECK(err == NULL);
+	CHECK(db_has(db, "alpha", "uno"));
+
+	pgdb_delete(db, NULL, "alpha", 5, &err);
+	CHECK(err == NULL);
+	CHECK(db_has(db, "alpha", NULL));
+	CHECK(db_has(db, "beta", "two"));
+}
+
+static void test_pinned(pgdb_t *db)
+{
+	char *err = NULL;
+	size_t vlen = 0;
+	pgdb_pinned_t *pin = NULL;
+
+	const char *v = pgdb_get_pinned(db, NULL, "beta", 4, &vlen, &pin,
+					&err);
+	CHECK(err == NULL);
+	CHECK(v != NULL && pin != NULL);
+	CHECK(vlen == 3 && !memcmp(v, "two", 3));
+	pgdb_pinned_release(pin);
+
+	char buf[2];
+	CHECK(pgdb_get_into(db, NULL, "beta", 4, buf, sizeof(buf), &vlen,
+			    &err));
+	CHECK(vlen == 3 && !memcmp(buf, "tw", 2));
+	CHECK(!pgdb_get_into(db, NULL, "nope", 4, buf, sizeof(buf), &vlen,
+			     &err));
+}
+
+static void test_many(pgdb_t *db)
+{
+	char *err = NULL;
+	char key[32], val[32];
+	int i;
+
+	for (i = 0; i < 20000; i++) {
+		snprintf(key, sizeof(key), "key%08d", i);
+		snprintf(val, sizeof(val), "val%d", i);
+		pgdb_put(db, NULL, key, strlen(key), val, strlen(val), &err);
+		CHECK(err == NULL);
+	}
+
+	for (i = 0; i < 20000; i += 7) {
+		snprintf(key, sizeof(key), "key%08d", i);
+		snprintf(val, sizeof(val), "val%d", i);
+		CHECK(db_has(db, key, val));
+	}
+}
+
+static void fill(pgdb_t *db, const char *prefix, int n)
+{
+	char *err = NULL;
+	char key[32], val[32];
+	int i;
+
+	for (i = 0; i < n; i++) {
+		snprintf(key, sizeof(key), "%s%06d", prefix, i);
+		snprintf(val, sizeof(val), "%s%d", prefix, i);
+		pgdb_put(db, NULL, key, strlen(key), val, strlen(val), &err);
+		CHECK(err == NULL);
+	}
+}
+
+// overwrites and deletes must shadow versions already flushed
+static void test_flush(pgdb_t *db)
+{
+	char *err = NULL;
+
+	pgdb_put(db, NULL, "shadow", 6, "old", 3, &err);
+	CHECK(err == NULL);
+	pgdb_put(db, NULL, "zapped", 6, "old", 3, &err);
+	CHECK(err == NULL);
+	fill(db, "fa", 4000);
+	wait_background(db);
+
+	pgdb_put(db, NULL, "shadow", 6, "new", 3, &err);
+	CHECK(err == NULL);
+	pgdb_delete(db, NULL, "zapped", 6, &err);
+	CHECK(err == NULL);
+	fill(db, "fb", 4000);
+	wait_background(db);
+
+	CHECK(db_has(db, "shadow", "new"));
+	CHECK(db_has(db, "zapped", NULL));
+	CHECK(db_has(db, "fa000123", "fa123"));
+	CHECK(db_has(db, "fb003999", "fb3999"));
+}
+
+static bool iter_at(pgdb_iterator_t *it, const char *want)
+{
+	size_t klen = 0;
+
+	if (!pgdb_iter_valid(it))
+		return want == NULL;
+
+	const char *k = pgdb_iter_key(it, &klen);
+	return want && (klen == strlen(want)) && !memcmp(k, want, klen);
+}
+
+// every live key once, in order, across memtables and runs
+static void test_iter(pgdb_t *db)
+{
+	char *err = NULL;
+	char key[32], val[32];
+	size_t vlen = 0;
+	int i, n;
+
+	pgdb_iterator_t *it = pgdb_create_iterator(db, NULL);
+	CHECK(it != NULL);
+
+	pgdb_iter_seek(it, "fa", 2);
+	for (i = 0; i < 4000; i++) {
+		snprintf(key, sizeof(key), "fa%06d", i);
+		snprintf(val, sizeof(val), "fa%d", i);
+		CHECK(iter_at(it, key));
+		const char *v = pgdb_iter_value(it, &vlen);
+		CHECK(vlen == strlen(val) && !memcmp(v, val, vlen));
+		pgdb_iter_next(it);
+	}
+	CHECK(iter_at(it, "fb000000"));
+	pgdb_iter_prev(it);
+	CHECK(iter_at(it, "fa003999"));
+
+	pgdb_iter_seek(it, "shadow", 6);
+	CHECK(iter_at(it, "shadow"));
+	CHECK(!memcmp(pgdb_iter_value(it, &vlen), "new", 3));
+	pgdb_iter_next(it);
+	CHECK(iter_at(it, NULL));
+
+	pgdb_iter_seek_to_last(it);
+	CHECK(iter_at(it, "shadow"));
+	pgdb_iter_prev(it);
+	CHECK(iter_at(it, "key00019999"));
+	pgdb_iter_next(it);
+	CHECK(iter_at(it, "shadow"));
+
+	// written after the iterator was created: not seen
+	pgdb_put(db, NULL, "later", 5, "x", 1, &err);
+	CHECK(err == NULL);
+
+	n = 0;
+	for (pgdb_iter_seek_to_first(it); pgdb_iter_valid(it);
+	     pgdb_iter_next(it))
+		n++;
+	CHECK(n == 28002);
+
+	n = 0;
+	for (pgdb_iter_seek_to_last(it); pgdb_iter_valid(it);
+	     pgdb_iter_prev(it))
+		n++;
+	CHECK(n == 28002);
+
+	pgdb_iter_get_error(it, &err);
+	CHECK(err == NULL);
+	pgdb_iter_destroy(it);
+
+	pgdb_delete(db, NULL, "later", 5, &err);
+	CHECK(err == NULL);
+}
+
+static void test_multi_get(pgdb_t *db)
+{
+	static const char * const keys[] = {
+		"fb003999", "nope", "zapped", "shadow",
+		"fa000010", "key00000005", "fa000010", "alpha",
+	};
+	static const char * const want[] = {
+		"fb3999", NULL, NULL, "new",
+		"fa10", "val5", "fa10", NULL,
+	};
+	enum { N_KEYS = sizeof(keys) / sizeof(keys[0]) };
+	size_t key_lens[N_KEYS], val_lens[N_KEYS];
+	const char *vals[N_KEYS];
+	char *err = NULL;
+	int i;
+
+	for (i = 0; i < N_KEYS; i++)
+		key_lens[i] = strlen(keys[i]);
+
+	char *buf = pgdb_multi_get(db, NULL, N_KEYS, keys, key_lens,
+				   vals, val_lens, &err);
+	CHECK(err == NULL);
+	CHECK(buf != NULL);
+
+	for (i = 0; i < N_KEYS; i++) {
+		if (!want[i]) {
+			CHECK(vals[i] == NULL);
+			continue;
+		}
+		CHECK(vals[i] != NULL);
+		CHECK(val_lens[i] == strlen(want[i]));
+		CHECK(!memcmp(vals[i], want[i], val_lens[i]));
+	}
+
+	pgdb_free(buf);
+
+	buf = pgdb_multi_get(db, NULL, 1, &keys[1], &key_lens[1],
+			     vals, val_lens, &err);
+	CHECK(err == NULL);
+	CHECK(buf == NULL && vals[0] == NULL);
+}
+
+struct async_want {
+	const char	*want;
+	int		calls;
+};
+
+static void async_done(void *arg, char *val, size_t vallen, char *err)
+{
+	struct async_want *w = arg;
+
+	CHECK(err == NULL);
+	if (!w->want)
+		CHECK(val == NULL)
+	else
+		CHECK(val && vallen == strlen(w->want) &&
+		      !memcmp(val, w->want, vallen));
+
+	w->calls++;
+	pgdb_free(val);
+}
+
+// n lookups through a queue shallower than n; table NULL for the default
+static void async_check(pgdb_t *db, pgdb_table_t *table,
+			const pgdb_readoptions_t *ro,
+			const char * const *keys, const char * const *want,
+			int n)
+{
+	char *err = NULL;
+	pgdb_getq_t *q = pgdb_getq_create(db, 4, &err);
+	CHECK(err == NULL && q != NULL);
+
+	struct async_want *w = calloc(n, sizeof(*w));
+	CHECK(w != NULL);
+
+	int i;
+	for (i = 0; i < n; i++) {
+		w[i].want = want[i];
+
+		bool ok;
+		if (table)
+			ok = pgdb_get_async_cf(q, ro, table, keys[i],
+					       strlen(keys[i]), async_done,
+					       &w[i], &err);
+		else
+			ok = pgdb_get_async(q, ro, keys[i], strlen(keys[i]),
+					    async_done, &w[i], &err);
+		CHECK(ok && err == NULL);
+		CHECK(pgdb_getq_pending(q) <= 4);
+	}
+
+	pgdb_getq_reap(q, pgdb_getq_pending(q));
+	CHECK(pgdb_getq_pending(q) == 0);
+	for (i = 0; i < n; i++)
+		CHECK(w[i].calls == 1);
+
+	pgdb_getq_destroy(q);
+	free(w);
+}
+
+static void test_async(pgdb_t *db)
+{
+	static const char * const keys[] = {
+		"fb003999", "nope", "zapped", "shadow",
+		"fa000010", "key00000005", "alpha",
+	};
+	static const char * const want[] = {
+		"fb3999", NULL, NULL, "new",
+		"fa10", "val5", NULL,
+	};
+
+	async_check(db, NULL, NULL, keys, want, 7);
+
+	// spread over many pagefiles
+	enum { N_MANY = 200 };
+	static char key_buf[N_MANY][32], val_buf[N_MANY][32];
+	const char *many_keys[N_MANY], *many_want[N_MANY];
+	int i;
+	for (i = 0; i < N_MANY; i++) {
+		snprintf(key_buf[i], 32, "key%08d", i * 97);
+		snprintf(val_buf[i], 32, "val%d", i * 97);
+		many_keys[i] = key_buf[i];
+		many_want[i] = val_buf[i];
+	}
+
+	async_check(db, NULL, NULL, many_keys, many_want, N_MANY);
+}
+
+static uint64_t compact_done, compact_total;
+
+static void compact_progress(void *arg, uint64_t done, uint64_t total)
+{
+	CHECK(done <= total);
+	compact_done = done;
+	compact_total = total;
+}
+
+static void test_compact(pgdb_t *db)
+{
+	char *err = NULL;
+
+	pgdb_compact_range_progress(db, "fa000100", 8, "fa000200", 8,
+				    compact_progress, NULL, &err);
+	CHECK(err == NULL);
+	CHECK(db_has(db, "fa000150", "fa150"));
+
+	pgdb_compact_range_progress(db, NULL, 0, NULL, 0,
+				    compact_progress, NULL, &err);
+	CHECK(err == NULL);
+	CHECK(compact_total > 0 && compact_done == compact_total);
+
+	CHECK(db_has(db, "shadow", "new"));
+	CHECK(db_has(db, "zapped", NULL));
+	CHECK(db_has(db, "alpha", NULL));
+	CHECK(db_has(db, "key00000007", "val7"));
+	CHECK(db_has(db, "fb001999", "fb1999"));
+
+	pgdb_compact_range(db, NULL, 0, NULL, 0);
+	CHECK(db_has(db, "fa003999", "fa3999"));
+}
+
+static bool snap_has(pgdb_t *db, const pgdb_readoptions_t *ro,
+		     const char *key, const char *want)
+{
+	char *err = NULL;
+	size_t vlen = 0;
+	char *v = pgdb_get(db, ro, key, strlen(key), &vlen, &err);
+	CHECK(err == NULL);
+
+	bool rc;
+	if (!want)
+		rc = (v == NULL);
+	else
+		rc = v && (vlen == strlen(want)) && !memcmp(v, want, vlen);
+
+	pgdb_free(v);
+	return rc;
+}
+
+// a snapshot outlives the overwrites, flushes and compactions after it
+static void test_snapshot(pgdb_t *db)
+{
+	char *err = NULL;
+
+	const pgdb_snapshot_t *snap = pgdb_create_snapshot(db);
+	CHECK(snap != NULL);
+	pgdb_readoptions_t *ro = pgdb_readoptions_create();
+	CHECK(ro != NULL);
+	pgdb_readoptions_set_snapshot(ro, snap);
+
+	pgdb_put(db, NULL, "shadow", 6, "newer", 5, &err);
+	CHECK(err == NULL);
+	pgdb_delete(db, NULL, "beta", 4, &err);
+	CHECK(err == NULL);
+	fill(db, "fc", 4000);
+	wait_background(db);
+	pgdb_compact_range(db, NULL, 0, NULL, 0);
+
+	CHECK(db_has(db, "shadow", "newer"));
+	CHECK(db_has(db, "beta", NULL));
+	CHECK(snap_has(db, ro, "shadow", "new"));
+	CHECK(snap_has(db, ro, "beta", "two"));
+	CHECK(snap_has(db, ro, "fc000001", NULL));
+	CHECK(snap_has(db, ro, "fa000001", "fa1"));
+
+	pgdb_iterator_t *it = pgdb_create_iterator(db, ro);
+	CHECK(it != NULL);
+	pgdb_iter_seek_to_first(it);
+	CHECK(iter_at(it, "beta"));
+	pgdb_iter_seek(it, "fc", 2);
+	CHECK(iter_at(it, "key00000000"));
+	pgdb_iter_destroy(it);
+
+	pgdb_readoptions_destroy(ro);
+	pgdb_release_snapshot(db, snap);
+
+	pgdb_put(db, NULL, "shadow", 6, "new", 3, &err);
+	CHECK(err == NULL);
+	pgdb_put(db, NULL, "beta", 4, "two", 3, &err);
+	CHECK(err == NULL);
+}
+
+static int batch_puts, batch_dels;
+
+static void batch_put(void *state, const char *k, size_t klen,
+		      const char *v, size_t vlen)
+{
+	batch_puts++;
+}
+
+static void batch_del(void *state, const char *k, size_t klen)
+{
+	CHECK(klen == 6 && !memcmp(k, "wb0001", 6));
+	batch_dels++;
+}
+
+static void test_batch(pgdb_t *db)
+{
+	char *err = NULL;
+	char key[32];
+	int i;
+
+	pgdb_writebatch_t *wb = pgdb_writebatch_create();
+	CHECK(wb != NULL);
+
+	for (i = 0; i < 1000; i++) {
+		snprintf(key, sizeof(key), "wb%04d", i);
+		pgdb_writebatch_put(wb, key, strlen(key), key, strlen(key));
+	}
+	pgdb_writebatch_put(wb, "wb0000", 6, "again", 5);
+	pgdb_writebatch_delete(wb, "wb0001", 6);
+
+	pgdb_writebatch_iterate(wb, NULL, batch_put, batch_del);
+	CHECK(batch_puts == 1001 && batch_dels == 1);
+
+	pgdb_write(db, NULL, wb, &err);
+	CHECK(err == NULL);
+	CHECK(db_has(db, "wb0000", "again"));
+	CHECK(db_has(db, "wb0001", NULL));
+	CHECK(db_has(db, "wb0999", "wb0999"));
+
+	pgdb_writebatch_clear(wb);
+	for (i = 0; i < 1000; i++) {
+		snprintf(key, sizeof(key), "wb%04d", i);
+		pgdb_writebatch_delete(wb, key, strlen(key));
+	}
+	pgdb_write(db, NULL, wb, &err);
+	CHECK(err == NULL);
+	CHECK(db_has(db, "wb0000", NULL));
+	CHECK(db_has(db, "wb0999", NULL));
+
+	pgdb_writebatch_destroy(wb);
+}
+
+static pgdb_t *test_reopen(pgdb_t *db)
+{
+	char *err = NULL;
+
+	pgdb_writeoptions_t *wo = pgdb_writeoptions_create();
+	CHECK(wo != NULL);
+	pgdb_writeoptions_set_sync(wo, true);
+	pgdb_put(db, wo, "durable", 7, "yes", 3, &err);
+	CHECK(err == NULL);
+	pgdb_writeoptions_destroy(wo);
+
+	pgdb_close(db);
+
+	db = pgdb_open(opt, db_name, &err);
+	CHECK(db != NULL);
+	CHECK(err == NULL);
+
+	CHECK(db_has(db, "durable", "yes"));
+	CHECK(db_has(db, "alpha", NULL));
+	CHECK(db_has(db, "beta", "two"));
+	CHECK(db_has(db, "key00019999", "val19999"));
+	CHECK(db_has(db, "shadow", "new"));
+	CHECK(db_has(db, "zapped", NULL));
+	CHECK(db_has(db, "fa003999", "fa3999"));
+
+	return db;
+}
+
+static bool cf_has(pgdb_t *db, const pgdb_readoptions_t *ro,
+		   pgdb_table_t *table, const char *key, const char *want)
+{
+	char *err = NULL;
+	size_t vlen = 0;
+	char *v = pgdb_get_cf(db, ro, table, key, strlen(key), &vlen, &err);
+	CHECK(err == NULL);
+
+	bool rc;
+	if (!want)
+		rc = (v == NULL);
+	else
+		rc = v && (vlen == strlen(want)) && !memcmp(v, want, vlen);
+
+	pgdb_free(v);
+	return rc;
+}
+
+static void fill_cf(pgdb_t *db, pgdb_table_t *table, const char *prefix,
+		    int n)
+{
+	char *err = NULL;
+	char key[32], val[32];
+	int i;
+
+	for (i = 0; i < n; i++) {
+		snprintf(key, sizeof(key), "%s%06d", prefix, i);
+		snprintf(val, sizeof(val), "%s%d", prefix, i);
+		pgdb_put_cf(db, NULL, table, key, strlen(key),
+			    val, strlen(val), &err);
+		CHECK(err == NULL);
+	}
+}
+
+// tables are separate key spaces, persist, and drop cleanly
+static pgdb_t *test_tables(pgdb_t *db)
+{
+	char *err = NULL;
+
+	pgdb_tableoptions_t *to = pgdb_tableoptions_create();
+	CHECK(to != NULL);
+	pgdb_tableoptions_set_write_buffer_size(to, 16 * 1024);
+	pgdb_tableoptions_set_compaction_trigger(to, 2);
+
+	pgdb_table_t *logs = pgdb_create_table(db, "logs", to, &err);
+	CHECK(err == NULL && logs != NULL);
+	CHECK(!strcmp(pgdb_table_name(logs), "logs"));
+	CHECK(pgdb_create_table(db, "logs", NULL, &err) == NULL);
+	CHECK(err != NULL);
+	free(err);
+	err = NULL;
+	CHECK(pgdb_open_table(db, "logs", &err) == logs);
+	CHECK(err == NULL);
+
+	pgdb_put_cf(db, NULL, logs, "beta", 4, "logged", 6, &err);
+	CHECK(err == NULL);
+	CHECK(db_has(db, "beta", "two"));
+	CHECK(cf_has(db, NULL, logs, "beta", "logged"));
+	CHECK(cf_has(db, NULL, logs, "alpha", NULL));
+
+	fill_cf(db, logs, "la", 3000);
+	wait_background(db);
+	fill_cf(db, logs, "lb", 1000);
+	CHECK(cf_has(db, NULL, logs, "la000042", "la42"));
+	CHECK(db_has(db, "la000042", NULL));
+
+	pgdb_iterator_t *it = pgdb_create_iterator_cf(db, NULL, logs);
+	CHECK(it != NULL);
+	int n = 0;
+	for (pgdb_iter_seek_to_first(it); pgdb_iter_valid(it);
+	     pgdb_iter_next(it))
+		n++;
+	pgdb_iter_get_error(it, &err);
+	CHECK(err == NULL);
+	CHECK(n == 4001);
+	pgdb_iter_destroy(it);
+
+	pgdb_table_t *scratch = pgdb_create_table(db, "scratch", NULL, &err);
+	CHECK(err == NULL && scratch != NULL);
+	fill_cf(db, scratch, "s", 100);
+
+	const pgdb_snapshot_t *snap = pgdb_create_snapshot(db);
+	CHECK(snap != NULL);
+	pgdb_readoptions_t *ro = pgdb_readoptions_create();
+	CHECK(ro != NULL);
+	pgdb_readoptions_set_snapshot(ro, snap);
+
+	pgdb_drop_table(db, scratch, &err);
+	CHECK(err == NULL);
+	CHECK(pgdb_open_table(db, "scratch", &err) == NULL);
+	free(err);
+	err = NULL;
+
+	size_t vlen;
+	CHECK(pgdb_get_cf(db, NULL, scratch, "s000001", 7, &vlen,
+			  &err) == NULL);
+	CHECK(err != NULL);
+	free(err);
+	err = NULL;
+	pgdb_put_cf(db, NULL, scratch, "s", 1, "x", 1, &err);
+	CHECK(err != NULL);
+	free(err);
+	err = NULL;
+
+	CHECK(cf_has(db, ro, scratch, "s000001", "s1"));
+	pgdb_readoptions_destroy(ro);
+	pgdb_release_snapshot(db, snap);
+
+	pgdb_drop_table(db, pgdb_open_table(db, "master", &err), &err);
+	CHECK(err != NULL);
+	free(err);
+	err = NULL;
+
+	pgdb_close(db);
+
+	db = pgdb_open(opt, db_name, &err);
+	CHECK(db != NULL);
+	CHECK(err == NULL);
+
+	logs = pgdb_open_table(db, "logs", &err);
+	CHECK(err == NULL && logs != NULL);
+	CHECK(cf_has(db, NULL, logs, "beta", "logged"));
+	CHECK(cf_has(db, NULL, logs, "la002999", "la2999"));
+	CHECK(cf_has(db, NULL, logs, "lb000999", "lb999"));
+	CHECK(db_has(db, "beta", "two"));
+
+	// a new table of the same name starts empty
+	scratch = pgdb_create_table(db, "scratch", NULL, &err);
+	CHECK(err == NULL && scratch != NULL);
+	CHECK(cf_has(db, NULL, scratch, "s000001", NULL));
+
+	pgdb_tableoptions_destroy(to);
+	return db;
+}
+
+/*
+ * Count the manifests of the database; with tear set, append to each
+ * the start of a record, as a crash part way through an append leaves.
+ */
+static int manifests(bool tear)
+{
+	int n = 0;
+
+	DIR *dir = opendir(db_name);
+	CHECK(dir != NULL);
+
+	struct dirent *de;
+	while ((de = readdir(dir)) != NULL) {
+		const char *suffix = strchr(de->d_name, '.');
+		if (!suffix || strcmp(suffix, ".manifest"))
+			continue;
+		n++;
+
+		if (tear) {
+			char fn[512];
+			snprintf(fn, sizeof(fn), "%s/%s", db_name, de->d_name);
+
+			int fd = open(fn, O_WRONLY | O_APPEND);
+			CHECK(fd >= 0);
+			CHECK(write(fd, "torn rec", 8) == 8);
+			close(fd);
+		}
+	}
+
+	closedir(dir);
+	return n;
+}
+
+/*
+ * Flip a bit of the length of the first record of a manifest holding
+ * more than one, then (with restore) flip it back.
+ */
+static bool manifest_damage(bool restore)
+{
+	static char fn[512];
+	struct pgdb_manifest_hdr hdr;
+	off_t off = sizeof(struct pgdb_file_header);
+	bool found = false;
+
+	if (!restore) {
+		DIR *dir = opendir(db_name);
+		CHECK(dir != NULL);
+
+		struct dirent *de;
+		while (!found && (de = readdir(dir)) != NULL) {
+			const char *suffix = strchr(de->d_name, '.');
+			if (!suffix || strcmp(suffix, ".manifest"))
+				continue;
+
+			struct stat st;
+			snprintf(fn, sizeof(fn), "%s/%s", db_name, de->d_name);
+			int fd = open(fn, O_RDONLY);
+			CHECK(fd >= 0 && fstat(fd, &st) == 0);
+			found = pread(fd, &hdr, sizeof(hdr), off) == sizeof(hdr) &&
+				(off + sizeof(hdr) + le32toh(hdr.len)) <
+				st.st_size;
+			close(fd);
+		}
+
+		closedir(dir);
+		if (!found)
+			return false;
+	}
+
+	int fd = open(fn, O_RDWR);
+	CHECK(fd >= 0);
+	CHECK(pread(fd, &hdr, sizeof(hdr), off) == sizeof(hdr));
+	hdr.len ^= htole32(0x40000000);
+	CHECK(pwrite(fd, &hdr, sizeof(hdr), off) == sizeof(hdr));
+	close(fd);
+	return true;
+}
+
+// root changes are logged, and replayed at open past a torn append
+static pgdb_t *test_manifest(pgdb_t *db)
+{
+	char *err = NULL;
+
+	pgdb_table_t *logs = pgdb_open_table(db, "logs", &err);
+	CHECK(err == NULL && logs != NULL);
+	fill_cf(db, logs, "lm", 3000);
+	wait_background(db);
+	CHECK(manifests(false) > 0);
+
+	pgdb_close(db);
+	manifests(true);
+
+	db = pgdb_open(opt, db_name, &err);
+	CHECK(db != NULL);
+	CHECK(err == NULL);
+
+	logs = pgdb_open_table(db, "logs", &err);
+	CHECK(err == NULL && logs != NULL);
+	CHECK(cf_has(db, NULL, logs, "la002999", "la2999"));
+	CHECK(cf_has(db, NULL, logs, "lm002999", "lm2999"));
+
+	// appends go after the last whole record
+	fill_cf(db, logs, "ln", 3000);
+	wait_background(db);
+	pgdb_close(db);
+
+	db = pgdb_open(opt, db_name, &err);
+	CHECK(db != NULL);
+	CHECK(err == NULL);
+
+	logs = pgdb_open_table(db, "logs", &err);
+	CHECK(err == NULL && logs != NULL);
+	CHECK(cf_has(db, NULL, logs, "lm000000", "lm0"));
+	CHECK(cf_has(db, NULL, logs, "ln002999", "ln2999"));
+	CHECK(db_has(db, "key00019999", "val19999"));
+
+	// a damaged record followed by others is no torn tail
+	pgdb_close(db);
+	CHECK(manifest_damage(false));
+	CHECK(pgdb_open(opt, db_name, &err) == NULL);
+	CHECK(err != NULL);
+	pgdb_free(err);
+	err = NULL;
+	CHECK(manifest_damage(true));
+
+	db = pgdb_open(opt, db_name, &err);
+	CHECK(db != NULL);
+	CHECK(err == NULL);
+
+	logs = pgdb_open_table(db, "logs", &err);
+	CHECK(err == NULL && logs != NULL);
+	CHECK(cf_has(db, NULL, logs, "lm000000", "lm0"));
+
+	return db;
+}
+
+// the ids of the database's newest logs, newest first; how many there are
+static int newest_logs(unsigned long long ids[2])
+{
+	int n = 0;
+
+	DIR *dir = opendir(db_name);
+	CHECK(dir != NULL);
+
+	struct dirent *de;
+	while ((de = readdir(dir)) != NULL) {
+		char *suffix;
+		unsigned long long id = strtoull(de->d_name, &suffix, 10);
+		if (suffix == de->d_name || strcmp(suffix, ".log"))
+			continue;
+
+		if (n == 0 || id > ids[0]) {
+			ids[1] = ids[0];
+			ids[0] = id;
+		} else if (n == 1 || id > ids[1]) {
+			ids[1] = id;
+		}
+		n++;
+	}
+
+	closedir(dir);
+	return n;
+}
+
+static void log_name(char *fn, size_t fn_len, unsigned long long id)
+{
+	snprintf(fn, fn_len, "%s/%llu.log", db_name, id);
+}
+
+static void log_append(const char *fn, const char *s)
+{
+	int fd = open(fn, O_WRONLY | O_APPEND);
+	CHECK(fd >= 0);
+	CHECK(write(fd, s, strlen(s)) == strlen(s));
+	close(fd);
+}
+
+// flip a bit of the length of the first batch of log fn
+static void log_damage(const char *fn)
+{
+	struct pgdb_wal_hdr hdr;
+	off_t off = sizeof(struct pgdb_file_header);
+
+	int fd = open(fn, O_RDWR);
+	CHECK(fd >= 0);
+	CHECK(pread(fd, &hdr, sizeof(hdr), off) == sizeof(hdr));
+	hdr.len ^= htole32(0x40000000);
+	CHECK(pwrite(fd, &hdr, sizeof(hdr), off) == sizeof(hdr));
+	close(fd);
+}
+
+static void open_fails(void)
+{
+	char *err = NULL;
+
+	CHECK(pgdb_open(opt, db_name, &err) == NULL);
+	CHECK(err != NULL);
+	pgdb_free(err);
+}
+
+static void put_n(pgdb_t *db, const char *prefix, int n)
+{
+	char *err = NULL;
+	char key[32], val[32];
+	int i;
+
+	for (i = 0; i < n; i++) {
+		snprintf(key, sizeof(key), "%s%02d", prefix, i);
+		snprintf(val, sizeof(val), "%d", i);
+		pgdb_put(db, NULL, key, strlen(key), val, strlen(val), &err);
+		CHECK(err == NULL);
+	}
+}
+
+/*
+ * Only the last log can end in a batch torn by a crash, which replay
+ * cuts off; damage anywhere else fails the open.
+ */
+static pgdb_t *test_wal(pgdb_t *db)
+{
+	unsigned long long ids[2];
+	char fn[512];
+	char *err = NULL;
+	struct stat st, st_torn;
+
+	// no flush may remove the logs under test
+	wait_background(db);
+	put_n(db, "wal", 20);
+	pgdb_close(db);
+
+	CHECK(newest_logs(ids) >= 1);
+	log_name(fn, sizeof(fn), ids[0]);
+	CHECK(stat(fn, &st) == 0);
+	log_append(fn, "torn batch");
+
+	db = pgdb_open(opt, db_name, &err);
+	CHECK(db != NULL);
+	CHECK(err == NULL);
+	CHECK(db_has(db, "wal19", "19"));
+	CHECK(stat(fn, &st_torn) == 0 && st_torn.st_size == st.st_size);
+
+	// a damaged batch followed by others is no torn tail
+	put_n(db, "wbl", 20);
+	pgdb_close(db);
+
+	CHECK(newest_logs(ids) >= 2);
+	log_name(fn, sizeof(fn), ids[0]);
+	log_damage(fn);
+	open_fails();
+	log_damage(fn);
+
+	db = pgdb_open(opt, db_name, &err);
+	CHECK(db != NULL);
+	CHECK(err == NULL);
+	CHECK(db_has(db, "wbl00", "0"));
+	CHECK(db_has(db, "wbl19", "19"));
+	pgdb_close(db);
+
+	// nor is a torn batch in a log a newer one follows
+	CHECK(newest_logs(ids) >= 2);
+	log_name(fn, sizeof(fn), ids[1]);
+	CHECK(stat(fn, &st) == 0);
+	log_append(fn, "torn batch");
+	open_fails();
+	CHECK(truncate(fn, st.st_size) == 0);
+
+	db = pgdb_open(opt, db_name, &err);
+	CHECK(db != NULL);
+	CHECK(err == NULL);
+	CHECK(db_has(db, "wal00", "0"));
+	CHECK(db_has(db, "wbl19", "19"));
+
+	return db;
+}
+
+/*
+ * Pagefiles read whole into a small pool, rather than mapped, read
+ * alike; the pool never holds more than its size, files iterators still
+ * hold included, and files it has no room for are mapped instead.
+ */
+static pgdb_t *test_read_io(pgdb_t *db)
+{
+	static const int modes[] = { pgdb_read_io, pgdb_direct_io,
+				     pgdb_read_io };
+	static const size_t pools[] = { 64 * 1024, 64 * 1024, 4096 };
+	char *err = NULL;
+	char key[32], val[32];
+	int m, i;
+
+	for (m = 0; m < 3; m++) {
+		pgdb_close(db);
+		pgdb_options_set_io(opt, modes[m]);
+		pgdb_options_set_read_pool_size(opt, pools[m]);
+		db = pgdb_open(opt, db_name, &err);
+		CHECK(db != NULL);
+		CHECK(err == NULL);
+
+		for (i = 0; i < 20000; i += 7) {
+			snprintf(key, sizeof(key), "key%08d", i);
+			snprintf(val, sizeof(val), "val%d", i);
+			CHECK(db_has(db, key, val));
+		}
+
+		pgdb_iterator_t *it = pgdb_create_iterator(db, NULL);
+		CHECK(it != NULL);
+		int n = 0;
+		for (pgdb_iter_seek(it, "key", 3); pgdb_iter_valid(it);
+		     pgdb_iter_next(it)) {
+			size_t klen;
+			const char *k = pgdb_iter_key(it, &klen);
+			if (klen < 3 || memcmp(k, "key", 3))
+				break;
+
+			// lookups elsewhere evict what the iterator holds
+			if (!(n % 1000)) {
+				snprintf(key, sizeof(key), "key%08d",
+					 19999 - n);
+				snprintf(val, sizeof(val), "val%d", 19999 - n);
+				CHECK(db_has(db, key, val));
+				CHECK(db->pool.used <= pools[m]);
+			}
+			n++;
+		}
+		pgdb_iter_get_error(it, &err);
+		CHECK(err == NULL);
+		CHECK(n == 20000);
+		pgdb_iter_destroy(it);
+
+		static const char * const keys[] = {
+			"key00000005", "key00019999", "key", "nope",
+		};
+		static const char * const want[] = {
+			"val5", "val19999", NULL, NULL,
+		};
+		async_check(db, NULL, NULL, keys, want, 4);
+
+		pgdb_compact_range(db, NULL, 0, NULL, 0);
+		CHECK(db_has(db, "key00012345", "val12345"));
+
+		// each pagefile is larger than the smallest pool
+		CHECK(db->pool.used <= pools[m]);
+		CHECK((db->pool.used > 0) == (pools[m] > 4096));
+	}
+
+	pgdb_close(db);
+	pgdb_options_set_io(opt, pgdb_mmap_io);
+	pgdb_options_set_read_pool_size(opt, 0);
+	db = pgdb_open(opt, db_name, &err);
+	CHECK(db != NULL);
+	CHECK(err == NULL);
+
+	return db;
+}
+
+static uint64_t warm_done, warm_total;
+
+static void warm_progress(void *arg, uint64_t done, uint64_t total)
+{
+	CHECK(done == warm_done + 1 && done <= total);
+	warm_done = done;
+	warm_total = total;
+}
+
+static pgdb_t *test_warmup(pgdb_t *db)
+{
+	char *err = NULL;
+
+	warm_done = warm_total = 0;
+	pgdb_warmup(db, false, warm_progress, NULL, &err);
+	CHECK(err == NULL);
+	CHECK(warm_total > 0 && warm_done == warm_total);
+
+	// RLIMIT_MEMLOCK may refuse; what could not be locked is still read
+	warm_done = 0;
+	pgdb_warmup(db, true, warm_progress, NULL, &err);
+	free(err);
+	err = NULL;
+	CHECK(warm_done == warm_total);
+	CHECK(db_has(db, "key00012345", "val12345"));
+
+	pgdb_close(db);
+	pgdb_options_set_warmup(opt, pgdb_lock_warmup);
+	db = pgdb_open(opt, db_name, &err);
+	CHECK(db != NULL);
+	CHECK(err == NULL);
+	CHECK(db_has(db, "key00000007", "val7"));
+
+	pgdb_close(db);
+	pgdb_options_set_warmup(opt, pgdb_no_warmup);
+	db = pgdb_open(opt, db_name, &err);
+	CHECK(db != NULL);
+	CHECK(err == NULL);
+
+	return db;
+}
+
+// pagefiles evicted from a small open-file cache stay readable to their users
+static void test_open_files(pgdb_t *db)
+{
+	char *err = NULL;
+	pgdb_tableoptions_t *to = pgdb_tableoptions_create();
+	CHECK(to != NULL);
+	pgdb_tableoptions_set_write_buffer_size(to, 16 * 1024);
+	pgdb_tableoptions_set_max_open_files(to, 16);
+
+	pgdb_table_t *few = pgdb_create_table(db, "few", to, &err);
+	CHECK(err == NULL && few != NULL);
+	fill_cf(db, few, "f", 4000);
+	wait_background(db);
+
+	pgdb_iterator_t *it = pgdb_create_iterator_cf(db, NULL, few);
+	CHECK(it != NULL);
+	pgdb_iter_seek_to_first(it);
+	CHECK(pgdb_iter_valid(it));
+
+	char key[32], val[32];
+	int i, n = 0;
+	for (i = 0; i < 4000; i += 7) {
+		snprintf(key, sizeof(key), "f%06d", i);
+		snprintf(val, sizeof(val), "f%d", i);
+		CHECK(cf_has(db, NULL, few, key, val));
+	}
+
+	for (; pgdb_iter_valid(it); pgdb_iter_next(it))
+		n++;
+	pgdb_iter_get_error(it, &err);
+	CHECK(err == NULL);
+	CHECK(n == 4000);
+	pgdb_iter_destroy(it);
+
+	pgdb_drop_table(db, few, &err);
+	CHECK(err == NULL);
+	pgdb_tableoptions_destroy(to);
+}
+
+/*
+ * Flip a bit of the byte following needle in the pagefile holding it;
+ * a second flip restores the file.
+ */
+static bool flip_after(const char *needle)
+{
+	size_t nlen = strlen(needle);
+	bool found = false;
+
+	DIR *dir = opendir(db_name);
+	CHECK(dir != NULL);
+
+	struct dirent *de;
+	while (!found && (de = readdir(dir)) != NULL) {
+		char fn[512];
+		snprintf(fn, sizeof(fn), "%s/%s", db_name, de->d_name);
+
+		int fd = open(fn, O_RDWR);
+		if (fd < 0)
+			continue;
+
+		struct stat st;
+		char *buf = NULL;
+		ssize_t len = 0, i;
+		if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 8) {
+			buf = malloc(st.st_size);
+			CHECK(buf != NULL);
+			len = pread(fd, buf, st.st_size, 0);
+		}
+
+		if (len > 8 && !memcmp(buf, "PGDBPAGE", 8))
+			for (i = 0; !found && (i + nlen) < len; i++)
+				if (!memcmp(&buf[i], needle, nlen)) {
+					char c = buf[i + nlen] ^ 0x20;
+					CHECK(pwrite(fd, &c, 1, i + nlen) == 1);
+					found = true;
+				}
+
+		free(buf);
+		close(fd);
+	}
+
+	closedir(dir);
+	return found;
+}
+
+// the standard check value, and the table agreeing with the hardware
+static void test_crc32c(void)
+{
+	static unsigned char buf[4096 + 8];
+	unsigned int i;
+
+	CHECK(pg_crc32c(0, "123456789", 9) == 0xe3069283);
+	CHECK(pg_crc32c_sw(0, "123456789", 9) == 0xe3069283);
+	CHECK(pg_crc32c(pg_crc32c(0, "1234", 4), "56789", 5) == 0xe3069283);
+
+	srand(42);
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = rand();
+
+	for (i = 0; i < 1000; i++) {
+		size_t off = rand() % 8;
+		size_t len = rand() % (sizeof(buf) - off);
+		uint32_t seed = rand();
+
+		CHECK(pg_crc32c(seed, &buf[off], len) ==
+		      pg_crc32c_sw(seed, &buf[off], len));
+	}
+}
+
+// a damaged chunk is found, by threads as by one reader
+static void test_merkle(void)
+{
+	unsigned int shift = PGDB_CHUNK_SHIFT_MIN;
+	size_t len = ((PGDB_MERKLE_THREADS * PGDB_MERKLE_SPAN_MIN) << shift) +
+		     1000;		// and a partial chunk
+	size_t off, n, i, j;
+
+	unsigned char *data = malloc(len);
+	CHECK(data != NULL);
+	srand(7);
+	for (i = 0; i < len; i++)
+		data[i] = rand();
+
+	// appended in uneven pieces, as a file writer would
+	struct pgdb_merkle *mk = pg_merkle_new(shift);
+	CHECK(mk != NULL);
+	for (off = 0; off < len; off += n) {
+		n = (rand() % 9000) + 1;
+		if (n > len - off)
+			n = len - off;
+		CHECK(pg_merkle_update(mk, data + off, n));
+	}
+	CHECK(pg_merkle_final(mk));
+
+	size_t n_chunks = pg_merkle_n_chunks(len, shift);
+	size_t digests_len;
+	const unsigned char *digests = pg_merkle_digests(mk, &digests_len);
+	CHECK(digests_len == n_chunks * SHA256_DIGEST_LENGTH);
+	CHECK(pg_merkle_verify(data, len, shift, digests));
+
+	size_t damaged[] = { 0, n_chunks / 2, n_chunks - 1 };
+	for (i = 0; i < sizeof(damaged) / sizeof(damaged[0]); i++) {
+		size_t at = (damaged[i] << shift) + 500;
+		data[at] ^= 1;
+
+		size_t n_bad = 0, bad = 0;
+		for (j = 0; j < n_chunks; j++)
+			if (!pg_merkle_chunk_ok(data, len, shift, digests, j)) {
+				n_bad++;
+				bad = j;
+			}
+		CHECK(n_bad == 1 && bad == damaged[i]);
+		CHECK(!pg_merkle_verify(data, len, shift, digests));
+
+		data[at] ^= 1;
+	}
+	CHECK(pg_merkle_verify(data, len, shift, digests));
+
+	// wrapped, then damaged; and as written before chunking
+	struct pgdb_file_header hdr;
+	size_t data_len = 100000;
+	size_t wrap_len = sizeof(hdr) + data_len + digests_len + PGDB_TRAIL_SZ;
+	unsigned char *file = malloc(wrap_len);
+	CHECK(file != NULL);
+
+	memcpy(hdr.magic, "PGDBTEST", sizeof(hdr.magic));
+	hdr.len = htole32(data_len);
+	hdr.chunk_shift = htole32(shift);
+
+	pg_merkle_free(mk);
+	mk = pg_merkle_new(shift);
+	CHECK(mk != NULL);
+	CHECK(pg_merkle_update(mk, data, data_len) && pg_merkle_final(mk));
+	digests = pg_merkle_digests(mk, &digests_len);
+
+	unsigned char *p = file;
+	memcpy(p, &hdr, sizeof(hdr));
+	memcpy(p += sizeof(hdr), data, data_len);
+	memcpy(p += data_len, digests, digests_len);
+	CHECK(pg_merkle_top(p + digests_len, &hdr, sizeof(hdr),
+			    digests, digests_len));
+	wrap_len = (p - file) + digests_len + PGDB_TRAIL_SZ;
+
+	char *err = NULL;
+	CHECK(pg_verify_file("PGDBTEST", file, wrap_len, &err));
+	file[sizeof(hdr) + 5000] ^= 1;
+	CHECK(!pg_verify_file("PGDBTEST", file, wrap_len, &err));
+	CHECK(err != NULL);
+	free(err);
+	err = NULL;
+	file[sizeof(hdr) + 5000] ^= 1;
+
+	hdr.chunk_shift = 0;
+	memcpy(file, &hdr, sizeof(hdr));
+	SHA256(file, sizeof(hdr) + data_len, file + sizeof(hdr) + data_len);
+	CHECK(pg_verify_file("PGDBTEST", file,
+			     sizeof(hdr) + data_len + PGDB_TRAIL_SZ, &err));
+	CHECK(err == NULL);
+
+	pg_merkle_free(mk);
+	free(file);
+	free(data);
+}
+
+// files larger than the writer's buffer stream out whole, and digested
+static void test_filewriter(pgdb_t *db)
+{
+	const char *fn = "basic.fw";
+	size_t len = (2 * PGDB_FW_BUF_SIZE) + 12345, off, n, i;
+	char *err = NULL;
+	int wrap;
+
+	unsigned char *data = malloc(len);
+	CHECK(data != NULL);
+	srand(11);
+	for (i = 0; i < len; i++)
+		data[i] = rand();
+
+	for (wrap = 0; wrap < 2; wrap++) {
+		unlink(fn);
+
+		struct pgdb_filewriter *fw = pg_fw_create(db, fn, 0, !wrap,
+							  &err);
+		CHECK(fw != NULL);
+		if (wrap)
+			CHECK(pg_fw_wrap_begin(fw, "PGDBTEST"));
+
+		for (off = 0; off < len; off += n) {
+			n = (rand() % 300000) + 1;
+			if (n > len - off)
+				n = len - off;
+			CHECK(pg_fw_append(fw, data + off, n));
+		}
+
+		if (wrap) {
+			CHECK(pg_fw_wrap_end(fw));
+		} else {
+			CHECK(pg_fw_append_digests(fw));
+		}
+		CHECK(pg_fw_finish(fw, &err));
+		pg_fw_free(fw, false);
+
+		struct pgdb_map *map = pgmap_open(fn, &err);
+		CHECK(map != NULL);
+
+		if (wrap) {
+			CHECK((uint64_t) map->st.st_size == pg_fw_wrap_size(len));
+			CHECK(pg_verify_file("PGDBTEST", map->mem,
+					     map->st.st_size, &err));
+			CHECK(!memcmp(map->mem + sizeof(struct pgdb_file_header),
+				      data, len));
+		} else {
+			size_t n_chunks = pg_merkle_n_chunks(len,
+							     PGDB_CHUNK_SHIFT);
+			CHECK((size_t) map->st.st_size ==
+			      len + (n_chunks * SHA256_DIGEST_LENGTH));
+			CHECK(!memcmp(map->mem, data, len));
+			CHECK(pg_merkle_verify(map->mem, len, PGDB_CHUNK_SHIFT,
+					       map->mem + len));
+		}
+
+		pgmap_free(map);
+	}
+
+	unlink(fn);
+	free(data);
+}
+
+#define ROOT_TEST_ENTS	50
+
+// root file id of db, its data data[0..len), wrapped as pg_write_root() does
+static void write_root_file(pgdb_t *db, uint64_t id, const void *data,
+			    size_t len)
+{
+	char fn[512];
+	char *err = NULL;
+
+	snprintf(fn, sizeof(fn), "%s/%llu", db_name, (unsigned long long) id);
+	unlink(fn);
+
+	struct pgdb_filewriter *fw = pg_fw_create(db, fn, pg_fw_wrap_size(len),
+						  false, &err);
+	CHECK(fw != NULL);
+	CHECK(pg_fw_wrap_begin(fw, PGDB_ROOT_MAGIC));
+	CHECK(pg_fw_append(fw, data, len));
+	CHECK(pg_fw_wrap_end(fw));
+	CHECK(pg_fw_finish(fw, &err));
+	pg_fw_free(fw, false);
+}
+
+// root lists exactly ents[0..n), in any order
+static bool root_matches(const PGcodec__RootIdx *root,
+			 const PGcodec__RootEnt *ents, size_t n)
+{
+	size_t i, j;
+
+	if (root->n_entries != n)
+		return false;
+
+	for (i = 0; i < n; i++) {
+		const PGcodec__RootEnt *a = root->entries[i];
+
+		for (j = 0; j < n; j++)
+			if (ents[j].file_id == a->file_id)
+				break;
+		if (j == n)
+			return false;
+
+		const PGcodec__RootEnt *b = &ents[j];
+		if (a->n_records != b->n_records || a->run_id != b->run_id ||
+		    a->key.len != b->key.len ||
+		    memcmp(a->key.data, b->key.data, a->key.len))
+			return false;
+	}
+
+	return true;
+}
+
+// flat roots read back in place; damaged ones fail; protobuf roots still open
+static void test_root(pgdb_t *db)
+{
+	PGcodec__RootEnt ents[ROOT_TEST_ENTS];
+	PGcodec__RootEnt *ptrs[ROOT_TEST_ENTS];
+	char keys[ROOT_TEST_ENTS][16];
+	PGcodec__RootIdx root = PGCODEC__ROOT_IDX__INIT;
+	PGcodec__RootIdx *got = NULL;
+	struct pgdb_map *map = NULL;
+	char fn[512];
+	char *err = NULL;
+	size_t i;
+
+	// unsorted, over three runs
+	for (i = 0; i < ROOT_TEST_ENTS; i++) {
+		PGcodec__RootEnt ent_init = PGCODEC__ROOT_ENT__INIT;
+
+		snprintf(keys[i], sizeof(keys[i]), "rootkey%03zu",
+			 ROOT_TEST_ENTS - i);
+		ents[i] = ent_init;
+		ents[i].key.data = (uint8_t *) keys[i];
+		ents[i].key.len = strlen(keys[i]);
+		ents[i].n_records = i * 10;
+		ents[i].file_id = 900000 + i;
+		ents[i].has_run_id = 1;
+		ents[i].run_id = (i % 3) + 1;
+		ptrs[i] = &ents[i];
+	}
+	root.n_entries = ROOT_TEST_ENTS;
+	root.entries = ptrs;
+
+	// flat round trip: sorted, keys in the mapping
+	CHECK(pg_write_root(db, &root, 999990, &err));
+	CHECK(pg_read_root(db, &got, &map, 999990, &err));
+	CHECK(map != NULL);
+	CHECK(root_matches(got, ents, ROOT_TEST_ENTS));
+	for (i = 0; i < got->n_entries; i++) {
+		const uint8_t *k = got->entries[i]->key.data;
+		CHECK(k > (uint8_t *) map->mem &&
+		      k < (uint8_t *) map->mem + map->st.st_size);
+		if (i)
+			CHECK(pg_root_ent_cmp(&got->entries[i - 1],
+					      &got->entries[i]) < 0);
+	}
+	pg_root_free(got, map);
+
+	// a flipped byte in an entry fails verification
+	snprintf(fn, sizeof(fn), "%s/999990", db_name);
+	int fd = open(fn, O_RDWR);
+	CHECK(fd >= 0);
+	off_t off = sizeof(struct pgdb_file_header) +
+		    sizeof(struct pgdb_root_hdr) + 3;
+	unsigned char c;
+	CHECK(pread(fd, &c, 1, off) == 1);
+	c ^= 0x10;
+	CHECK(pwrite(fd, &c, 1, off) == 1);
+	close(fd);
+
+	CHECK(!pg_read_root(db, &got, &map, 999990, &err));
+	CHECK(err != NULL);
+	free(err);
+	err = NULL;
+	unlink(fn);
+
+	// a sound file holding an unsound flat root is rejected too
+	struct {
+		struct pgdb_root_hdr	hdr;
+		struct pgdb_root_ent	ent;
+		char			key[8];
+	} bad;
+	memset(&bad, 0, sizeof(bad));
+	memcpy(bad.hdr.magic, PGDB_ROOT_FLAT_MAGIC, sizeof(bad.hdr.magic));
+	bad.hdr.version = htole32(PGDB_ROOT_V1);
+	bad.hdr.n_entries = htole32(1);
+	bad.hdr.key_offset = htole32(offsetof(typeof(bad), key));
+	bad.ent.k_offset = bad.hdr.key_offset;
+	bad.ent.k_len = htole32(sizeof(bad.key) + 1);
+	write_root_file(db, 999991, &bad, sizeof(bad));
+
+	CHECK(!pg_read_root(db, &got, &map, 999991, &err));
+	CHECK(err != NULL);
+	free(err);
+	err = NULL;
+
+	bad.ent.k_len = htole32(sizeof(bad.key));
+	bad.hdr.version = htole32(PGDB_ROOT_VERSION + 1);
+	write_root_file(db, 999991, &bad, sizeof(bad));
+
+	CHECK(!pg_read_root(db, &got, &map, 999991, &err));
+	CHECK(err != NULL);
+	free(err);
+	err = NULL;
+
+	bad.hdr.version = htole32(PGDB_ROOT_V1);
+	write_root_file(db, 999991, &bad, sizeof(bad));
+
+	CHECK(pg_read_root(db, &got, &map, 999991, &err));
+	CHECK(got->n_entries == 1 && got->entries[0]->key.len == sizeof(bad.key));
+	pg_root_free(got, map);
+	snprintf(fn, sizeof(fn), "%s/999991", db_name);
+	unlink(fn);
+
+	// a root written before the flat form, as a RootIdx message
+	size_t len = pgcodec__root_idx__get_packed_size(&root);
+	uint8_t *buf = malloc(len);
+	CHECK(buf != NULL);
+	CHECK(pgcodec__root_idx__pack(&root, buf) == len);
+	write_root_file(db, 999992, buf, len);
+	free(buf);
+
+	CHECK(pg_read_root(db, &got, &map, 999992, &err));
+	CHECK(map == NULL);
+	CHECK(root_matches(got, ents, ROOT_TEST_ENTS));
+	pg_root_free(got, map);
+	snprintf(fn, sizeof(fn), "%s/999992", db_name);
+	unlink(fn);
+}
+
+// strip every pagefile of its chunk digests, as written before them
+static int unchunk_pagefiles(void)
+{
+	int n = 0;
+
+	DIR *dir = opendir(db_name);
+	CHECK(dir != NULL);
+
+	struct dirent *de;
+	while ((de = readdir(dir)) != NULL) {
+		char fn[512];
+		snprintf(fn, sizeof(fn), "%s/%s", db_name, de->d_name);
+
+		int fd = open(fn, O_RDWR);
+		if (fd < 0)
+			continue;
+
+		struct pgdb_page_hdr phdr;
+		struct pgdb_page_meta meta;
+		off_t meta_offset = 0;
+		if (pread(fd, &phdr, sizeof(phdr), 0) == sizeof(phdr) &&
+		    !memcmp(phdr.magic, "PGDBPAGE", 8) &&
+		    le32toh(phdr.version) >= PGDB_PAGE_V1) {
+			meta_offset = le32toh(phdr.meta_offset);
+			CHECK(pread(fd, &meta, sizeof(meta), meta_offset) ==
+			      sizeof(meta));
+		}
+
+		if (meta_offset && meta.chunk_shift) {
+			meta.chunk_shift = 0;
+			meta.digest_offset = 0;
+			CHECK(pwrite(fd, &meta, sizeof(meta), meta_offset) ==
+			      sizeof(meta));
+			n++;
+		}
+
+		close(fd);
+	}
+
+	closedir(dir);
+	return n;
+}
+
+// pagefiles without chunk digests open, and verify, as before them
+static pgdb_t *test_unchunked(pgdb_t *db)
+{
+	char *err = NULL;
+
+	pgdb_close(db);
+	CHECK(unchunk_pagefiles() > 0);
+
+	db = pgdb_open(opt, db_name, &err);
+	CHECK(db != NULL);
+	CHECK(err == NULL);
+
+	pgdb_readoptions_t *ro = pgdb_readoptions_create();
+	CHECK(ro != NULL);
+	pgdb_readoptions_set_verify_checksums(ro, true);
+
+	CHECK(snap_has(db, ro, "fa000123", "fa123"));
+	CHECK(snap_has(db, ro, "key00019999", "val19999"));
+	CHECK(snap_has(db, ro, "shadow", "new"));
+
+	pgdb_iterator_t *it = pgdb_create_iterator(db, ro);
+	CHECK(it != NULL);
+	pgdb_iter_seek(it, "fb", 2);
+	CHECK(iter_at(it, "fb000000"));
+	pgdb_iter_get_error(it, &err);
+	CHECK(err == NULL);
+	pgdb_iter_destroy(it);
+
+	pgdb_readoptions_destroy(ro);
+	return db;
+}
+
+// a value damaged on disk is returned as is, unless checksums are verified
+static void test_checksums(pgdb_t *db)
+{
+	char *err = NULL;
+	size_t vlen = 0;
+
+	pgdb_readoptions_t *ro = pgdb_readoptions_create();
+	CHECK(ro != NULL);
+	pgdb_readoptions_set_verify_checksums(ro, true);
+
+	// no compaction may rewrite the damaged file
+	pgdb_tableoptions_t *to = pgdb_tableoptions_create();
+	CHECK(to != NULL);
+	pgdb_tableoptions_set_compaction_trigger(to, 1000);
+
+	pgdb_table_t *sums = pgdb_create_table(db, "sums", to, &err);
+	CHECK(err == NULL && sums != NULL);
+	fill_cf(db, sums, "cs", 4000);
+	wait_background(db);
+
+	CHECK(cf_has(db, ro, sums, "cs000123", "cs123"));
+	CHECK(cf_has(db, ro, sums, "cs003999", "cs3999"));
+	CHECK(snap_has(db, ro, "fa000123", "fa123"));
+
+	CHECK(flip_after("cs000123cs12"));
+	CHECK(cf_has(db, NULL, sums, "cs000123", "cs12\x13"));
+
+	char *v = pgdb_get_cf(db, ro, sums, "cs000123", 8, &vlen, &err);
+	CHECK(v == NULL && err != NULL);
+	pgdb_free(err);
+	err = NULL;
+
+	const char *keys[] = { "cs000122", "cs000123" };
+	size_t klens[] = { 8, 8 };
+	const char *vals[2];
+	size_t vlens[2];
+	v = pgdb_multi_get_cf(db, ro, sums, 2, keys, klens, vals, vlens, &err);
+	CHECK(v == NULL && err != NULL);
+	pgdb_free(err);
+	err = NULL;
+
+	pgdb_iterator_t *it = pgdb_create_iterator_cf(db, ro, sums);
+	CHECK(it != NULL);
+	pgdb_iter_seek(it, "cs000123", 8);
+	CHECK(!pgdb_iter_valid(it));
+	pgdb_iter_get_error(it, &err);
+	CHECK(err != NULL);
+	pgdb_free(err);
+	err = NULL;
+	pgdb_iter_destroy(it);
+
+	CHECK(flip_after("cs000123cs12"));
+	CHECK(cf_has(db, ro, sums, "cs000123", "cs123"));
+
+	pgdb_drop_table(db, sums, &err);
+	CHECK(err == NULL);
+
+	pgdb_tableoptions_destroy(to);
+	pgdb_readoptions_destroy(ro);
+}
+
+// values packed in compressed blocks read back every way, across reopens
+static pgdb_t *test_compression(pgdb_t *db)
+{
+	char *err = NULL;
+	size_t vlen = 0;
+
+	pgdb_close(db);
+	pgdb_options_set_compression(opt, pgdb_snappy_compression);
+	pgdb_options_set_block_size(opt, 1024);
+	db = pgdb_open(opt, db_name, &err);
+	CHECK(db != NULL);
+	CHECK(err == NULL);
+
+	pgdb_readoptions_t *ro = pgdb_readoptions_create();
+	CHECK(ro != NULL);
+	pgdb_readoptions_set_verify_checksums(ro, true);
+
+	pgdb_tableoptions_t *to = pgdb_tableoptions_create();
+	CHECK(to != NULL);
+	pgdb_tableoptions_set_write_buffer_size(to, 16 * 1024);
+	pgdb_tableoptions_set_compaction_trigger(to, 2);
+
+	pgdb_table_t *packed = pgdb_create_table(db, "packed", to, &err);
+	CHECK(err == NULL && packed != NULL);
+
+	// larger than a block, and in one
+	static char big[10000];
+	memset(big, 'z', sizeof(big));
+	pgdb_put_cf(db, NULL, packed, "pk", 2, big, sizeof(big), &err);
+	CHECK(err == NULL);
+
+	fill_cf(db, packed, "pk", 5000);
+	pgdb_delete_cf(db, NULL, packed, "pk000321", 8, &err);
+	CHECK(err == NULL);
+	pgdb_compact_range_cf(db, packed, NULL, 0, NULL, 0, &err);
+	CHECK(err == NULL);
+
+	// the default table is rewritten compressed too
+	pgdb_compact_range(db, NULL, 0, NULL, 0);
+
+	CHECK(cf_has(db, ro, packed, "pk000123", "pk123"));
+	CHECK(cf_has(db, ro, packed, "pk004999", "pk4999"));
+	CHECK(cf_has(db, ro, packed, "pk000321", NULL));
+	CHECK(snap_has(db, ro, "fa000123", "fa123"));
+	CHECK(snap_has(db, ro, "fa003999", "fa3999"));
+
+	char *v = pgdb_get_cf(db, ro, packed, "pk", 2, &vlen, &err);
+	CHECK(err == NULL && v != NULL);
+	CHECK(vlen == sizeof(big) && !memcmp(v, big, vlen));
+	pgdb_free(v);
+
+	pgdb_pinned_t *pin = NULL;
+	const char *pv = pgdb_get_pinned(db, ro, "fa000777", 8, &vlen,
+					 &pin, &err);
+	CHECK(err == NULL && pv != NULL);
+	CHECK(vlen == 5 && !memcmp(pv, "fa777", 5));
+	pgdb_pinned_release(pin);
+
+	const char *keys[] = { "pk000100", "pk000101", "pk000321", "pk" };
+	size_t klens[] = { 8, 8, 8, 2 };
+	const char *vals[4];
+	size_t vlens[4];
+	v = pgdb_multi_get_cf(db, ro, packed, 4, keys, klens, vals, vlens,
+			      &err);
+	CHECK(err == NULL && v != NULL);
+	CHECK(vlens[0] == 5 && !memcmp(vals[0], "pk100", 5));
+	CHECK(vlens[1] == 5 && !memcmp(vals[1], "pk101", 5));
+	CHECK(vals[2] == NULL);
+	CHECK(vlens[3] == sizeof(big) && !memcmp(vals[3], big, vlens[3]));
+	pgdb_free(v);
+
+	static const char * const async_keys[] = {
+		"pk000100", "pk004999", "pk000321", "pk0003210",
+	};
+	static const char * const async_want[] = {
+		"pk100", "pk4999", NULL, NULL,
+	};
+	async_check(db, packed, ro, async_keys, async_want, 4);
+
+	pgdb_iterator_t *it = pgdb_create_iterator_cf(db, ro, packed);
+	CHECK(it != NULL);
+	int i;
+	pgdb_iter_seek(it, "pk000300", 8);
+	for (i = 300; i < 400; i++) {
+		char key[32], val[32];
+		if (i == 321)
+			continue;
+		snprintf(key, sizeof(key), "pk%06d", i);
+		snprintf(val, sizeof(val), "pk%d", i);
+		CHECK(iter_at(it, key));
+		const char *iv = pgdb_iter_value(it, &vlen);
+		CHECK(vlen == strlen(val) && !memcmp(iv, val, vlen));
+		pgdb_iter_next(it);
+	}
+	pgdb_iter_get_error(it, &err);
+	CHECK(err == NULL);
+	pgdb_iter_destroy(it);
+
+	// compressed pagefiles stay readable with compression off
+	pgdb_close(db);
+	pgdb_options_set_compression(opt, pgdb_no_compression);
+	db = pgdb_open(opt, db_name, &err);
+	CHECK(db != NULL);
+	CHECK(err == NULL);
+
+	packed = pgdb_open_table(db, "packed", &err);
+	CHECK(err == NULL && packed != NULL);
+	CHECK(cf_has(db, ro, packed, "pk002222", "pk2222"));
+	CHECK(cf_has(db, ro, packed, "pk000321", NULL));
+	CHECK(db_has(db, "fb001999", "fb1999"));
+
+	pgdb_drop_table(db, packed, &err);
+	CHECK(err == NULL);
+
+	pgdb_tableoptions_destroy(to);
+	pgdb_readoptions_destroy(ro);
+	return db;
+}
+
+// one block cache serves two databases, whose file ids coincide
+static void test_cache(void)
+{
+	const char *names[2] = { "basic-a.db", "basic-b.db" };
+	pgdb_t *dbs[2];
+	char *err = NULL;
+	char key[32], val[32];
+	int d, i;
+
+	pgdb_cache_t *cache = pgdb_cache_create_lru(64 * 1024);
+	CHECK(cache != NULL);
+
+	pgdb_options_t *copt = pgdb_options_create();
+	CHECK(copt != NULL);
+	pgdb_options_set_create_if_missing(copt, true);
+	pgdb_options_set_compression(copt, pgdb_snappy_compression);
+	pgdb_options_set_cache(copt, cache);
+
+	for (d = 0; d < 2; d++) {
+		pgdb_destroy_db(copt, names[d], &err);
+		free(err);
+		err = NULL;
+
+		dbs[d] = pgdb_open(copt, names[d], &err);
+		CHECK(dbs[d] != NULL);
+		CHECK(err == NULL);
+
+		for (i = 0; i < 3000; i++) {
+			snprintf(key, sizeof(key), "cc%06d", i);
+			snprintf(val, sizeof(val), "%c%d", 'a' + d, i);
+			pgdb_put(dbs[d], NULL, key, strlen(key),
+				 val, strlen(val), &err);
+			CHECK(err == NULL);
+		}
+		pgdb_compact_range(dbs[d], NULL, 0, NULL, 0);
+	}
+
+	pgdb_readoptions_t *ro = pgdb_readoptions_create();
+	CHECK(ro != NULL);
+	pgdb_readoptions_set_fill_cache(ro, false);
+
+	// filling the cache, reading from it, then leaving it be
+	int pass;
+	for (pass = 0; pass < 3; pass++)
+		for (i = 0; i < 3000; i += 7)
+			for (d = 0; d < 2; d++) {
+				snprintf(key, sizeof(key), "cc%06d", i);
+				snprintf(val, sizeof(val), "%c%d", 'a' + d, i);
+				CHECK(snap_has(dbs[d], (pass == 2) ? ro : NULL,
+					       key, val));
+			}
+
+	pgdb_iterator_t *it = pgdb_create_iterator(dbs[1], ro);
+	CHECK(it != NULL);
+	for (pgdb_iter_seek_to_first(it), i = 0; pgdb_iter_valid(it);
+	     pgdb_iter_next(it), i++) {
+		size_t vlen;
+		const char *v = pgdb_iter_value(it, &vlen);
+		snprintf(val, sizeof(val), "b%d", i);
+		CHECK(vlen == strlen(val) && !memcmp(v, val, vlen));
+	}
+	CHECK(i == 3000);
+	pgdb_iter_destroy(it);
+	pgdb_readoptions_destroy(ro);
+
+	for (d = 0; d < 2; d++) {
+		pgdb_close(dbs[d]);
+		pgdb_destroy_db(copt, names[d], &err);
+		CHECK(err == NULL);
+	}
+
+	pgdb_options_destroy(copt);
+	pgdb_cache_destroy(cache);
+}
+
+int main (int argc, char *argv[])
+{
+	char *err = NULL;
+
+	opt = pgdb_options_create();
+	CHECK(opt != NULL);
+	pgdb_options_set_create_if_missing(opt, true);
+	pgdb_options_set_write_buffer_size(opt, 64 * 1024);
+	pgdb_options_set_max_file_size(opt, 32 * 1024);
+
+	pgdb_destroy_db(opt, db_name, &err);
+	free(err);
+	err = NULL;
+
+	pgdb_t *db = pgdb_open(opt, db_name, &err);
+	CHECK(db != NULL);
+	CHECK(err == NULL);
+
+	test_put_get(db);
+	test_pinned(db);
+	test_many(db);
+	test_flush(db);
+	test_iter(db);
+	test_multi_get(db);
+	test_compact(db);
+	test_multi_get(db);
+	test_async(db);
+	test_iter(db);
+	test_snapshot(db);
+	test_batch(db);
+	db = test_reopen(db);
+	db = test_tables(db);
+	db = test_manifest(db);
+	db = test_wal(db);
+	db = test_read_io(db);
+	db = test_warmup(db);
+	test_open_files(db);
+	test_crc32c();
+	test_checksums(db);
+	test_merkle();
+	test_filewriter(db);
+	test_root(db);
+	db = test_unchunked(db);
+	db = test_compression(db);
+	test_cache();
+
+	pgdb_close(db);
+
+	pgdb_destroy_db(opt, db_name, &err);
+	CHECK(err == NULL);
+	pgdb_options_destroy(opt);
+	return 0;
+}